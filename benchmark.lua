@@ -1 +1,10 @@
-require('person').benchmark()
+-- benchmark.lua                  - the person flattener, RPS
+-- benchmark.lua suite [module]   - schema_bench suite, JSON report;
+--                                  module returns a schema definition
+if arg and arg[1] == 'suite' then
+    local schema_bench = require('schema_bench')
+    local schema = require('schema_load').create_schema(require(arg[2] or 'person_schema'))
+    print(schema_bench.to_json(schema_bench.suite(schema, { ndocs = tonumber(arg[3]) })))
+else
+    require('person').benchmark()
+end
@@ -7,8 +7,7 @@ local schema_util_C = schema_util.schema_util_C
 
 local null = ffi.cast('void *', 0)
 local regs = ffi.new('struct tarantool_schema_proc_Regs')
-regs.t[0]  = ffi.C.malloc(4096)
-regs.v[0]  = ffi.C.malloc(4096*8)
+local arena = schema_util.new_arena(4096)
 regs.ot    = ffi.C.malloc(512)
 regs.ov    = ffi.C.malloc(512*8)
 
@@ -75,7 +74,7 @@ local function flatten(data)
         r.b2 = ffi.cast('const uint8_t *', bank)
         r.b2 = r.b2 + #bank
 
-        r.rc = schema_util_C.preprocess_msgpack(data, #data, 4096, r.t[0], r.v[0], r.t, r.v)
+        r.rc = schema_util_C.preprocess_msgpack_arena(arena, data, #data, r.t, r.v)
         if r.rc < 0 then
             error('preprocess_msgpack: -1')
         end
@@ -141,7 +140,7 @@ local function flatten(data)
             r.ot[13 + i] = 8; r.ov[13 + i].uval = r.v[0][rr13 + i].uval
         end
 
-        r.rc = schema_util_C.create_msgpack(slots, r.ot, r.ov, r.b1, r.b2, 4096, r.t[0], r.res)
+        r.rc = schema_util_C.create_msgpack_arena(arena, slots, r.ot, r.ov, r.b1, r.b2, r.res)
         if r.rc < 0 then
             error('create_msgpack: -1')
         end
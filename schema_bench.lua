@@ -0,0 +1,416 @@
+local ffi            = require('ffi')
+local clock          = require('clock')
+local json           = require('json')
+local schema_util    = require('schema_util')
+local schema_load    = require('schema_load')
+local schema_compile = require('schema_compile')
+
+local schema_util_C = schema_util.schema_util_C
+local has_default   = schema_load.has_default
+
+local format, char, rep = string.format, string.char, string.rep
+local insert, concat = table.insert, table.concat
+local floor, random = math.floor, math.random
+
+--
+-- msgpack writer
+--
+-- Corpora control the key order, hence not msgpack.encode.
+--
+
+local scratch = ffi.new('union { double d; int64_t i; uint8_t b[8]; }')
+
+local function be64(tag)
+    local b = scratch.b
+    if ffi.abi('le') then
+        return char(tag, b[7], b[6], b[5], b[4], b[3], b[2], b[1], b[0])
+    end
+    return char(tag, b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7])
+end
+
+local function mp_uint(n)
+    if n < 0x80 then
+        return char(n)
+    elseif n < 0x100 then
+        return char(0xcc, n)
+    elseif n < 0x10000 then
+        return char(0xcd, floor(n / 0x100), n % 0x100)
+    elseif n < 0x100000000 then
+        return char(0xce, floor(n / 0x1000000), floor(n / 0x10000) % 0x100,
+                    floor(n / 0x100) % 0x100, n % 0x100)
+    end
+    scratch.i = n
+    return be64(0xcf)
+end
+
+local function mp_int(n)
+    if n >= 0 then
+        return mp_uint(n)
+    elseif n >= -32 then
+        return char(0x100 + n)
+    end
+    scratch.i = n
+    return be64(0xd3)
+end
+
+local function mp_double(x)
+    scratch.d = x
+    return be64(0xcb)
+end
+
+-- header of a str, an array (0x90, 0xdc) or a map (0x80, 0xde)
+local function mp_header(fix, h16, n)
+    if n < 16 or (fix == 0xa0 and n < 32) then
+        return char(fix + n)
+    elseif fix == 0xa0 and n < 0x100 then
+        return char(0xd9, n)
+    elseif n < 0x10000 then
+        return char(h16, floor(n / 0x100), n % 0x100)
+    end
+    return char(h16 + 1, floor(n / 0x1000000), floor(n / 0x10000) % 0x100,
+                floor(n / 0x100) % 0x100, n % 0x100)
+end
+
+local function mp_str(s)
+    return mp_header(0xa0, 0xda, #s)..s
+end
+
+--
+-- corpus
+--
+-- Options (all optional):
+--   ndocs         - number of documents
+--   seed          - random seed, corpora are reproducible
+--   string_len,
+--   array_len,
+--   map_len       - size distributions: a number, { min, max }
+--                   (uniform) or a function returning a size
+--   key_order     - 'schema', 'reverse' or 'random'
+--   omit_defaults - probability of leaving out a field with a default
+--   error_rate    - fraction of documents with a defect: a missing
+--                   field, an unknown key or a value of a wrong type
+--
+
+local corpus_defaults = {
+    ndocs         = 1000,
+    seed          = 1,
+    string_len    = { 0, 32 },
+    array_len     = { 0, 8 },
+    map_len       = { 0, 8 },
+    key_order     = 'schema',
+    omit_defaults = 0.5,
+    error_rate    = 0,
+}
+
+local function with_defaults(opts, defaults)
+    local res = {}
+    for k, v in pairs(defaults) do res[k] = v end
+    for k, v in pairs(opts or {}) do res[k] = v end
+    return res
+end
+
+local function pick(dist)
+    if type(dist) == 'number' then
+        return dist
+    elseif type(dist) == 'function' then
+        return dist()
+    end
+    return random(dist[1], dist[2])
+end
+
+local letters = 'abcdefghijklmnopqrstuvwxyz0123456789'
+
+local function random_string(len)
+    local parts = {}
+    while len > 0 do
+        local n = len < 16 and len or 16
+        local k = random(1, #letters - n + 1)
+        insert(parts, letters:sub(k, k + n - 1))
+        len = len - n
+    end
+    return concat(parts)
+end
+
+local gen_value
+
+local function gen_record(t, opts, defect)
+    local fields = {}
+    for _, field in ipairs(t.fields) do
+        if not has_default(field.default) or random() >= opts.omit_defaults then
+            insert(fields, { name = field.name, type = field.type })
+        end
+    end
+    if opts.key_order == 'reverse' then
+        local n = #fields
+        for k = 1, floor(n / 2) do
+            fields[k], fields[n - k + 1] = fields[n - k + 1], fields[k]
+        end
+    elseif opts.key_order == 'random' then
+        for k = #fields, 2, -1 do
+            local j = random(1, k)
+            fields[k], fields[j] = fields[j], fields[k]
+        end
+    end
+    if defect == 'missing' then
+        local required = {}
+        for k, f in ipairs(fields) do
+            for _, field in ipairs(t.fields) do
+                if field.name == f.name and not has_default(field.default) then
+                    insert(required, k)
+                end
+            end
+        end
+        if #required == 0 then
+            defect = 'unknown'
+        else
+            table.remove(fields, required[random(1, #required)])
+        end
+    end
+    if defect == 'unknown' then
+        insert(fields, random(1, #fields + 1), { name = '_unknown_' })
+    elseif defect == 'type' and #fields ~= 0 then
+        fields[random(1, #fields)].bad = true
+    end
+    local parts = { mp_header(0x80, 0xde, #fields) }
+    for _, f in ipairs(fields) do
+        insert(parts, mp_str(f.name))
+        if f.bad or not f.type then
+            -- fixext 1, no schema type takes it
+            insert(parts, '\xd4\x01\x00')
+        else
+            insert(parts, gen_value(f.type, opts))
+        end
+    end
+    return concat(parts)
+end
+
+gen_value = function(t, opts)
+    local xtype = t.type
+    if xtype == 'null' then
+        return '\xc0'
+    elseif xtype == 'boolean' then
+        return random() < 0.5 and '\xc2' or '\xc3'
+    elseif xtype == 'int' or xtype == 'long' then
+        local bits = random(0, xtype == 'int' and 30 or 52)
+        return mp_int(random(-2 ^ bits, 2 ^ bits))
+    elseif xtype == 'float' or xtype == 'double' then
+        return mp_double((random() - 0.5) * 2 ^ random(0, 32))
+    elseif xtype == 'string' or xtype == 'bytes' then
+        return mp_str(random_string(pick(opts.string_len)))
+    elseif xtype == 'fixed' then
+        return mp_str(random_string(t.size))
+    elseif xtype == 'enum' then
+        return mp_str(t.symbols[random(1, #t.symbols)])
+    elseif xtype == 'array' then
+        local n = pick(opts.array_len)
+        local parts = { mp_header(0x90, 0xdc, n) }
+        for _ = 1, n do
+            insert(parts, gen_value(t.items, opts))
+        end
+        return concat(parts)
+    elseif xtype == 'map' then
+        local n = pick(opts.map_len)
+        local parts = { mp_header(0x80, 0xde, n) }
+        for k = 1, n do
+            insert(parts, mp_str(format('k%d', k)))
+            insert(parts, gen_value(t.items, opts))
+        end
+        return concat(parts)
+    elseif xtype == 'record' then
+        return gen_record(t, opts)
+    elseif xtype == 'union' then
+        return gen_value(t.branches[random(1, #t.branches)], opts)
+    end
+    error(format('schema_bench: type %s is not supported', xtype))
+end
+
+local defects = { 'missing', 'unknown', 'type' }
+
+-- gen_corpus(schema, opts) -> { msgpack, ... }
+local function gen_corpus(schema, opts)
+    opts = with_defaults(opts, corpus_defaults)
+    math.randomseed(opts.seed)
+    local docs = {}
+    for k = 1, opts.ndocs do
+        local defect
+        if random() < opts.error_rate then
+            defect = defects[random(1, #defects)]
+        end
+        docs[k] = gen_record(schema, opts, defect)
+    end
+    return docs
+end
+
+--
+-- timing
+--
+-- Phases are timed separately over the whole corpus, each the best of
+-- opts.rounds runs:
+--   preprocess - preprocess_msgpack over the documents
+--   create     - create_msgpack over the flattened tuples (the time
+--                to preprocess the tuples is subtracted)
+--   dispatch   - the rest of flatten, i.e. the generated Lua code
+-- Latency percentiles are of the whole flatten, per document.
+--
+
+local function best_of(rounds, f)
+    local best = math.huge
+    for _ = 1, rounds do
+        local t0 = clock.monotonic()
+        f()
+        local t = clock.monotonic() - t0
+        if t < best then
+            best = t
+        end
+    end
+    return best
+end
+
+local function percentile(sorted, p)
+    if #sorted == 0 then
+        return 0
+    end
+    local k = math.ceil(p * #sorted)
+    return sorted[k < 1 and 1 or k]
+end
+
+local function phase(t, ndocs, nbytes)
+    return {
+        ns_per_doc    = ndocs > 0 and floor(t * 1e9 / ndocs + 0.5) or 0,
+        bytes_per_sec = t > 0 and floor(nbytes / t) or 0,
+    }
+end
+
+local function measure(flatten, docs, rounds)
+    local arena = schema_util.new_arena(4096)
+    local typeid = ffi.new('uint8_t *[1]')
+    local value  = ffi.new('struct tarantool_schema_preproc_Value *[1]')
+    local out    = ffi.new('uint8_t *[1]')
+
+    local tuples, nerrors, bytes_in, bytes_out = {}, 0, 0, 0
+    for _, doc in ipairs(docs) do
+        local ok, res = pcall(flatten, doc)
+        bytes_in = bytes_in + #doc
+        if ok then
+            insert(tuples, res)
+            bytes_out = bytes_out + #res
+        else
+            nerrors = nerrors + 1
+        end
+    end
+
+    local function preprocess_all(list)
+        for _, data in ipairs(list) do
+            schema_util_C.preprocess_msgpack_arena(arena, data, #data, typeid, value)
+        end
+    end
+
+    local t_total = best_of(rounds, function()
+        for _, doc in ipairs(docs) do
+            pcall(flatten, doc)
+        end
+    end)
+    local t_preprocess = best_of(rounds, function() preprocess_all(docs) end)
+    local t_tuples = best_of(rounds, function() preprocess_all(tuples) end)
+    local t_tuples_create = best_of(rounds, function()
+        for _, data in ipairs(tuples) do
+            local n = schema_util_C.preprocess_msgpack_arena(arena, data, #data,
+                                                             typeid, value)
+            local b1 = ffi.cast('const uint8_t *', data) + #data
+            schema_util_C.create_msgpack_arena(arena, n, typeid[0], value[0],
+                                               b1, nil, out)
+        end
+    end)
+    local t_create = math.max(t_tuples_create - t_tuples, 0)
+    local t_dispatch = math.max(t_total - t_preprocess - t_create, 0)
+
+    local lat = {}
+    for k, doc in ipairs(docs) do
+        local t0 = clock.monotonic()
+        pcall(flatten, doc)
+        lat[k] = clock.monotonic() - t0
+    end
+    table.sort(lat)
+    local function ns(t) return floor(t * 1e9 + 0.5) end
+
+    local n = #docs
+    return {
+        ndocs      = n,
+        nerrors    = nerrors,
+        bytes_in   = bytes_in,
+        bytes_out  = bytes_out,
+        phases     = {
+            preprocess = phase(t_preprocess, n, bytes_in),
+            dispatch   = phase(t_dispatch, n, bytes_in),
+            create     = phase(t_create, n, bytes_out),
+            total      = phase(t_total, n, bytes_in),
+        },
+        latency_ns = {
+            p50 = ns(percentile(lat, 0.5)),
+            p90 = ns(percentile(lat, 0.9)),
+            p99 = ns(percentile(lat, 0.99)),
+            max = ns(lat[n] or 0),
+        },
+    }
+end
+
+--
+-- run(schema, opts) - benchmark a flattener compiled for schema (a
+-- create_schema result) over a synthetic corpus.  Opts are corpus
+-- options (see above) plus:
+--   rounds  - timing runs per phase, the best one is reported
+--   compile - options for compile_flatten
+-- Returns a report table, see run_json.
+--
+
+local function run(schema, opts)
+    opts = opts or {}
+    local docs = gen_corpus(schema, opts)
+    local compiled = schema_compile.compile_flatten(schema, opts.compile)
+    -- warm up (and let the JIT compile the traces)
+    for _ = 1, 3 do
+        for _, doc in ipairs(docs) do
+            pcall(compiled.flatten, doc)
+        end
+    end
+    local report = measure(compiled.flatten, docs, opts.rounds or 5)
+    report.schema = schema.name
+    report.scenario = opts.scenario
+    return report
+end
+
+--
+-- suite(schema, base) - run the scenarios below, each overriding
+-- the base options: document size, array length, key order and
+-- error rate vary one at a time.
+--
+
+local scenarios = {
+    { scenario = 'baseline' },
+    { scenario = 'strings_long',  string_len = { 256, 1024 } },
+    { scenario = 'arrays_long',   array_len = { 64, 256 } },
+    { scenario = 'keys_reverse',  key_order = 'reverse' },
+    { scenario = 'keys_random',   key_order = 'random' },
+    { scenario = 'errors_10pct',  error_rate = 0.1 },
+    { scenario = 'errors_50pct',  error_rate = 0.5 },
+}
+
+local function suite(schema, base)
+    local reports = {}
+    for _, sc in ipairs(scenarios) do
+        insert(reports, run(schema, with_defaults(sc, base or {})))
+    end
+    return reports
+end
+
+-- JSON for a report or a list of them, one line.
+local function to_json(reports)
+    return json.encode(reports)
+end
+
+return {
+    gen_corpus = gen_corpus,
+    run        = run,
+    suite      = suite,
+    to_json    = to_json,
+}
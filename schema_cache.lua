@@ -0,0 +1,388 @@
+local schema_util    = require('schema_util')
+local schema_load    = require('schema_load')
+local schema_compile = require('schema_compile')
+
+local schema_util_C = schema_util.schema_util_C
+local has_default   = schema_load.has_default
+
+local format, byte, gsub = string.format, string.byte, string.gsub
+local insert, concat, sort = table.insert, table.concat, table.sort
+local floor, random = math.floor, math.random
+
+--
+-- Compiled flattener cache.
+--
+-- Generating a flattener (layout, perfect hashes, code generation)
+-- takes long compared to loading the generated source.  A cache keeps
+-- the sources (the key bank is embedded) in memory and, if given a
+-- directory, on disk, a file per entry, so that a restarted process
+-- skips generation.  A warm-up then runs the flatteners until their
+-- loops are compiled (see schema_trace.lua) before taking traffic.
+--
+--   canonical_form(schema) - Avro Parsing Canonical Form of a schema
+--                            (create_schema's result)
+--   fingerprint(schema)    - CRC-64-AVRO (Rabin) fingerprint of the
+--                            canonical form, 16 hex digits; schema
+--                            might be a canonical form already
+--   new(opts)              - a cache, opts.dir - directory for entries
+--                            (optional, must exist)
+--   cache:flatten(schema, opts)   - compile_flatten, cached
+--   cache:unflatten(schema)       - compile_unflatten, cached
+--   cache:warm_up(rounds)         - warm_up every cached flattener
+--                                   with a synthetic corpus
+--   warm_up(fl, docs, rounds)     - run a flattener over sample
+--                                   documents rounds times, errors
+--                                   ignored
+--
+-- The canonical form drops defaults and aliases, the generated code
+-- depends on these, hence entries are keyed by a fingerprint of an
+-- extended form (defaults and aliases kept), the options and the
+-- generator (schema_compile.lua contents).  An entry on disk keeps
+-- the key material and is ignored unless it matches, fingerprint
+-- collisions included.
+--
+
+local function json_string(s)
+    return '"'..gsub(s, '[%c"\\]', function(c)
+        if c == '"' or c == '\\' then
+            return '\\'..c
+        end
+        return format('\\u%04x', byte(c))
+    end)..'"'
+end
+
+local function json_number(v)
+    if v == floor(v) and v > -2^53 and v < 2^53 then
+        return format('%d', v)
+    end
+    return format('%.17g', v)
+end
+
+-- A default value as JSON, shaped by the type (an empty table is
+-- either an array or a map).
+local function json_default(t, v)
+    local xtype = t.type
+    if xtype == 'union' then
+        return json_default(t.branches[1], v)
+    elseif not has_default(v) or xtype == 'null' then
+        return 'null'
+    elseif xtype == 'boolean' then
+        return v and 'true' or 'false'
+    elseif type(v) == 'number' then
+        return json_number(v)
+    elseif xtype == 'array' then
+        local res = {}
+        for i, x in ipairs(v) do
+            res[i] = json_default(t.items, x)
+        end
+        return '['..concat(res, ',')..']'
+    elseif xtype == 'map' then
+        local keys, res = {}, {}
+        for k in pairs(v) do
+            insert(keys, k)
+        end
+        sort(keys)
+        for _, k in ipairs(keys) do
+            insert(res, json_string(k)..':'..json_default(t.items, v[k]))
+        end
+        return '{'..concat(res, ',')..'}'
+    elseif xtype == 'record' then
+        local res = {}
+        for _, f in ipairs(t.fields) do
+            if has_default(v[f.name]) then
+                insert(res, json_string(f.name)..':'..
+                            json_default(f.type, v[f.name]))
+            end
+        end
+        return '{'..concat(res, ',')..'}'
+    end
+    return json_string(tostring(v))
+end
+
+local function json_names(list)
+    local res = {}
+    for i, s in ipairs(list) do
+        res[i] = json_string(s)
+    end
+    return '['..concat(res, ',')..']'
+end
+
+-- Canonical form; extended keeps aliases and defaults, after the
+-- attributes of the canonical form.
+local function canonical(t, extended, seen)
+    local xtype = t.type
+    if t.name then
+        if seen[t] then
+            return json_string(t.name)
+        end
+        seen[t] = true
+    end
+    if xtype == 'union' then
+        local res = {}
+        for i, b in ipairs(t.branches) do
+            res[i] = canonical(b, extended, seen)
+        end
+        return '['..concat(res, ',')..']'
+    elseif xtype == 'array' or xtype == 'map' then
+        return format('{"type":"%s","%s":%s}', xtype,
+                      xtype == 'array' and 'items' or 'values',
+                      canonical(t.items, extended, seen))
+    elseif not t.name then
+        return json_string(xtype)
+    end
+    local res = { '"name":'..json_string(t.name),
+                  '"type":'..json_string(xtype) }
+    if xtype == 'record' then
+        local fields = {}
+        for i, f in ipairs(t.fields) do
+            local attrs = { '"name":'..json_string(f.name),
+                            '"type":'..canonical(f.type, extended, seen) }
+            if extended and f.aliases then
+                insert(attrs, '"aliases":'..json_names(f.aliases))
+            end
+            if extended and has_default(f.default) then
+                insert(attrs, '"default":'..json_default(f.type, f.default))
+            end
+            fields[i] = '{'..concat(attrs, ',')..'}'
+        end
+        insert(res, '"fields":['..concat(fields, ',')..']')
+    elseif xtype == 'enum' then
+        insert(res, '"symbols":'..json_names(t.symbols))
+    elseif xtype == 'fixed' then
+        insert(res, '"size":'..json_number(t.size))
+    end
+    if extended and t.aliases then
+        insert(res, '"aliases":'..json_names(t.aliases))
+    end
+    return '{'..concat(res, ',')..'}'
+end
+
+local function canonical_form(schema)
+    return canonical(schema, false, {})
+end
+
+local function fingerprint_string(s)
+    local fp = schema_util_C.schema_fingerprint64(s, #s)
+    return format('%08x%08x', tonumber(fp / 0x100000000ULL),
+                  tonumber(fp % 0x100000000ULL))
+end
+
+local function fingerprint(schema)
+    if type(schema) ~= 'string' then
+        schema = canonical_form(schema)
+    end
+    return fingerprint_string(schema)
+end
+
+-- The generator's own fingerprint, a change invalidates disk entries.
+local generator
+local function generator_fingerprint()
+    if not generator then
+        local info = debug.getinfo(schema_compile.compile_flatten, 'S')
+        local path = info.source:match('^@(.*)')
+        local f = path and io.open(path, 'rb')
+        generator = f and fingerprint_string(f:read('*a')) or 'unknown'
+        if f then
+            f:close()
+        end
+    end
+    return generator
+end
+
+-- Key material of an entry: what the generated code depends on.
+local function entry_form(kind, schema, opts)
+    local parts = { kind, generator_fingerprint(),
+                    canonical(schema, true, {}) }
+    if opts and opts.writer then
+        insert(parts, 'writer='..canonical(opts.writer, true, {}))
+    end
+    if opts and opts.project then
+        local paths = {}
+        for i, path in ipairs(opts.project) do
+            paths[i] = path
+        end
+        sort(paths)
+        insert(parts, 'project='..json_names(paths))
+    end
+    if opts and opts.validate then
+        insert(parts, 'validate')
+    end
+    if opts and opts.json then
+        insert(parts, 'json')
+    end
+    if opts and opts.columnar then
+        insert(parts, 'columnar')
+    end
+    if opts and opts.compact then
+        insert(parts, 'compact')
+    end
+    if opts and opts.iov then
+        insert(parts, 'iov='..tostring(opts.iov))
+    end
+    return concat(parts, '\n')
+end
+
+--
+-- disk entries - Lua files returning a table, loaded in an empty
+-- environment
+--
+
+local function entry_path(cache, kind, key)
+    return format('%s/%s-%s.lua', cache.dir, kind, key)
+end
+
+local function load_entry(cache, kind, key, form)
+    local chunk = loadfile(entry_path(cache, kind, key))
+    if not chunk then
+        return nil
+    end
+    setfenv(chunk, {})
+    local ok, entry = pcall(chunk)
+    if not ok or type(entry) ~= 'table' or entry.form ~= form then
+        return nil
+    end
+    return entry
+end
+
+local function store_entry(cache, kind, key, entry)
+    local path = entry_path(cache, kind, key)
+    local tmp = format('%s.%d.%d.tmp', path, os.time(), random(1e9))
+    local f = io.open(tmp, 'wb')
+    if not f then
+        return false
+    end
+    local parts = { 'return {' }
+    for _, k in ipairs({ 'form', 'source', 'batch_source' }) do
+        if entry[k] then
+            insert(parts, format('    %s = %q,', k, entry[k]))
+        end
+    end
+    insert(parts, '}\n')
+    local ok = f:write(concat(parts, '\n'))
+    f:close()
+    -- rename is atomic, readers never see a partial entry
+    if not ok or not os.rename(tmp, path) then
+        os.remove(tmp)
+        return false
+    end
+    return true
+end
+
+--
+-- cache
+--
+
+local cache_mt = {}
+cache_mt.__index = cache_mt
+
+local function new(opts)
+    return setmetatable({
+        dir = opts and opts.dir,
+        entries = {}, -- key -> { form, kind, schema, opts, result }
+        hits = 0, disk_hits = 0, misses = 0
+    }, cache_mt)
+end
+
+local function lookup(cache, kind, schema, opts, compile)
+    local form = entry_form(kind, schema, opts)
+    local key = fingerprint_string(form)
+    local entry = cache.entries[key]
+    if entry and entry.form == form then
+        cache.hits = cache.hits + 1
+        return entry.result
+    end
+    local sources = cache.dir and load_entry(cache, kind, key, form)
+    local copts = {}
+    for k, v in pairs(opts or {}) do
+        copts[k] = v
+    end
+    if sources then
+        cache.disk_hits = cache.disk_hits + 1
+        copts.sources = sources
+    else
+        cache.misses = cache.misses + 1
+    end
+    local result = compile(schema, copts)
+    if cache.dir and not sources then
+        store_entry(cache, kind, key, {
+            form = form, source = result.source,
+            batch_source = result.batch_source
+        })
+    end
+    cache.entries[key] = {
+        form = form, kind = kind, schema = schema, opts = opts,
+        result = result
+    }
+    return result
+end
+
+function cache_mt:flatten(schema, opts)
+    return lookup(self, 'flatten', schema, opts,
+                  schema_compile.compile_flatten)
+end
+
+function cache_mt:unflatten(schema)
+    return lookup(self, 'unflatten', schema, nil,
+                  schema_compile.compile_unflatten)
+end
+
+--
+-- warm-up
+--
+-- LuaJIT compiles a loop after 56 iterations and a side exit after
+-- 10 (hotloop, hotexit); a few dozen passes over a varied sample
+-- reach every path the sample exercises.  The batch flattener runs
+-- its own loop, it is warmed up as well.
+--
+
+local WARM_UP_ROUNDS = 64
+local WARM_UP_DOCS   = 16
+
+local function warm_up(fl, docs, rounds)
+    local n = 0
+    for _ = 1, rounds or WARM_UP_ROUNDS do
+        for _, doc in ipairs(docs) do
+            pcall(fl.flatten or fl.unflatten, doc)
+            n = n + 1
+        end
+        if fl.flatten_batch then
+            pcall(fl.flatten_batch, docs)
+        end
+        -- columns would grow with every round
+        if fl.reset then
+            fl.reset()
+        end
+    end
+    return n
+end
+
+-- JSON flatteners are skipped, the corpus is msgpack.
+function cache_mt:warm_up(rounds)
+    local schema_bench = require('schema_bench')
+    local entries, n = {}, 0
+    -- warming unflatten up might add entries
+    for _, entry in pairs(self.entries) do
+        insert(entries, entry)
+    end
+    for _, entry in ipairs(entries) do
+        if not (entry.opts and entry.opts.json) then
+            local docs = schema_bench.gen_corpus(entry.schema,
+                                                 { ndocs = WARM_UP_DOCS })
+            if entry.kind == 'unflatten' then
+                local fl = self:flatten(entry.schema)
+                for i, doc in ipairs(docs) do
+                    docs[i] = fl.flatten(doc)
+                end
+            end
+            n = n + warm_up(entry.result, docs, rounds)
+        end
+    end
+    return n
+end
+
+return {
+    canonical_form = canonical_form,
+    fingerprint    = fingerprint,
+    new            = new,
+    warm_up        = warm_up
+}
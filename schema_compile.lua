@@ -0,0 +1,3098 @@
+local ffi         = require('ffi')
+local schema_util = require('schema_util')
+local schema_load = require('schema_load')
+
+local schema_util_C = schema_util.schema_util_C
+local has_default   = schema_load.has_default
+local validdefault  = schema_load.validdefault
+
+local format, rep, byte, gsub = string.format, string.rep, string.byte, string.gsub
+local insert, concat = table.insert, table.concat
+
+-- Initial capacity of per-flattener buffers; regrown on demand.
+local ARENA_ITEMS  = 4096
+local STOCK_OUTPUT = 512
+-- payloads referenced in place by flatten with iov, bytes
+local IOV_THRESHOLD = 256
+
+-- LuaJIT allows up to 200 locals per function; leave room for
+-- the handful of non-register locals in the generated code.
+local MAX_REGS     = 180
+
+-- Records with that many keys (or more) use perfect hash dispatch.
+local PHASH_MIN_KEYS = 8
+
+local function unknown_key(ks, kl)
+    error('unknown key: '..ffi.string(ks, kl))
+end
+
+--
+-- bank - key names and enum symbols encoded as msgpack strings, and
+-- default values (raw msgpack)
+--
+-- Generated code addresses an entry relative to the bank end (r.b2),
+-- same as strings in the preprocessed data are addressed relative to
+-- the blob end (r.b1).  Entries are msgpack-encoded (header included)
+-- so that they could be copied verbatim with CopyCommand.
+--
+
+local function msgpack_str_header(len)
+    if len <= 31 then
+        return string.char(0xa0 + len)
+    elseif len <= 255 then
+        return string.char(0xd9, len)
+    elseif len <= 65535 then
+        return string.char(0xda, math.floor(len / 256), len % 256)
+    end
+    error('bank string too long')
+end
+
+local function bank_new()
+    return { entries = {}, index = {}, raw_index = {} }
+end
+
+local function bank_add(bank, s)
+    local e = bank.index[s]
+    if not e then
+        e = { str = s }
+        bank.index[s] = e
+        insert(bank.entries, e)
+    end
+    return e
+end
+
+-- Add an entry encoded already.
+local function bank_add_raw(bank, s)
+    local e = bank.raw_index[s]
+    if not e then
+        e = { str = s, raw = true }
+        bank.raw_index[s] = e
+        insert(bank.entries, e)
+    end
+    return e
+end
+
+-- Lay out the bank, computing entry offsets.  Entries are stored in
+-- reverse order, i.e. the first one added ends up at the bank end.
+local function bank_finalize(bank)
+    local parts, size = {}, 0
+    for i = #bank.entries, 1, -1 do
+        local e = bank.entries[i]
+        local hdr = e.raw and '' or msgpack_str_header(#e.str)
+        insert(parts, hdr)
+        insert(parts, e.str)
+        e.hpos = size
+        size = size + #hdr + #e.str
+        e.size = #hdr + #e.str
+    end
+    for _, e in ipairs(bank.entries) do
+        -- offset of the payload / the header relative to the bank end
+        e.hoff = size - e.hpos
+        e.off  = e.hoff - (e.size - #e.str)
+    end
+    bank.data = concat(parts)
+    return bank.data
+end
+
+--
+-- leaf types
+--
+-- tids - acceptable input type ids, what - used in error messages,
+-- tid  - output type id (nil: copy input type id verbatim),
+-- conv - 'dval' if an integer input is converted to double.
+--
+
+local leaf_types = {
+    null    = { tids = { 1 },       what = 'nil',    tid = 1   },
+    boolean = { tids = { 2, 3 },    what = 'bool'               },
+    int     = { tids = { 4 },       what = 'int',    tid = 4   },
+    long    = { tids = { 4 },       what = 'long',   tid = 4   },
+    float   = { tids = { 4, 6, 7 }, what = 'float',  tid = 6, conv = 'dval' },
+    double  = { tids = { 4, 6, 7 }, what = 'double', tid = 7, conv = 'dval' },
+    string  = { tids = { 8 },       what = 'str',    tid = 8   },
+    bytes   = { tids = { 8, 9 },    what = 'bin',    tid = 9   },
+    fixed   = { tids = { 8, 9 },    what = 'bin',    tid = 9   },
+}
+
+-- Lua condition that holds if type id 'e' is NOT acceptable.
+local function bad_tid_cond(e, tids)
+    local c = {}
+    for _, tid in ipairs(tids) do
+        insert(c, format('%s ~= %d', e, tid))
+    end
+    return concat(c, ' and ')
+end
+
+--
+-- defaults
+--
+-- A default of a leaf or an array field is encoded once, the way
+-- flatten would encode the value, and is stored in the bank.  The
+-- flattener copies it with CopyCommand if the field is missing.
+-- Enum defaults are symbol indices, these don't need the bank.
+--
+
+local function symbol_index(symbols, v)
+    for i, sym in ipairs(symbols) do
+        if sym == v then
+            return i - 1
+        end
+    end
+end
+
+local function encode_default(t, v)
+    local items, blob, blen = {}, {}, 0
+    local function add(xtype, x)
+        local lt = leaf_types[xtype]
+        if xtype == 'enum' then
+            insert(items, { tid = 4, ival = symbol_index(t.items.symbols, x) })
+        elseif xtype == 'boolean' then
+            insert(items, { tid = x and 3 or 2 })
+        elseif lt.conv then
+            insert(items, { tid = lt.tid, dval = x })
+        elseif lt.tid == 4 then
+            insert(items, { tid = 4, ival = x })
+        elseif lt.tid == 1 then
+            insert(items, { tid = 1 })
+        else
+            insert(items, { tid = lt.tid, xlen = #x, pos = blen })
+            insert(blob, x)
+            blen = blen + #x
+        end
+    end
+    if t.type == 'array' then
+        insert(items, { tid = 11, xlen = #v })
+        for _, x in ipairs(v) do
+            add(t.items.type, x)
+        end
+    elseif t.type == 'map' then
+        -- same layout as map_hash_order yields, keys sorted first
+        local keys, buckets = {}, {}
+        for key in pairs(v) do
+            insert(keys, key)
+        end
+        table.sort(keys)
+        local nb = schema_util_C.map_buckets(#keys)
+        for _, key in ipairs(keys) do
+            local b = schema_util_C.map_key_hash(key, #key) % nb
+            while buckets[b] do
+                b = (b + 1) % nb
+            end
+            buckets[b] = key
+        end
+        insert(items, { tid = 11, xlen = 2 * nb })
+        for b = 0, nb - 1 do
+            local key = buckets[b]
+            if key then
+                add('string', key)
+                add(t.items.type, v[key])
+            else
+                insert(items, { tid = 1 })
+                insert(items, { tid = 1 })
+            end
+        end
+    else
+        add(t.type, v)
+    end
+    local n = #items
+    local ot = ffi.new('uint8_t[?]', n)
+    local ov = ffi.new('struct tarantool_schema_preproc_Value[?]', n)
+    for k, item in ipairs(items) do
+        local val = ov[k - 1]
+        ot[k - 1] = item.tid
+        if item.ival then
+            val.ival = item.ival
+        elseif item.dval then
+            val.dval = item.dval
+        elseif item.xlen then
+            val.xlen = item.xlen
+            val.xoff = item.pos and blen - item.pos or 0
+        end
+    end
+    blob = concat(blob)
+    local b1 = ffi.cast('const uint8_t *', blob) + blen
+    local size = schema_util_C.create_msgpack_size(n, ot, ov)
+    if size < 0 then
+        error('create_msgpack_size: -1')
+    end
+    local out = ffi.new('uint8_t[?]', size)
+    schema_util_C.create_msgpack_into(n, ot, ov, b1, nil, out)
+    return ffi.string(out, size)
+end
+
+--
+-- resolution
+--
+-- Given a writer schema, reader fields are matched with writer fields
+-- by name or by alias.  Fields the writer doesn't have must have
+-- defaults, keys of writer fields the reader doesn't have are skipped
+-- over.  Writer types must resolve to reader types.
+--
+
+-- Reader leaf type -> writer types promoted to it.
+local promotions = {
+    long   = { int = true },
+    float  = { int = true, long = true },
+    double = { int = true, long = true, float = true },
+    string = { bytes = true },
+    bytes  = { string = true },
+}
+
+local function writer_field(wrec, field)
+    for _, wf in ipairs(wrec.fields) do
+        if wf.name == field.name then
+            return wf
+        end
+    end
+    for _, alias in ipairs(field.aliases or {}) do
+        for _, wf in ipairs(wrec.fields) do
+            if wf.name == alias then
+                return wf
+            end
+        end
+    end
+end
+
+local function same_name(wt, t)
+    if wt.name == t.name then
+        return true
+    end
+    for _, alias in ipairs(t.aliases or {}) do
+        if wt.name == alias then
+            return true
+        end
+    end
+    return false
+end
+
+-- Check that writer type wt resolves to t, returns acceptable input
+-- type ids if these differ from leaf_types (string from bytes).
+local function resolve_type(path, wt, t)
+    local xtype, ok = t.type, wt.type == t.type
+    if xtype == 'union' and ok then
+        -- branches must correspond one to one
+        if #wt.branches ~= #t.branches then
+            error(format('%s: writer union has %d branches, reader has %d',
+                         path, #wt.branches, #t.branches))
+        end
+        for k, bt in ipairs(t.branches) do
+            resolve_type(format('%s(%d)', path, k - 1), wt.branches[k], bt)
+        end
+        return
+    end
+    if not ok and promotions[xtype] then
+        ok = promotions[xtype][wt.type]
+    end
+    if ok and (xtype == 'record' or xtype == 'enum' or xtype == 'fixed') then
+        ok = same_name(wt, t) and (xtype ~= 'fixed' or wt.size == t.size)
+    end
+    if not ok then
+        error(format('%s: writer type %s doesn\'t resolve to %s',
+                     path, wt.name or wt.type, t.name or xtype))
+    end
+    if xtype == 'string' and wt.type == 'bytes' then
+        return { 8, 9 }
+    elseif xtype == 'array' then
+        return resolve_type(path..'[]', wt.items, t.items)
+    elseif xtype == 'map' then
+        return resolve_type(path..'{}', wt.items, t.items)
+    end
+end
+
+--
+-- layout
+--
+-- Assigns a register to every field (recursively), a state to every
+-- record and a slot in the output tuple to every non-record field.
+--
+-- A register holds the index (in the preprocessed data) of the
+-- field's value, or 0 if the field wasn't seen yet.  Enum registers
+-- are different, they hold the symbol index or #symbols if the field
+-- wasn't seen yet.  Record registers hold the index of the nested
+-- map.
+--
+-- Defaults of a field are collected in reg.dflt, outermost first: a
+-- default of an enclosing record applies if the record is missing,
+-- the field's own default (last, reg.own) if the field is missing.
+--
+-- Fields of a union's record branch are guarded (reg.guards), their
+-- slots are nil unless the branch is taken.
+--
+
+local layout_record, layout_union
+
+-- Auxiliary registers (aux) are never reported missing.
+local function new_reg(ctx, path, t, aux)
+    local reg = { id = #ctx.regs, path = path, type = t, init = 0, aux = aux }
+    reg.name = format('rr%d', reg.id)
+    reg.dflt = {}
+    reg.guards = ctx.guards
+    insert(ctx.regs, reg)
+    if #ctx.regs > MAX_REGS then
+        error(format('schema too large: more than %d fields', MAX_REGS))
+    end
+    return reg
+end
+
+local function layout_field(ctx, rec, field, path, dflt, wt)
+    local ft = field.type
+    local xtype = ft.type
+    local reg = new_reg(ctx, path, ft)
+    local tids = wt and resolve_type(path, wt, ft)
+    if has_default(field.default) then
+        insert(dflt, { reg = reg, value = field.default })
+        reg.own = true
+    end
+    reg.dflt = dflt
+    local f = { name = field.name, path = path, type = ft, reg = reg, tids = tids }
+    f.key = bank_add(ctx.bank, field.name)
+    f.aliases = {}
+    for _, alias in ipairs(field.aliases or {}) do
+        insert(f.aliases, bank_add(ctx.bank, alias))
+    end
+    if xtype == 'record' then
+        f.kind = 'record'
+        f.state = layout_record(ctx, ft, path, rec, reg, dflt, wt)
+        return f
+    elseif xtype == 'enum' then
+        f.kind = 'enum'
+        reg.init = #ft.symbols
+        f.symbols = {}
+        for _, sym in ipairs(ft.symbols) do
+            insert(f.symbols, bank_add(ctx.bank, sym))
+        end
+        for _, d in ipairs(dflt) do
+            d.symbol = symbol_index(ft.symbols, d.value)
+        end
+        insert(ctx.slots, f)
+        return f
+    elseif xtype == 'union' then
+        layout_union(ctx, rec, f, dflt, wt)
+        return f
+    elseif xtype == 'array' then
+        local items = ft.items
+        f.kind = 'array'
+        if leaf_types[items.type] then
+            f.items = items
+        elseif items.type == 'enum' then
+            f.items = items
+            f.symbols = {}
+            for _, sym in ipairs(items.symbols) do
+                insert(f.symbols, bank_add(ctx.bank, sym))
+            end
+        else
+            error(format('%s: arrays of %s are not supported', path, items.type))
+        end
+        insert(ctx.slots, f)
+    elseif xtype == 'map' then
+        local items = ft.items
+        f.kind = 'map'
+        f.items = items
+        if items.type == 'enum' then
+            f.symbols = {}
+            for _, sym in ipairs(items.symbols) do
+                insert(f.symbols, bank_add(ctx.bank, sym))
+            end
+        elseif not leaf_types[items.type] then
+            error(format('%s: maps of %s are not supported', path, items.type))
+        end
+        -- holds the number of buckets
+        f.nreg = new_reg(ctx, path, ft, true)
+        insert(ctx.slots, f)
+        insert(ctx.maps, f)
+    elseif leaf_types[xtype] then
+        f.kind = 'leaf'
+        insert(ctx.slots, f)
+    else
+        error(format('%s: type %s is not supported', path, xtype))
+    end
+    for _, d in ipairs(dflt) do
+        d.entry = bank_add_raw(ctx.bank, encode_default(ft, d.value))
+    end
+    return f
+end
+
+-- wrec is the writer's record (if resolving), dflt lists defaults of
+-- the record itself (see above).
+layout_record = function(ctx, rec, path, parent, reg, dflt, wrec)
+    local s = { rec = rec, path = path, parent = parent, reg = reg, fields = {} }
+    insert(ctx.states, s)
+    s.id = #ctx.states
+    local matched = {}
+    for _, field in ipairs(rec.fields) do
+        local fpath = path and path..'.'..field.name or field.name
+        local wf = wrec and writer_field(wrec, field)
+        if wf then
+            matched[wf] = true
+        elseif wrec and not has_default(field.default) then
+            error(format('%s: not in the writer schema and has no default', fpath))
+        end
+        local fdflt = {}
+        for _, d in ipairs(dflt or {}) do
+            local v = d.value[field.name]
+            if not has_default(v) then
+                v = field.default
+            end
+            insert(fdflt, { reg = d.reg, value = v })
+        end
+        insert(s.fields, layout_field(ctx, s, field, fpath, fdflt, wf and wf.type))
+    end
+    -- keys of writer fields unknown to the reader
+    s.ignore = {}
+    for _, wf in ipairs(wrec and wrec.fields or {}) do
+        if not matched[wf] then
+            insert(s.ignore, bank_add(ctx.bank, wf.name))
+        end
+    end
+    return s
+end
+
+--
+-- unions
+--
+-- A union takes a slot for the branch index, then a slot for the
+-- value if any branch isn't a record; fields of record branches get
+-- slots of their own (nil unless the branch is taken).  The branch is
+-- looked up by the preprocessed type id in a jump table; a map picks
+-- a record branch by a discriminator key if there are several.
+--
+
+local UNION_NONE, UNION_DISC = 255, 254
+
+-- Type ids a branch takes: the ones it outputs as is, other ones.
+local function branch_tids(b)
+    if b.kind == 'null' then
+        return { 1 }, {}
+    elseif b.kind == 'leaf' then
+        local lt = leaf_types[b.type.type]
+        local native, other = {}, {}
+        for _, tid in ipairs(b.tids or lt.tids) do
+            insert((lt.tid == nil or lt.tid == tid) and native or other, tid)
+        end
+        return native, other
+    elseif b.kind == 'enum' then
+        return {}, { 8 }
+    elseif b.kind == 'array' then
+        return { 11 }, {}
+    end
+    return { 12 }, {}
+end
+
+-- Pick a key for every record branch no other record branch has,
+-- preferring fields without defaults (always present).
+local function choose_discriminators(ctx, f, records)
+    for _, b in ipairs(records) do
+        local taken = {}
+        for _, other in ipairs(records) do
+            if other ~= b then
+                for _, field in ipairs(other.type.fields) do
+                    taken[field.name] = true
+                    for _, alias in ipairs(field.aliases or {}) do
+                        taken[alias] = true
+                    end
+                end
+            end
+        end
+        local disc
+        for _, field in ipairs(b.type.fields) do
+            if not taken[field.name] and
+               (not disc or has_default(disc.default)) then
+                disc = field
+            end
+        end
+        if not disc then
+            error(format('%s: no discriminator key for %s', f.path, b.type.name))
+        end
+        b.disc = bank_add(ctx.bank, disc.name)
+    end
+end
+
+layout_union = function(ctx, rec, f, dflt, wt)
+    local ut, path, reg = f.type, f.path, f.reg
+    local records, vf = {}, nil
+    f.kind = 'union'
+    f.branches = {}
+    insert(ctx.slots, f)
+    insert(ctx.unions, f)
+    for k, bt in ipairs(ut.branches) do
+        local xtype = bt.type
+        local b = { index = k - 1, type = bt }
+        b.tids = wt and resolve_type(path, wt.branches[k], bt)
+        if xtype == 'record' then
+            b.kind = 'record'
+            insert(records, b)
+        elseif xtype == 'null' then
+            b.kind = 'null'
+        elseif xtype == 'enum' then
+            b.kind = 'enum'
+            b.symbols = {}
+            for _, sym in ipairs(bt.symbols) do
+                insert(b.symbols, bank_add(ctx.bank, sym))
+            end
+        elseif xtype == 'array' then
+            local items = bt.items
+            b.kind = 'array'
+            -- looks like an array field to emit_array_items
+            b.af = { path = path, items = items, tids = b.tids }
+            if items.type == 'enum' then
+                b.af.symbols = {}
+                for _, sym in ipairs(items.symbols) do
+                    insert(b.af.symbols, bank_add(ctx.bank, sym))
+                end
+            elseif not leaf_types[items.type] then
+                error(format('%s: arrays of %s are not supported', path, items.type))
+            end
+        elseif leaf_types[xtype] then
+            b.kind = 'leaf'
+        else
+            error(format('%s: unions of %s are not supported', path, xtype))
+        end
+        if b.kind ~= 'record' and not vf then
+            vf = { kind = 'uvalue', path = path, type = ut, union = f, reg = reg }
+            vf.vreg = new_reg(ctx, path, ut, true)
+            insert(ctx.slots, vf)
+        end
+        if b.af then
+            b.af.reg = vf.vreg
+            vf.dynamic = true
+        end
+        insert(f.branches, b)
+    end
+    f.value = vf
+
+    for _, b in ipairs(records) do
+        local bpath = path..'.'..b.type.name:match('[^.]*$')
+        local guards = ctx.guards
+        ctx.guards = { { reg = reg, value = b.index + 1 } }
+        for _, g in ipairs(guards) do
+            insert(ctx.guards, g)
+        end
+        b.reg = new_reg(ctx, bpath, b.type, true)
+        b.state = layout_record(ctx, b.type, bpath, rec, b.reg, nil,
+                                wt and wt.branches[b.index + 1])
+        ctx.guards = guards
+    end
+
+    -- a default is of the first branch
+    local first = f.branches[1]
+    for _, d in ipairs(dflt) do
+        if first.kind == 'record' then
+            error(format('%s: defaults of record branches are not supported', path))
+        elseif first.kind == 'enum' then
+            d.symbol = symbol_index(first.type.symbols, d.value)
+        else
+            d.entry = bank_add_raw(ctx.bank, encode_default(first.type, d.value))
+        end
+    end
+
+    local jt = {}
+    for pass = 1, 2 do
+        for _, b in ipairs(f.branches) do
+            local native, other = branch_tids(b)
+            for _, tid in ipairs(pass == 1 and native or other) do
+                jt[tid] = jt[tid] or b.index
+            end
+        end
+    end
+    if #records > 1 then
+        jt[12] = UNION_DISC
+        choose_discriminators(ctx, f, records)
+    end
+    f.jt = {}
+    for tid = 0, 13 do
+        f.jt[tid + 1] = jt[tid] or UNION_NONE
+    end
+    f.disc = #records > 1
+end
+
+--
+-- code generation
+--
+
+-- Lua literal for a binary string, keeps printable chars readable.
+local function string_literal(s)
+    s = s:gsub('["\\]', '\\%0')
+    s = s:gsub('[^%w%p ]', function(c)
+        return format('\\%03d', byte(c))
+    end)
+    return '"'..s..'"'
+end
+
+local function emitter()
+    local code = {}
+    return code, function(fmt, ...)
+        insert(code, format(fmt, ...))
+    end
+end
+
+-- Position of the first byte that tells all strings apart, or nil.
+local function distinguishing_byte(strs)
+    local minlen = math.huge
+    for _, s in ipairs(strs) do
+        if #s < minlen then minlen = #s end
+    end
+    for pos = 1, minlen do
+        local seen, ok = {}, true
+        for _, s in ipairs(strs) do
+            local b = byte(s, pos)
+            if seen[b] then ok = false; break end
+            seen[b] = true
+        end
+        if ok then return pos - 1, minlen end
+    end
+end
+
+local function annotate(s, pos)
+    return s:sub(1, pos)..'_'..s:sub(pos + 1, pos + 1)..'_'..s:sub(pos + 2)
+end
+
+-- Match r.ks, r.kl against bank entries.  Calls body(i) to emit the
+-- code for a match (it is inside an if, must not fall through) and
+-- emits miss after all the checks.
+local function emit_key_dispatch(emit, ind, entries, body, miss)
+    local strs = {}
+    for i, e in ipairs(entries) do strs[i] = e.str end
+    local pos, minlen = distinguishing_byte(strs)
+    if pos then
+        emit('%sif r.kl < %d then', ind, minlen)
+        emit('%s    %s', ind, miss)
+        emit('%send', ind)
+        for i, e in ipairs(entries) do
+            emit('')
+            emit('%sif r.ks[%d] == %d then -- %s', ind, pos, byte(e.str, pos + 1),
+                 annotate(e.str, pos))
+            emit('%s    if r.kl ~= %d or ffi.C.memcmp(r.ks, r.b2 - %d, %d) ~= 0 then',
+                 ind, #e.str, e.off, #e.str)
+            emit('%s        %s', ind, miss)
+            emit('%s    end', ind)
+            body(i, ind..'    ')
+            emit('%send', ind)
+        end
+    else
+        for i, e in ipairs(entries) do
+            emit('')
+            emit('%sif r.kl == %d and ffi.C.memcmp(r.ks, r.b2 - %d, %d) == 0 then -- %s',
+                 ind, #e.str, e.off, #e.str, e.str)
+            body(i, ind..'    ')
+            emit('%send', ind)
+        end
+    end
+    emit('')
+    emit('%s%s', ind, miss)
+end
+
+--
+-- perfect hash - key dispatch for wide records
+--
+-- A key is reduced to a few features: the length and some bytes at
+-- fixed offsets from either end (all below the min key length).  Two
+-- hashes are linear combinations of the features:
+--
+--   g = a1 * f1 + a2 * f2 + ...
+--   h = b1 * f1 + b2 * f2 + ...
+--   k = (disp[g % nb] + h) % n
+--
+-- Coefficients and displacements are found at compile time so that k
+-- is a distinct index in [0, n) for every key (hash and displace).
+--
+
+local function feature_value(f, s)
+    if f.kind == 'len' then
+        return #s
+    elseif f.kind == 'fwd' then
+        return byte(s, f.pos + 1)
+    end
+    return byte(s, #s - f.pos)
+end
+
+local function feature_expr(f)
+    if f.kind == 'len' then
+        return 'r.kl'
+    elseif f.kind == 'fwd' then
+        return format('r.ks[%d]', f.pos)
+    end
+    return format('r.ks[r.kl - %d]', f.pos + 1)
+end
+
+local function count_distinct(strs, features)
+    local seen, count = {}, 0
+    for _, s in ipairs(strs) do
+        local t = {}
+        for i, f in ipairs(features) do
+            t[i] = feature_value(f, s)
+        end
+        t = concat(t, ',')
+        if not seen[t] then
+            seen[t] = true
+            count = count + 1
+        end
+    end
+    return count
+end
+
+-- Greedily pick features until they tell all strings apart.
+local function select_features(strs, minlen)
+    local candidates = {}
+    for pos = 0, minlen - 1 do
+        insert(candidates, { kind = 'fwd', pos = pos })
+        insert(candidates, { kind = 'back', pos = pos })
+    end
+    local features = { { kind = 'len' } }
+    local count = count_distinct(strs, features)
+    while count < #strs do
+        local best, best_count
+        for i, c in ipairs(candidates) do
+            features[#features + 1] = c
+            local n = count_distinct(strs, features)
+            features[#features] = nil
+            if n > (best_count or count) then
+                best, best_count = i, n
+            end
+        end
+        if not best then
+            return nil
+        end
+        insert(features, table.remove(candidates, best))
+        count = best_count
+    end
+    return features
+end
+
+local function perfect_hash(strs)
+    local n = #strs
+    local minlen = math.huge
+    for _, s in ipairs(strs) do
+        if #s < minlen then minlen = #s end
+    end
+    if minlen == 0 then
+        return nil
+    end
+    local features = select_features(strs, minlen)
+    if not features then
+        return nil
+    end
+    local nb = math.ceil(n / 2)
+    local seed = 1
+    for _ = 1, 10000 do
+        local coef, g, h = { {}, {} }, {}, {}
+        for i = 1, #features do
+            for j = 1, 2 do
+                seed = (seed * 1103515245 + 12345) % 2147483648
+                coef[j][i] = 1 + 2 * (math.floor(seed / 65536) % 32768)
+            end
+        end
+        for i, s in ipairs(strs) do
+            local u, v = 0, 0
+            for j, f in ipairs(features) do
+                u = u + coef[1][j] * feature_value(f, s)
+                v = v + coef[2][j] * feature_value(f, s)
+            end
+            g[i], h[i] = u, v
+        end
+        -- place buckets, largest first
+        local buckets = {}
+        for b = 0, nb - 1 do buckets[b + 1] = { id = b } end
+        for i = 1, n do
+            insert(buckets[g[i] % nb + 1], i)
+        end
+        table.sort(buckets, function(a, b)
+            if #a ~= #b then return #a > #b end
+            return a.id < b.id
+        end)
+        local disp, slot, taken, ok = {}, {}, {}, true
+        for _, bucket in ipairs(buckets) do
+            local found
+            for d = 0, n - 1 do
+                local pos = {}
+                found = true
+                for _, i in ipairs(bucket) do
+                    local k = (d + h[i]) % n
+                    if taken[k] or pos[k] then found = false; break end
+                    pos[k] = i
+                end
+                if found then
+                    for k, i in pairs(pos) do
+                        taken[k] = true
+                        slot[i] = k
+                    end
+                    disp[bucket.id] = d
+                    break
+                end
+            end
+            if not found then ok = false; break end
+        end
+        if ok then
+            return {
+                n = n, nb = nb, minlen = minlen, features = features,
+                coef = coef, disp = disp, slot = slot
+            }
+        end
+    end
+end
+
+-- Emit tables referenced by the hash dispatch code.
+local function emit_phash_tables(emit, name, ph, entries)
+    local d = {}
+    for b = 0, ph.nb - 1 do
+        insert(d, tostring(ph.disp[b] or 0))
+    end
+    emit('local %s_disp = ffi.new(\'const uint32_t[%d]\', { %s })', name, ph.nb,
+         concat(d, ', '))
+    -- (payload offset, length) by hash slot
+    local k = {}
+    for i, e in ipairs(entries) do
+        k[ph.slot[i] + 1] = format('%d, %d', e.off, #e.str)
+    end
+    emit('local %s_keys = ffi.new(\'const uint32_t[%d]\', { %s })', name, 2 * ph.n,
+         concat(k, ', '))
+end
+
+-- Binary decision tree on the hash slot k, bodies never fall through.
+local function emit_slot_tree(emit, ind, lo, hi, body)
+    if lo == hi then
+        body(lo, ind)
+        return
+    end
+    local mid = math.floor((lo + hi + 1) / 2)
+    emit('%sif k < %d then', ind, mid)
+    emit_slot_tree(emit, ind..'    ', lo, mid - 1, body)
+    emit('%send', ind)
+    emit_slot_tree(emit, ind, mid, hi, body)
+end
+
+local function emit_phash_dispatch(emit, ind, name, ph, entries, body, miss)
+    local g, h = {}, {}
+    for i, f in ipairs(ph.features) do
+        insert(g, format('%s * %d', feature_expr(f), ph.coef[1][i]))
+        insert(h, format('%s * %d', feature_expr(f), ph.coef[2][i]))
+    end
+    local by_slot = {}
+    for i = 1, #entries do
+        by_slot[ph.slot[i]] = i
+    end
+    emit('%sif r.kl < %d then', ind, ph.minlen)
+    emit('%s    %s', ind, miss)
+    emit('%send', ind)
+    emit('%sk = (%s_disp[(%s) %% %d] +', ind, name, concat(g, ' + '), ph.nb)
+    emit('%s     %s) %% %d', ind, concat(h, ' + '), ph.n)
+    emit('%sif r.kl ~= %s_keys[k + k + 1] or', ind, name)
+    emit('%s   ffi.C.memcmp(r.ks, r.b2 - %s_keys[k + k], r.kl) ~= 0 then', ind, name)
+    emit('%s    %s', ind, miss)
+    emit('%send', ind)
+    emit_slot_tree(emit, ind, 0, ph.n - 1, function(k, ind)
+        local i = by_slot[k]
+        emit('%s-- %s', ind, entries[i].str)
+        body(i, ind)
+    end)
+end
+
+-- Same as above, but produces an if-elseif chain assigning the
+-- symbol index to target.
+local function emit_symbol_dispatch(emit, ind, entries, target, miss)
+    local strs = {}
+    for i, e in ipairs(entries) do strs[i] = e.str end
+    local pos, minlen = distinguishing_byte(strs)
+    if pos then
+        emit('%sif r.kl < %d then %s end', ind, minlen, miss)
+        for i, e in ipairs(entries) do
+            emit('%s%s r.ks[%d] == %d then -- %s', ind, i == 1 and 'if    ' or 'elseif',
+                 pos, byte(e.str, pos + 1), annotate(e.str, pos))
+            emit('%s    if r.kl ~= %d or ffi.C.memcmp(r.ks, r.b2 - %d, %d) ~= 0 then',
+                 ind, #e.str, e.off, #e.str)
+            emit('%s        %s', ind, miss)
+            emit('%s    end', ind)
+            emit('%s    %s = %d', ind, target, i - 1)
+        end
+    else
+        for i, e in ipairs(entries) do
+            emit('%s%s r.kl == %d and ffi.C.memcmp(r.ks, r.b2 - %d, %d) == 0 then -- %s',
+                 ind, i == 1 and 'if    ' or 'elseif', #e.str, e.off, #e.str, e.str)
+            emit('%s    %s = %d', ind, target, i - 1)
+        end
+    end
+    emit('%selse', ind)
+    emit('%s    %s', ind, miss)
+    emit('%send', ind)
+end
+
+-- Record branch by the discriminator key, scans keys of the map.
+local function emit_discriminator(emit, ind, f)
+    local label = format('ud_%s', f.reg.name)
+    local entries, branch = {}, {}
+    for _, b in ipairs(f.branches) do
+        if b.disc then
+            insert(entries, b.disc)
+            insert(branch, b.index)
+        end
+    end
+    emit('%sb = %d', ind, UNION_NONE)
+    emit('%sk = i + 2', ind)
+    emit('%swhile k < i + 1 + r.v[0][i+1].xoff do', ind)
+    emit('%s    if r.t[0][k] ~= 8 then goto %s end', ind, label)
+    emit('%s    r.ks, r.kl = r.b1 - r.v[0][k].xoff, r.v[0][k].xlen', ind)
+    emit_key_dispatch(emit, ind..'    ', entries, function(n, ind)
+        emit('%sb = %d', ind, branch[n])
+        emit('%sbreak', ind)
+    end, format('goto %s', label))
+    emit('%s    ::%s::', ind, label)
+    emit('%s    if r.t[0][k+1] == 11 or r.t[0][k+1] == 12 then', ind)
+    emit('%s        k = k + 1 + r.v[0][k+1].xoff', ind)
+    emit('%s    else', ind)
+    emit('%s        k = k + 2', ind)
+    emit('%s    end', ind)
+    emit('%send', ind)
+end
+
+-- Union branch b was taken, register the value.
+local function emit_branch(emit, ind, f, b)
+    local vreg = f.value and f.value.vreg.name
+    if b.kind == 'record' then
+        emit('%s%s = i + 1', ind, b.reg.name)
+        emit('%si = i + 2', ind)
+        emit('%sstate = %d', ind, b.state.id)
+    elseif b.kind == 'enum' then
+        emit('%sr.ks, r.kl = r.b1 - r.v[0][i+1].xoff, r.v[0][i+1].xlen', ind)
+        emit_symbol_dispatch(emit, ind, b.symbols, vreg,
+                             format('error(\'wrong %s\')', f.path))
+        emit('%si = i + 2', ind)
+    elseif b.kind == 'array' then
+        emit('%s%s = i + 1', ind, vreg)
+        emit('%si = %s + r.v[0][%s].xoff', ind, vreg, vreg)
+    else
+        if b.type.type == 'fixed' then
+            emit('%sif r.v[0][i+1].xlen ~= %d then error(\'%s wrong size\') end',
+                 ind, b.type.size, f.path)
+        end
+        emit('%s%s = i + 1', ind, vreg)
+        emit('%si = i + 2', ind)
+    end
+end
+
+local function emit_field(emit, ind, f)
+    local reg = f.reg.name
+    local path = f.path
+    if f.skip then
+        -- projected away, a single RawValue
+        emit('%sif %s ~= 0 then error(\'%s dup\') end', ind, reg, path)
+        emit('%s%s = i + 1', ind, reg)
+        emit('%si = i + 2', ind)
+        emit('%sgoto continue', ind)
+    elseif f.kind == 'record' then
+        emit('%sif r.t[0][i+1] ~= 12 then error(\'%s not map\') end', ind, path)
+        emit('%sif %s ~= 0 then error(\'%s dup\') end', ind, reg, path)
+        emit('%s%s = i + 1', ind, reg)
+        emit('%si = i + 2', ind)
+        emit('%sstate = %d', ind, f.state.id)
+        emit('%sgoto continue', ind)
+    elseif f.kind == 'array' then
+        emit('%sif r.t[0][i+1] ~= 11 then error(\'%s not array\') end', ind, path)
+        emit('%sif %s ~= 0 then error(\'%s dup\') end', ind, reg, path)
+        emit('%s%s = i + 1', ind, reg)
+        emit('%si = %s + r.v[0][%s].xoff', ind, reg, reg)
+        emit('%sgoto continue', ind)
+    elseif f.kind == 'map' then
+        local nreg = f.nreg.name
+        emit('%sif r.t[0][i+1] ~= 12 then error(\'%s not map\') end', ind, path)
+        emit('%sif %s ~= 0 then error(\'%s dup\') end', ind, reg, path)
+        emit('%s%s = i + 1', ind, reg)
+        emit('%sb = schema_util_C.map_buckets(r.v[0][%s].xlen)', ind, reg)
+        emit('%sif b > mc_%s then', ind, reg)
+        emit('%s    mo_%s, mc_%s = ffi.new(\'uint32_t[?]\', b), b', ind, reg, reg)
+        emit('%send', ind)
+        emit('%sr.rc = schema_util_C.map_hash_order(r.t[0], r.v[0], %s, r.b1, mo_%s)',
+             ind, reg, reg)
+        emit('%sif r.rc < 0 then', ind)
+        emit('%s    error(r.rc == -2 and \'%s dup key\' or \'%s key not str\')', ind, path, path)
+        emit('%send', ind)
+        emit('%s%s = tonumber(r.rc)', ind, nreg)
+        emit('%si = %s + r.v[0][%s].xoff', ind, reg, reg)
+        emit('%sgoto continue', ind)
+    elseif f.kind == 'union' then
+        emit('%sif %s ~= 0 then error(\'%s dup\') end', ind, reg, path)
+        emit('%sb = ut_%s[r.t[0][i+1]]', ind, reg)
+        if f.disc then
+            emit('%sif b == %d then', ind, UNION_DISC)
+            emit_discriminator(emit, ind..'    ', f)
+            emit('%send', ind)
+        end
+        emit('%sif b == %d then error(\'%s no branch\') end', ind, UNION_NONE, path)
+        emit('%s%s = b + 1', ind, reg)
+        for k, b in ipairs(f.branches) do
+            emit('%s%s b == %d then -- %s', ind, k == 1 and 'if' or 'elseif',
+                 b.index, b.type.name or b.type.type)
+            emit_branch(emit, ind..'    ', f, b)
+        end
+        emit('%send', ind)
+        emit('%sgoto continue', ind)
+    elseif f.kind == 'enum' then
+        emit('%sif r.t[0][i+1] ~= 8 then error(\'%s not str\') end', ind, path)
+        emit('%sif %s ~= %d then error(\'%s dup\') end', ind, reg, f.reg.init, path)
+        emit('%sr.ks, r.kl = r.b1 - r.v[0][i+1].xoff, r.v[0][i+1].xlen', ind)
+        emit_symbol_dispatch(emit, ind, f.symbols, reg,
+                             format('error(\'wrong %s\')', path))
+        emit('%si = i + 2', ind)
+        emit('%sgoto continue', ind)
+    else
+        local lt = leaf_types[f.type.type]
+        emit('%sif %s then error(\'%s not %s\') end', ind,
+             bad_tid_cond('r.t[0][i+1]', f.tids or lt.tids), path, lt.what)
+        if f.type.type == 'fixed' then
+            emit('%sif r.v[0][i+1].xlen ~= %d then error(\'%s wrong size\') end',
+                 ind, f.type.size, path)
+        end
+        emit('%sif %s ~= 0 then error(\'%s dup\') end', ind, reg, path)
+        emit('%s%s = i + 1', ind, reg)
+        emit('%si = i + 2', ind)
+        emit('%sgoto continue', ind)
+    end
+end
+
+-- Step over a value of a writer field unknown to the reader.
+local function emit_ignore(emit, ind)
+    emit('%sif r.t[0][i+1] == 11 or r.t[0][i+1] == 12 then', ind)
+    emit('%s    i = i + 1 + r.v[0][i+1].xoff', ind)
+    emit('%selse', ind)
+    emit('%s    i = i + 2', ind)
+    emit('%send', ind)
+    emit('%sgoto continue', ind)
+end
+
+local function state_label(s)
+    if not s.parent then
+        return 'do_root'
+    end
+    return format('do_%d_%s', s.id, (s.path:gsub('%.', '_')))
+end
+
+local function emit_state(emit, ctx, s)
+    local what = s.path or '::root::'
+    emit('::%s::', state_label(s))
+    if s.parent then
+        emit('        if i == %s + r.v[0][%s].xoff then', s.reg.name, s.reg.name)
+        emit('            state = %d', s.parent.id)
+    else
+        emit('        if i == %s then', ctx.batch and 'root + r.v[0][root].xoff'
+                                               or 'r.v[0][0].xoff')
+        emit('            state = %d', ctx.fini)
+    end
+    emit('            goto continue')
+    emit('        end')
+    emit('')
+    emit('        if r.t[0][i] ~= 8 then error(\'%s key not str\') end', what)
+    emit('')
+    emit('        r.ks, r.kl = r.b1 - r.v[0][i].xoff, r.v[0][i].xlen')
+    emit('')
+    local body = function(i, ind)
+        local f = s.fields[s.key_field[i]]
+        if f then
+            emit_field(emit, ind, f)
+        else
+            emit_ignore(emit, ind)
+        end
+    end
+    if s.ph then
+        emit_phash_dispatch(emit, '        ', format('ph%d', s.id), s.ph, s.keys,
+                            body, 'unknown_key(r.ks, r.kl)')
+    else
+        emit_key_dispatch(emit, '        ', s.keys, body, 'unknown_key(r.ks, r.kl)')
+    end
+    emit('')
+end
+
+-- Collect keys (names and aliases) of every record and pick the
+-- dispatch method.
+local function prepare_states(ctx)
+    for _, s in ipairs(ctx.states) do
+        local keys, key_field, strs = {}, {}, {}
+        for i, f in ipairs(s.fields) do
+            insert(keys, f.key)
+            insert(key_field, i)
+            for _, alias in ipairs(f.aliases) do
+                insert(keys, alias)
+                insert(key_field, i)
+            end
+        end
+        for _, e in ipairs(s.ignore) do
+            insert(keys, e)
+            insert(key_field, 0)
+        end
+        for i, e in ipairs(keys) do strs[i] = e.str end
+        s.keys, s.key_field = keys, key_field
+        if #keys >= PHASH_MIN_KEYS or
+           (#keys > 1 and not distinguishing_byte(strs)) then
+            s.ph = perfect_hash(strs)
+        end
+    end
+end
+
+-- Output position tracker: slots at fixed positions until the first
+-- array, positions relative to 'o' afterwards.
+local function pos_expr(base, off)
+    if not base then
+        return tostring(off)
+    elseif off == 0 then
+        return base
+    end
+    return format('%s + %d', base, off)
+end
+
+local function emit_copy_leaf(emit, ind, xtype, dst, src)
+    local lt = leaf_types[xtype]
+    if lt.conv then
+        emit('%sr.ot[%s] = %d', ind, dst, lt.tid)
+        emit('%sif r.t[0][%s] == 4 then', ind, src)
+        emit('%s    r.ov[%s].dval = tonumber(r.v[0][%s].ival)', ind, dst, src)
+        emit('%selse', ind)
+        emit('%s    r.ov[%s].dval = r.v[0][%s].dval', ind, dst, src)
+        emit('%send', ind)
+    elseif xtype == 'null' then
+        emit('%sr.ot[%s] = 1', ind, dst)
+    elseif xtype == 'boolean' then
+        emit('%sr.ot[%s] = r.t[0][%s]', ind, dst, src)
+    else
+        emit('%sr.ot[%s] = %2d; r.ov[%s].uval = r.v[0][%s].uval', ind,
+             dst, lt.tid, dst, src)
+    end
+end
+
+-- Check an array / map item at src and copy it to dst.  Error
+-- messages name the item with string.format(name, arg).
+local function emit_item(emit, ind, f, dst, src, name, arg)
+    local items = f.items
+    if items.type == 'enum' then
+        emit('%sif r.t[0][%s] ~= 8 then', ind, src)
+        emit('%s    error(string.format(\'%s not str\', %s))', ind, name, arg)
+        emit('%send', ind)
+        emit('%sr.ks, r.kl = r.b1 - r.v[0][%s].xoff, r.v[0][%s].xlen', ind, src, src)
+        emit('%sr.ot[%s] = 4', ind, dst)
+        emit_symbol_dispatch(emit, ind, f.symbols, format('r.ov[%s].uval', dst),
+                             format('error(string.format(\'wrong %s\', %s))', name, arg))
+    else
+        local lt = leaf_types[items.type]
+        emit('%sif %s then', ind, bad_tid_cond(format('r.t[0][%s]', src), f.tids or lt.tids))
+        emit('%s    error(string.format(\'%s not %s\', %s))', ind, name, lt.what, arg)
+        emit('%send', ind)
+        if items.type == 'fixed' then
+            emit('%sif r.v[0][%s].xlen ~= %d then', ind, src, items.size)
+            emit('%s    error(string.format(\'%s wrong size\', %s))', ind, name, arg)
+            emit('%send', ind)
+        end
+        emit_copy_leaf(emit, ind, items.type, dst, src)
+    end
+end
+
+local function emit_array_items(emit, ind, f, pos)
+    local reg = f.reg.name
+    emit('%sfor k = 1, r.v[0][%s].xlen do', ind, reg)
+    emit_item(emit, ind..'    ', f, format('%s + k', pos), format('%s + k', reg),
+              f.path..'[%d]', 'k')
+    emit('%send', ind)
+end
+
+-- Buckets of a map (see map_hash_order), a pair or two nils each.
+local function emit_map_items(emit, ind, f, pos)
+    local nreg = f.nreg.name
+    local kdst, vdst = format('%s + 1 + k + k', pos), format('%s + 2 + k + k', pos)
+    emit('%sfor k = 0, %s - 1 do', ind, nreg)
+    emit('%s    b = mo_%s[k]', ind, f.reg.name)
+    emit('%s    if b == 0 then', ind)
+    emit('%s        r.ot[%s] = 1', ind, kdst)
+    emit('%s        r.ot[%s] = 1', ind, vdst)
+    emit('%s    else', ind)
+    emit('%s        r.ot[%s] = 8; r.ov[%s].uval = r.v[0][b].uval', ind, kdst, kdst)
+    emit_item(emit, ind..'        ', f, vdst, 'b + 1', f.path..'.%s',
+              'ffi.string(r.b1 - r.v[0][b].xoff, r.v[0][b].xlen)')
+    emit('%s    end', ind)
+    emit('%send', ind)
+end
+
+-- Common part of flatten / unflatten: chunk args, the bank and the
+-- output buffer management.
+local function emit_prologue(emit, ctx, name)
+    emit('-- generated from %s', name)
+    emit('local ffi, schema_util_C, r, arena, unknown_key, program, invalid, sink = ...')
+    emit('')
+    emit('local bank = %s', string_literal(ctx.bank.data))
+    emit('local ocap = %d', STOCK_OUTPUT)
+    if not ctx.batch then
+        emit('local sb1 = ffi.new(\'const uint8_t *[1]\') -- bank1 of a stream / json')
+        if ctx.validate then
+            emit('local verr = ffi.new(\'struct tarantool_schema_DocError\')')
+        end
+    end
+    emit('')
+    emit('local function grow_output(n)')
+    emit('    local cap = n + math.floor(n / 2)')
+    emit('    local ot = ffi.C.realloc(r.ot, cap)')
+    emit('    if ot == nil then')
+    emit('        error(\'out of memory\')')
+    emit('    end')
+    emit('    r.ot = ot')
+    emit('    local ov = ffi.C.realloc(r.ov, cap * 8)')
+    emit('    if ov == nil then')
+    emit('        error(\'out of memory\')')
+    emit('    end')
+    emit('    r.ov = ov')
+    emit('    ocap = cap')
+    emit('end')
+    emit('')
+    local tables = false
+    for _, f in ipairs(ctx.unions) do
+        emit('local ut_%s = ffi.new(\'const uint8_t[14]\', { %s }) -- %s',
+             f.reg.name, concat(f.jt, ', '), f.path)
+        tables = true
+    end
+    for _, f in ipairs(ctx.maps) do
+        emit('local mo_%s, mc_%s = ffi.new(\'uint32_t[16]\'), 16 -- %s buckets',
+             f.reg.name, f.reg.name, f.path)
+        tables = true
+    end
+    for _, s in ipairs(ctx.states) do
+        if s.ph then
+            emit_phash_tables(emit, format('ph%d', s.id), s.ph, s.keys)
+            tables = true
+        end
+    end
+    if tables then
+        emit('')
+    end
+end
+
+-- Preprocess data into r.t[0] / r.v[0] (owned by the arena).  Data
+-- is either a string or a complete stream (schema_util.preprocess_stream);
+-- in the latter case the buffers are borrowed from the stream.  JSON
+-- is a string; strings with escapes are decoded in the arena, bank1
+-- is returned by preprocess_json.
+local function emit_preprocess(emit, ind, ctx)
+    emit('%sr.b2 = ffi.cast(\'const uint8_t *\', bank)', ind)
+    emit('%sr.b2 = r.b2 + %d', ind, #ctx.bank.data)
+    emit('')
+    if ctx.json then
+        emit('%sif type(data) ~= \'string\' then', ind)
+        emit('%s    error(\'json needs a string\')', ind)
+        emit('%send', ind)
+        emit('%sr.rc = schema_util_C.preprocess_json(arena, data, #data, r.t, r.v, sb1)', ind)
+        emit('%sif r.rc < 0 then', ind)
+        emit('%s    error(\'preprocess_json: -1\')', ind)
+        emit('%send', ind)
+        emit('%sr.b1 = sb1[0]', ind)
+        return
+    end
+    emit('%sif type(data) ~= \'string\' then', ind)
+    if ctx.project or ctx.validate then
+        emit('%s    error(\'%s needs a string\')', ind,
+             ctx.validate and 'validation' or 'projection')
+    end
+    emit('%s    r.rc = schema_util_C.preprocess_stream_result(data, r.t, r.v, sb1)', ind)
+    emit('%s    if r.rc < 0 then', ind)
+    emit('%s        error(\'preprocess_stream_result: -1\')', ind)
+    emit('%s    end', ind)
+    emit('%s    r.b1 = sb1[0]', ind)
+    if ctx.compact then
+        emit('%s    compact = false', ind)
+    end
+    emit('%selse', ind)
+    emit('%s    r.b1 = ffi.cast(\'const uint8_t *\', data)', ind)
+    emit('%s    r.b1 = r.b1 + #data', ind)
+    if ctx.compact then
+        emit('%s    r.rc = schema_util_C.preprocess_msgpack_compact(arena, data, #data, r.t, r.cv, r.side)', ind)
+        emit('%s    compact = r.rc ~= -2', ind)
+        emit('%s    if not compact then', ind)
+        emit('%s        r.rc = schema_util_C.preprocess_msgpack_arena(arena, data, #data, r.t, r.v)', ind)
+        emit('%s    end', ind)
+        emit('%s    if r.rc < 0 then', ind)
+        emit('%s        error(\'preprocess_msgpack: -1\')', ind)
+        emit('%s    end', ind)
+        emit('%send', ind)
+        return
+    end
+    if ctx.validate then
+        emit('%s    r.rc = schema_util_C.validate_msgpack(arena, program.prog, data, #data, r.t, r.v, verr)', ind)
+        emit('%s    if r.rc < 0 then', ind)
+        emit('%s        error(invalid(verr, data))', ind)
+        emit('%s    end', ind)
+        emit('%send', ind)
+        return
+    elseif ctx.project then
+        emit('%s    r.rc = schema_util_C.preprocess_msgpack_projected(arena, program.prog, data, #data, r.t, r.v)', ind)
+    else
+        emit('%s    r.rc = schema_util_C.preprocess_msgpack_arena(arena, data, #data, r.t, r.v)', ind)
+    end
+    emit('%s    if r.rc < 0 then', ind)
+    emit('%s        error(\'preprocess_msgpack: -1\')', ind)
+    emit('%s    end', ind)
+    emit('%send', ind)
+end
+
+-- Encode r.ot / r.ov into res.
+local function emit_create(emit, ind, iov)
+    if iov then
+        emit('%sr.rc = schema_util_C.create_msgpack_iov(arena, slots, r.ot, r.ov, r.b1, r.b2, %d, r.iov, r.size)',
+             ind, iov)
+        emit('%sif r.rc < 0 then', ind)
+        emit('%s    error(\'create_msgpack_iov: -1\')', ind)
+        emit('%send', ind)
+        emit('')
+        emit('%sres = r.iov[0]', ind)
+        return
+    end
+    emit('%sr.rc = schema_util_C.create_msgpack_arena(arena, slots, r.ot, r.ov, r.b1, r.b2, r.res)',
+         ind)
+    emit('%sif r.rc < 0 then', ind)
+    emit('%s    error(\'create_msgpack: -1\')', ind)
+    emit('%send', ind)
+    emit('')
+    emit('%sres = ffi.string(r.res[0], r.rc)', ind)
+end
+
+-- A missing field is an error unless it has a default; if only
+-- enclosing records have defaults, unless one of these is missing.
+-- Fields of union branches are checked if the branch is taken.
+local function emit_missing(emit, reg)
+    if reg.own or reg.aux then
+        return
+    end
+    local cond = { format('%-5s == %d', reg.name, reg.init) }
+    for _, d in ipairs(reg.dflt) do
+        insert(cond, format('%s ~= 0', d.reg.name))
+    end
+    for _, g in ipairs(reg.guards) do
+        insert(cond, format('%s == %d', g.reg.name, g.value))
+    end
+    emit('        if %s then error(\'%s missing\') end', concat(cond, ' and '), reg.path)
+end
+
+-- Does the slot move subsequent slots (an array)?
+local function slot_dynamic(f)
+    return (f.kind == 'array' and not f.skip) or f.kind == 'map' or
+           (f.kind == 'uvalue' and f.dynamic)
+end
+
+-- Value of a union, by the branch taken.
+local function emit_union_value(emit, ind, f, pos, last)
+    local reg, vreg = f.reg.name, f.vreg.name
+    local kw = 'if'
+    for _, b in ipairs(f.union.branches) do
+        if b.kind ~= 'record' then
+            emit('%s%s %s == %d then', ind, kw, reg, b.index + 1)
+            kw = 'elseif'
+            if b.kind == 'null' then
+                emit('%s    r.ot[%s] = 1', ind, pos)
+            elseif b.kind == 'enum' then
+                emit('%s    r.ot[%s] =  4; r.ov[%s].uval = %s', ind, pos, pos, vreg)
+            elseif b.kind == 'array' then
+                emit('%s    r.ot[%s] = 11; r.ov[%s].xlen = r.v[0][%s].xlen',
+                     ind, pos, pos, vreg)
+                emit_array_items(emit, ind..'    ', b.af, pos)
+                if not last then
+                    emit('%s    o = %s + 1 + r.v[0][%s].xlen', ind, pos, vreg)
+                end
+            else
+                emit_copy_leaf(emit, ind..'    ', b.type.type, pos, vreg)
+            end
+            if f.dynamic and not last and b.kind ~= 'array' then
+                emit('%s    o = %s + 1', ind, pos)
+            end
+        end
+    end
+    -- a record branch
+    emit('%selse', ind)
+    emit('%s    r.ot[%s] = 1', ind, pos)
+    if f.dynamic and not last then
+        emit('%s    o = %s + 1', ind, pos)
+    end
+    emit('%send', ind)
+end
+
+-- Slot value at pos, from the field's value or from a default; nil
+-- if in a union branch not taken.
+local function emit_slot(emit, ind, f, pos, last)
+    local reg = f.reg.name
+    local dflt, guards = f.reg.dflt, f.reg.guards
+    local dynamic = slot_dynamic(f) and not last
+    local kw = 'if'
+    if #guards ~= 0 then
+        local cond = {}
+        for _, g in ipairs(guards) do
+            insert(cond, format('%s ~= %d', g.reg.name, g.value))
+        end
+        emit('%s%s %s then -- branch not taken', ind, kw, concat(cond, ' or '))
+        kw = 'elseif'
+        emit('%s    r.ot[%s] = 1', ind, pos)
+        if dynamic then
+            emit('%s    o = %s + 1', ind, pos)
+        end
+    end
+    for _, d in ipairs(dflt) do
+        emit('%s%s %s == %d then -- default', ind, kw, d.reg.name, d.reg.init)
+        kw = 'elseif'
+        if f.kind == 'union' then
+            emit('%s    r.ot[%s] =  4; r.ov[%s].uval = 0', ind, pos, pos)
+        elseif d.symbol then
+            emit('%s    r.ot[%s] =  4; r.ov[%s].uval = %d', ind, pos, pos, d.symbol)
+        else
+            emit('%s    r.ot[%s] = 20; r.ov[%s].xlen = %d; r.ov[%s].xoff = %d',
+                 ind, pos, pos, d.entry.size, pos, d.entry.hoff)
+        end
+        if dynamic then
+            emit('%s    o = %s + 1', ind, pos)
+        end
+    end
+    if kw ~= 'if' then
+        emit('%selse', ind)
+        ind = ind..'    '
+    end
+    if f.skip then
+        emit('%sr.ot[%s] = 13; r.ov[%s].uval = r.v[0][%s].uval', ind, pos, pos, reg)
+    elseif f.kind == 'enum' then
+        emit('%sr.ot[%s] =  4; r.ov[%s].uval = %s', ind, pos, pos, reg)
+    elseif f.kind == 'union' then
+        emit('%sr.ot[%s] =  4; r.ov[%s].uval = %s - 1', ind, pos, pos, reg)
+    elseif f.kind == 'uvalue' then
+        emit_union_value(emit, ind, f, pos, last)
+    elseif f.kind == 'map' then
+        local nreg = f.nreg.name
+        emit('%sr.ot[%s] = 11; r.ov[%s].xlen = %s + %s', ind, pos, pos, nreg, nreg)
+        emit_map_items(emit, ind, f, pos)
+        if not last then
+            emit('%so = %s + 1 + %s + %s', ind, pos, nreg, nreg)
+        end
+    elseif f.kind == 'array' then
+        emit('%sr.ot[%s] = 11; r.ov[%s].xlen = r.v[0][%s].xlen', ind, pos, pos, reg)
+        emit_array_items(emit, ind, f, pos)
+        if not last then
+            emit('%so = %s + 1 + r.v[0][%s].xlen', ind, pos, reg)
+        end
+    else
+        emit_copy_leaf(emit, ind, f.type.type, pos, reg)
+    end
+    if kw ~= 'if' then
+        emit('%send', ind:sub(5))
+    end
+end
+
+local function emit_fini(emit, ctx)
+    emit('::fini::')
+    for _, reg in ipairs(ctx.regs) do
+        emit_missing(emit, reg)
+    end
+    emit('')
+    local nslots, arrays = #ctx.slots, {}
+    for _, f in ipairs(ctx.slots) do
+        local reg = f.reg.name
+        if f.kind == 'array' and not f.skip then
+            if #f.reg.dflt ~= 0 or #f.reg.guards ~= 0 then
+                -- a default / nil takes a single slot
+                insert(arrays, format(' + (%s ~= 0 and r.v[0][%s].xlen or 0)', reg, reg))
+            else
+                insert(arrays, format(' + r.v[0][%s].xlen', reg))
+            end
+        elseif f.kind == 'map' then
+            -- no buckets if missing
+            insert(arrays, format(' + %s + %s', f.nreg.name, f.nreg.name))
+        elseif f.kind == 'uvalue' then
+            for _, b in ipairs(f.union.branches) do
+                if b.kind == 'array' then
+                    insert(arrays, format(' + (%s == %d and r.v[0][%s].xlen or 0)',
+                                          reg, b.index + 1, f.vreg.name))
+                end
+            end
+        end
+    end
+    emit('        slots = %d%s', nslots + 1, concat(arrays))
+    -- in batch mode output goes at ob
+    local base, off = nil, 1
+    if ctx.batch then
+        base, off = 'ob', 1
+        emit('        if ob + slots > ocap then')
+        emit('            grow_output(ob + slots)')
+        emit('        end')
+        emit('')
+        emit('        r.ot[ob] = 11; r.ov[ob].xlen = %d', nslots)
+    else
+        emit('        if slots > ocap then')
+        emit('            grow_output(slots)')
+        emit('        end')
+        emit('')
+        emit('        r.ot[0] = 11; r.ov[0].xlen = %d', nslots)
+    end
+    for n, f in ipairs(ctx.slots) do
+        local pos = pos_expr(base, off)
+        emit('        -- #%d %s', n, f.path)
+        emit_slot(emit, '        ', f, pos, n == nslots)
+        if slot_dynamic(f) then
+            base, off = 'o', 0
+        else
+            off = off + 1
+        end
+    end
+    emit('')
+    if ctx.batch then
+        emit('        ob = ob + slots')
+        emit('        state = 0')
+    else
+        emit_create(emit, '        ', ctx.iov)
+        emit('        state = %d', ctx.fini + 1)
+    end
+    emit('        goto continue')
+    emit('')
+end
+
+local function emit_regs(emit, ctx)
+    for _, reg in ipairs(ctx.regs) do
+        emit('    local %-4s = %d -- %s', reg.name, reg.init, reg.path)
+    end
+    emit('')
+end
+
+-- Loop head with state dispatch, returns ret once done.
+local function emit_loop_head(emit, ctx, ret)
+    emit('    -- see person.lua for the rationale behind the loop')
+    emit('    for _ = 1, 10000000000 do')
+    emit('')
+    -- states with more fields are likely to be visited more often
+    local order = {}
+    for _, s in ipairs(ctx.states) do insert(order, s) end
+    table.sort(order, function(a, b)
+        if #a.fields ~= #b.fields then return #a.fields > #b.fields end
+        return a.id < b.id
+    end)
+    emit('        -- grow strong branches (ordered by frequency)')
+    for _, s in ipairs(order) do
+        emit('        if state == %d then goto %s end', s.id, state_label(s))
+    end
+    emit('        if state == 0 then goto init end')
+    emit('        if state == %d then goto fini end', ctx.fini)
+    emit('')
+    emit('        do')
+    emit('            -- often not JIT-ed')
+    emit('            return %s', ret)
+    emit('        end')
+    emit('')
+end
+
+local function emit_loop_tail(emit, ctx)
+    for _, s in ipairs(ctx.states) do
+        emit_state(emit, ctx, s)
+    end
+    emit('::continue::')
+    emit('    end')
+end
+
+--
+-- compact items
+--
+-- preprocess_msgpack_compact packs values into 4 bytes (see
+-- schema_util.c), documents too large for that are preprocessed as
+-- usual.  The generated code reads values through accessors picking
+-- the form of the current document; emit_* functions are unaware,
+-- value reads in their output are rewritten.
+--
+local function emit_compact_accessors(emit)
+    emit('local compact = false -- r.cv / r.side hold the items')
+    emit('local band, rshift, arshift = bit.band, bit.rshift, bit.arshift')
+    emit('')
+    for _, field in ipairs({ 'xlen', 'xoff' }) do
+        emit('local function cv_%s(i)', field)
+        emit('    if compact then return r.cv[0][i].%s end', field)
+        emit('    return r.v[0][i].%s', field)
+        emit('end')
+        emit('')
+    end
+    emit('local function cv_ival(i)')
+    emit('    if not compact then return r.v[0][i].ival end')
+    emit('    local u = r.cv[0][i].u')
+    emit('    if band(u, 1) == 0 then return arshift(u, 1) end')
+    emit('    return r.side[0][rshift(u, 1)].ival')
+    emit('end')
+    emit('')
+    emit('local function cv_dval(i)')
+    emit('    if not compact then return r.v[0][i].dval end')
+    emit('    return r.side[0][rshift(r.cv[0][i].u, 1)].dval')
+    emit('end')
+    emit('')
+    emit('local function cv_copy(dst, i)')
+    emit('    if not compact then')
+    emit('        r.ov[dst].uval = r.v[0][i].uval')
+    emit('        return')
+    emit('    end')
+    emit('    local u = r.cv[0][i].u')
+    emit('    if r.t[0][i] >= 8 then')
+    emit('        r.ov[dst].xlen = r.cv[0][i].xlen')
+    emit('        r.ov[dst].xoff = r.cv[0][i].xoff')
+    emit('    elseif band(u, 1) == 1 then')
+    emit('        r.ov[dst].uval = r.side[0][rshift(u, 1)].uval')
+    emit('    else')
+    emit('        r.ov[dst].ival = arshift(u, 1)')
+    emit('    end')
+    emit('end')
+    emit('')
+end
+
+local compact_accessors = { xlen = true, xoff = true, ival = true,
+                            dval = true, copy = true }
+
+-- Reads of r.v[0] become accessor calls.  Anything else touching
+-- r.v[0] (writes, reads of other fields) is a generator bug, caught
+-- here rather than when the generated code is loaded or run.
+local function compact_reader(emit)
+    return function(fmt, ...)
+        local line = format(fmt, ...)
+        line = gsub(line, 'r%.ov%[([^%]]+)%]%.uval = r%.v%[0%]%[([^%]]+)%]%.uval',
+                    'cv_copy(%1, %2)')
+        line = gsub(line, 'r%.v%[0%]%[([^%]]+)%]%.(%a+)', 'cv_%2(%1)')
+        if line:find('r%.v%[0%]') or line:find('cv_%a+%b()%s*=[^=]') then
+            error(format('compact: can\'t rewrite %q', line))
+        end
+        for field in line:gmatch('cv_(%a+)%(') do
+            if not compact_accessors[field] then
+                error(format('compact: no accessor cv_%s in %q', field, line))
+            end
+        end
+        emit('%s', line)
+    end
+end
+
+local function generate_flatten(ctx, name)
+    local code, emit = emitter()
+    emit_prologue(emit, ctx, name)
+    if ctx.compact then
+        emit_compact_accessors(emit)
+        emit = compact_reader(emit)
+    end
+    emit('return function(data)')
+    emit('')
+    emit('    local res, slots, o, k, b')
+    emit('    local state, i = 0, 1')
+    emit('')
+    emit_regs(emit, ctx)
+    emit_loop_head(emit, ctx, ctx.iov and
+                   'res, tonumber(r.rc), tonumber(r.size[0])' or 'res')
+    emit('::init::')
+    emit_preprocess(emit, '        ', ctx)
+    emit('')
+    emit('        if r.t[0][0] ~= 12 then')
+    emit('            error(\'::root:: not map\')')
+    emit('        end')
+    emit('')
+    emit('        state = 1')
+    emit('        goto continue')
+    emit('')
+    emit_fini(emit, ctx)
+    emit_loop_tail(emit, ctx)
+    emit('end')
+    emit('')
+    return concat(code, '\n')
+end
+
+--
+-- batch flatten
+--
+-- The state machine runs over all documents in a batch, both
+-- preprocessing and encoding take a single call.  Output items of
+-- all documents go into r.ot / r.ov back to back (ob is the current
+-- document's base).  An error aborts the current document only, it
+-- is caught outside the loop and processing resumes with the next
+-- document.  With columnar, items are appended to a column sink
+-- instead of being encoded.
+--
+local function generate_flatten_batch(ctx, name)
+    local code, emit = emitter()
+    emit_prologue(emit, ctx, name)
+    emit('local ndocs = 0')
+    emit('local docs, ioffs, ooffs%s', ctx.validate and ', verrs' or
+                                      ctx.json and ', jdocs' or '')
+    emit('local cur -- index of the document being processed')
+    emit('')
+    emit('local function reserve(n)')
+    emit('    if n > ndocs or not docs then')
+    emit('        ndocs = n + math.floor(n / 2)')
+    emit('        docs  = ffi.new(\'struct tarantool_schema_Doc[?]\', ndocs)')
+    emit('        ioffs = ffi.new(\'uint32_t[?]\', ndocs + 1)')
+    emit('        ooffs = ffi.new(\'uint32_t[?]\', ndocs + 1)')
+    if ctx.validate then
+        emit('        verrs = ffi.new(\'struct tarantool_schema_DocError[?]\', ndocs)')
+    elseif ctx.json then
+        emit('        jdocs = ffi.new(\'struct tarantool_schema_Doc[?]\', ndocs)')
+    end
+    emit('    end')
+    emit('end')
+    emit('')
+    emit('-- process documents [d, n), output starts at ob')
+    emit('local function run(d, n, ob)')
+    emit('')
+    emit('    local slots, o, k, b')
+    emit('    local state, i, root = 0, 0, 0')
+    emit('')
+    emit_regs(emit, ctx)
+    emit_loop_head(emit, ctx, 'ob')
+    emit('::init::')
+    emit('        if d == n then')
+    emit('            state = %d', ctx.fini + 1)
+    emit('            goto continue')
+    emit('        end')
+    emit('')
+    emit('        cur = d')
+    emit('        ooffs[d] = ob')
+    emit('        root = ioffs[d]')
+    emit('        if ioffs[d + 1] == root then')
+    if ctx.validate then
+        emit('            error(invalid(verrs[d], docs[d].data))')
+    elseif ctx.json then
+        emit('            error(\'preprocess_json: -1\')')
+    else
+        emit('            error(\'preprocess_msgpack: -1\')')
+    end
+    emit('        end')
+    -- preprocess_json_batch yields bank1 of every document in jdocs
+    local bdocs = ctx.json and 'jdocs' or 'docs'
+    emit('        r.b1 = %s[d].data + %s[d].size', bdocs, bdocs)
+    emit('        d = d + 1')
+    emit('')
+    emit('        if r.t[0][root] ~= 12 then')
+    emit('            error(\'::root:: not map\')')
+    emit('        end')
+    emit('')
+    for _, reg in ipairs(ctx.regs) do
+        emit('        %-4s = %d', reg.name, reg.init)
+    end
+    emit('')
+    emit('        i = root + 1')
+    emit('        state = 1')
+    emit('        goto continue')
+    emit('')
+    emit_fini(emit, ctx)
+    emit_loop_tail(emit, ctx)
+    emit('end')
+    emit('')
+    emit('return function(list)')
+    emit('')
+    emit('    local n = #list')
+    emit('    local d, ob, ok, res, errs = 0, 0')
+    emit('')
+    emit('    reserve(n)')
+    emit('    for j = 0, n - 1 do')
+    emit('        local data = list[j + 1]')
+    emit('        docs[j].data = ffi.cast(\'const uint8_t *\', data)')
+    emit('        docs[j].size = #data')
+    emit('    end')
+    emit('')
+    emit('    r.b2 = ffi.cast(\'const uint8_t *\', bank)')
+    emit('    r.b2 = r.b2 + %d', #ctx.bank.data)
+    emit('')
+    if ctx.validate then
+        emit('    r.rc = schema_util_C.validate_msgpack_batch(arena, program.prog, n, docs, r.t, r.v, ioffs, verrs)')
+    elseif ctx.json then
+        emit('    r.rc = schema_util_C.preprocess_json_batch(arena, n, docs, r.t, r.v, ioffs, jdocs)')
+    elseif ctx.project then
+        emit('    r.rc = schema_util_C.preprocess_msgpack_batch_projected(arena, program.prog, n, docs, r.t, r.v, ioffs)')
+    else
+        emit('    r.rc = schema_util_C.preprocess_msgpack_batch_arena(arena, n, docs, r.t, r.v, ioffs)')
+    end
+    emit('    if r.rc < 0 then')
+    emit('        error(\'preprocess_msgpack_batch: -1\')')
+    emit('    end')
+    emit('')
+    emit('    while true do')
+    emit('        ok, res = pcall(run, d, n, ob)')
+    emit('        if ok then')
+    emit('            ob = res')
+    emit('            break')
+    emit('        end')
+    emit('        -- the document yields no output, resume with the next one')
+    emit('        errs = errs or {}')
+    emit('        errs[cur + 1] = res')
+    emit('        d, ob = cur + 1, ooffs[cur]')
+    emit('    end')
+    emit('    ooffs[n] = ob')
+    emit('')
+    if ctx.columnar then
+        emit('    r.rc = schema_util_C.column_sink_append(sink, n, r.ot, r.ov, ooffs, %s, r.b2)',
+             bdocs)
+        emit('    if r.rc < 0 then')
+        emit('        error(\'column_sink_append: -1\')')
+        emit('    end')
+        emit('    return tonumber(r.rc), errs')
+        emit('end')
+        emit('')
+        return concat(code, '\n')
+    end
+    emit('    -- output offsets go to ioffs, input offsets aren\'t needed anymore')
+    emit('    r.rc = schema_util_C.create_msgpack_batch_arena(arena, n, r.ot, r.ov, ooffs, %s, r.b2, r.res, ioffs)',
+         bdocs)
+    emit('    if r.rc < 0 then')
+    emit('        error(\'create_msgpack_batch: -1\')')
+    emit('    end')
+    emit('')
+    emit('    res = {}')
+    emit('    for j = 0, n - 1 do')
+    emit('        local len = ioffs[j + 1] - ioffs[j]')
+    emit('        if len ~= 0 then')
+    emit('            res[j + 1] = ffi.string(r.res[0] + ioffs[j], len)')
+    emit('        end')
+    emit('    end')
+    emit('    return res, errs')
+    emit('end')
+    emit('')
+    return concat(code, '\n')
+end
+
+--
+-- unflatten - the reverse of flatten, turns a tuple back into a map
+--
+-- Keys and enum symbols aren't materialized as Lua strings, they are
+-- copied from the bank with CopyCommand.  Everything else references
+-- the input data (bank1) directly.  The output layout is static save
+-- for arrays, hence the code is straight-line.
+--
+
+-- Positions in the input tuple / in the output, same scheme as in
+-- pos_expr: fixed until the first array, relative to i / o afterwards.
+local function cursor()
+    return { base = nil, off = 1 }
+end
+
+local function cursor_pos(c)
+    return pos_expr(c.base, c.off)
+end
+
+local function emit_symbol_copy(emit, ind, f, dst, src, what)
+    emit('%se = tonumber(r.v[0][%s].ival)', ind, src)
+    emit('%sif r.t[0][%s] ~= 4 or e < 0 or e >= %d then', ind, src, #f.symbols)
+    emit('%s    %s', ind, what)
+    emit('%send', ind)
+    emit('%sr.ot[%s] = 20', ind, dst)
+    emit('%sr.ov[%s].xlen = sym_%s[e + e + 1]', ind, dst, f.reg.name)
+    emit('%sr.ov[%s].xoff = sym_%s[e + e]', ind, dst, f.reg.name)
+end
+
+local function emit_unflatten_field(emit, ctx, f, ic, oc)
+    local pos = cursor_pos(oc)
+    emit('    r.ot[%s] = 20; r.ov[%s].xlen = %d; r.ov[%s].xoff = %d -- %s',
+         pos, pos, f.key.size, pos, f.key.hoff, f.name)
+    oc.off = oc.off + 1
+    if f.kind == 'record' then
+        local rec = f.state
+        pos = cursor_pos(oc)
+        emit('    r.ot[%s] = 12; r.ov[%s].xlen = %d -- %s', pos, pos, #rec.fields, f.path)
+        oc.off = oc.off + 1
+        for _, sf in ipairs(rec.fields) do
+            emit_unflatten_field(emit, ctx, sf, ic, oc)
+        end
+        return
+    end
+    local src, dst = cursor_pos(ic), cursor_pos(oc)
+    local last = f == ctx.slots[#ctx.slots]
+    if f.kind == 'enum' then
+        emit_symbol_copy(emit, '    ', f, dst, src,
+                         format('error(\'wrong %s\')', f.path))
+    elseif f.kind == 'array' then
+        emit('    if r.t[0][%s] ~= 11 then error(\'%s not array\') end', src, f.path)
+        emit('    n = r.v[0][%s].xlen', src)
+        emit('    r.ot[%s] = 11; r.ov[%s].xlen = n', dst, dst)
+        emit('    for k = 1, n do')
+        local isrc, idst = format('%s + k', src), format('%s + k', dst)
+        local items = f.items
+        if items.type == 'enum' then
+            emit_symbol_copy(emit, '        ', f, idst, isrc,
+                             format('error(string.format(\'wrong %s[%%d]\', k))', f.path))
+        else
+            local lt = leaf_types[items.type]
+            emit('        if %s then', bad_tid_cond(format('r.t[0][%s]', isrc), lt.tids))
+            emit('            error(string.format(\'%s[%%d] not %s\', k))', f.path, lt.what)
+            emit('        end')
+            if items.type == 'fixed' then
+                emit('        if r.v[0][%s].xlen ~= %d then', isrc, items.size)
+                emit('            error(string.format(\'%s[%%d] wrong size\', k))', f.path)
+                emit('        end')
+            end
+            emit_copy_leaf(emit, '        ', items.type, idst, isrc)
+        end
+        emit('    end')
+        if not last then
+            emit('    i = %s + 1 + n', src)
+        end
+        emit('    o = %s + 1 + n', dst)
+        ic.base, ic.off = 'i', 0
+        oc.base, oc.off = 'o', 0
+        return
+    else
+        local lt = leaf_types[f.type.type]
+        emit('    if %s then error(\'%s not %s\') end',
+             bad_tid_cond(format('r.t[0][%s]', src), lt.tids), f.path, lt.what)
+        if f.type.type == 'fixed' then
+            emit('    if r.v[0][%s].xlen ~= %d then error(\'%s wrong size\') end',
+                 src, f.type.size, f.path)
+        end
+        emit_copy_leaf(emit, '    ', f.type.type, dst, src)
+    end
+    ic.off = ic.off + 1
+    oc.off = oc.off + 1
+end
+
+local function generate_unflatten(ctx, name)
+    local code, emit = emitter()
+    emit_prologue(emit, ctx, name)
+    -- enum symbols, (hoff, size) pairs
+    for _, f in ipairs(ctx.slots) do
+        if f.symbols then
+            local t = {}
+            for _, e in ipairs(f.symbols) do
+                insert(t, format('%d, %d', e.hoff, e.size))
+            end
+            emit('local sym_%s = ffi.new(\'const uint32_t[%d]\', { %s }) -- %s',
+                 f.reg.name, 2 * #f.symbols, concat(t, ', '), f.path)
+        end
+    end
+    emit('')
+    emit('return function(data)')
+    emit('')
+    emit('    local res, slots, i, o, n, e')
+    emit('')
+    emit_preprocess(emit, '    ', ctx)
+    emit('')
+    emit('    if r.t[0][0] ~= 11 then')
+    emit('        error(\'::root:: not array\')')
+    emit('    end')
+    emit('    if r.v[0][0].xlen ~= %d then', #ctx.slots)
+    emit('        error(\'::root:: wrong size\')')
+    emit('    end')
+    emit('')
+    -- every tuple item but the root array maps to exactly one output
+    -- item (or fails validation), keys and nested maps come on top
+    local extra = 0
+    for _, s in ipairs(ctx.states) do
+        extra = extra + #s.fields + 1
+    end
+    emit('    slots = r.rc + %d', extra - 1)
+    emit('    if slots > ocap then')
+    emit('        grow_output(slots)')
+    emit('    end')
+    emit('')
+    local root = ctx.states[1]
+    emit('    r.ot[0] = 12; r.ov[0].xlen = %d', #root.fields)
+    local ic, oc = cursor(), cursor()
+    for _, f in ipairs(root.fields) do
+        emit_unflatten_field(emit, ctx, f, ic, oc)
+    end
+    emit('    slots = %s', cursor_pos(oc))
+    emit('')
+    emit_create(emit, '    ')
+    emit('    return res')
+    emit('end')
+    emit('')
+    return concat(code, '\n')
+end
+
+local function layout(schema, writer)
+    if schema.type ~= 'record' then
+        error('root schema must be a record')
+    end
+    if writer then
+        resolve_type('::root::', writer, schema)
+    end
+    local ctx = { regs = {}, states = {}, slots = {}, unions = {}, maps = {},
+                  guards = {}, bank = bank_new() }
+    layout_record(ctx, schema, nil, nil, nil, nil, writer)
+    ctx.fini = #ctx.states + 1
+    bank_finalize(ctx.bank)
+    return ctx
+end
+
+-- Unions and maps are handled by the Lua flattener only.
+local function check_lua_only(ctx, what)
+    local f = ctx.unions[1] or ctx.maps[1]
+    if f then
+        error(format('%s: %ss are not supported by %s', f.path, f.kind, what))
+    end
+end
+
+local function free_regs(regs)
+    ffi.C.free(regs.ot)
+    ffi.C.free(regs.ov)
+end
+
+local function instantiate(source, chunkname, arena, program, invalid, sink)
+    local chunk, err = load(source, chunkname)
+    if not chunk then
+        error(err)
+    end
+
+    local regs = ffi.new('struct tarantool_schema_proc_Regs')
+    regs.ot   = ffi.C.malloc(STOCK_OUTPUT)
+    regs.ov   = ffi.C.malloc(STOCK_OUTPUT * 8)
+    -- the generated code reallocs these, free whatever regs hold last
+    ffi.gc(regs, free_regs)
+
+    return chunk(ffi, schema_util_C, regs, arena, unknown_key, program,
+                 invalid, sink)
+end
+
+--
+-- projection
+--
+-- Fields not covered by any of the given paths are skipped: their
+-- values go to the output verbatim, as a single RawValue, without
+-- being preprocessed, validated or converted.  A path naming a record
+-- keeps the whole subtree.  Only leaf and array slots are skipped,
+-- enums need their symbols translated.
+--
+
+local function mark_projection(ctx, paths)
+    local keep = {}
+    for _, path in ipairs(paths) do
+        local found = false
+        for _, reg in ipairs(ctx.regs) do
+            if reg.path == path then found = true; break end
+        end
+        if not found then
+            error(format('project: unknown path %s', path))
+        end
+        keep[path] = true
+    end
+    for _, f in ipairs(ctx.slots) do
+        -- enums, arrays of enums, unions are kept
+        local kept = f.symbols ~= nil or #f.reg.guards ~= 0 or
+                     (f.kind ~= 'leaf' and f.kind ~= 'array')
+        local path = f.path
+        while not kept and path do
+            kept = keep[path]
+            path = path:match('^(.*)%.[^.]*$')
+        end
+        f.skip = not kept
+    end
+    ctx.project = true
+end
+
+--
+-- columnar output
+--
+-- The batch flattener appends its output items to a column sink
+-- (schema_util.c): a column per slot, a row per document, buffers in
+-- Arrow's memory layout.  Enums are dictionary-encoded, the symbols
+-- being the dictionary; arrays are lists of an item column (these
+-- follow the slot columns).  Ints are widened to int64.  Format is
+-- the type in Arrow C data interface notation (of the indices for a
+-- dictionary).
+--
+
+local leaf_columns = {
+    null    = { 'null',   'n' },
+    boolean = { 'bool',   'b' },
+    int     = { 'int64',  'l' },
+    long    = { 'int64',  'l' },
+    float   = { 'float',  'f' },
+    double  = { 'double', 'g' },
+    bytes   = { 'binary', 'z' },
+    string  = { 'binary', 'u' },
+    fixed   = { 'binary', 'z' }
+}
+
+local function new_column(name, t)
+    if t.type == 'enum' then
+        return { name = name, type = 'dict', format = 'i',
+                 dictionary = t.symbols }
+    end
+    local c = leaf_columns[t.type]
+    return { name = name, type = c[1], format = c[2] }
+end
+
+local function column_layout(ctx)
+    local columns, arrays = {}, {}
+    for i, f in ipairs(ctx.slots) do
+        if f.kind == 'array' then
+            columns[i] = { name = f.path, type = 'list', format = '+l' }
+            insert(arrays, i)
+        else
+            columns[i] = new_column(f.path, f.type)
+        end
+    end
+    for _, i in ipairs(arrays) do
+        insert(columns, new_column(ctx.slots[i].path..'[]', ctx.slots[i].items))
+        columns[i].child = #columns
+    end
+    return columns
+end
+
+local function new_column_sink(columns, nslots)
+    local types, children = {}, {}
+    for i, c in ipairs(columns) do
+        types[i] = c.type
+        children[i] = c.child
+    end
+    return schema_util.new_column_sink(types, children, nslots)
+end
+
+local build_program, validator
+
+--
+-- compile_flatten(schema, opts) - generate a flattener for a schema
+-- produced by create_schema (schema_load.lua).
+--
+-- Options (opts may be nil):
+--   project - list of field paths ('a.b') to keep, see projection
+--   writer  - schema the data was written with, see resolution;
+--             missing fields are filled from defaults regardless
+--   validate - check documents in C while preprocessing them, bad
+--             ones are rejected before the generated code runs
+--             (not with writer); unions and maps are still checked
+--             by the generated code
+--   json    - input documents are JSON (not with project / validate)
+--   columnar - flatten_batch appends documents to columns, see
+--             columnar output (no unions, maps)
+--   compact - flatten preprocesses into compact items, see compact
+--             items (msgpack input only, no maps)
+--   iov     - flatten returns iovec-s (struct tarantool_schema_iovec,
+--             see create_msgpack_iov in schema_util.c) instead of a
+--             string: iov, count, size; payloads of iov bytes and
+--             longer (true - IOV_THRESHOLD) reference the input, the
+--             input must be kept; valid until the next call
+--   sources - { source = ..., batch_source = ... } generated earlier
+--             for the same schema and options, code generation is
+--             skipped (see schema_cache.lua)
+--
+-- Returns a table:
+--   flatten       - function(msgpack) -> flattened tuple (msgpack),
+--                   msgpack is a string or a complete stream (a
+--                   JSON string with json)
+--   flatten_batch - function({msgpack, ...}) -> {tuple, ...}, errors
+--                   (errors is nil or a table mapping the index of
+--                   a failed document to the error message)
+--   source        - the generated Lua source (flatten)
+--   batch_source  - the generated Lua source (flatten_batch)
+--   bank          - key names / enum symbols referenced by the code
+--   arena         - buffers shared by flatten and flatten_batch, see
+--                   schema_util.arena_high_water / arena_set_limit
+--   program       - the schema program driving projection and
+--                   validation (if any)
+--   validate      - function(msgpack) -> true or false, message,
+--                   byte offset of the bad value (with validate)
+--
+-- With columnar, flatten_batch returns the number of rows appended
+-- and errors, and there are:
+--   columns       - { {name, type, format, dictionary, child}, ... }
+--                   column descriptions, name is the field path
+--   column        - function(i) -> struct tarantool_schema_Column,
+--                   buffers of the i-th column (valid until the next
+--                   flatten_batch / reset)
+--   reset         - function() empties the columns
+--
+local function compile_flatten(schema, opts)
+    local ctx = layout(schema, opts and opts.writer)
+    local arena = schema_util.new_arena(ARENA_ITEMS)
+    local program, invalid, validate
+    if opts and opts.validate and opts.writer then
+        error('validate: resolving writer schemas is not supported')
+    end
+    if opts and opts.json and (opts.project or opts.validate) then
+        error('json: projection and validation need msgpack input')
+    end
+    ctx.json = opts and opts.json
+    ctx.columnar = opts and opts.columnar
+    if opts and opts.compact then
+        if opts.json or opts.project or opts.validate then
+            error('compact: projection, validation and json are not supported')
+        end
+        if ctx.maps[1] then
+            error(format('%s: maps are not supported by compact', ctx.maps[1].path))
+        end
+        ctx.compact = true
+    end
+    if opts and opts.iov then
+        ctx.iov = opts.iov == true and IOV_THRESHOLD or opts.iov
+    end
+    if ctx.columnar then
+        check_lua_only(ctx, 'columnar output')
+    end
+    if opts and opts.project then
+        mark_projection(ctx, opts.project)
+    end
+    if opts and (opts.project or opts.validate) then
+        program = build_program(ctx)
+    end
+    if opts and opts.validate then
+        ctx.validate = true
+        invalid, validate = validator(program, arena)
+    end
+    local source, batch_source
+    if opts and opts.sources then
+        source = opts.sources.source
+        batch_source = opts.sources.batch_source
+    else
+        prepare_states(ctx)
+        source = generate_flatten(ctx, schema.name)
+        ctx.batch = true
+        batch_source = generate_flatten_batch(ctx, schema.name)
+    end
+    local columns, sink
+    if ctx.columnar then
+        columns = column_layout(ctx)
+        sink = new_column_sink(columns, #ctx.slots)
+    end
+    return {
+        flatten       = instantiate(source, '=flatten_'..schema.name, arena, program, invalid),
+        flatten_batch = instantiate(batch_source, '=flatten_batch_'..schema.name, arena, program, invalid, sink),
+        source        = source,
+        batch_source  = batch_source,
+        bank          = ctx.bank.data,
+        arena         = arena,
+        program       = program,
+        validate      = validate,
+        columns       = columns,
+        column        = sink and function(i)
+            return schema_util_C.column_sink_columns(sink)[i - 1]
+        end,
+        reset         = sink and function()
+            schema_util_C.column_sink_reset(sink)
+        end
+    }
+end
+
+--
+-- compile_unflatten(schema, opts) - generate the reverse of
+-- compile_flatten; opts.sources as in compile_flatten.
+--
+-- Returns a table:
+--   unflatten - function(tuple) -> map (msgpack), tuple is a string
+--               or a complete stream
+--   source    - the generated Lua source
+--   bank      - key names / enum symbols referenced by the code
+--   arena     - buffers used by unflatten
+--
+local function compile_unflatten(schema, opts)
+    local ctx = layout(schema)
+    check_lua_only(ctx, 'unflatten')
+    local source = opts and opts.sources and opts.sources.source or
+                   generate_unflatten(ctx, schema.name)
+    local arena = schema_util.new_arena(ARENA_ITEMS)
+    return {
+        unflatten = instantiate(source, '=unflatten_'..schema.name, arena),
+        source    = source,
+        bank      = ctx.bank.data,
+        arena     = arena
+    }
+end
+
+--
+-- native flattener
+--
+-- The schema is translated into a program for the C flattener
+-- (flatten_batch_mt in schema_util.c) which runs on a worker pool.
+-- Node 0 is the root record, field nodes follow in register order,
+-- array item nodes come last.
+--
+
+local NODE_RECORD, NODE_LEAF, NODE_ENUM, NODE_ARRAY = 1, 2, 3, 4
+
+local native_errors = {
+    [1]  = function(n) return 'preprocess_msgpack: -1' end,
+    [2]  = function(n) return 'out of memory' end,
+    [3]  = function(n) return format('%s not %s', n.path, n.what) end,
+    [4]  = function(n) return format('%s wrong size', n.path) end,
+    [5]  = function(n) return format('%s key not str', n.path) end,
+    [6]  = function(n, e, data)
+        data = ffi.cast('const uint8_t *', data)
+        return 'unknown key: '..ffi.string(data + e.aux1, e.aux2)
+    end,
+    [7]  = function(n) return format('%s dup', n.path) end,
+    [8]  = function(n) return format('%s missing', n.path) end,
+    [9]  = function(n) return format('wrong %s', n.path) end,
+    [10] = function(n, e)
+        return format('%s[%d] not %s', n.path, e.aux1, n.item_what)
+    end,
+    [11] = function(n, e) return format('%s[%d] wrong size', n.path, e.aux1) end,
+    [12] = function(n, e) return format('wrong %s[%d]', n.path, e.aux1) end,
+}
+
+build_program = function(ctx)
+    local nodes, fields, keys = {}, {}, {}
+    local bank = ctx.bank.data
+    local bank_end = ffi.cast('const uint8_t *', bank) + #bank
+
+    local function add_keys(node, entries, ids)
+        node.first_key = #keys
+        node.nkeys = #entries
+        for i, e in ipairs(entries) do
+            insert(keys, { e = e, id = ids[i] })
+        end
+    end
+
+    local function set_leaf(node, t)
+        local lt = leaf_types[t.type]
+        node.kind = NODE_LEAF
+        node.tid = lt.tid or 0
+        node.conv = lt.conv and 1 or 0
+        node.accept = 0
+        for _, tid in ipairs(lt.tids) do
+            node.accept = node.accept + 2 ^ tid
+        end
+        node.size = t.type == 'fixed' and t.size or 0xffffffff
+        node.what = lt.what
+    end
+
+    local function set_enum(node, symbols)
+        local ids = {}
+        for i = 1, #symbols do ids[i] = i - 1 end
+        node.kind = NODE_ENUM
+        node.what = 'str'
+        add_keys(node, symbols, ids)
+    end
+
+    -- nodes for records and fields
+    nodes[0] = { path = '::root::' }
+    for _, reg in ipairs(ctx.regs) do
+        nodes[reg.id + 1] = { path = reg.path }
+    end
+    for _, st in ipairs(ctx.states) do
+        local node = st.reg and nodes[st.reg.id + 1] or nodes[0]
+        local entries, ids = {}, {}
+        node.kind = NODE_RECORD
+        node.what = 'map'
+        node.first = #fields
+        node.count = #st.fields
+        for _, f in ipairs(st.fields) do
+            local id = f.reg.id + 1
+            nodes[id].optional = f.reg.own and 1 or 0
+            insert(fields, id)
+            insert(entries, f.key)
+            insert(ids, id)
+            for _, alias in ipairs(f.aliases) do
+                insert(entries, alias)
+                insert(ids, id)
+            end
+        end
+        add_keys(node, entries, ids)
+    end
+    local nnodes = #ctx.regs + 1
+    for _, f in ipairs(ctx.slots) do
+        local node = nodes[f.reg.id + 1]
+        node.skip = f.skip and 1 or 0
+        if f.kind == 'leaf' then
+            set_leaf(node, f.type)
+        elseif f.kind == 'enum' then
+            set_enum(node, f.symbols)
+        elseif f.kind == 'array' then
+            local item = {}
+            node.kind = NODE_ARRAY
+            node.what = 'array'
+            node.first = nnodes
+            nodes[nnodes] = item
+            nnodes = nnodes + 1
+            if f.items.type == 'enum' then
+                set_enum(item, f.symbols)
+            else
+                set_leaf(item, f.items)
+            end
+            node.item_what = item.what
+        end
+    end
+
+    local cnodes = ffi.new('struct tarantool_schema_Node[?]', nnodes)
+    for i = 0, nnodes - 1 do
+        local n, c = nodes[i], cnodes[i]
+        c.kind = n.kind or 0 -- unions are left to the Lua flattener
+        c.tid = n.tid or 0
+        c.conv = n.conv or 0
+        c.skip = n.skip or 0
+        c.optional = n.optional or 0
+        c.accept = n.accept or 0
+        c.size = n.size or 0xffffffff
+        c.first = n.first or 0
+        c.count = n.count or 0
+        c.first_key = n.first_key or 0
+        c.nkeys = n.nkeys or 0
+    end
+    local cfields = ffi.new('uint32_t[?]', #fields + 1)
+    for i, id in ipairs(fields) do
+        cfields[i - 1] = id
+    end
+    local ckeys = ffi.new('struct tarantool_schema_Key[?]', #keys + 1)
+    for i, k in ipairs(keys) do
+        ckeys[i - 1].str = bank_end - k.e.off
+        ckeys[i - 1].len = #k.e.str
+        ckeys[i - 1].id = k.id
+    end
+    local prog = ffi.new('struct tarantool_schema_Program')
+    prog.nodes = cnodes
+    prog.nnodes = nnodes
+    prog.root = 0
+    prog.nslots = #ctx.slots
+    prog.fields = cfields
+    prog.keys = ckeys
+    schema_util_C.schema_program_prepare(prog)
+    return {
+        -- anchor everything prog references
+        prog = prog, nodes = nodes, bank = bank,
+        cnodes = cnodes, cfields = cfields, ckeys = ckeys
+    }
+end
+
+--
+-- validator(p, arena) - error formatter for the generated code and
+-- the validate function of compile_flatten, p is build_program's
+-- result.
+--
+validator = function(p, arena)
+    local typeid = ffi.new('uint8_t *[1]')
+    local value = ffi.new('struct tarantool_schema_preproc_Value *[1]')
+    local err = ffi.new('struct tarantool_schema_DocError')
+
+    local function invalid(e, data)
+        return native_errors[e.code](p.nodes[e.node], e, data)
+    end
+
+    local function validate(data)
+        local rc = schema_util_C.validate_msgpack(arena, p.prog, data, #data,
+                                                  typeid, value, err)
+        if rc < 0 then
+            return false, invalid(err, data), err.offset
+        end
+        return true
+    end
+
+    return invalid, validate
+end
+
+--
+-- new_worker_pool(n) - a pool of n threads (the calling thread
+-- included) for native flatteners.
+--
+local function new_worker_pool(n)
+    local pool = schema_util_C.worker_pool_new(n)
+    if pool == nil then
+        error('worker_pool_new: -1')
+    end
+    return ffi.gc(pool, schema_util_C.worker_pool_delete)
+end
+
+--
+-- compile_native(schema) - native (C) flattener for bulk conversion.
+--
+-- Returns a table:
+--   flatten_batch - function({msgpack, ...}, pool) -> {tuple, ...},
+--                   errors (same conventions as compile_flatten)
+--
+-- The output matches compile_flatten; error messages match as well,
+-- though if a document has several problems, a different one might
+-- be reported.
+--
+local function compile_native(schema)
+    local ctx = layout(schema)
+    check_lua_only(ctx, 'the native flattener')
+    local p = build_program(ctx)
+    local msgpack_out = ffi.new('uint8_t *[1]')
+
+    local function flatten_batch(list, pool)
+        local n = #list
+        local docs = ffi.new('struct tarantool_schema_Doc[?]', n + 1)
+        local offsets = ffi.new('uint32_t[?]', n + 1)
+        local errors = ffi.new('struct tarantool_schema_DocError[?]', n + 1)
+        for j = 0, n - 1 do
+            local data = list[j + 1]
+            docs[j].data = ffi.cast('const uint8_t *', data)
+            docs[j].size = #data
+        end
+        local rc = schema_util_C.flatten_batch_mt(p.prog, pool, n, docs,
+                                                  msgpack_out, offsets, errors)
+        if rc < 0 then
+            error('flatten_batch_mt: -1')
+        end
+        local res, errs = {}, nil
+        for j = 0, n - 1 do
+            local e = errors[j]
+            if e.code ~= 0 then
+                errs = errs or {}
+                errs[j + 1] = native_errors[e.code](p.nodes[e.node], e, list[j + 1])
+            else
+                res[j + 1] = ffi.string(msgpack_out[0] + offsets[j],
+                                        offsets[j + 1] - offsets[j])
+            end
+        end
+        ffi.C.free(msgpack_out[0])
+        return res, errs
+    end
+
+    return {
+        flatten_batch = flatten_batch,
+        program       = p
+    }
+end
+
+--
+-- keys
+--
+-- A key packs a few fields of a document so that keys compare with
+-- memcmp the way tuples of the field values would (key_extract in
+-- schema_util.c has the encoding).  The extractor walks the msgpack
+-- until it has every part; nothing is preprocessed or flattened.
+--
+
+local key_types = {
+    int = 1, long = 1, double = 2, float = 2, boolean = 3,
+    string = 4, bytes = 4, fixed = 5, enum = 6
+}
+
+local KEY_MAX_SLOTS = 64
+
+-- A part value in msgpack, enums are symbols.
+local function encode_key_value(t, v)
+    if t.type == 'enum' then
+        return msgpack_str_header(#v)..v
+    end
+    return encode_default(t, v)
+end
+
+--
+-- compile_key(schema, paths) - key extractor for a list of field
+-- paths ('a.b'), leaf or enum fields outside of unions.
+--
+-- Returns a table:
+--   extract       - function(msgpack) -> key (a string)
+--   extract_batch - function({msgpack, ...}) -> {key, ...}, errors
+--                   (same conventions as compile_flatten)
+--   key           - function(v1, v2, ...) -> key of the given part
+--                   values (e.g. for a lookup), enums are symbols
+--
+-- Missing parts are filled from defaults as flatten would.  Only the
+-- parts and the records enclosing them are checked: a document
+-- flatten rejects (an unknown key, a bad field elsewhere) might still
+-- have a key.
+--
+local function compile_key(schema, paths)
+    local ctx = layout(schema)
+    local p = build_program(ctx)
+    local arena = schema_util.new_arena(ARENA_ITEMS)
+    local regs, slot_of, nslots = {}, {}, 0
+    local parts, path, defaults, values = {}, {}, {}, {}
+    local nleaves = 0
+
+    if #paths == 0 then
+        error('compile_key: no parts')
+    end
+    for _, reg in ipairs(ctx.regs) do
+        if not reg.aux then
+            regs[reg.path] = reg
+        end
+    end
+    local function add_slot(id)
+        if not slot_of[id] then
+            nslots = nslots + 1
+            slot_of[id] = nslots
+        end
+    end
+    for i, fpath in ipairs(paths) do
+        local reg = regs[fpath]
+        if not reg then
+            error(format('compile_key: unknown path %s', fpath))
+        elseif #reg.guards ~= 0 then
+            error(format('compile_key: %s is in a union', fpath))
+        elseif not key_types[reg.type.type] then
+            error(format('compile_key: %s is not a scalar', fpath))
+        end
+        local id = reg.id + 1
+        local part = { node = id, type = key_types[reg.type.type],
+                       first_path = #path, ft = reg.type,
+                       first_default = #defaults }
+        if not slot_of[id] then
+            nleaves = nleaves + 1
+        end
+        -- enclosing record fields, outermost first, then the part
+        local pos = 0
+        repeat
+            pos = fpath:find('.', pos + 1, true)
+            local node = regs[fpath:sub(1, pos and pos - 1 or #fpath)].id + 1
+            add_slot(node)
+            insert(path, node)
+        until not pos
+        part.depth = #path - part.first_path
+        for _, d in ipairs(reg.dflt) do
+            if has_default(d.value) then
+                local v = encode_key_value(reg.type, d.value)
+                insert(values, v)
+                insert(defaults, { node = d.reg.id + 1, data = v })
+            end
+        end
+        part.ndefaults = #defaults - part.first_default
+        parts[i] = part
+    end
+    if nslots > KEY_MAX_SLOTS then
+        error(format('compile_key: more than %d fields on the paths',
+                     KEY_MAX_SLOTS))
+    end
+
+    local cparts = ffi.new('struct tarantool_schema_KeyPart[?]', #parts)
+    for i, part in ipairs(parts) do
+        local c = cparts[i - 1]
+        c.node = part.node
+        c.type = part.type
+        c.first_path = part.first_path
+        c.depth = part.depth
+        c.first_default = part.first_default
+        c.ndefaults = part.ndefaults
+    end
+    local cpath = ffi.new('uint32_t[?]', #path)
+    for i, node in ipairs(path) do
+        cpath[i - 1] = node
+    end
+    local cdefaults = ffi.new('struct tarantool_schema_KeyDefault[?]',
+                              #defaults + 1)
+    for i, d in ipairs(defaults) do
+        cdefaults[i - 1].node = d.node
+        cdefaults[i - 1].size = #d.data
+        cdefaults[i - 1].data = d.data
+    end
+    local cslots = ffi.new('uint32_t[?]', p.prog.nnodes)
+    for id, slot in pairs(slot_of) do
+        cslots[id] = slot
+    end
+    local def = ffi.new('struct tarantool_schema_KeyDef')
+    def.prog = p.prog
+    def.parts = cparts
+    def.nparts = #parts
+    def.nleaves = nleaves
+    def.path = cpath
+    def.defaults = cdefaults
+    def.slots = cslots
+    -- def holds raw pointers into these, the functions below keep
+    -- them alive through anchor
+    local anchor = { def = def, cparts = cparts, cpath = cpath,
+                     cdefaults = cdefaults, cslots = cslots,
+                     values = values }
+
+    local out = ffi.new('uint8_t *[1]')
+    local err = ffi.new('struct tarantool_schema_DocError')
+
+    local function invalid(e, data)
+        return native_errors[e.code](p.nodes[e.node], e, data)
+    end
+
+    local function extract(data)
+        local rc = schema_util_C.key_extract(arena, anchor.def, data, #data,
+                                             out, err)
+        if rc < 0 then
+            error(invalid(err, data))
+        end
+        return ffi.string(out[0], rc)
+    end
+
+    local function extract_batch(list)
+        local n = #list
+        local docs = ffi.new('struct tarantool_schema_Doc[?]', n + 1)
+        local offsets = ffi.new('uint32_t[?]', n + 1)
+        local errors = ffi.new('struct tarantool_schema_DocError[?]', n + 1)
+        for j = 0, n - 1 do
+            local data = list[j + 1]
+            docs[j].data = ffi.cast('const uint8_t *', data)
+            docs[j].size = #data
+        end
+        local rc = schema_util_C.key_extract_batch(arena, anchor.def, n, docs,
+                                                   out, offsets, errors)
+        if rc < 0 then
+            error('key_extract_batch: -1')
+        end
+        local res, errs = {}, nil
+        for j = 0, n - 1 do
+            if errors[j].code ~= 0 then
+                errs = errs or {}
+                errs[j + 1] = invalid(errors[j], list[j + 1])
+            else
+                res[j + 1] = ffi.string(out[0] + offsets[j],
+                                        offsets[j + 1] - offsets[j])
+            end
+        end
+        return res, errs
+    end
+
+    local function key(...)
+        local args = { ... }
+        local docs = ffi.new('struct tarantool_schema_Doc[?]', #parts)
+        for i, part in ipairs(parts) do
+            local v = encode_key_value(part.ft, args[i])
+            args[i] = v
+            docs[i - 1].data = ffi.cast('const uint8_t *', v)
+            docs[i - 1].size = #v
+        end
+        local rc = schema_util_C.key_encode(arena, anchor.def, docs, out, err)
+        if rc < 0 then
+            error(invalid(err, ''))
+        end
+        return ffi.string(out[0], rc)
+    end
+
+    return {
+        extract       = extract,
+        extract_batch = extract_batch,
+        key           = key,
+        program       = p,
+        arena         = arena,
+        def           = def,
+        anchor        = anchor
+    }
+end
+
+--
+-- updates
+--
+-- Operations on flattened tuples go to update_tuple (schema_util.c):
+-- slots nothing touches are copied verbatim, arguments are encoded
+-- the way flatten would encode the value (see defaults) and are
+-- copied in as well; only numbers being added to are decoded.
+--
+
+local UPDATE_SET, UPDATE_ADD, UPDATE_APPEND = 1, 2, 3
+
+local update_ops = { ['='] = UPDATE_SET, ['+'] = UPDATE_ADD,
+                     ['-'] = UPDATE_ADD, ['!'] = UPDATE_APPEND }
+
+local update_numbers = { int = true, long = true, float = true, double = true }
+
+--
+-- compile_update(schema) - updates of tuples flattened with the
+-- schema.
+--
+-- Returns a table:
+--   update - function(tuple, ops) -> updated tuple; ops is a list of
+--            { op, path, value }, applied in order:
+--              '='      - set a field to value (as in defaults, enum
+--                         symbols)
+--              '+', '-' - add value to / subtract it from a number
+--              '!'      - append value (an item or a list of items)
+--                         to an array
+--
+-- Union fields can't be updated, records are updated field by field.
+--
+local function compile_update(schema)
+    local ctx = layout(schema)
+    local arena = schema_util.new_arena(ARENA_ITEMS)
+    local fields, paths = {}, {}
+    for i, f in ipairs(ctx.slots) do
+        if f.kind ~= 'uvalue' then
+            fields[f.path] = { f = f, slot = i - 1 }
+        end
+        paths[i - 1] = f.path
+    end
+    local nops = 16
+    local cops = ffi.new('struct tarantool_schema_UpdateOp[?]', nops)
+    local out = ffi.new('uint8_t *[1]')
+    local err = ffi.new('struct tarantool_schema_DocError')
+
+    -- a leaf or an enum value of type t
+    local function check_value(path, t, v)
+        if t.type == 'enum' then
+            if not symbol_index(t.symbols, v) then
+                error(format('update: wrong %s', path))
+            end
+        elseif t.type ~= 'null' and not validdefault(t, v) then
+            error(format('update: %s not %s', path, leaf_types[t.type].what))
+        end
+    end
+
+    local function check_items(path, t, v)
+        if type(v) ~= 'table' then
+            error(format('update: %s not %s', path, t.type))
+        elseif t.type == 'array' then
+            for k, x in ipairs(v) do
+                check_value(format('%s[%d]', path, k), t.items, x)
+            end
+        else
+            for k, x in pairs(v) do
+                if type(k) ~= 'string' then
+                    error(format('update: %s key not str', path))
+                end
+                check_value(format('%s[%s]', path, k), t.items, x)
+            end
+        end
+    end
+
+    local function encode_arg(op, path, f, v)
+        local ft = f.type
+        if op == '=' then
+            if f.kind == 'enum' then
+                check_value(path, ft, v)
+                return encode_default({ type = 'long' },
+                                      symbol_index(ft.symbols, v))
+            elseif f.kind == 'leaf' then
+                check_value(path, ft, v)
+            else
+                check_items(path, ft, v)
+            end
+            return encode_default(ft, v)
+        elseif op == '!' then
+            if f.kind ~= 'array' then
+                error(format('update: %s not array', path))
+            end
+            v = type(v) == 'table' and v or { v }
+            check_items(path, ft, v)
+            return encode_default(ft, v)
+        end
+    end
+
+    local function update(tuple, ops)
+        local list, args, size = {}, {}, 0
+        for i, x in ipairs(ops) do
+            local op, path, v = x[1], x[2], x[3]
+            local field = fields[path]
+            if not update_ops[op] then
+                error(format('update: unknown operation %s', tostring(op)))
+            elseif not field then
+                error(format('update: unknown path %s', tostring(path)))
+            elseif field.f.kind == 'union' then
+                error(format('update: %s is a union', path))
+            elseif #field.f.reg.guards ~= 0 then
+                error(format('update: %s is in a union', path))
+            end
+            local item = { i = i, slot = field.slot, op = update_ops[op] }
+            if item.op == UPDATE_ADD then
+                local xtype = field.f.type.type
+                if not update_numbers[xtype] or type(v) ~= 'number' then
+                    error(format('update: %s not a number', path))
+                end
+                v = op == '-' and -v or v
+                if xtype == 'int' or xtype == 'long' then
+                    -- update_tuple checks the sum fits as well
+                    if not validdefault(field.f.type, v) or
+                       v < -2^63 or v >= 2^63 then
+                        error(format('update: %s not %s', path, xtype))
+                    end
+                    item.tid, item.ival = 4, v
+                    item.int32 = xtype == 'int'
+                else
+                    item.tid, item.dval = 7, v
+                end
+            else
+                local arg = encode_arg(op, path, field.f, v)
+                insert(args, arg)
+                size = size + #arg
+                item.xlen, item.pos = #arg, size
+            end
+            list[i] = item
+        end
+        -- by slot, the order is kept within a slot
+        table.sort(list, function(a, b)
+            if a.slot ~= b.slot then
+                return a.slot < b.slot
+            end
+            return a.i < b.i
+        end)
+        if #list > nops then
+            nops = #list
+            cops = ffi.new('struct tarantool_schema_UpdateOp[?]', nops)
+        end
+        for k, item in ipairs(list) do
+            local c = cops[k - 1]
+            c.op = item.op
+            c.slot = item.slot
+            c.tid = item.tid or 0
+            c.int32 = item.int32 and 1 or 0
+            if item.ival then
+                c.arg.ival = item.ival
+            elseif item.dval then
+                c.arg.dval = item.dval
+            else
+                c.arg.xlen = item.xlen
+                c.arg.xoff = size - item.pos + item.xlen
+            end
+        end
+        args = concat(args)
+        local rc = schema_util_C.update_tuple(
+            arena, #ctx.slots, tuple, #tuple, #list, cops,
+            ffi.cast('const uint8_t *', args) + #args, out, err)
+        if rc < 0 then
+            local path = paths[err.node]
+            if err.code == 3 then
+                local x = ops[list[err.aux1 + 1].i]
+                error(format('update: %s %s', path, x[1] == '!' and
+                             'not array' or 'not a number'))
+            elseif err.code == 13 then
+                error(format('update: %s overflow', path))
+            elseif err.code == 2 then
+                error('update: out of memory')
+            end
+            error('update: bad tuple')
+        end
+        return ffi.string(out[0], rc)
+    end
+
+    return {
+        update = update,
+        arena  = arena
+    }
+end
+
+--
+-- Avro binary encoding
+--
+-- The schema is translated into a program for create_avro /
+-- preprocess_avro (schema_util.c), a node per distinct type.  Record
+-- fields and enum symbols are names (bank entries), a record's names
+-- are parallel to its children (field types), union children are the
+-- branches.  Array and map nodes refer to the item node with first,
+-- a fixed node keeps the size in count.
+--
+
+local avro_kinds = {
+    null = 1, boolean = 2, int = 3, long = 4, float = 5, double = 6,
+    bytes = 7, string = 8, fixed = 9, enum = 10, array = 11, map = 12,
+    record = 13, union = 14
+}
+
+local function build_avro_program(schema)
+    local nodes, children, names = {}, {}, {}
+    local ids = {} -- type -> node id
+    local bank = bank_new()
+
+    local function add_node(t)
+        local id = ids[t]
+        if id then
+            return id
+        end
+        id = #nodes
+        ids[t] = id
+        local node = { kind = avro_kinds[t.type], first = 0, count = 0 }
+        nodes[id + 1] = node
+        if t.type == 'record' or t.type == 'union' then
+            local list = t.fields or t.branches
+            -- reserve the range first, nested types append their own
+            node.first = #children
+            node.count = #list
+            for i = 1, #list do
+                children[node.first + i] = false
+                names[node.first + i] = false
+            end
+            for i, x in ipairs(list) do
+                if t.fields then
+                    names[node.first + i] = bank_add(bank, x.name)
+                    children[node.first + i] = add_node(x.type)
+                else
+                    children[node.first + i] = add_node(x)
+                end
+            end
+        elseif t.type == 'enum' then
+            node.first = #children
+            node.count = #t.symbols
+            for i, sym in ipairs(t.symbols) do
+                children[node.first + i] = 0
+                names[node.first + i] = bank_add(bank, sym)
+            end
+        elseif t.type == 'array' or t.type == 'map' then
+            node.first = add_node(t.items)
+        elseif t.type == 'fixed' then
+            node.count = t.size
+        end
+        return id
+    end
+
+    local root = add_node(schema)
+    local data = bank_finalize(bank)
+    local bank_end = ffi.cast('const uint8_t *', data) + #data
+    local cnodes = ffi.new('struct tarantool_schema_AvroNode[?]', #nodes)
+    for i, n in ipairs(nodes) do
+        cnodes[i - 1].kind = n.kind
+        cnodes[i - 1].first = n.first
+        cnodes[i - 1].count = n.count
+    end
+    local cchildren = ffi.new('uint32_t[?]', #children + 1)
+    local cnames = ffi.new('struct tarantool_schema_Key[?]', #children + 1)
+    local ckeys = ffi.new('struct tarantool_schema_Key[?]', #children + 1)
+    for i = 1, #children do
+        cchildren[i - 1] = children[i]
+        local e = names[i]
+        if e then
+            cnames[i - 1].str = bank_end - e.off
+            cnames[i - 1].len = #e.str
+        end
+    end
+    -- a name's id is its position in the node's list
+    for _, n in ipairs(nodes) do
+        if n.kind == avro_kinds.record or n.kind == avro_kinds.enum then
+            for i = 0, n.count - 1 do
+                cnames[n.first + i].id = i
+            end
+        end
+    end
+    local prog = ffi.new('struct tarantool_schema_AvroProgram')
+    prog.nodes = cnodes
+    prog.nnodes = #nodes
+    prog.root = root
+    prog.nnames = #children
+    prog.children = cchildren
+    prog.names = cnames
+    prog.keys = ckeys
+    prog.bank = bank_end
+    schema_util_C.avro_program_prepare(prog)
+    return {
+        -- anchor everything prog references
+        prog = prog, bank = data, cnodes = cnodes,
+        cchildren = cchildren, cnames = cnames, ckeys = ckeys
+    }
+end
+
+--
+-- compile_avro(schema) - converters between msgpack and the Avro
+-- binary encoding.
+--
+-- Returns a table:
+--   to_avro   - function(msgpack) -> avro
+--   from_avro - function(avro) -> msgpack
+--
+-- Conversions go through the preprocessed form, no Lua code runs per
+-- value.  Record fields are written in schema order whatever the key
+-- order; all fields must be present (defaults aren't applied), unknown
+-- keys are an error.  A union value takes the first branch accepting
+-- its type.  Arrays and maps are written as a single block.
+--
+local function compile_avro(schema)
+    local p = build_avro_program(schema)
+    local arena = schema_util.new_arena(ARENA_ITEMS)
+    local typeid = ffi.new('uint8_t *[1]')
+    local value = ffi.new('struct tarantool_schema_preproc_Value *[1]')
+    local out = ffi.new('uint8_t *[1]')
+
+    local function to_avro(data)
+        local n = schema_util_C.preprocess_msgpack_arena(arena, data, #data,
+                                                         typeid, value)
+        if n < 0 then
+            error('preprocess_msgpack: -1')
+        end
+        local b1 = ffi.cast('const uint8_t *', data) + #data
+        local rc = schema_util_C.create_avro(arena, p.prog, n, typeid[0],
+                                             value[0], b1, p.prog.bank, out)
+        if rc < 0 then
+            error('create_avro: -1')
+        end
+        return ffi.string(out[0], rc)
+    end
+
+    local function from_avro(data)
+        local n = schema_util_C.preprocess_avro(arena, p.prog, data, #data,
+                                                typeid, value)
+        if n < 0 then
+            error('preprocess_avro: -1')
+        end
+        local b1 = ffi.cast('const uint8_t *', data) + #data
+        local rc = schema_util_C.create_msgpack_arena(arena, n, typeid[0],
+                                                      value[0], b1,
+                                                      p.prog.bank, out)
+        if rc < 0 then
+            error('create_msgpack: -1')
+        end
+        return ffi.string(out[0], rc)
+    end
+
+    return {
+        to_avro   = to_avro,
+        from_avro = from_avro,
+        program   = p,
+        arena     = arena
+    }
+end
+
+return {
+    compile_flatten   = compile_flatten,
+    compile_unflatten = compile_unflatten,
+    compile_native    = compile_native,
+    compile_key       = compile_key,
+    compile_update    = compile_update,
+    compile_avro      = compile_avro,
+    new_worker_pool   = new_worker_pool
+}
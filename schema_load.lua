@@ -314,10 +314,109 @@ create_schema1 = function(schema, ss, scope)
     end
 end
 
+local function has_default(v)
+    -- null defaults are NULL cdata (e.g. json.NULL), equal to nil
+    return type(v) ~= 'nil'
+end
+
+local validdefault
+
+-- Does v conform to schema?  Record defaults may omit fields having
+-- defaults of their own, unions take the first branch (as per Avro).
+validdefault = function(schema, v)
+    local xtype = schema.type
+    if xtype == 'null' then
+        return v == nil
+    elseif xtype == 'boolean' then
+        return type(v) == 'boolean'
+    elseif xtype == 'int' then
+        return type(v) == 'number' and math.floor(v) == v and
+               v >= -2147483648 and v <= 2147483647
+    elseif xtype == 'long' then
+        return type(v) == 'number' and math.floor(v) == v
+    elseif xtype == 'float' or xtype == 'double' then
+        return type(v) == 'number'
+    elseif xtype == 'string' or xtype == 'bytes' then
+        return type(v) == 'string'
+    elseif xtype == 'fixed' then
+        return type(v) == 'string' and #v == schema.size
+    elseif xtype == 'enum' then
+        for _, sym in ipairs(schema.symbols) do
+            if v == sym then
+                return true
+            end
+        end
+        return false
+    elseif xtype == 'array' then
+        if type(v) ~= 'table' then
+            return false
+        end
+        for _, item in ipairs(v) do
+            if not validdefault(schema.items, item) then
+                return false
+            end
+        end
+        return true
+    elseif xtype == 'map' then
+        if type(v) ~= 'table' then
+            return false
+        end
+        for k, item in pairs(v) do
+            if type(k) ~= 'string' or not validdefault(schema.items, item) then
+                return false
+            end
+        end
+        return true
+    elseif xtype == 'record' then
+        if type(v) ~= 'table' then
+            return false
+        end
+        for _, field in ipairs(schema.fields) do
+            local item = v[field.name]
+            if has_default(item) then
+                if not validdefault(field.type, item) then
+                    return false
+                end
+            elseif not has_default(field.default) then
+                return false
+            end
+        end
+        return true
+    elseif xtype == 'union' then
+        return validdefault(schema.branches[1], v)
+    end
+    return false
+end
+
+-- Check field defaults, every record is visited once.
+local function process_defaults(schema, visited)
+    if visited[schema] then
+        return
+    end
+    visited[schema] = true
+    local xtype = schema.type
+    if xtype == 'record' then
+        for _, field in ipairs(schema.fields) do
+            if has_default(field.default) and
+               not validdefault(field.type, field.default) then
+                schema_error(nil, 'Bad default for field %s.%s',
+                             schema.name, field.name)
+            end
+            process_defaults(field.type, visited)
+        end
+    elseif xtype == 'array' or xtype == 'map' then
+        process_defaults(schema.items, visited)
+    elseif xtype == 'union' then
+        for _, branch in ipairs(schema.branches) do
+            process_defaults(branch, visited)
+        end
+    end
+end
+
 local function create_schema(schema)
     local scope = {}
     local root = create_schema1(schema, {}, scope)
-    -- XXX process defaults
+    process_defaults(root, {})
     return root
 end
 
@@ -328,5 +427,7 @@ return {
     validfullname = validfullname,
     checkname = checkname,
     checkaliases = checkaliases,
+    has_default = has_default,
+    validdefault = validdefault,
     create_schema = create_schema
 }
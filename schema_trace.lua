@@ -0,0 +1,230 @@
+local jit    = require('jit')
+local jutil  = require('jit.util')
+local vmdef  = require('jit.vmdef')
+
+local format, sub, gsub = string.format, string.sub, string.gsub
+local insert, concat = table.insert, table.concat
+local band = bit.band
+
+--
+-- Trace health of generated flatteners.
+--
+-- A flattener is fast as long as its main loop is JIT-compiled (see
+-- the comment on the root trace in person.lua).  The monitor listens
+-- to trace events (jit.attach) and keeps counters per flattener,
+-- i.e. per chunk; generated code is named flatten_<Schema>,
+-- flatten_batch_<Schema> or unflatten_<Schema>.  The state of a
+-- loop is read from its bytecode: LuaJIT patches FORL into JFORL
+-- once the loop has a trace and into IFORL once it is blacklisted.
+--
+--   start(pattern)  - attach; chunks matching pattern are tracked
+--                     ('flatten' by default, '@' / '=' stripped)
+--   stop()          - detach, counters are kept
+--   reset()         - forget counters
+--   report()        - counters per flattener, see below
+--   check()         - true, or false and a message naming the
+--                     flatteners running in the interpreter
+--
+-- Report: { jit = <JIT on>, flatteners = { [name] = {
+--     starts, stops, aborts, side_traces, blacklisted, flushes,
+--     abort_reasons = { [message] = count },
+--     roots       - root trace entry points seen (loops, functions)
+--     compiled    - entry points currently having a trace
+--     interpreted - true if an entry point is blacklisted, or no
+--                   entry point has a trace although tracing started
+-- } } }
+--
+
+local blacklisted_ops = {
+    IFORL = true, IITERL = true, ILOOP = true, IFUNCF = true, IFUNCV = true
+}
+
+local compiled_ops = {
+    JFORL = true, JITERL = true, JLOOP = true, JFUNCF = true, JFUNCV = true
+}
+
+local pattern = 'flatten'
+local attached = false
+local flatteners = {}
+local traces = {} -- traceno -> { fl, func, pc, parent }, while recording
+local flushes = 0
+
+local function chunk_name(func)
+    if type(func) ~= 'function' then
+        return nil
+    end
+    local source = jutil.funcinfo(func).source
+    if type(source) ~= 'string' then
+        return nil
+    end
+    local name = gsub(source, '^[=@]', '')
+    if name:find(pattern) then
+        return name
+    end
+end
+
+local function opname(func, pc)
+    local ins = jutil.funcbc(func, pc)
+    if not ins then
+        return '?'
+    end
+    local op = band(ins, 0xff)
+    return (gsub(sub(vmdef.bcnames, op * 6 + 1, op * 6 + 6), ' ', ''))
+end
+
+local function fmterr(err, info)
+    if type(err) ~= 'number' then
+        return tostring(err)
+    end
+    local msg = vmdef.traceerr[err]
+    if not msg then
+        return format('error %d', err)
+    end
+    if type(info) == 'function' then
+        info = jutil.funcinfo(info).loc or '?'
+    end
+    local ok, res = pcall(format, msg, info)
+    return ok and res or msg
+end
+
+local function flattener(name)
+    local fl = flatteners[name]
+    if not fl then
+        fl = {
+            starts = 0, stops = 0, aborts = 0, side_traces = 0,
+            blacklisted = 0, flushes = flushes, abort_reasons = {},
+            roots = {}, root_index = {}
+        }
+        flatteners[name] = fl
+    end
+    return fl
+end
+
+local function add_root(fl, func, pc)
+    local pcs = fl.root_index[func]
+    if not pcs then
+        pcs = {}
+        fl.root_index[func] = pcs
+    end
+    if not pcs[pc] then
+        pcs[pc] = true
+        insert(fl.roots, { func = func, pc = pc })
+    end
+end
+
+local function on_trace(what, tr, func, pc, otr, oex)
+    if what == 'flush' then
+        traces = {}
+        flushes = flushes + 1
+        return
+    elseif what == 'start' then
+        local name = chunk_name(func)
+        if not name then
+            return
+        end
+        local fl = flattener(name)
+        fl.starts = fl.starts + 1
+        traces[tr] = { fl = fl, func = func, pc = pc, parent = otr }
+        if not otr then
+            add_root(fl, func, pc)
+        end
+        return
+    end
+    local t = traces[tr]
+    if not t then
+        return
+    end
+    local fl = t.fl
+    if what == 'stop' then
+        traces[tr] = nil
+        fl.stops = fl.stops + 1
+        if t.parent then
+            fl.side_traces = fl.side_traces + 1
+        end
+    elseif what == 'abort' then
+        traces[tr] = nil
+        fl.aborts = fl.aborts + 1
+        local reason = fmterr(otr, oex)
+        fl.abort_reasons[reason] = (fl.abort_reasons[reason] or 0) + 1
+        -- the penalty is applied before the event is sent
+        if not t.parent and blacklisted_ops[opname(t.func, t.pc)] then
+            fl.blacklisted = fl.blacklisted + 1
+        end
+    end
+end
+
+local function start(match)
+    pattern = match or 'flatten'
+    if not attached then
+        jit.attach(on_trace, 'trace')
+        attached = true
+    end
+end
+
+local function stop()
+    if attached then
+        jit.attach(on_trace)
+        attached = false
+    end
+end
+
+local function reset()
+    flatteners = {}
+    traces = {}
+end
+
+local function report()
+    local res = {}
+    for name, fl in pairs(flatteners) do
+        local compiled, blacklisted = 0, false
+        for _, root in ipairs(fl.roots) do
+            local op = opname(root.func, root.pc)
+            if compiled_ops[op] then
+                compiled = compiled + 1
+            elseif blacklisted_ops[op] then
+                blacklisted = true
+            end
+        end
+        local reasons = {}
+        for k, v in pairs(fl.abort_reasons) do
+            reasons[k] = v
+        end
+        res[name] = {
+            starts        = fl.starts,
+            stops         = fl.stops,
+            aborts        = fl.aborts,
+            side_traces   = fl.side_traces,
+            blacklisted   = fl.blacklisted,
+            flushes       = flushes - fl.flushes,
+            abort_reasons = reasons,
+            roots         = #fl.roots,
+            compiled      = compiled,
+            interpreted   = blacklisted or (fl.starts ~= 0 and compiled == 0)
+        }
+    end
+    return { jit = (jit.status()), flatteners = res }
+end
+
+local function check()
+    local r = report()
+    local bad = {}
+    for name, fl in pairs(r.flatteners) do
+        if not r.jit or fl.interpreted then
+            insert(bad, format('%s (%d aborts, %d blacklisted)',
+                               name, fl.aborts, fl.blacklisted))
+        end
+    end
+    if #bad == 0 then
+        return true
+    end
+    table.sort(bad)
+    return false, 'running in the interpreter: '..concat(bad, ', ')
+end
+
+return {
+    start  = start,
+    stop   = stop,
+    reset  = reset,
+    report = report,
+    check  = check
+}
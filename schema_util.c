@@ -3,6 +3,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
 
 enum TypeId {
     NilValue         = 1,
@@ -19,6 +27,10 @@ enum TypeId {
     ArrayValue       = 11,
     MapValue         = 12,
 
+    RawValue         = 13, /* A value kept in its original encoding,
+                            * see preprocess_msgpack_projected.
+                            */
+
     CopyCommand      = 20 /* Copy N bytes verbatim from data bank.
                            * Provides complex default values. Also
                            * strings during unflatten.
@@ -52,6 +64,7 @@ struct Value {
  * ExtValue         - xlen, xoff
  * ArrayValue       - xlen, xoff
  * MapValue         - xlen, xoff
+ * RawValue         - xlen, xoff (as a string, encoded bytes)
  */
 
 ssize_t
@@ -73,6 +86,798 @@ create_msgpack(size_t             nitems,
                uint8_t           *stock_buf,
                uint8_t          **msgpack_out);
 
+/*
+ * Encode in two steps: compute the exact size, then encode into
+ * memory provided by the caller (e.g. a tuple being allocated).
+ * The buffer must have room for create_msgpack_size bytes.
+ *
+ * Return the number of bytes or -1 if a TypeId is invalid.
+ */
+ssize_t
+create_msgpack_size(size_t             nitems,
+                    const uint8_t     *typeid,
+                    const struct Value*value);
+
+ssize_t
+create_msgpack_into(size_t             nitems,
+                    const uint8_t     *typeid,
+                    const struct Value*value,
+                    const uint8_t     *bank1,
+                    const uint8_t     *bank2,
+                    uint8_t           *out);
+
+/*
+ * Batch API, amortizes call overhead across many documents.
+ *
+ * Items of all documents go into a single stream, the items of
+ * document i are [offsets[i], offsets[i+1]).  An empty range marks
+ * a document that failed to process (a valid document always has
+ * at least one item).  Offsets arrays have ndocs + 1 elements.
+ *
+ * When encoding, bank1 of document i is docs[i].data + docs[i].size,
+ * matching string offsets produced by preprocess.
+ *
+ * Return the total number of items / bytes or -1 if out of memory.
+ */
+struct Doc {
+    const uint8_t *data;
+    size_t         size;
+};
+
+ssize_t
+preprocess_msgpack_batch(size_t             ndocs,
+                         const struct Doc  *docs,
+                         size_t             stock_buf_size_or_hint,
+                         uint8_t           *stock_typeid_buf,
+                         struct Value      *stock_value_buf,
+                         uint8_t          **typeid_out,
+                         struct Value     **value_out,
+                         uint32_t          *offsets);
+
+ssize_t
+create_msgpack_batch(size_t             ndocs,
+                     const uint8_t     *typeid,
+                     const struct Value*value,
+                     const uint32_t    *offsets,
+                     const struct Doc  *docs,
+                     const uint8_t     *bank2,
+                     size_t             stock_buf_size_or_hint,
+                     uint8_t           *stock_buf,
+                     uint8_t          **msgpack_out,
+                     uint32_t          *out_offsets);
+
+/*
+ * Streaming preprocess, for a document arriving in pieces.
+ *
+ * The state of preprocess_msgpack (pending items count, patch list
+ * and the stack) survives between feed calls, so processing starts
+ * before the whole document is buffered.  String, bin and ext
+ * payloads are copied into a buffer owned by the stream; headers and
+ * scalars are decoded on the fly, hence the caller is free to drop
+ * a chunk once fed.  When the document is complete, the result is
+ * the same as if preprocess_msgpack was given the concatenation,
+ * except that bank1 is the end of the stream payload buffer.
+ *
+ * Memory used by a stream is capped by max_bytes (0 - no limit).
+ */
+struct PreprocStream;
+
+struct PreprocStream *
+preprocess_stream_new(size_t stock_buf_size_or_hint, size_t max_bytes);
+
+void
+preprocess_stream_delete(struct PreprocStream *st);
+
+/* Prepare for the next document, buffers are reused. */
+void
+preprocess_stream_reset(struct PreprocStream *st);
+
+/*
+ * Returns 1 if the document is complete (the remaining bytes are not
+ * consumed), 0 if more data needed, -1 - bad data, -2 - out of
+ * memory or the cap exceeded.  Errors are sticky until reset.
+ */
+int
+preprocess_stream_feed(struct PreprocStream *st,
+                       const uint8_t        *chunk,
+                       size_t                size,
+                       size_t               *consumed);
+
+/*
+ * Returns the number of items, or -1 if the document isn't complete.
+ * Buffers are owned by the stream and remain valid until reset.
+ */
+ssize_t
+preprocess_stream_result(struct PreprocStream *st,
+                         uint8_t             **typeid_out,
+                         struct Value        **value_out,
+                         const uint8_t       **bank1_out);
+
+/*
+ * Arena, a context owning preprocess / create buffers.
+ *
+ * Buffers persist between calls and grow geometrically when needed,
+ * steady-state processing makes no allocations at all.  Results are
+ * owned by the arena and remain valid until the next call of the
+ * same kind (preprocess or create) on it; don't free them.  Growth
+ * beyond max_bytes (0 - no limit) fails the call.
+ *
+ * Return the number of items / bytes or -1 (bad data, out of memory
+ * or the limit exceeded).
+ */
+struct SchemaArena;
+
+struct SchemaArena *
+schema_arena_new(size_t size_hint, size_t max_bytes);
+
+void
+schema_arena_delete(struct SchemaArena *arena);
+
+void
+schema_arena_set_limit(struct SchemaArena *arena, size_t max_bytes);
+
+/* Peak memory used by the arena, bytes. */
+size_t
+schema_arena_high_water(const struct SchemaArena *arena);
+
+ssize_t
+preprocess_msgpack_arena(struct SchemaArena *arena,
+                         const uint8_t      *msgpack_in,
+                         size_t              msgpack_size,
+                         uint8_t           **typeid_out,
+                         struct Value      **value_out);
+
+ssize_t
+create_msgpack_arena(struct SchemaArena *arena,
+                     size_t              nitems,
+                     const uint8_t      *typeid,
+                     const struct Value *value,
+                     const uint8_t      *bank1,
+                     const uint8_t      *bank2,
+                     uint8_t           **msgpack_out);
+
+/*
+ * Scatter-gather create_msgpack, the result is a list of iovec-s in
+ * the arena (for writev and the like).  Payloads of strings, bin,
+ * ext, raw and copied values of at least threshold bytes (16 at the
+ * least) are referenced in place: bank1 / bank2 must outlive the
+ * result.  Everything else is encoded into the arena.  Returns the
+ * number of iovec-s (size_out receives the number of bytes) or -1.
+ */
+ssize_t
+create_msgpack_iov(struct SchemaArena *arena,
+                   size_t              nitems,
+                   const uint8_t      *typeid,
+                   const struct Value *value,
+                   const uint8_t      *bank1,
+                   const uint8_t      *bank2,
+                   size_t              threshold,
+                   struct iovec      **iov_out,
+                   size_t             *size_out);
+
+ssize_t
+preprocess_msgpack_batch_arena(struct SchemaArena *arena,
+                               size_t              ndocs,
+                               const struct Doc   *docs,
+                               uint8_t           **typeid_out,
+                               struct Value      **value_out,
+                               uint32_t           *offsets);
+
+/*
+ * Compact items: 4-byte values instead of 8-byte ones, TypeId-s are
+ * unchanged.  For documents of up to COMPACT_MAX_SIZE bytes, xlen
+ * and xoff always fit 16 bits.  Numbers are either inline (integers
+ * of 31 bits, shifted left by 1) or in a side table (the index
+ * shifted left by 1, plus 1); floats and doubles are always in the
+ * side table.  Nil and booleans have 0.
+ *
+ * NilValue .. DoubleValue - u
+ * StringValue .. MapValue  - xlen, xoff
+ * RawValue, CopyCommand    - xlen, xoff
+ */
+#define COMPACT_MAX_SIZE 65535
+
+/* u == xlen | xoff << 16 only holds on little-endian targets. */
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "struct CompactValue assumes a little-endian target"
+#endif
+
+struct CompactValue {
+    union {
+        uint32_t       u;
+        struct {
+            uint16_t   xlen;
+            uint16_t   xoff;
+        };
+    };
+};
+
+/*
+ * Preprocess into compact items in the arena, the side table is in
+ * the arena as well.  Returns the number of items, -1 (bad data or
+ * out of memory) or -2 if the document is too large, use
+ * preprocess_msgpack_arena then.
+ */
+ssize_t
+preprocess_msgpack_compact(struct SchemaArena   *arena,
+                           const uint8_t        *msgpack_in,
+                           size_t                msgpack_size,
+                           uint8_t             **typeid_out,
+                           struct CompactValue **value_out,
+                           struct Value        **side_out);
+
+/*
+ * Encode compact items, as create_msgpack_arena.  RawValue-s and
+ * CopyCommand-s are accepted as well.
+ */
+ssize_t
+create_msgpack_compact(struct SchemaArena        *arena,
+                       size_t                     nitems,
+                       const uint8_t             *typeid,
+                       const struct CompactValue *value,
+                       const struct Value        *side,
+                       const uint8_t             *bank1,
+                       const uint8_t             *bank2,
+                       uint8_t                  **msgpack_out);
+
+ssize_t
+create_msgpack_batch_arena(struct SchemaArena *arena,
+                           size_t              ndocs,
+                           const uint8_t      *typeid,
+                           const struct Value *value,
+                           const uint32_t     *offsets,
+                           const struct Doc   *docs,
+                           const uint8_t      *bank2,
+                           uint8_t           **msgpack_out,
+                           uint32_t           *out_offsets);
+
+/*
+ * Counters, how often preprocess / create fall off the fast path.
+ *
+ * Compiled in unless SCHEMA_STATS=0, counting is off until enabled
+ * (SCHEMA_STATS=2 - on from the start).  Counters are process-wide
+ * and updated atomically; the item histograms and copy_bytes are
+ * collected by a separate pass over the items of a successful call,
+ * the encoding loops aren't touched.  Histograms are indexed by
+ * TypeId (invalid ones count as 0).
+ */
+struct SchemaStats {
+    uint64_t           preprocess_calls;
+    uint64_t           preprocess_grows;      /* output reallocated */
+    uint64_t           preprocess_stock_overflows; /* stock buf left */
+    uint64_t           stack_grows;           /* beyond auto_stack_buf */
+    uint64_t           error_underflow;
+    uint64_t           error_c1;
+    uint64_t           error_alloc;
+    uint64_t           create_calls;
+    uint64_t           create_grows;
+    uint64_t           create_stock_overflows;
+    uint64_t           copy_bytes;            /* memcpy-ed by copy_data */
+    uint64_t           error_badcode;
+    uint64_t           error_create_alloc;
+    uint64_t           preprocess_types[32];
+    uint64_t           create_types[32];
+};
+
+/*
+ * Returns the previous state (0 / 1) or -1 if compiled out.
+ */
+int
+schema_stats_enable(int on);
+
+/* NULL if compiled out. */
+const struct SchemaStats *
+schema_stats(void);
+
+void
+schema_stats_reset(void);
+
+/*
+ * Schema program, drives the native flattener.
+ */
+enum NodeKind {
+    NODE_RECORD      = 1,
+    NODE_LEAF        = 2,
+    NODE_ENUM        = 3,
+    NODE_ARRAY       = 4
+};
+
+struct SchemaNode {
+    uint8_t            kind;
+    uint8_t            tid;       /* leaf: output TypeId, 0 - keep input */
+    uint8_t            conv;      /* leaf: LongValue -> dval */
+    uint8_t            skip;      /* field: keep raw when projecting */
+    uint8_t            optional;  /* field: might be missing (default) */
+    uint32_t           accept;    /* leaf: mask of acceptable input TypeId-s */
+    uint32_t           size;      /* leaf: fixed size or UINT32_MAX */
+    uint32_t           first;     /* record: in fields[], array: item node */
+    uint32_t           count;     /* record: number of fields */
+    uint32_t           first_key; /* record, enum: in keys[] */
+    uint32_t           nkeys;
+};
+
+struct SchemaKey {
+    const uint8_t     *str;
+    uint32_t           len;
+    uint32_t           id;        /* record: field node, enum: symbol index */
+};
+
+struct SchemaProgram {
+    const struct SchemaNode
+                      *nodes;
+    uint32_t           nnodes;
+    uint32_t           root;
+    uint32_t           nslots;    /* items in the root array */
+    const uint32_t    *fields;
+    struct SchemaKey  *keys;
+};
+
+enum NativeError {
+    NATIVE_ERR_BAD_DATA       = 1,
+    NATIVE_ERR_NO_MEMORY      = 2,
+    NATIVE_ERR_TYPE           = 3,  /* node */
+    NATIVE_ERR_SIZE           = 4,  /* node */
+    NATIVE_ERR_KEY_NOT_STR    = 5,  /* node */
+    NATIVE_ERR_UNKNOWN_KEY    = 6,  /* node, aux1 - key offset, aux2 - len */
+    NATIVE_ERR_DUP            = 7,  /* node */
+    NATIVE_ERR_MISSING        = 8,  /* node */
+    NATIVE_ERR_ENUM           = 9,  /* node */
+    NATIVE_ERR_ITEM_TYPE      = 10, /* node, aux1 - item (1-based) */
+    NATIVE_ERR_ITEM_SIZE      = 11, /* node, aux1 - item */
+    NATIVE_ERR_ITEM_ENUM      = 12, /* node, aux1 - item */
+    NATIVE_ERR_OVERFLOW       = 13  /* update: node - slot, aux1 - op */
+};
+
+struct DocError {
+    uint32_t           code;      /* 0 - ok */
+    uint32_t           node;
+    uint32_t           aux1;
+    uint32_t           aux2;
+    uint32_t           offset;    /* validate: where the value starts */
+};
+
+/* Sort keys for lookup, call once before use. */
+void
+schema_program_prepare(struct SchemaProgram *prog);
+
+/*
+ * Projection: preprocess guided by a schema program.  Values of
+ * fields marked skip aren't expanded, each becomes a single RawValue
+ * spanning the original bytes (create_msgpack copies these verbatim).
+ * Everything else is the same as preprocess_msgpack.  Items land in
+ * the arena, see preprocess_msgpack_arena.
+ */
+ssize_t
+preprocess_msgpack_projected(struct SchemaArena         *arena,
+                             const struct SchemaProgram *prog,
+                             const uint8_t              *msgpack_in,
+                             size_t                      msgpack_size,
+                             uint8_t                   **typeid_out,
+                             struct Value              **value_out);
+
+ssize_t
+preprocess_msgpack_batch_projected(struct SchemaArena         *arena,
+                                   const struct SchemaProgram *prog,
+                                   size_t                      ndocs,
+                                   const struct Doc           *docs,
+                                   uint8_t                   **typeid_out,
+                                   struct Value              **value_out,
+                                   uint32_t                   *offsets);
+
+/*
+ * Validation: check a document against a schema program in the same
+ * pass that preprocesses it (projection included, see above).  On
+ * success, the result is the same as preprocess_msgpack_projected.
+ * Otherwise -1 is returned and err receives the first problem found:
+ * one of NativeError codes, the node and the offset of the offending
+ * value in the input (array items: of the array, aux1 is the item).
+ * Only missing fields that aren't optional are reported.  Nodes of
+ * kind 0 (unions, maps) are preprocessed without checks, these are
+ * left to the Lua flattener.
+ *
+ * Batch: an empty range marks a bad document, errors has ndocs
+ * entries (code 0 - ok).  Returns -1 only if out of memory.
+ */
+ssize_t
+validate_msgpack(struct SchemaArena         *arena,
+                 const struct SchemaProgram *prog,
+                 const uint8_t              *msgpack_in,
+                 size_t                      msgpack_size,
+                 uint8_t                   **typeid_out,
+                 struct Value              **value_out,
+                 struct DocError            *err);
+
+ssize_t
+validate_msgpack_batch(struct SchemaArena         *arena,
+                       const struct SchemaProgram *prog,
+                       size_t                      ndocs,
+                       const struct Doc           *docs,
+                       uint8_t                   **typeid_out,
+                       struct Value              **value_out,
+                       uint32_t                   *offsets,
+                       struct DocError            *errors);
+
+/*
+ * Maps are flattened into open addressing tables: key k goes to
+ * bucket map_key_hash(k) & (nbuckets - 1) or the next free one
+ * (linear probing).  Nbuckets is a power of 2 keeping the load at
+ * 2/3 or below, map_buckets() computes it for npairs (0 if there are
+ * too many).
+ */
+uint32_t
+map_key_hash(const uint8_t *key, uint32_t len);
+
+uint32_t
+map_buckets(uint32_t npairs);
+
+/*
+ * CRC-64-AVRO (Rabin) fingerprint, as in the Avro spec; the input is
+ * a schema in Parsing Canonical Form (see schema_cache.lua).
+ */
+uint64_t
+schema_fingerprint64(const uint8_t *data, size_t size);
+
+/*
+ * Hash the map at index map in the preprocessed data (string keys
+ * reference bank1).  Order receives map_buckets(npairs) entries, the
+ * index of the key in the bucket or 0 if the bucket is empty.
+ * Returns the number of buckets, MAP_KEY_NOT_STR, MAP_DUP_KEY or
+ * MAP_TOO_BIG.
+ */
+ssize_t
+map_hash_order(const uint8_t      *typeid,
+               const struct Value *value,
+               size_t              map,
+               const uint8_t      *bank1,
+               uint32_t           *order);
+
+struct WorkerPool;
+
+struct WorkerPool *
+worker_pool_new(uint32_t nworkers);
+
+void
+worker_pool_delete(struct WorkerPool *pool);
+
+/*
+ * Flatten ndocs documents on the pool.  Results are laid out in
+ * *msgpack_out (malloc-ed, in input order); a document that failed
+ * yields an empty range and has errors[i].code set.
+ * Returns the total size or -1 if out of memory.
+ */
+ssize_t
+flatten_batch_mt(const struct SchemaProgram *prog,
+                 struct WorkerPool          *pool,
+                 size_t                      ndocs,
+                 const struct Doc           *docs,
+                 uint8_t                   **msgpack_out,
+                 uint32_t                   *out_offsets,
+                 struct DocError            *errors);
+
+/*
+ * Avro binary.
+ *
+ * Avro data isn't self-describing, the codec is driven by an Avro
+ * program: a tree of nodes mirroring the schema.  The items are the
+ * ones of preprocess_msgpack for the same document as msgpack:
+ * records are maps keyed by field names, enums are symbol strings,
+ * a union is the value of the branch taken.  Field names and symbols
+ * are msgpack strings in the bank; preprocess_avro emits these as
+ * CopyCommand-s, hence create_msgpack needs the bank as bank2.
+ * Strings and bytes reference the Avro data (bank1 is its end).
+ */
+enum AvroKind {
+    AVRO_NULL        = 1,
+    AVRO_BOOLEAN     = 2,
+    AVRO_INT         = 3,
+    AVRO_LONG        = 4,
+    AVRO_FLOAT       = 5,
+    AVRO_DOUBLE      = 6,
+    AVRO_BYTES       = 7,
+    AVRO_STRING      = 8,
+    AVRO_FIXED       = 9,
+    AVRO_ENUM        = 10,
+    AVRO_ARRAY       = 11,
+    AVRO_MAP         = 12,
+    AVRO_RECORD      = 13,
+    AVRO_UNION       = 14
+};
+
+struct AvroNode {
+    uint8_t            kind;
+    uint32_t           first;     /* record, union: in children[],
+                                   * enum: in names[],
+                                   * array, map: item node */
+    uint32_t           count;     /* record: fields, union: branches,
+                                   * enum: symbols, fixed: size */
+};
+
+struct AvroProgram {
+    const struct AvroNode
+                      *nodes;
+    uint32_t           nnodes;
+    uint32_t           root;
+    uint32_t           nnames;
+    const uint32_t    *children;
+    const struct SchemaKey
+                      *names;     /* record: parallel to children[] */
+    struct SchemaKey  *keys;      /* names sorted, see prepare */
+    const uint8_t     *bank;      /* bank end */
+};
+
+/* Sort keys for lookup (copying names), call once before use. */
+void
+avro_program_prepare(struct AvroProgram *prog);
+
+/*
+ * Encode items as Avro, the result is in the arena (see
+ * create_msgpack_arena).  Returns the number of bytes or -1 (items
+ * don't match the schema, out of memory or the limit exceeded).
+ */
+ssize_t
+create_avro(struct SchemaArena       *arena,
+            const struct AvroProgram *prog,
+            size_t                    nitems,
+            const uint8_t            *typeid,
+            const struct Value       *value,
+            const uint8_t            *bank1,
+            const uint8_t            *bank2,
+            uint8_t                 **avro_out);
+
+/*
+ * Decode Avro data into items in the arena (see
+ * preprocess_msgpack_arena).  Returns the number of items or -1.
+ */
+ssize_t
+preprocess_avro(struct SchemaArena       *arena,
+                const struct AvroProgram *prog,
+                const uint8_t            *avro_in,
+                size_t                    avro_size,
+                uint8_t                 **typeid_out,
+                struct Value            **value_out);
+
+/*
+ * Preprocess a JSON document into items in the arena, the same ones
+ * preprocess_msgpack_arena produces for the msgpack equivalent.
+ * Strings reference the input unless they have escapes, bank1_out
+ * receives the address strings are relative to: the input end or
+ * the end of a region in the arena holding a copy of the document
+ * and the decoded strings.  Returns the number of items or -1.
+ */
+ssize_t
+preprocess_json(struct SchemaArena *arena,
+                const uint8_t      *json_in,
+                size_t              json_size,
+                uint8_t           **typeid_out,
+                struct Value      **value_out,
+                const uint8_t     **bank1_out);
+
+/*
+ * Batch version, bad documents get empty ranges.  docs_out (must not
+ * be docs) receives documents for create_msgpack_batch: data + size
+ * is the document's bank1.
+ */
+ssize_t
+preprocess_json_batch(struct SchemaArena *arena,
+                      size_t              ndocs,
+                      const struct Doc   *docs,
+                      uint8_t           **typeid_out,
+                      struct Value      **value_out,
+                      uint32_t           *offsets,
+                      struct Doc         *docs_out);
+
+/*
+ * Columnar output in Arrow's memory layout.
+ *
+ * A sink has a column per slot of the flattened tuple (an item of
+ * the root array), columns of list items follow.  Appending a batch
+ * of flattened documents (the items create_msgpack_batch takes)
+ * adds a row per document, bad documents (empty ranges) are skipped.
+ * An item is a value of the column's type or nil (a null);
+ * CopyCommand-s (defaults) and RawValue-s (projection) are decoded.
+ *
+ * Buffers, as in Arrow:
+ *   validity - a bit per row, least significant first, 1 - not null
+ *   values   - int64 / double / float, int32 dictionary indices (DICT),
+ *              a bit per row (BOOL), unused otherwise
+ *   offsets  - BINARY, LIST: int32, length + 1 entries
+ *   data     - BINARY: the bytes
+ * Buffers are 64-byte aligned and persist, reset empties them.
+ */
+enum ColumnType {
+    COLUMN_NULL      = 1,
+    COLUMN_BOOL      = 2,
+    COLUMN_INT64     = 3,
+    COLUMN_DOUBLE    = 4,
+    COLUMN_BINARY    = 5,
+    COLUMN_DICT      = 6,
+    COLUMN_LIST      = 7,
+    COLUMN_FLOAT     = 8
+};
+
+struct ColumnBuf {
+    uint8_t           *data;
+    size_t             size;
+    size_t             cap;
+};
+
+struct Column {
+    uint8_t            type;
+    uint32_t           child;     /* LIST: item column */
+    uint64_t           length;
+    uint64_t           null_count;
+    struct ColumnBuf   validity;
+    struct ColumnBuf   values;
+    struct ColumnBuf   offsets;
+    struct ColumnBuf   data;
+};
+
+struct ColumnSink;
+
+/*
+ * Types[i] is the type of column i, children[i] the item column of
+ * a LIST (a later one).  Columns [0, nslots) receive the slots.
+ */
+struct ColumnSink *
+column_sink_new(uint32_t        ncolumns,
+                const uint8_t  *types,
+                const uint32_t *children,
+                uint32_t        nslots);
+
+void
+column_sink_delete(struct ColumnSink *sink);
+
+void
+column_sink_reset(struct ColumnSink *sink);
+
+struct Column *
+column_sink_columns(struct ColumnSink *sink);
+
+/*
+ * Append flattened documents (as in create_msgpack_batch).  Returns
+ * the number of rows appended or -1 (items don't match the columns
+ * or out of memory); the sink is left as it was if the call fails.
+ */
+ssize_t
+column_sink_append(struct ColumnSink  *sink,
+                   size_t              ndocs,
+                   const uint8_t      *typeid,
+                   const struct Value *value,
+                   const uint32_t     *offsets,
+                   const struct Doc   *docs,
+                   const uint8_t      *bank2);
+
+/*
+ * Key extraction: a few fields of a document packed into a key
+ * comparable with memcmp, straight from msgpack.  Parts are leaf or
+ * enum fields of a schema program (outside of unions), each part is
+ * reached through a path of record fields (path[first_path], depth
+ * nodes, the part's node last).  Slots map nodes on the paths to
+ * 1 + their slot (0 - not on a path).
+ *
+ * Defaults of a part (first_default, ndefaults) are msgpack values
+ * used if the node they belong to is missing, see compile_key.
+ */
+enum KeyType {
+    KEY_LONG         = 1,
+    KEY_DOUBLE       = 2,         /* double, float */
+    KEY_BOOL         = 3,
+    KEY_STRING       = 4,         /* string, bytes */
+    KEY_FIXED        = 5,
+    KEY_ENUM         = 6
+};
+
+#define KEY_MAX_SLOTS 64
+
+struct KeyPart {
+    uint32_t           node;
+    uint32_t           type;
+    uint32_t           first_path;
+    uint32_t           depth;
+    uint32_t           first_default;
+    uint32_t           ndefaults;
+};
+
+struct KeyDefault {
+    uint32_t           node;
+    uint32_t           size;
+    const uint8_t     *data;
+};
+
+struct KeyDef {
+    const struct SchemaProgram
+                      *prog;
+    const struct KeyPart
+                      *parts;
+    uint32_t           nparts;
+    uint32_t           nleaves;   /* distinct part nodes */
+    const uint32_t    *path;
+    const struct KeyDefault
+                      *defaults;
+    const uint32_t    *slots;     /* by node */
+};
+
+/*
+ * Extract the key of a document into the arena (valid until the next
+ * call).  The map is scanned until every part is found, the rest of
+ * the document isn't looked at; unknown keys are skipped.  Returns
+ * the key size or -1, err tells the problem (see validate_msgpack;
+ * the offset is 0 if a default is bad).
+ *
+ * Batch: keys are concatenated, out_offsets has ndocs + 1 entries,
+ * an empty range marks a bad document (see errors).  Returns -1 only
+ * if out of memory.
+ */
+ssize_t
+key_extract(struct SchemaArena   *arena,
+            const struct KeyDef  *def,
+            const uint8_t        *msgpack_in,
+            size_t                msgpack_size,
+            uint8_t             **key_out,
+            struct DocError      *err);
+
+ssize_t
+key_extract_batch(struct SchemaArena   *arena,
+                  const struct KeyDef  *def,
+                  size_t                ndocs,
+                  const struct Doc     *docs,
+                  uint8_t             **keys_out,
+                  uint32_t             *out_offsets,
+                  struct DocError      *errors);
+
+/*
+ * Build a key from part values, values[i] is the msgpack encoding of
+ * part i (e.g. for a lookup).  Same result as key_extract.
+ */
+ssize_t
+key_encode(struct SchemaArena   *arena,
+           const struct KeyDef  *def,
+           const struct Doc     *values,
+           uint8_t             **key_out,
+           struct DocError      *err);
+
+/*
+ * Updates of flattened tuples (nslots items in the root array).
+ * Operations are sorted by slot, the ones on the same slot apply in
+ * order:
+ *   SET    - replace the value, arg is a msgpack value in args
+ *   ADD    - add arg (tid is LongValue or DoubleValue) to a number;
+ *            a long stays a long (NATIVE_ERR_OVERFLOW if it doesn't
+ *            fit, or doesn't fit 32 bits with int32 set), a float
+ *            stays a float
+ *   APPEND - append the items of arg, a msgpack array in args, to
+ *            an array
+ * Arguments are xdata in a bank ending at args (as bank2 of
+ * create_msgpack).  Returns the size of the updated tuple (in the arena)
+ * or -1, err tells the problem: NATIVE_ERR_TYPE if an operation
+ * doesn't apply to the value (node is the slot, aux1 the operation),
+ * NATIVE_ERR_BAD_DATA if the tuple, an argument or the order is bad.
+ */
+enum UpdateOpCode {
+    UPDATE_SET       = 1,
+    UPDATE_ADD       = 2,
+    UPDATE_APPEND    = 3
+};
+
+struct UpdateOp {
+    uint8_t            op;
+    uint8_t            tid;       /* ADD: the type of arg */
+    uint8_t            int32;     /* ADD: the field is an int */
+    uint32_t           slot;
+    struct Value       arg;
+};
+
+ssize_t
+update_tuple(struct SchemaArena    *arena,
+             uint32_t               nslots,
+             const uint8_t         *tuple_in,
+             size_t                 tuple_size,
+             uint32_t               nops,
+             const struct UpdateOp *ops,
+             const uint8_t         *args,
+             uint8_t              **tuple_out,
+             struct DocError       *err);
+
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 #define net2host16(v) __builtin_bswap16(v)
 #define net2host32(v) __builtin_bswap32(v)
@@ -116,68 +921,408 @@ static void *realloc_wrap(void *buf, size_t size,
     return memcpy(buf, stock_buf, old_size);
 }
 
-ssize_t preprocess_msgpack(const uint8_t * restrict mi,
-                           size_t        ms,
-                           size_t        sz_or_hint,
-                           uint8_t      *stock_typeid_buf,
-                           struct Value *stock_value_buf,
-                           uint8_t     **typeid_out,
-                           struct Value **value_out)
-{
-    const uint8_t *me = mi + ms;
-    uint8_t       * restrict typeid, *typeid_max, *typeid_buf;
-    struct Value  * restrict value, *value_buf = NULL;
-    uint32_t       todo = 1, patch = -1;
-    uint32_t       auto_stack_buf[32];
-    uint32_t      *stack_buf = auto_stack_buf, *stack_max = auto_stack_buf + 32;
-    uint32_t      *stack = stack_buf;
-    uint32_t       len;
-
-    if (stock_typeid_buf != NULL && stock_value_buf != NULL) {
-        typeid = typeid_buf = stock_typeid_buf;
-        typeid_max = stock_typeid_buf + sz_or_hint * sizeof(typeid[0]);
-        value = value_buf = stock_value_buf;
-    } else {
-        size_t ic = 32; /* initial capacity */
-        if (sz_or_hint > ic)
-            ic = sz_or_hint;
+/*
+ * Counters
+ *
+ * STAT_ADD costs a well predicted branch when counting is off; it is
+ * only used off the fast path (growth, errors) and once per call.
+ */
+#ifndef SCHEMA_STATS
+#define SCHEMA_STATS 1
+#endif
 
-        typeid_max = (typeid = typeid_buf = malloc(ic * sizeof(typeid[0]))) + ic;
-        if (typeid_buf == NULL)
-            goto error_alloc;
+#if SCHEMA_STATS
 
-        value = value_buf = malloc(ic * sizeof(value[0]));
-        if (value_buf == NULL)
-            goto error_alloc;
-    }
+static int                stats_on = SCHEMA_STATS > 1;
+static struct SchemaStats stats;
 
-    if (0) {
-repeat:
-        value++; typeid++;
-    }
+#define stats_enabled() \
+    __builtin_expect(__atomic_load_n(&stats_on, __ATOMIC_RELAXED), 0)
 
-    while (todo -- == 0) {
-        struct Value *fixit;
+#define STAT_ADD(counter, n) do { \
+    if (stats_enabled()) \
+        __atomic_fetch_add(&stats.counter, (n), __ATOMIC_RELAXED); \
+} while (0)
 
-        if (stack == stack_buf)
-            goto done;
+static void stats_histogram(uint64_t *hist,
+                            const uint8_t *typeid, size_t nitems)
+{
+    uint64_t local[32] = { 0 };
+    size_t   i;
 
-        todo = *--stack;
-        fixit = value_buf + patch;
-        patch = fixit->xoff;
-        fixit->xoff = value - fixit;
+    for (i = 0; i != nitems; i++)
+        local[typeid[i] < 32 ? typeid[i] : 0]++;
+    for (i = 0; i != 32; i++) {
+        if (local[i] != 0)
+            __atomic_fetch_add(&hist[i], local[i], __ATOMIC_RELAXED);
     }
+}
 
-    if (mi == me)
-        goto error_underflow;
+static void stats_preprocess(const uint8_t *typeid, size_t nitems)
+{
+    stats_histogram(stats.preprocess_types, typeid, nitems);
+}
 
-    /* ensure output has capacity for 1 more item */
+/* Mirrors encode_core: everything but fixext 1 - 8 goes to copy_data. */
+static void stats_create(const uint8_t *typeid, const struct Value *value,
+                         size_t nitems)
+{
+    uint64_t copy_bytes = 0;
+    size_t   i;
+
+    stats_histogram(stats.create_types, typeid, nitems);
+    for (i = 0; i != nitems; i++) {
+        switch (typeid[i]) {
+        case ExtValue:
+            if (value[i].xlen == 2 || value[i].xlen == 3 ||
+                value[i].xlen == 5 || value[i].xlen == 9)
+                break;
+            /* fallthrough */
+        case StringValue:
+        case BinValue:
+        case RawValue:
+        case CopyCommand:
+            copy_bytes += value[i].xlen;
+        }
+    }
+    __atomic_fetch_add(&stats.copy_bytes, copy_bytes, __ATOMIC_RELAXED);
+}
+
+int schema_stats_enable(int on)
+{
+    return __atomic_exchange_n(&stats_on, on != 0, __ATOMIC_RELAXED);
+}
+
+const struct SchemaStats *schema_stats(void)
+{
+    return &stats;
+}
+
+void schema_stats_reset(void)
+{
+    uint64_t *counter = (uint64_t *)&stats;
+    size_t    i;
+
+    for (i = 0; i != sizeof(stats) / sizeof(*counter); i++)
+        __atomic_store_n(&counter[i], 0, __ATOMIC_RELAXED);
+}
+
+#else
+
+#define stats_enabled() 0
+#define STAT_ADD(counter, n) ((void)0)
+#define stats_preprocess(typeid, nitems) ((void)0)
+#define stats_create(typeid, value, nitems) ((void)0)
+
+int schema_stats_enable(int on)
+{
+    (void)on;
+    return -1;
+}
+
+const struct SchemaStats *schema_stats(void)
+{
+    return NULL;
+}
+
+void schema_stats_reset(void)
+{
+}
+
+#endif
+
+/*
+ * Runs of positive fixints and fixstrs.
+ *
+ * Numeric-heavy payloads are mostly runs of 1 byte positive fixints
+ * (arrays) or fixstr / fixint pairs (maps with short keys).  Instead
+ * of going through the main switch for every item, preprocess_msgpack
+ * hands such runs over to fix_run.  Runs of fixints are classified
+ * 16 or 32 header bytes at a time with SSE4.2 / AVX2 (chosen at
+ * runtime), the rest is handled by a tight scalar loop.
+ */
+
+typedef size_t (*fixint_run_fn)(const uint8_t *mi, size_t n,
+                                uint8_t *typeid, struct Value *value);
+
+/*
+ * Emit LongValue for the leading positive fixints in [mi, mi + n),
+ * returns the number of items emitted.
+ */
+static size_t fixint_run_scalar(const uint8_t *mi, size_t n,
+                                uint8_t *typeid, struct Value *value)
+{
+    size_t i;
+    for (i = 0; i != n && mi[i] < 0x80; i++) {
+        typeid[i] = LongValue;
+        value[i].ival = mi[i];
+    }
+    return i;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse4.2")))
+static size_t fixint_run_sse42(const uint8_t *mi, size_t n,
+                               uint8_t *typeid, struct Value *value)
+{
+    const __m128i long_value = _mm_set1_epi8(LongValue);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i  hdr = _mm_loadu_si128((const __m128i *)(mi + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hdr);
+        size_t   j;
+        if (mask != 0)
+            break;
+        _mm_storeu_si128((__m128i *)(typeid + i), long_value);
+        for (j = 0; j != 16; j += 2) {
+            uint16_t b;
+            memcpy(&b, mi + i + j, sizeof(b));
+            _mm_storeu_si128((__m128i *)(value + i + j),
+                             _mm_cvtepu8_epi64(_mm_cvtsi32_si128(b)));
+        }
+    }
+    return i + fixint_run_scalar(mi + i, n - i, typeid + i, value + i);
+}
+
+__attribute__((target("avx2")))
+static size_t fixint_run_avx2(const uint8_t *mi, size_t n,
+                              uint8_t *typeid, struct Value *value)
+{
+    const __m256i long_value = _mm256_set1_epi8(LongValue);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i  hdr = _mm256_loadu_si256((const __m256i *)(mi + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hdr);
+        size_t   j;
+        if (mask != 0)
+            break;
+        _mm256_storeu_si256((__m256i *)(typeid + i), long_value);
+        for (j = 0; j != 32; j += 4) {
+            uint32_t b;
+            memcpy(&b, mi + i + j, sizeof(b));
+            _mm256_storeu_si256((__m256i *)(value + i + j),
+                                _mm256_cvtepu8_epi64(_mm_cvtsi32_si128((int)b)));
+        }
+    }
+    return i + fixint_run_scalar(mi + i, n - i, typeid + i, value + i);
+}
+
+#endif
+
+static size_t fixint_run_select(const uint8_t *mi, size_t n,
+                                uint8_t *typeid, struct Value *value);
+
+/* Resolved on first call; threads may race, hence relaxed atomics. */
+static fixint_run_fn fixint_run_fnp = fixint_run_select;
+
+static inline size_t fixint_run(const uint8_t *mi, size_t n,
+                                uint8_t *typeid, struct Value *value)
+{
+    return __atomic_load_n(&fixint_run_fnp, __ATOMIC_RELAXED)(
+        mi, n, typeid, value);
+}
+
+static size_t fixint_run_select(const uint8_t *mi, size_t n,
+                                uint8_t *typeid, struct Value *value)
+{
+    fixint_run_fn fn = fixint_run_scalar;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        fn = fixint_run_avx2;
+    else if (__builtin_cpu_supports("sse4.2"))
+        fn = fixint_run_sse42;
+#endif
+    __atomic_store_n(&fixint_run_fnp, fn, __ATOMIC_RELAXED);
+    return fn(mi, n, typeid, value);
+}
+
+/*
+ * Emit up to *pn items (positive fixints / fixstrs) starting at mi.
+ * Stops at the first item of a different kind or at a truncated
+ * string.  Stores the number of items emitted in *pn, returns the
+ * updated input position.
+ */
+static inline const uint8_t *fix_run(const uint8_t * restrict mi,
+                                     const uint8_t *me, size_t *pn,
+                                     uint8_t * restrict typeid,
+                                     struct Value * restrict value)
+{
+    size_t n = *pn, i = 0;
+    int    run = 0; /* previous item was a fixint */
+    while (i != n && mi != me) {
+        uint32_t len;
+        if (*mi < 0x80) {
+            size_t avail = (size_t)(me - mi), k;
+            if (avail > n - i)
+                avail = n - i;
+            if (!run || avail < 16) {
+                /* a lone fixint (e.g. a map value), skip the kernel */
+                typeid[i] = LongValue;
+                value[i].ival = *mi++;
+                i++;
+                run = 1;
+                continue;
+            }
+            k = fixint_run(mi, avail, typeid + i, value + i);
+            mi += k;
+            i  += k;
+            continue;
+        }
+        run = 0;
+        if ((*mi & 0xe0) != 0xa0)
+            break;
+        len = *mi - 0xa0;
+        if (mi + len + 1 > me)
+            break;
+        typeid[i] = StringValue;
+        value[i].xlen = len;
+        value[i].xoff = (me - mi - 1);
+        mi += len + 1;
+        i++;
+    }
+    *pn = i;
+    return mi;
+}
+
+/*
+ * Output buffers of preprocess_msgpack(_batch), grown on demand.
+ * Stock buffers (if any) are never freed.  The stack tracking nested
+ * containers starts in auto_stack_buf; pb must not move once
+ * initialized.  Growth beyond limit bytes (0 - no limit) fails.
+ */
+struct PreprocBuf {
+    uint8_t       *typeid_buf, *typeid_max, *stock_typeid_buf;
+    struct Value  *value_buf, *stock_value_buf;
+    uint32_t      *stack_buf, *stack_max;
+    size_t         limit;
+    uint32_t       auto_stack_buf[32];
+};
+
+static size_t preproc_buf_footprint(size_t capacity, size_t stack_capacity)
+{
+    return capacity * (sizeof(uint8_t) + sizeof(struct Value)) +
+           stack_capacity * sizeof(uint32_t);
+}
+
+static int preproc_buf_init(struct PreprocBuf *pb,
+                            size_t        sz_or_hint,
+                            uint8_t      *stock_typeid_buf,
+                            struct Value *stock_value_buf)
+{
+    pb->stock_typeid_buf = stock_typeid_buf;
+    pb->stock_value_buf = stock_value_buf;
+    pb->stack_buf = pb->auto_stack_buf;
+    pb->stack_max = pb->auto_stack_buf + 32;
+    pb->limit = 0;
+    if (stock_typeid_buf != NULL && stock_value_buf != NULL) {
+        pb->typeid_buf = stock_typeid_buf;
+        pb->typeid_max = stock_typeid_buf + sz_or_hint;
+        pb->value_buf = stock_value_buf;
+    } else {
+        size_t ic = 32; /* initial capacity */
+        if (sz_or_hint > ic)
+            ic = sz_or_hint;
+
+        pb->typeid_buf = malloc(ic * sizeof(pb->typeid_buf[0]));
+        pb->typeid_max = pb->typeid_buf + ic;
+        pb->value_buf = malloc(ic * sizeof(pb->value_buf[0]));
+        if (pb->typeid_buf == NULL || pb->value_buf == NULL) {
+            free(pb->typeid_buf);
+            free(pb->value_buf);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Release the stack, output buffers are handed over to the caller. */
+static void preproc_buf_release_stack(struct PreprocBuf *pb)
+{
+    if (pb->stack_buf != pb->auto_stack_buf)
+        free(pb->stack_buf);
+    pb->stack_buf = pb->auto_stack_buf;
+    pb->stack_max = pb->auto_stack_buf + 32;
+}
+
+static void preproc_buf_destroy(struct PreprocBuf *pb)
+{
+    if (pb->typeid_buf != pb->stock_typeid_buf)
+        free(pb->typeid_buf);
+    if (pb->value_buf != pb->stock_value_buf)
+        free(pb->value_buf);
+    preproc_buf_release_stack(pb);
+}
+
+#define PREPROC_BAD_DATA    (-1)
+#define PREPROC_NO_MEMORY   (-2)
+
+/*
+ * Preprocess a single document, appending items to pb starting at
+ * index pos.  Returns the index past the last item or one of
+ * PREPROC_BAD_DATA, PREPROC_NO_MEMORY.  Buffers in pb might have
+ * been reallocated even if the call failed.  Trailing data is
+ * ignored; if end_out is not NULL, it receives the document end.
+ */
+static ssize_t preprocess_doc(const uint8_t * restrict mi,
+                              size_t             ms,
+                              struct PreprocBuf *pb,
+                              size_t             pos,
+                              const uint8_t    **end_out)
+{
+    const uint8_t *me = mi + ms;
+    uint8_t       * restrict typeid, *typeid_max, *typeid_buf;
+    struct Value  * restrict value, *value_buf;
+    uint8_t       *stock_typeid_buf = pb->stock_typeid_buf;
+    struct Value  *stock_value_buf = pb->stock_value_buf;
+    uint32_t       todo = 1, patch = -1;
+    uint32_t      *stack_buf = pb->stack_buf, *stack_max = pb->stack_max;
+    uint32_t      *stack = stack_buf;
+    uint32_t       len;
+    ssize_t        rc;
+
+    typeid_buf = pb->typeid_buf;
+    typeid_max = pb->typeid_max;
+    typeid = typeid_buf + pos;
+    value_buf = pb->value_buf;
+    value = value_buf + pos;
+
+    if (0) {
+repeat:
+        value++; typeid++;
+    }
+
+    while (todo -- == 0) {
+        struct Value *fixit;
+
+        if (stack == stack_buf)
+            goto done;
+
+        todo = *--stack;
+        fixit = value_buf + patch;
+        patch = fixit->xoff;
+        fixit->xoff = value - fixit;
+    }
+
+    if (mi == me)
+        goto error_underflow;
+
+    /* ensure output has capacity for 1 more item */
     if (__builtin_expect(typeid == typeid_max, 0)) {
         size_t          capacity = typeid_max - typeid_buf;
         size_t          new_capacity = capacity + capacity / 2;
         uint8_t        *new_typeid_buf;
         struct Value   *new_value_buf;
 
+        if (pb->limit != 0 &&
+            preproc_buf_footprint(new_capacity, stack_max - stack_buf) > pb->limit)
+            goto error_alloc;
+
+        STAT_ADD(preprocess_grows, 1);
+        if (typeid_buf == stock_typeid_buf)
+            STAT_ADD(preprocess_stock_overflows, 1);
+
         new_typeid_buf = realloc_wrap(typeid_buf, new_capacity * sizeof(typeid[0]),
                                       stock_typeid_buf, capacity * sizeof(typeid[0]));
         if (new_typeid_buf == NULL)
@@ -198,9 +1343,19 @@ repeat:
 
     switch (*mi) {
     case 0x00 ... 0x7f:
-        /* positive fixint */
-        *typeid = LongValue;
-        value->ival = *mi++;
+    case 0xa0 ... 0xbf:
+        /* positive fixint / fixstr, possibly a run of these */
+        {
+            size_t n = (size_t)todo + 1, avail = typeid_max - typeid;
+            if (n > avail)
+                n = avail;
+            mi = fix_run(mi, me, &n, typeid, value);
+            if (n == 0)
+                goto error_underflow;
+            todo  -= n - 1;
+            typeid += n - 1;
+            value  += n - 1;
+        }
         goto repeat;
     case 0x80 ... 0x8f:
         /* fixmap */
@@ -222,9 +1377,15 @@ setup_nested:
             size_t      new_capacity = capacity + capacity/2;
             uint32_t   *new_stack_buf;
 
+            if (pb->limit != 0 &&
+                preproc_buf_footprint(typeid_max - typeid_buf,
+                                      new_capacity) > pb->limit)
+                goto error_alloc;
+
+            STAT_ADD(stack_grows, 1);
             new_stack_buf = realloc_wrap(
                 stack_buf, new_capacity * sizeof(stack[0]),
-                auto_stack_buf, capacity * sizeof(stack[0]));
+                pb->auto_stack_buf, capacity * sizeof(stack[0]));
 
             if (new_stack_buf == NULL)
                 goto error_alloc;
@@ -236,10 +1397,6 @@ setup_nested:
         *stack++ = todo;
         todo = len;
         goto repeat;
-    case 0xa0 ... 0xbf:
-        /* fixstr */
-        len = *mi - 0xa0;
-        *typeid = StringValue;
         /* string, bin and ext jumps here */
 do_xdata:
         if (mi + len + 1 > me)
@@ -303,7 +1460,7 @@ do_xdata:
         if (mi + 3 > me)
             goto error_underflow;
         *typeid = ExtValue;
-        len = net2host16(unaligned(mi + 1)->u16);
+        len = net2host16(unaligned(mi + 1)->u16) + 1;
         mi += 2;
         goto do_xdata;
     case 0xc9:
@@ -311,7 +1468,7 @@ do_xdata:
         if (mi + 5 > me)
             goto error_underflow;
         *typeid = ExtValue;
-        len = net2host32(unaligned(mi + 1)->u32);
+        len = net2host32(unaligned(mi + 1)->u32) + 1;
         mi += 4;
         goto do_xdata;
     case 0xca: {
@@ -412,7 +1569,7 @@ do_xdata:
     case 0xd4:
     case 0xd5:
         /* fixext 1, 2 */
-        len = *mi - 0xd3;
+        len = *mi - 0xd2;
         *typeid = ExtValue;
         goto do_xdata;
     case 0xd6:
@@ -488,6 +1645,7 @@ do_xdata:
         len = net2host32(unaligned(mi + 1)->u32);
         mi += 5;
         value->xlen = len;
+        len *= 2;
         goto setup_nested;
     case 0xe0 ... 0xff:
         /* negative fixint */
@@ -497,320 +1655,5014 @@ do_xdata:
     }
 
 done:
-    if (stack_buf != auto_stack_buf)
-        free(stack_buf);
-    *typeid_out = typeid_buf;
-    *value_out = value_buf;
-    return typeid - typeid_buf;
+    rc = typeid - typeid_buf;
+    if (end_out != NULL)
+        *end_out = mi;
+    if (stats_enabled())
+        stats_preprocess(typeid_buf + pos, rc - pos);
+    goto out;
 
 error_underflow:
+    STAT_ADD(error_underflow, 1);
+    rc = PREPROC_BAD_DATA;
+    goto out;
+
 error_c1:
+    STAT_ADD(error_c1, 1);
+    rc = PREPROC_BAD_DATA;
+    goto out;
+
 error_alloc:
-    if (stack_buf != auto_stack_buf)
-        free(stack_buf);
-    if (typeid_buf != stock_typeid_buf)
-        free(typeid_buf);
-    if (value_buf != stock_value_buf);
-        free(value_buf);
-    return -1;
+    STAT_ADD(error_alloc, 1);
+    rc = PREPROC_NO_MEMORY;
+
+out:
+    STAT_ADD(preprocess_calls, 1);
+    pb->typeid_buf = typeid_buf;
+    pb->typeid_max = typeid_max;
+    pb->value_buf = value_buf;
+    pb->stack_buf = stack_buf;
+    pb->stack_max = stack_max;
+    return rc;
 }
 
-ssize_t create_msgpack(size_t nitems,
-                       const uint8_t * restrict typeid,
-                       const struct Value * restrict value,
-                       const uint8_t * restrict bank1,
-                       const uint8_t * restrict bank2,
-                       size_t    sz_or_hint,
-                       uint8_t  *stock_buf,
-                       uint8_t **msgpack_out)
+ssize_t preprocess_msgpack(const uint8_t *mi,
+                           size_t        ms,
+                           size_t        sz_or_hint,
+                           uint8_t      *stock_typeid_buf,
+                           struct Value *stock_value_buf,
+                           uint8_t     **typeid_out,
+                           struct Value **value_out)
 {
-    const uint8_t *typeid_max = typeid + nitems;
-    uint8_t * restrict out, *out_max, *out_buf;
-    const uint8_t * restrict copy_from = bank1;
+    struct PreprocBuf pb;
+    ssize_t           rc;
 
-    if (stock_buf != NULL) {
-        out = out_buf = stock_buf;
-        out_max = stock_buf + sz_or_hint;
-    } else {
-        size_t initial_capacity = nitems > 128 ? nitems : 128;
-        if (sz_or_hint > initial_capacity)
-            initial_capacity = sz_or_hint;
-        out_buf = malloc(initial_capacity);
-        if (out_buf == NULL)
-            goto error_alloc;
-        out = out_buf;
-        out_max = out_buf + initial_capacity;
+    if (preproc_buf_init(&pb, sz_or_hint,
+                         stock_typeid_buf, stock_value_buf) != 0)
+        return -1;
+
+    rc = preprocess_doc(mi, ms, &pb, 0, NULL);
+    if (rc < 0) {
+        preproc_buf_destroy(&pb);
+        return -1;
     }
+    preproc_buf_release_stack(&pb);
+    *typeid_out = pb.typeid_buf;
+    *value_out = pb.value_buf;
+    return rc;
+}
 
-    for (; typeid != typeid_max; typeid++, value++) {
+/* Preprocess documents into pb, returns the total or -1. */
+static ssize_t preprocess_docs(size_t            ndocs,
+                               const struct Doc *docs,
+                               struct PreprocBuf *pb,
+                               uint32_t         *offsets)
+{
+    size_t i, pos = 0;
 
-        /* precondition: at least 10 bytes avail in out */
+    for (i = 0; i != ndocs; i++) {
+        ssize_t rc = preprocess_doc(docs[i].data, docs[i].size, pb, pos, NULL);
+        offsets[i] = (uint32_t)pos;
+        if (rc == PREPROC_NO_MEMORY || rc > UINT32_MAX)
+            return -1;
+        if (rc >= 0)
+            pos = (size_t)rc;
+        /* else an empty range marks a bad document */
+    }
+    offsets[ndocs] = (uint32_t)pos;
+    return pos;
+}
 
-        switch (*typeid) {
-        default:
-            goto error_badcode;
-        case NilValue:
-            *out ++ = 0xc0;
-            goto check_buf;
-        case FalseValue:
-            *out ++ = 0xc2;
-            goto check_buf;
-        case TrueValue:
-            *out ++ = 0xc3;
-            goto check_buf;
-        case LongValue:
-            /*
-             * Note: according to the MsgPack spec, signed and unsigned
-             * integer families are different 'presentations' of
-             * Integer type (i.e. signedness isn't a core value property
-             * worth preserving).
-             * It's faster to encode it the way we do, i.e. to use signed
-             * presentations for negative values only.
-             * Also, Tarantool friendly (can't index signed integers).
-             * Assuming 2-complement signed integers.
-             */
-            if (value->uval > (uint64_t)INT64_MAX /* negative val */) {
-                if (value->uval >= (uint64_t)-0x20) {
-                    *out++ = (uint8_t)value->uval;
-                    goto check_buf;
-                }
-                if (value->uval >= (uint64_t)INT8_MIN) {
-                    out[0] = 0xd0;
-                    out[1] = (uint8_t)value->uval;
-                    out += 2;
-                    goto check_buf;
-                }
-                if (value->uval >= (uint64_t)INT16_MIN) {
-                    out[0] = 0xd1;
-                    unaligned(out + 1)->u16 = host2net16((uint16_t)value->uval);
-                    out += 3;
-                    goto check_buf;
-                }
-                if (value->uval >= (uint64_t)INT32_MIN) {
-                    out[0] = 0xd2;
-                    unaligned(out + 1)->u32 = host2net32((uint32_t)value->uval);
-                    out += 5;
-                    goto check_buf;
-                }
-                out[0] = 0xd3;
-                unaligned(out + 1)->u64 = host2net64(value->uval);
-                out += 9;
-                goto check_buf;
-            }
-            /* fallthrough */
-        case UlongValue:
-            if (value->uval <= 0x7f) {
-                *out++ = (uint8_t)value->uval;
-                goto check_buf;
-            }
-            if (value->uval <= UINT8_MAX) {
-                out[0] = 0xcc;
-                out[1] = (uint8_t)value->uval;
-                out += 2;
-                goto check_buf;
-            }
-            if (value->uval <= UINT16_MAX) {
-                out[0] = 0xcd;
-                unaligned(out + 1)->u16 = host2net16((uint16_t)value->uval);
-                out += 3;
-                goto check_buf;
-            }
-            if (value->uval <= UINT32_MAX) {
-                out[0] = 0xce;
-                unaligned(out + 1)->u32 = host2net32((uint32_t)value->uval);
-                out += 5;
-                goto check_buf;
-            }
-            out[0] = 0xcf;
-            unaligned(out + 1)->u64 = host2net64(value->uval);
-            out += 9;
+ssize_t preprocess_msgpack_batch(size_t           ndocs,
+                                 const struct Doc *docs,
+                                 size_t           sz_or_hint,
+                                 uint8_t         *stock_typeid_buf,
+                                 struct Value    *stock_value_buf,
+                                 uint8_t        **typeid_out,
+                                 struct Value   **value_out,
+                                 uint32_t        *offsets)
+{
+    struct PreprocBuf pb;
+    ssize_t           pos;
+
+    if (preproc_buf_init(&pb, sz_or_hint,
+                         stock_typeid_buf, stock_value_buf) != 0)
+        return -1;
+
+    pos = preprocess_docs(ndocs, docs, &pb, offsets);
+    if (pos < 0) {
+        preproc_buf_destroy(&pb);
+        return -1;
+    }
+
+    preproc_buf_release_stack(&pb);
+    *typeid_out = pb.typeid_buf;
+    *value_out = pb.value_buf;
+    return pos;
+}
+
+/*
+ * Streaming preprocess.
+ *
+ * Unlike preprocess_doc, a header might be split between chunks,
+ * hence it is collected in hdr first.  Header size is determined by
+ * the first byte.
+ */
+static const uint8_t header_size[32] = {
+    /* 0xc0 - 0xcf */
+    1, 1, 1, 1, 2, 3, 5, 2, 3, 5, 5, 9, 2, 3, 5, 9,
+    /* 0xd0 - 0xdf */
+    2, 3, 5, 9, 1, 1, 1, 1, 1, 2, 3, 5, 3, 5, 3, 5
+};
+
+#define HDR_SCALAR    0
+#define HDR_XDATA     1
+#define HDR_NESTED    2
+
+/*
+ * Decode a complete header.  Returns HDR_SCALAR, HDR_XDATA (*len
+ * is the payload size), HDR_NESTED (*len is the number of items)
+ * or PREPROC_BAD_DATA.
+ */
+static int decode_header(const uint8_t *h, uint8_t *typeid,
+                         struct Value *value, uint32_t *len)
+{
+    struct unaligned_storage ux;
+
+    switch (*h) {
+    case 0x00 ... 0x7f:
+        *typeid = LongValue;
+        value->ival = *h;
+        return HDR_SCALAR;
+    case 0x80 ... 0x8f:
+        *typeid = MapValue;
+        value->xlen = *h - 0x80;
+        *len = value->xlen * 2;
+        return HDR_NESTED;
+    case 0x90 ... 0x9f:
+        *typeid = ArrayValue;
+        *len = value->xlen = *h - 0x90;
+        return HDR_NESTED;
+    case 0xa0 ... 0xbf:
+        *typeid = StringValue;
+        *len = *h - 0xa0;
+        return HDR_XDATA;
+    case 0xc0:
+        *typeid = NilValue;
+        return HDR_SCALAR;
+    case 0xc1:
+        return PREPROC_BAD_DATA;
+    case 0xc2:
+        *typeid = FalseValue;
+        return HDR_SCALAR;
+    case 0xc3:
+        *typeid = TrueValue;
+        return HDR_SCALAR;
+    case 0xc4:
+        *typeid = BinValue;
+        *len = h[1];
+        return HDR_XDATA;
+    case 0xc5:
+        *typeid = BinValue;
+        *len = net2host16(unaligned(h + 1)->u16);
+        return HDR_XDATA;
+    case 0xc6:
+        *typeid = BinValue;
+        *len = net2host32(unaligned(h + 1)->u32);
+        return HDR_XDATA;
+    case 0xc7:
+        *typeid = ExtValue;
+        *len = h[1] + 1;
+        return HDR_XDATA;
+    case 0xc8:
+        *typeid = ExtValue;
+        *len = net2host16(unaligned(h + 1)->u16) + 1;
+        return HDR_XDATA;
+    case 0xc9:
+        *typeid = ExtValue;
+        *len = net2host32(unaligned(h + 1)->u32) + 1;
+        return HDR_XDATA;
+    case 0xca:
+        ux.u32 = net2host32(unaligned(h + 1)->u32);
+        *typeid = FloatValue;
+        value->dval = ux.f32;
+        return HDR_SCALAR;
+    case 0xcb:
+        ux.u64 = net2host64(unaligned(h + 1)->u64);
+        *typeid = DoubleValue;
+        value->dval = ux.f64;
+        return HDR_SCALAR;
+    case 0xcc:
+        *typeid = LongValue;
+        value->ival = h[1];
+        return HDR_SCALAR;
+    case 0xcd:
+        *typeid = LongValue;
+        value->ival = net2host16(unaligned(h + 1)->u16);
+        return HDR_SCALAR;
+    case 0xce:
+        *typeid = LongValue;
+        value->ival = net2host32(unaligned(h + 1)->u32);
+        return HDR_SCALAR;
+    case 0xcf:
+        value->uval = net2host64(unaligned(h + 1)->u64);
+        *typeid = value->uval > (uint64_t)INT64_MAX ? UlongValue : LongValue;
+        return HDR_SCALAR;
+    case 0xd0:
+        *typeid = LongValue;
+        value->ival = (int8_t)h[1];
+        return HDR_SCALAR;
+    case 0xd1:
+        *typeid = LongValue;
+        value->ival = (int16_t)net2host16(unaligned(h + 1)->u16);
+        return HDR_SCALAR;
+    case 0xd2:
+        *typeid = LongValue;
+        value->ival = (int32_t)net2host32(unaligned(h + 1)->u32);
+        return HDR_SCALAR;
+    case 0xd3:
+        *typeid = LongValue;
+        value->ival = (int64_t)net2host64(unaligned(h + 1)->u64);
+        return HDR_SCALAR;
+    case 0xd4 ... 0xd8:
+        /* fixext 1, 2, 4, 8, 16 (+ type byte) */
+        *typeid = ExtValue;
+        *len = (1u << (*h - 0xd4)) + 1;
+        return HDR_XDATA;
+    case 0xd9:
+        *typeid = StringValue;
+        *len = h[1];
+        return HDR_XDATA;
+    case 0xda:
+        *typeid = StringValue;
+        *len = net2host16(unaligned(h + 1)->u16);
+        return HDR_XDATA;
+    case 0xdb:
+        *typeid = StringValue;
+        *len = net2host32(unaligned(h + 1)->u32);
+        return HDR_XDATA;
+    case 0xdc:
+        *typeid = ArrayValue;
+        *len = value->xlen = net2host16(unaligned(h + 1)->u16);
+        return HDR_NESTED;
+    case 0xdd:
+        *typeid = ArrayValue;
+        *len = value->xlen = net2host32(unaligned(h + 1)->u32);
+        return HDR_NESTED;
+    case 0xde:
+        *typeid = MapValue;
+        value->xlen = net2host16(unaligned(h + 1)->u16);
+        *len = value->xlen * 2;
+        return HDR_NESTED;
+    case 0xdf:
+        *typeid = MapValue;
+        value->xlen = net2host32(unaligned(h + 1)->u32);
+        *len = value->xlen * 2;
+        return HDR_NESTED;
+    default:
+        /* negative fixint */
+        *typeid = LongValue;
+        value->ival = (int8_t)*h;
+        return HDR_SCALAR;
+    }
+}
+
+struct PreprocStream {
+    struct PreprocBuf  pb;
+    size_t             nitems;
+    uint32_t           todo, patch;
+    uint32_t          *stack_buf, *stack, *stack_max;
+    uint8_t           *data;          /* string, bin and ext payloads */
+    size_t             data_len, data_cap;
+    uint32_t           pending;       /* payload bytes yet to arrive */
+    uint8_t            hdr[9];
+    uint8_t            hdr_len;
+    int8_t             state;         /* 1 - done, < 0 - error */
+    int8_t             finalized;     /* xoff-s made relative to the end */
+    size_t             max_bytes;
+};
+
+/* Check whether buffers of the given capacity fit in the cap. */
+static int stream_grow(const struct PreprocStream *st, size_t items_cap,
+                       size_t data_cap, size_t stack_cap)
+{
+    size_t footprint = items_cap * (sizeof(uint8_t) + sizeof(struct Value)) +
+                       data_cap + stack_cap * sizeof(uint32_t);
+
+    return st->max_bytes != 0 && footprint > st->max_bytes ? -1 : 0;
+}
+
+struct PreprocStream *preprocess_stream_new(size_t sz_or_hint,
+                                            size_t max_bytes)
+{
+    struct PreprocStream *st = calloc(1, sizeof(*st));
+    size_t                stack_cap = 32, data_cap = 256;
+
+    if (st == NULL)
+        return NULL;
+    st->max_bytes = max_bytes;
+    if (preproc_buf_init(&st->pb, sz_or_hint, NULL, NULL) != 0)
+        goto error;
+    st->stack_buf = malloc(stack_cap * sizeof(st->stack_buf[0]));
+    st->stack_max = st->stack_buf + stack_cap;
+    st->data = malloc(data_cap);
+    st->data_cap = data_cap;
+    if (st->stack_buf == NULL || st->data == NULL) {
+        preproc_buf_destroy(&st->pb);
+        free(st->stack_buf);
+        free(st->data);
+        goto error;
+    }
+    preprocess_stream_reset(st);
+    return st;
+error:
+    free(st);
+    return NULL;
+}
+
+void preprocess_stream_delete(struct PreprocStream *st)
+{
+    if (st == NULL)
+        return;
+    preproc_buf_destroy(&st->pb);
+    free(st->stack_buf);
+    free(st->data);
+    free(st);
+}
+
+void preprocess_stream_reset(struct PreprocStream *st)
+{
+    st->nitems = 0;
+    st->todo = 1;
+    st->patch = -1;
+    st->stack = st->stack_buf;
+    st->data_len = 0;
+    st->pending = 0;
+    st->hdr_len = 0;
+    st->state = 0;
+    st->finalized = 0;
+}
+
+int preprocess_stream_feed(struct PreprocStream *st,
+                           const uint8_t        *mi,
+                           size_t                ms,
+                           size_t               *consumed)
+{
+    const uint8_t *mb = mi, *me = mi + ms;
+    struct PreprocBuf *pb = &st->pb;
+    uint32_t       len;
+    int            rc;
+
+    if (st->state != 0)
+        goto out;
+
+    for (;;) {
+        struct Value  *value;
+        uint8_t       *typeid;
+        size_t         need;
+
+        if (st->pending != 0) {
+            size_t n = me - mi;
+            if (n > st->pending)
+                n = st->pending;
+            memcpy(st->data + st->data_len, mi, n);
+            st->data_len += n;
+            st->pending -= n;
+            mi += n;
+            if (st->pending != 0)
+                goto out;
+        }
+
+        while (st->todo -- == 0) {
+            struct Value *fixit;
+
+            if (st->stack == st->stack_buf) {
+                st->state = 1;
+                goto out;
+            }
+
+            st->todo = *--st->stack;
+            fixit = pb->value_buf + st->patch;
+            st->patch = fixit->xoff;
+            fixit->xoff = pb->value_buf + st->nitems - fixit;
+        }
+
+        /* collect the header */
+        if (st->hdr_len == 0) {
+            if (mi == me)
+                goto suspend;
+            st->hdr[st->hdr_len++] = *mi++;
+        }
+        need = st->hdr[0] < 0xc0 || st->hdr[0] >= 0xe0 ?
+               1 : header_size[st->hdr[0] - 0xc0];
+        while (st->hdr_len != need) {
+            if (mi == me)
+                goto suspend;
+            st->hdr[st->hdr_len++] = *mi++;
+        }
+        st->hdr_len = 0;
+
+        /* ensure output has capacity for 1 more item */
+        if (__builtin_expect(pb->typeid_buf + st->nitems == pb->typeid_max, 0)) {
+            size_t          capacity = st->nitems;
+            size_t          new_capacity = capacity + capacity / 2;
+            uint8_t        *new_typeid_buf;
+            struct Value   *new_value_buf;
+
+            if (stream_grow(st, new_capacity, st->data_cap,
+                            st->stack_max - st->stack_buf) != 0)
+                goto error_alloc;
+
+            new_typeid_buf = realloc(pb->typeid_buf,
+                                     new_capacity * sizeof(typeid[0]));
+            if (new_typeid_buf == NULL)
+                goto error_alloc;
+            pb->typeid_buf = new_typeid_buf;
+            pb->typeid_max = new_typeid_buf + new_capacity;
+
+            new_value_buf = realloc(pb->value_buf,
+                                    new_capacity * sizeof(value[0]));
+            if (new_value_buf == NULL)
+                goto error_alloc;
+            pb->value_buf = new_value_buf;
+        }
+
+        typeid = pb->typeid_buf + st->nitems;
+        value = pb->value_buf + st->nitems;
+        st->nitems++;
+
+        rc = decode_header(st->hdr, typeid, value, &len);
+        switch (rc) {
+        case HDR_SCALAR:
+            break;
+        case HDR_XDATA:
+            if (__builtin_expect(st->data_cap - st->data_len < len, 0)) {
+                size_t   new_cap = st->data_cap + st->data_cap / 2;
+                uint8_t *new_data;
+
+                if (new_cap - st->data_len < len)
+                    new_cap = st->data_len + len;
+                if (stream_grow(st, pb->typeid_max - pb->typeid_buf, new_cap,
+                                st->stack_max - st->stack_buf) != 0)
+                    goto error_alloc;
+                new_data = realloc(st->data, new_cap);
+                if (new_data == NULL)
+                    goto error_alloc;
+                st->data = new_data;
+                st->data_cap = new_cap;
+            }
+            value->xlen = len;
+            /* offset from the start for now, see preprocess_stream_result */
+            value->xoff = st->data_len;
+            st->pending = len;
+            break;
+        case HDR_NESTED:
+            value->xoff = st->patch;
+            st->patch = value - pb->value_buf;
+            if (__builtin_expect(st->stack == st->stack_max, 0)) {
+                size_t      capacity = st->stack_max - st->stack_buf;
+                size_t      new_capacity = capacity + capacity/2;
+                uint32_t   *new_stack_buf;
+
+                if (stream_grow(st, pb->typeid_max - pb->typeid_buf,
+                                st->data_cap, new_capacity) != 0)
+                    goto error_alloc;
+                new_stack_buf = realloc(st->stack_buf,
+                                        new_capacity * sizeof(uint32_t));
+                if (new_stack_buf == NULL)
+                    goto error_alloc;
+                st->stack_buf = new_stack_buf;
+                st->stack     = new_stack_buf + capacity;
+                st->stack_max = new_stack_buf + new_capacity;
+            }
+            *st->stack++ = st->todo;
+            st->todo = len;
+            break;
+        default:
+            st->state = PREPROC_BAD_DATA;
+            goto out;
+        }
+    }
+
+suspend:
+    /* undo the decrement, the item is yet to arrive */
+    st->todo++;
+    goto out;
+
+error_alloc:
+    st->state = PREPROC_NO_MEMORY;
+
+out:
+    *consumed = mi - mb;
+    return st->state;
+}
+
+ssize_t preprocess_stream_result(struct PreprocStream *st,
+                                 uint8_t             **typeid_out,
+                                 struct Value        **value_out,
+                                 const uint8_t       **bank1_out)
+{
+    size_t i;
+
+    if (st->state != 1)
+        return -1;
+    if (!st->finalized) {
+        uint8_t      *typeid = st->pb.typeid_buf;
+        struct Value *value = st->pb.value_buf;
+
+        for (i = 0; i != st->nitems; i++) {
+            if (typeid[i] >= StringValue && typeid[i] <= ExtValue)
+                value[i].xoff = st->data_len - value[i].xoff;
+        }
+        st->finalized = 1;
+    }
+    *typeid_out = st->pb.typeid_buf;
+    *value_out = st->pb.value_buf;
+    *bank1_out = st->data + st->data_len;
+    return st->nitems;
+}
+
+/*
+ * Output buffer of create_msgpack(_batch), grown on demand.
+ * Invariant: at least 10 bytes available past the current position.
+ * Growth beyond limit bytes (0 - no limit) fails.
+ */
+struct OutputBuf {
+    uint8_t *out_buf, *out_max, *stock_buf;
+    size_t   limit;
+};
+
+static int output_buf_init(struct OutputBuf *ob,
+                           size_t    nitems,
+                           size_t    sz_or_hint,
+                           uint8_t  *stock_buf)
+{
+    ob->stock_buf = stock_buf;
+    ob->limit = 0;
+    if (stock_buf != NULL) {
+        ob->out_buf = stock_buf;
+        ob->out_max = stock_buf + sz_or_hint;
+    } else {
+        size_t initial_capacity = nitems > 128 ? nitems : 128;
+        if (sz_or_hint > initial_capacity)
+            initial_capacity = sz_or_hint;
+        ob->out_buf = malloc(initial_capacity);
+        if (ob->out_buf == NULL)
+            return -1;
+        ob->out_max = ob->out_buf + initial_capacity;
+    }
+    return 0;
+}
+
+static void output_buf_destroy(struct OutputBuf *ob)
+{
+    if (ob->out_buf != ob->stock_buf)
+        free(ob->out_buf);
+}
+
+#define CREATE_BAD_CODE     (-1)
+#define CREATE_NO_MEMORY    (-2)
+
+/*
+ * Sizing pass
+ *
+ * Encoded size of an item depends on the TypeId and, for numbers
+ * and xdata, on the magnitude of the value.  Magnitude is taken as
+ * the bit length (clz) of the number / length, the size is then
+ * looked up in a per-TypeId table mirroring the choices made by
+ * encode_core.  Apart from ext, there are no data dependent
+ * branches.
+ */
+#define B8(x)  x, x, x, x, x, x, x, x
+#define B64(x) B8(x), B8(x), B8(x), B8(x), B8(x), B8(x), B8(x), B8(x)
+static const uint8_t size_1[65] = { B64(1), 1 };
+static const uint8_t size_5[65] = { B64(5), 5 };
+static const uint8_t size_9[65] = { B64(9), 9 };
+static const uint8_t size_bad[65] = { B64(0xff), 0xff };
+static const uint8_t size_uint[65] = {
+    /* 0 - 7 bits: positive fixint, 8: uint 8, ..: uint 16/32/64 */
+    1, 1, 1, 1, 1, 1, 1, 1, 2, B8(3), B8(5), B8(5), B8(9), B8(9), B8(9), B8(9)
+};
+static const uint8_t size_nint[65] = {
+    /* bit length of ~v: negative fixint, int 8/16/32/64 */
+    1, 1, 1, 1, 1, 1, 2, 2, B8(3), B8(5), 5, 5, 5, 5, 5, 5, 5, 5,
+    B8(9), B8(9), B8(9), B8(9), 9
+};
+/* xdata / containers, header only (up to 32 bits) */
+static const uint8_t size_str[65] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, B8(3), B8(5), 5, 5, 5, 5, 5, 5, 5, 5
+};
+static const uint8_t size_bin[65] = {
+    2, 2, 2, 2, 2, 2, 2, 2, 2, B8(3), B8(5), 5, 5, 5, 5, 5, 5, 5, 5
+};
+static const uint8_t size_nested[65] = {
+    1, 1, 1, 1, 1, 3, 3, 3, 3, B8(3), B8(5), 5, 5, 5, 5, 5, 5, 5, 5
+};
+static const uint8_t size_copy[65] = { 0 };
+#undef B64
+#undef B8
+
+/* [negative LongValue][TypeId], row 0 stands for an invalid TypeId */
+static const uint8_t *const size_tab[2][CopyCommand + 1] = {
+    {
+        size_bad, size_1, size_1, size_1, size_uint, size_uint,
+        size_5, size_9, size_str, size_bin, size_bad /* ext */,
+        size_nested, size_nested, size_copy /* raw */, size_bad, size_bad,
+        size_bad, size_bad, size_bad, size_bad, size_copy
+    },
+    {
+        [LongValue] = size_nint
+    }
+};
+
+/* xdata / containers: magnitude is xlen; xdata: payload follows */
+#define X(t) (1u << (t))
+static const uint32_t xlen_types = X(StringValue) | X(BinValue) |
+    X(ExtValue) | X(ArrayValue) | X(MapValue) | X(RawValue) | X(CopyCommand);
+static const uint32_t payload_types = X(StringValue) | X(BinValue) |
+    X(ExtValue) | X(RawValue) | X(CopyCommand);
+#undef X
+
+static size_t ext_size(uint32_t xlen)
+{
+    switch (xlen) {
+    case 2: case 3: case 5: case 9: case 17:
+        return (size_t)xlen + 1; /* fixext */
+    }
+    return (size_t)xlen + size_bin[32 - __builtin_clz((xlen - 1) | 1)];
+}
+
+/* Exact encoded size or CREATE_BAD_CODE. */
+static ssize_t size_items(size_t nitems,
+                          const uint8_t * restrict typeid,
+                          const struct Value * restrict value)
+{
+    size_t   i, size = 0;
+    unsigned bad = 0;
+
+    for (i = 0; i != nitems; i++) {
+        unsigned t = typeid[i];
+        uint64_t u = value[i].uval;
+        uint32_t xlen = value[i].xlen;
+        unsigned neg, x, sz;
+
+        if (__builtin_expect(t == ExtValue, 0)) {
+            size += ext_size(xlen);
+            continue;
+        }
+        t = t <= CopyCommand ? t : 0;
+        x = (xlen_types >> t) & 1;
+        neg = (t == LongValue) & (value[i].ival < 0);
+        u = x ? xlen : u ^ -(uint64_t)neg;
+        sz = size_tab[neg][t][64 - __builtin_clzll(u | 1)];
+        bad |= sz;
+        size += sz + (((payload_types >> t) & 1) ? xlen : 0);
+    }
+    return bad & 0x80 ? CREATE_BAD_CODE : (ssize_t)size;
+}
+
+/*
+ * Encode items appending to ob starting at offset pos.  Returns the
+ * offset past the last byte written or one of CREATE_BAD_CODE,
+ * CREATE_NO_MEMORY.  The buffer in ob might have been reallocated
+ * even if the call failed.
+ *
+ * Unless checked, ob must have room for size_items bytes; no bounds
+ * checks are made then and ob is left intact.
+ */
+static inline __attribute__((always_inline))
+ssize_t encode_core(size_t nitems,
+                    const uint8_t * restrict typeid,
+                    const struct Value * restrict value,
+                    const uint8_t * restrict bank1,
+                    const uint8_t * restrict bank2,
+                    struct OutputBuf *ob,
+                    size_t pos,
+                    const int checked)
+{
+    const uint8_t *typeid_max = typeid + nitems;
+    uint8_t * restrict out, *out_max, *out_buf;
+    uint8_t *stock_buf = ob->stock_buf;
+    const uint8_t * restrict copy_from = bank1;
+    ssize_t rc;
+
+    out_buf = ob->out_buf;
+    out_max = ob->out_max;
+    out = out_buf + pos;
+
+    for (; typeid != typeid_max; typeid++, value++) {
+
+        /* precondition: at least 10 bytes avail in out */
+
+        switch (*typeid) {
+        default:
+            goto error_badcode;
+        case NilValue:
+            *out ++ = 0xc0;
             goto check_buf;
-        case FloatValue: {
-            struct unaligned_storage ux;
-            ux.f32 = (float)value->dval;
-            out[0] = 0xca;
-            unaligned(out + 1)->u32 = host2net32(ux.u32);
-            out += 5;
+        case FalseValue:
+            *out ++ = 0xc2;
             goto check_buf;
+        case TrueValue:
+            *out ++ = 0xc3;
+            goto check_buf;
+        case LongValue:
+            /*
+             * Note: according to the MsgPack spec, signed and unsigned
+             * integer families are different 'presentations' of
+             * Integer type (i.e. signedness isn't a core value property
+             * worth preserving).
+             * It's faster to encode it the way we do, i.e. to use signed
+             * presentations for negative values only.
+             * Also, Tarantool friendly (can't index signed integers).
+             * Assuming 2-complement signed integers.
+             */
+            if (value->uval > (uint64_t)INT64_MAX /* negative val */) {
+                if (value->uval >= (uint64_t)-0x20) {
+                    *out++ = (uint8_t)value->uval;
+                    goto check_buf;
+                }
+                if (value->uval >= (uint64_t)INT8_MIN) {
+                    out[0] = 0xd0;
+                    out[1] = (uint8_t)value->uval;
+                    out += 2;
+                    goto check_buf;
+                }
+                if (value->uval >= (uint64_t)INT16_MIN) {
+                    out[0] = 0xd1;
+                    unaligned(out + 1)->u16 = host2net16((uint16_t)value->uval);
+                    out += 3;
+                    goto check_buf;
+                }
+                if (value->uval >= (uint64_t)INT32_MIN) {
+                    out[0] = 0xd2;
+                    unaligned(out + 1)->u32 = host2net32((uint32_t)value->uval);
+                    out += 5;
+                    goto check_buf;
+                }
+                out[0] = 0xd3;
+                unaligned(out + 1)->u64 = host2net64(value->uval);
+                out += 9;
+                goto check_buf;
+            }
+            /* fallthrough */
+        case UlongValue:
+            if (value->uval <= 0x7f) {
+                *out++ = (uint8_t)value->uval;
+                goto check_buf;
+            }
+            if (value->uval <= UINT8_MAX) {
+                out[0] = 0xcc;
+                out[1] = (uint8_t)value->uval;
+                out += 2;
+                goto check_buf;
+            }
+            if (value->uval <= UINT16_MAX) {
+                out[0] = 0xcd;
+                unaligned(out + 1)->u16 = host2net16((uint16_t)value->uval);
+                out += 3;
+                goto check_buf;
+            }
+            if (value->uval <= UINT32_MAX) {
+                out[0] = 0xce;
+                unaligned(out + 1)->u32 = host2net32((uint32_t)value->uval);
+                out += 5;
+                goto check_buf;
+            }
+            out[0] = 0xcf;
+            unaligned(out + 1)->u64 = host2net64(value->uval);
+            out += 9;
+            goto check_buf;
+        case FloatValue: {
+            struct unaligned_storage ux;
+            ux.f32 = (float)value->dval;
+            out[0] = 0xca;
+            unaligned(out + 1)->u32 = host2net32(ux.u32);
+            out += 5;
+            goto check_buf;
+        }
+        case DoubleValue: {
+            struct unaligned_storage ux;
+            ux.f64 = value->dval;
+            out[0] = 0xcb;
+            unaligned(out + 1)->u64 = host2net64(ux.u64);
+            out += 9;
+            goto check_buf;
+        }
+        case StringValue:
+            if (value->xlen <= 31) {
+                *out++ = 0xa0 + (uint8_t)value->xlen;
+                goto copy_data;
+            }
+            if (value->xlen <= UINT8_MAX) {
+                out[0] = 0xd9;
+                out[1] = (uint8_t)value->xlen;
+                out += 2;
+                goto copy_data;
+            }
+            if (value->xlen <= UINT16_MAX) {
+                out[0] = 0xda;
+                unaligned(out+1)->u16 = host2net16((uint16_t)value->xlen);
+                out += 3;
+                goto copy_data;
+            }
+            out[0] = 0xdb;
+            unaligned(out+1)->u32 = host2net32(value->xlen);
+            out += 5;
+            goto copy_data;
+        case BinValue:
+            if (value->xlen <= UINT8_MAX) {
+                out[0] = 0xc4;
+                out[1] = (uint8_t)value->xlen;
+                out += 2;
+                goto copy_data;
+            }
+            if (value->xlen <= UINT16_MAX) {
+                out[0] = 0xc5;
+                unaligned(out + 1)->u16 = host2net16((uint16_t)value->xlen);
+                out += 3;
+                goto copy_data;
+            }
+            out[0] = 0xc6;
+            unaligned(out + 1)->u32 = host2net32(value->xlen);
+            out += 5;
+            goto copy_data;
+        case ExtValue:
+            switch (value->xlen) {
+            case 2:
+                /* fixext 1 */
+                out[0] = 0xd4;
+                unaligned(out + 1)->u16 = unaligned(copy_from - value->xoff)->u16;
+                out += 3;
+                goto check_buf;
+            case 3:
+                /* fixext 2 */
+                out[0] = 0xd5;
+                out[1] = (copy_from - value->xoff)[0];
+                unaligned(out + 2)->u16 = unaligned(copy_from - value->xoff + 1)->u16;
+                out += 4;
+                goto check_buf;
+            case 5:
+                /* fixext 4 */
+                out[0] = 0xd6;
+                out[1] = (copy_from - value->xoff)[0];
+                unaligned(out + 2)->u32 = unaligned(copy_from - value->xoff + 1)->u32;
+                out += 6;
+                goto check_buf;
+            case 9:
+                /* fixext 8 */
+                out[0] = 0xd7;
+                out[1] = (copy_from - value->xoff)[0];
+                unaligned(out + 2)->u64 = unaligned(copy_from - value->xoff + 1)->u64;
+                out += 10;
+                goto check_buf;
+            case 17:
+                /* fixext 16 */
+                *out++ = 0xd8;
+                goto copy_data;
+            }
+            if (value->xlen - 1 <= UINT8_MAX) {
+                out[0] = 0xc7;
+                out[1] = (uint8_t)(value->xlen - 1);
+                out += 2;
+                goto copy_data;
+            }
+            if (value->xlen - 1 <= UINT16_MAX) {
+                out[0] = 0xc8;
+                unaligned(out + 1)->u16 = host2net16((uint16_t)(value->xlen - 1));
+                out += 3;
+                goto copy_data;
+            }
+            out[0] = 0xc9;
+            unaligned(out + 1)->u32 = host2net32(value->xlen - 1);
+            out += 5;
+            goto copy_data;
+        case ArrayValue:
+            if (value->xlen <= 15) {
+                *out++ = 0x90 + (uint8_t)value->xlen;
+                goto check_buf;
+            }
+            if (value->xlen <= UINT16_MAX) {
+                out[0] = 0xdc;
+                unaligned(out + 1)->u16 = host2net16((uint16_t)value->xlen);
+                out += 3;
+                goto check_buf;
+            }
+            out[0] = 0xdd;
+            unaligned(out + 1)->u32 = host2net32(value->xlen);
+            out += 5;
+            goto check_buf;
+        case MapValue:
+            if (value->xlen <= 15) {
+                *out++ = 0x80 + (uint8_t)value->xlen;
+                goto check_buf;
+            }
+            if (value->xlen <= UINT16_MAX) {
+                out[0] = 0xde;
+                unaligned(out + 1)->u16 = host2net16((uint16_t)value->xlen);
+                out += 3;
+                goto check_buf;
+            }
+            out[0] = 0xdf;
+            unaligned(out + 1)->u32 = host2net32(value->xlen);
+            out += 5;
+            goto check_buf;
+        case RawValue:
+            /* already encoded */
+            goto copy_data;
+        case CopyCommand:
+            copy_from = bank2;
+            goto copy_data;
+        }
+
+check_buf:
+        /*
+         * Restore invariant: at least 10 bytes available in out_buf.
+         * Almost every switch branch ends up jumping here.
+         */
+        if (checked && out + 10 > out_max) {
+            size_t capacity = out_max - out_buf;
+            size_t new_capacity = capacity + capacity / 2;
+            if (ob->limit != 0 && new_capacity > ob->limit)
+                goto error_alloc;
+            STAT_ADD(create_grows, 1);
+            if (out_buf == stock_buf)
+                STAT_ADD(create_stock_overflows, 1);
+            uint8_t *new_out_buf = realloc_wrap(out_buf, new_capacity,
+                                                stock_buf, capacity);
+            if (new_out_buf == NULL)
+                goto error_alloc;
+            out     = new_out_buf + (out - out_buf);
+            out_buf = new_out_buf;
+            out_max = new_out_buf + new_capacity;
+        }
+        continue;
+
+copy_data:
+        /*
+         * Ensure we have a room fom value->xlen bytes in out_buf, plus
+         * 10 more bytes for the next iteration.
+         * Some switch branches end up jumping here.
+         */
+        if (checked && out + value->xlen + 10 > out_max) {
+            size_t capacity = out_max - out_buf;
+            size_t new_capacity = capacity + capacity / 2;
+            /* 1.5x might be not enough for a long string */
+            if (new_capacity < (size_t)(out - out_buf) + value->xlen + 10)
+                new_capacity = (size_t)(out - out_buf) + value->xlen + 10;
+            if (ob->limit != 0 && new_capacity > ob->limit)
+                goto error_alloc;
+            STAT_ADD(create_grows, 1);
+            if (out_buf == stock_buf)
+                STAT_ADD(create_stock_overflows, 1);
+            uint8_t *new_out_buf = realloc_wrap(out_buf, new_capacity,
+                                                stock_buf, capacity);
+            if (new_out_buf == NULL)
+                goto error_alloc;
+            out     = new_out_buf + (out - out_buf);
+            out_buf = new_out_buf;
+            out_max = new_out_buf + new_capacity;
+        }
+        memcpy(out, copy_from - value->xoff, value->xlen);
+        out += value->xlen;
+        copy_from = bank1;
+        continue;
+    }
+
+    rc = out - out_buf;
+    if (stats_enabled())
+        stats_create(typeid - nitems, value - nitems, nitems);
+    goto done;
+
+error_badcode:
+    STAT_ADD(error_badcode, 1);
+    rc = CREATE_BAD_CODE;
+    goto done;
+
+error_alloc:
+    STAT_ADD(error_create_alloc, 1);
+    rc = CREATE_NO_MEMORY;
+
+done:
+    STAT_ADD(create_calls, 1);
+    if (checked) {
+        ob->out_buf = out_buf;
+        ob->out_max = out_max;
+    }
+    return rc;
+}
+
+/*
+ * Checked variant, grows the buffer on demand.  Bounds checks are
+ * cheap (well predicted), a separate sizing pass costs more than it
+ * saves here, even counting reallocations.
+ */
+static ssize_t encode_items(size_t nitems,
+                            const uint8_t *typeid,
+                            const struct Value *value,
+                            const uint8_t *bank1,
+                            const uint8_t *bank2,
+                            struct OutputBuf *ob,
+                            size_t pos)
+{
+    return encode_core(nitems, typeid, value, bank1, bank2, ob, pos, 1);
+}
+
+ssize_t create_msgpack(size_t nitems,
+                       const uint8_t *typeid,
+                       const struct Value *value,
+                       const uint8_t *bank1,
+                       const uint8_t *bank2,
+                       size_t    sz_or_hint,
+                       uint8_t  *stock_buf,
+                       uint8_t **msgpack_out)
+{
+    struct OutputBuf ob;
+    ssize_t          rc;
+
+    if (output_buf_init(&ob, nitems, sz_or_hint, stock_buf) != 0)
+        return -1;
+
+    rc = encode_items(nitems, typeid, value, bank1, bank2, &ob, 0);
+    if (rc < 0) {
+        output_buf_destroy(&ob);
+        return -1;
+    }
+    *msgpack_out = ob.out_buf;
+    return rc;
+}
+
+ssize_t create_msgpack_size(size_t             nitems,
+                            const uint8_t     *typeid,
+                            const struct Value*value)
+{
+    return size_items(nitems, typeid, value);
+}
+
+ssize_t create_msgpack_into(size_t             nitems,
+                            const uint8_t     *typeid,
+                            const struct Value*value,
+                            const uint8_t     *bank1,
+                            const uint8_t     *bank2,
+                            uint8_t           *out)
+{
+    struct OutputBuf ob = { .out_buf = out };
+
+    return encode_core(nitems, typeid, value, bank1, bank2, &ob, 0, 0);
+}
+
+/* Encode documents into ob, returns the total or -1. */
+static ssize_t encode_docs(size_t              ndocs,
+                           const uint8_t      *typeid,
+                           const struct Value *value,
+                           const uint32_t     *offsets,
+                           const struct Doc   *docs,
+                           const uint8_t      *bank2,
+                           struct OutputBuf   *ob,
+                           uint32_t           *out_offsets)
+{
+    size_t i, pos = 0;
+
+    for (i = 0; i != ndocs; i++) {
+        ssize_t rc = encode_items(offsets[i + 1] - offsets[i],
+                                  typeid + offsets[i], value + offsets[i],
+                                  docs[i].data + docs[i].size, bank2,
+                                  ob, pos);
+        out_offsets[i] = (uint32_t)pos;
+        if (rc == CREATE_NO_MEMORY || rc > UINT32_MAX)
+            return -1;
+        if (rc >= 0)
+            pos = (size_t)rc;
+        /* else an empty range marks a bad document */
+    }
+    out_offsets[ndocs] = (uint32_t)pos;
+    return pos;
+}
+
+ssize_t create_msgpack_batch(size_t              ndocs,
+                             const uint8_t      *typeid,
+                             const struct Value *value,
+                             const uint32_t     *offsets,
+                             const struct Doc   *docs,
+                             const uint8_t      *bank2,
+                             size_t              sz_or_hint,
+                             uint8_t            *stock_buf,
+                             uint8_t           **msgpack_out,
+                             uint32_t           *out_offsets)
+{
+    struct OutputBuf ob;
+    ssize_t          pos;
+
+    if (output_buf_init(&ob, offsets[ndocs] - offsets[0],
+                        sz_or_hint, stock_buf) != 0)
+        return -1;
+
+    pos = encode_docs(ndocs, typeid, value, offsets, docs, bank2,
+                      &ob, out_offsets);
+    if (pos < 0) {
+        output_buf_destroy(&ob);
+        return -1;
+    }
+
+    *msgpack_out = ob.out_buf;
+    return pos;
+}
+
+/*
+ * Arena
+ *
+ * Just a PreprocBuf and an OutputBuf without stock buffers, kept
+ * between calls.  Before a call, the limit of the buffer about to
+ * grow is what is left of max_bytes by the other one.
+ */
+/* preprocess_json: decoded strings, a region per document. */
+struct JsonText {
+    uint8_t *buf;
+    size_t   size, cap, limit;
+};
+
+struct SchemaArena {
+    struct PreprocBuf  pb;
+    struct OutputBuf   ob;
+    size_t             max_bytes;
+    size_t             high_water;
+    uint32_t          *seen;      /* validate: fields seen, by node */
+    uint32_t           nseen;
+    uint32_t           seen_gen;
+    uint32_t          *slots;     /* create_avro: field values */
+    uint32_t           nslots;
+    struct JsonText    text;
+    struct iovec      *iov;       /* create_msgpack_iov */
+    size_t             niov;
+    struct Value      *side;      /* compact items: wide numbers */
+    size_t             nside;
+};
+
+static size_t arena_pb_footprint(const struct SchemaArena *arena)
+{
+    return preproc_buf_footprint(
+        arena->pb.typeid_max - arena->pb.typeid_buf,
+        arena->pb.stack_max - arena->pb.stack_buf);
+}
+
+static size_t arena_ob_footprint(const struct SchemaArena *arena)
+{
+    return arena->ob.out_max - arena->ob.out_buf;
+}
+
+static size_t arena_limit(const struct SchemaArena *arena, size_t other)
+{
+    if (arena->max_bytes == 0)
+        return 0;
+    /* 1 - effectively disables growth */
+    return other < arena->max_bytes ? arena->max_bytes - other : 1;
+}
+
+static void arena_update_high_water(struct SchemaArena *arena)
+{
+    size_t footprint = arena_pb_footprint(arena) + arena_ob_footprint(arena) +
+                       arena->text.cap + arena->niov * sizeof(struct iovec) +
+                       arena->nside * sizeof(struct Value);
+    if (footprint > arena->high_water)
+        arena->high_water = footprint;
+}
+
+struct SchemaArena *schema_arena_new(size_t size_hint, size_t max_bytes)
+{
+    struct SchemaArena *arena = malloc(sizeof(*arena));
+
+    if (arena == NULL)
+        return NULL;
+    if (preproc_buf_init(&arena->pb, size_hint, NULL, NULL) != 0) {
+        free(arena);
+        return NULL;
+    }
+    if (output_buf_init(&arena->ob, 0, size_hint, NULL) != 0) {
+        preproc_buf_destroy(&arena->pb);
+        free(arena);
+        return NULL;
+    }
+    arena->max_bytes = max_bytes;
+    arena->high_water = 0;
+    arena->seen = NULL;
+    arena->nseen = 0;
+    arena->seen_gen = 0;
+    arena->slots = NULL;
+    arena->nslots = 0;
+    arena->text.buf = NULL;
+    arena->text.size = arena->text.cap = arena->text.limit = 0;
+    arena->iov = NULL;
+    arena->niov = 0;
+    arena->side = NULL;
+    arena->nside = 0;
+    arena_update_high_water(arena);
+    return arena;
+}
+
+void schema_arena_delete(struct SchemaArena *arena)
+{
+    if (arena == NULL)
+        return;
+    preproc_buf_destroy(&arena->pb);
+    output_buf_destroy(&arena->ob);
+    free(arena->seen);
+    free(arena->slots);
+    free(arena->text.buf);
+    free(arena->iov);
+    free(arena->side);
+    free(arena);
+}
+
+void schema_arena_set_limit(struct SchemaArena *arena, size_t max_bytes)
+{
+    arena->max_bytes = max_bytes;
+}
+
+size_t schema_arena_high_water(const struct SchemaArena *arena)
+{
+    return arena->high_water;
+}
+
+ssize_t preprocess_msgpack_arena(struct SchemaArena *arena,
+                                 const uint8_t      *mi,
+                                 size_t              ms,
+                                 uint8_t           **typeid_out,
+                                 struct Value      **value_out)
+{
+    ssize_t rc;
+
+    arena->pb.limit = arena_limit(arena, arena_ob_footprint(arena));
+    rc = preprocess_doc(mi, ms, &arena->pb, 0, NULL);
+    arena_update_high_water(arena);
+    if (rc < 0)
+        return -1;
+    *typeid_out = arena->pb.typeid_buf;
+    *value_out = arena->pb.value_buf;
+    return rc;
+}
+
+/*
+ * Compact items
+ *
+ * The document is preprocessed as usual, then values are packed in
+ * place: compact value i overlaps the bytes of full value i / 2,
+ * these were consumed already.  Encoding expands values a chunk at
+ * a time and hands the chunk to encode_items.
+ */
+#define COMPACT_CHUNK 256
+
+static int arena_side_reserve(struct SchemaArena *arena, size_t n)
+{
+    size_t        new_nside, limit;
+    struct Value *side;
+
+    if (n <= arena->nside)
+        return 0;
+    new_nside = arena->nside ? arena->nside * 2 : 32;
+    if (new_nside < n)
+        new_nside = n;
+    limit = arena_limit(arena, arena_pb_footprint(arena) +
+                               arena_ob_footprint(arena));
+    if (limit != 0 && new_nside * sizeof(*side) > limit)
+        return -1;
+    side = realloc(arena->side, new_nside * sizeof(*side));
+    if (side == NULL)
+        return -1;
+    arena->side = side;
+    arena->nside = new_nside;
+    return 0;
+}
+
+static ssize_t compact_items(struct SchemaArena *arena,
+                             size_t              nitems,
+                             const uint8_t      *typeid,
+                             struct Value       *value)
+{
+    size_t   i, nside = 0;
+    uint32_t u;
+
+    for (i = 0; i != nitems; i++) {
+        struct Value v;
+
+        memcpy(&v, value + i, sizeof(v));
+        switch (typeid[i]) {
+        case LongValue:
+        case UlongValue:
+            if (typeid[i] == LongValue &&
+                v.ival >= -(INT64_C(1) << 30) && v.ival < (INT64_C(1) << 30)) {
+                u = (uint32_t)v.ival << 1;
+                break;
+            }
+            /* fallthrough */
+        case FloatValue:
+        case DoubleValue:
+            if (nside == arena->nside &&
+                arena_side_reserve(arena, nside + 1) != 0)
+                return -1;
+            arena->side[nside] = v;
+            u = (uint32_t)(nside++ << 1) | 1;
+            break;
+        case StringValue:
+        case BinValue:
+        case ExtValue:
+        case ArrayValue:
+        case MapValue:
+        case RawValue:
+        case CopyCommand:
+            /* CopyCommand-s reference bank2, might not fit */
+            if (v.xlen > UINT16_MAX || v.xoff > UINT16_MAX)
+                return -1;
+            u = v.xlen | (uint32_t)v.xoff << 16;
+            break;
+        default:
+            u = 0;
+        }
+        memcpy((uint8_t *)value + i * sizeof(u), &u, sizeof(u));
+    }
+    return nitems;
+}
+
+/* Expand compact items [i, i + n) into value. */
+static void expand_items(size_t                     n,
+                         const uint8_t             *typeid,
+                         const struct CompactValue *cvalue,
+                         const struct Value        *side,
+                         struct Value              *value)
+{
+    size_t i;
+
+    for (i = 0; i != n; i++) {
+        uint32_t u = cvalue[i].u;
+
+        switch (typeid[i]) {
+        case StringValue:
+        case BinValue:
+        case ExtValue:
+        case ArrayValue:
+        case MapValue:
+        case RawValue:
+        case CopyCommand:
+            value[i].xlen = cvalue[i].xlen;
+            value[i].xoff = cvalue[i].xoff;
+            break;
+        default:
+            if (u & 1)
+                value[i] = side[u >> 1];
+            else
+                value[i].ival = (int32_t)u >> 1;
+        }
+    }
+}
+
+ssize_t preprocess_msgpack_compact(struct SchemaArena   *arena,
+                                   const uint8_t        *mi,
+                                   size_t                ms,
+                                   uint8_t             **typeid_out,
+                                   struct CompactValue **value_out,
+                                   struct Value        **side_out)
+{
+    ssize_t rc;
+
+    if (ms > COMPACT_MAX_SIZE)
+        return -2;
+    arena->pb.limit = arena_limit(arena, arena_ob_footprint(arena));
+    rc = preprocess_doc(mi, ms, &arena->pb, 0, NULL);
+    if (rc >= 0)
+        rc = compact_items(arena, rc, arena->pb.typeid_buf,
+                           arena->pb.value_buf);
+    arena_update_high_water(arena);
+    if (rc < 0)
+        return -1;
+    *typeid_out = arena->pb.typeid_buf;
+    *value_out = (struct CompactValue *)arena->pb.value_buf;
+    *side_out = arena->side;
+    return rc;
+}
+
+ssize_t create_msgpack_compact(struct SchemaArena        *arena,
+                               size_t                     nitems,
+                               const uint8_t             *typeid,
+                               const struct CompactValue *cvalue,
+                               const struct Value        *side,
+                               const uint8_t             *bank1,
+                               const uint8_t             *bank2,
+                               uint8_t                  **msgpack_out)
+{
+    struct Value value[COMPACT_CHUNK];
+    size_t       i, n;
+    ssize_t      rc = 0;
+
+    arena->ob.limit = arena_limit(arena, arena_pb_footprint(arena));
+    for (i = 0; i < nitems; i += n) {
+        n = nitems - i < COMPACT_CHUNK ? nitems - i : COMPACT_CHUNK;
+        expand_items(n, typeid + i, cvalue + i, side, value);
+        rc = encode_items(n, typeid + i, value, bank1, bank2,
+                          &arena->ob, (size_t)rc);
+        if (rc < 0)
+            break;
+    }
+    arena_update_high_water(arena);
+    if (rc < 0)
+        return -1;
+    *msgpack_out = arena->ob.out_buf;
+    return rc;
+}
+
+ssize_t create_msgpack_arena(struct SchemaArena *arena,
+                             size_t              nitems,
+                             const uint8_t      *typeid,
+                             const struct Value *value,
+                             const uint8_t      *bank1,
+                             const uint8_t      *bank2,
+                             uint8_t           **msgpack_out)
+{
+    ssize_t rc;
+
+    arena->ob.limit = arena_limit(arena, arena_pb_footprint(arena));
+    rc = encode_items(nitems, typeid, value, bank1, bank2, &arena->ob, 0);
+    arena_update_high_water(arena);
+    if (rc < 0)
+        return -1;
+    *msgpack_out = arena->ob.out_buf;
+    return rc;
+}
+
+/*
+ * Scatter-gather
+ *
+ * Items are encoded in runs by encode_items, a run ends with the
+ * header of a long payload; the payload itself becomes an iovec
+ * pointing into the bank.  The output buffer might move, iovec-s
+ * of its segments keep offsets until the end.  Fixext 1 - 8 are
+ * inlined by encode_core, these are shorter than the threshold.
+ */
+#define IOV_MIN_PAYLOAD 16
+
+static int iov_payload(uint8_t tid, const struct Value *v, size_t threshold)
+{
+    switch (tid) {
+    case StringValue:
+    case BinValue:
+    case ExtValue:
+    case RawValue:
+    case CopyCommand:
+        return v->xlen >= threshold;
+    }
+    return 0;
+}
+
+/* Header of a payload, as encode_core writes it; returns the size. */
+static size_t encode_payload_header(uint8_t tid, uint32_t xlen, uint8_t *out)
+{
+    switch (tid) {
+    case StringValue:
+        if (xlen <= 31) {
+            out[0] = 0xa0 + (uint8_t)xlen;
+            return 1;
+        }
+        if (xlen <= UINT8_MAX) {
+            out[0] = 0xd9;
+            out[1] = (uint8_t)xlen;
+            return 2;
+        }
+        if (xlen <= UINT16_MAX) {
+            out[0] = 0xda;
+            unaligned(out + 1)->u16 = host2net16((uint16_t)xlen);
+            return 3;
+        }
+        out[0] = 0xdb;
+        unaligned(out + 1)->u32 = host2net32(xlen);
+        return 5;
+    case BinValue:
+        if (xlen <= UINT8_MAX) {
+            out[0] = 0xc4;
+            out[1] = (uint8_t)xlen;
+            return 2;
+        }
+        if (xlen <= UINT16_MAX) {
+            out[0] = 0xc5;
+            unaligned(out + 1)->u16 = host2net16((uint16_t)xlen);
+            return 3;
+        }
+        out[0] = 0xc6;
+        unaligned(out + 1)->u32 = host2net32(xlen);
+        return 5;
+    case ExtValue:
+        if (xlen == 17) {
+            out[0] = 0xd8; /* fixext 16 */
+            return 1;
+        }
+        if (xlen - 1 <= UINT8_MAX) {
+            out[0] = 0xc7;
+            out[1] = (uint8_t)(xlen - 1);
+            return 2;
+        }
+        if (xlen - 1 <= UINT16_MAX) {
+            out[0] = 0xc8;
+            unaligned(out + 1)->u16 = host2net16((uint16_t)(xlen - 1));
+            return 3;
+        }
+        out[0] = 0xc9;
+        unaligned(out + 1)->u32 = host2net32(xlen - 1);
+        return 5;
+    }
+    return 0; /* already encoded */
+}
+
+/* Room for n bytes at pos plus the 10 encode_core expects. */
+static int output_buf_room(struct OutputBuf *ob, size_t pos, size_t n)
+{
+    size_t   capacity = ob->out_max - ob->out_buf;
+    size_t   new_capacity = capacity + capacity / 2;
+    uint8_t *new_out_buf;
+
+    if (pos + n + 10 <= capacity)
+        return 0;
+    if (new_capacity < pos + n + 10)
+        new_capacity = pos + n + 10;
+    if (ob->limit != 0 && new_capacity > ob->limit)
+        return -1;
+    new_out_buf = realloc_wrap(ob->out_buf, new_capacity, ob->stock_buf,
+                               capacity);
+    if (new_out_buf == NULL)
+        return -1;
+    ob->out_buf = new_out_buf;
+    ob->out_max = new_out_buf + new_capacity;
+    return 0;
+}
+
+static int arena_iov_reserve(struct SchemaArena *arena, size_t n)
+{
+    size_t        limit;
+    struct iovec *iov;
+
+    if (n <= arena->niov)
+        return 0;
+    limit = arena_limit(arena, arena_pb_footprint(arena) +
+                               arena_ob_footprint(arena));
+    if (limit != 0 && n * sizeof(*iov) > limit)
+        return -1;
+    iov = realloc(arena->iov, n * sizeof(*iov));
+    if (iov == NULL)
+        return -1;
+    arena->iov = iov;
+    arena->niov = n;
+    return 0;
+}
+
+ssize_t create_msgpack_iov(struct SchemaArena *arena,
+                           size_t              nitems,
+                           const uint8_t      *typeid,
+                           const struct Value *value,
+                           const uint8_t      *bank1,
+                           const uint8_t      *bank2,
+                           size_t              threshold,
+                           struct iovec      **iov_out,
+                           size_t             *size_out)
+{
+    struct OutputBuf *ob = &arena->ob;
+    struct iovec     *iov;
+    size_t            i, k, start = 0, seg = 0, pos = 0, size = 0;
+    size_t            nlong = 0, niov = 0;
+    ssize_t           rc;
+
+    if (threshold < IOV_MIN_PAYLOAD)
+        threshold = IOV_MIN_PAYLOAD;
+    for (i = 0; i != nitems; i++)
+        nlong += iov_payload(typeid[i], value + i, threshold);
+    /* segments of the buffer alternate with payloads */
+    if (arena_iov_reserve(arena, 2 * nlong + 1) != 0)
+        goto error;
+    iov = arena->iov;
+    ob->limit = arena_limit(arena, arena_pb_footprint(arena) +
+                                   arena->niov * sizeof(*iov));
+    for (i = 0; i != nitems; i++) {
+        const uint8_t *bank = typeid[i] == CopyCommand ? bank2 : bank1;
+
+        if (!iov_payload(typeid[i], value + i, threshold))
+            continue;
+        rc = encode_items(i - start, typeid + start, value + start,
+                          bank1, bank2, ob, pos);
+        if (rc < 0 || output_buf_room(ob, (size_t)rc, 5) != 0)
+            goto error;
+        pos = (size_t)rc;
+        pos += encode_payload_header(typeid[i], value[i].xlen,
+                                     ob->out_buf + pos);
+        iov[niov].iov_base = (void *)(uintptr_t)seg;
+        iov[niov++].iov_len = pos - seg;
+        iov[niov].iov_base = (void *)(bank - value[i].xoff);
+        iov[niov++].iov_len = value[i].xlen;
+        size += value[i].xlen;
+        seg = pos;
+        start = i + 1;
+    }
+    rc = encode_items(nitems - start, typeid + start, value + start,
+                      bank1, bank2, ob, pos);
+    if (rc < 0)
+        goto error;
+    pos = (size_t)rc;
+    iov[niov].iov_base = (void *)(uintptr_t)seg;
+    iov[niov++].iov_len = pos - seg;
+    /* offsets to pointers, empty segments dropped */
+    for (i = k = 0; i != niov; i++) {
+        if (i % 2 == 0) {
+            if (iov[i].iov_len == 0)
+                continue;
+            iov[i].iov_base = ob->out_buf + (uintptr_t)iov[i].iov_base;
+        }
+        iov[k++] = iov[i];
+    }
+    arena_update_high_water(arena);
+    *iov_out = iov;
+    *size_out = size + pos;
+    return k;
+error:
+    arena_update_high_water(arena);
+    return -1;
+}
+
+ssize_t preprocess_msgpack_batch_arena(struct SchemaArena *arena,
+                                       size_t              ndocs,
+                                       const struct Doc   *docs,
+                                       uint8_t           **typeid_out,
+                                       struct Value      **value_out,
+                                       uint32_t           *offsets)
+{
+    ssize_t pos;
+
+    arena->pb.limit = arena_limit(arena, arena_ob_footprint(arena));
+    pos = preprocess_docs(ndocs, docs, &arena->pb, offsets);
+    arena_update_high_water(arena);
+    if (pos < 0)
+        return -1;
+    *typeid_out = arena->pb.typeid_buf;
+    *value_out = arena->pb.value_buf;
+    return pos;
+}
+
+ssize_t create_msgpack_batch_arena(struct SchemaArena *arena,
+                                   size_t              ndocs,
+                                   const uint8_t      *typeid,
+                                   const struct Value *value,
+                                   const uint32_t     *offsets,
+                                   const struct Doc   *docs,
+                                   const uint8_t      *bank2,
+                                   uint8_t           **msgpack_out,
+                                   uint32_t           *out_offsets)
+{
+    ssize_t pos;
+
+    arena->ob.limit = arena_limit(arena, arena_pb_footprint(arena));
+    pos = encode_docs(ndocs, typeid, value, offsets, docs, bank2,
+                      &arena->ob, out_offsets);
+    arena_update_high_water(arena);
+    if (pos < 0)
+        return -1;
+    *msgpack_out = arena->ob.out_buf;
+    return pos;
+}
+
+/*
+ * Native flattener
+ *
+ * A schema program (built by schema_compile.lua) drives a C
+ * counterpart of the generated Lua flattener.  It is meant for bulk
+ * conversion on a worker pool, see flatten_batch_mt.
+ *
+ * Every field is a node; the node index doubles as a register
+ * holding the index of the field's value in the preprocessed data
+ * (0 - not seen yet).  Records list their fields in schema order in
+ * fields[] and their keys (names and aliases) in keys[].  Enums list
+ * their symbols in keys[], key id is the symbol index then.
+ */
+
+static int schema_key_cmp(const void *a, const void *b)
+{
+    const struct SchemaKey *ka = a, *kb = b;
+    if (ka->len != kb->len)
+        return ka->len < kb->len ? -1 : 1;
+    return memcmp(ka->str, kb->str, ka->len);
+}
+
+void schema_program_prepare(struct SchemaProgram *prog)
+{
+    uint32_t i;
+    for (i = 0; i != prog->nnodes; i++) {
+        const struct SchemaNode *node = &prog->nodes[i];
+        if (node->nkeys > 1)
+            qsort(prog->keys + node->first_key, node->nkeys,
+                  sizeof(prog->keys[0]), schema_key_cmp);
+    }
+}
+
+static const struct SchemaKey *schema_key_lookup(
+    const struct SchemaProgram *prog, const struct SchemaNode *node,
+    const uint8_t *str, uint32_t len)
+{
+    struct SchemaKey key;
+    key.str = str;
+    key.len = len;
+    return bsearch(&key, prog->keys + node->first_key, node->nkeys,
+                   sizeof(key), schema_key_cmp);
+}
+
+/*
+ * Projection
+ *
+ * Maps of record nodes are scanned pair by pair.  A value of a field
+ * marked skip is stepped over without emitting items: a skip only
+ * walks headers, no stack either since a count of pending items is
+ * enough.  Values of other fields recurse (records) or go through
+ * preprocess_doc; so do values of unknown keys, the flattener
+ * reports these.
+ */
+
+/* Returns the pointer past the value or NULL if data is malformed. */
+static const uint8_t *msgpack_skip(const uint8_t *mi, const uint8_t *me)
+{
+    uint64_t todo = 1;
+
+    do {
+        struct Value value;
+        uint8_t      typeid;
+        uint32_t     len;
+        size_t       hs;
+
+        if (mi == me)
+            return NULL;
+        if (*mi < 0x80 || *mi >= 0xe0) {
+            mi++;
+            continue;
+        }
+        hs = *mi < 0xc0 ? 1 : header_size[*mi - 0xc0];
+        if ((size_t)(me - mi) < hs)
+            return NULL;
+        switch (decode_header(mi, &typeid, &value, &len)) {
+        case HDR_SCALAR:
+            mi += hs;
+            break;
+        case HDR_XDATA:
+            if ((size_t)(me - mi) - hs < len)
+                return NULL;
+            mi += hs + len;
+            break;
+        case HDR_NESTED:
+            todo += len;
+            mi += hs;
+            break;
+        default:
+            return NULL;
+        }
+    } while (--todo != 0);
+    return mi;
+}
+
+/* Ensure room for an item at pos. */
+static int preproc_buf_reserve(struct PreprocBuf *pb, size_t pos)
+{
+    size_t        capacity = pb->typeid_max - pb->typeid_buf;
+    size_t        new_capacity = capacity + capacity / 2;
+    uint8_t      *new_typeid_buf;
+    struct Value *new_value_buf;
+
+    if (pos < capacity)
+        return 0;
+    if (pb->limit != 0 &&
+        preproc_buf_footprint(new_capacity,
+                              pb->stack_max - pb->stack_buf) > pb->limit)
+        return -1;
+    new_typeid_buf = realloc_wrap(pb->typeid_buf, new_capacity,
+                                  pb->stock_typeid_buf, capacity);
+    if (new_typeid_buf == NULL)
+        return -1;
+    pb->typeid_buf = new_typeid_buf;
+    pb->typeid_max = new_typeid_buf + new_capacity;
+    new_value_buf = realloc_wrap(pb->value_buf,
+                                 new_capacity * sizeof(struct Value),
+                                 pb->stock_value_buf,
+                                 capacity * sizeof(struct Value));
+    if (new_value_buf == NULL)
+        return -1;
+    pb->value_buf = new_value_buf;
+    return 0;
+}
+
+/*
+ * Preprocess a value of node id at *pmi, advancing *pmi.  Returns the
+ * index past the last item or one of PREPROC_BAD_DATA,
+ * PREPROC_NO_MEMORY (see preprocess_doc).
+ */
+static ssize_t project_value(const struct SchemaProgram *prog, uint32_t id,
+                             const uint8_t **pmi, const uint8_t *me,
+                             struct PreprocBuf *pb, size_t pos)
+{
+    const struct SchemaNode *node = prog->nodes + id;
+    const uint8_t           *mi = *pmi;
+    uint32_t                 npairs, k;
+    size_t                   map;
+    ssize_t                  rc;
+
+    if (node->kind != NODE_RECORD || mi == me)
+        goto plain;
+    switch (*mi) {
+    case 0x80 ... 0x8f:
+        npairs = *mi - 0x80;
+        mi += 1;
+        break;
+    case 0xde:
+        if (me - mi < 3)
+            return PREPROC_BAD_DATA;
+        npairs = net2host16(unaligned(mi + 1)->u16);
+        mi += 3;
+        break;
+    case 0xdf:
+        if (me - mi < 5)
+            return PREPROC_BAD_DATA;
+        npairs = net2host32(unaligned(mi + 1)->u32);
+        mi += 5;
+        break;
+    default:
+        /* not a map, let the flattener complain */
+        goto plain;
+    }
+
+    if (preproc_buf_reserve(pb, pos) != 0)
+        return PREPROC_NO_MEMORY;
+    map = pos++;
+    pb->typeid_buf[map] = MapValue;
+    pb->value_buf[map].xlen = npairs;
+
+    for (k = 0; k != npairs; k++) {
+        const struct SchemaKey *key = NULL;
+        size_t                  key_pos = pos;
+
+        rc = preprocess_doc(mi, me - mi, pb, pos, &mi);
+        if (rc < 0)
+            return rc;
+        pos = rc;
+        if (pb->typeid_buf[key_pos] == StringValue) {
+            const struct Value *kv = pb->value_buf + key_pos;
+            key = schema_key_lookup(prog, node, me - kv->xoff, kv->xlen);
+        }
+
+        if (key != NULL && prog->nodes[key->id].skip) {
+            const uint8_t *end = msgpack_skip(mi, me);
+            if (end == NULL)
+                return PREPROC_BAD_DATA;
+            if (preproc_buf_reserve(pb, pos) != 0)
+                return PREPROC_NO_MEMORY;
+            pb->typeid_buf[pos] = RawValue;
+            pb->value_buf[pos].xlen = end - mi;
+            pb->value_buf[pos].xoff = me - mi;
+            pos++;
+            mi = end;
+            continue;
+        }
+        if (key != NULL)
+            rc = project_value(prog, key->id, &mi, me, pb, pos);
+        else
+            rc = preprocess_doc(mi, me - mi, pb, pos, &mi);
+        if (rc < 0)
+            return rc;
+        pos = rc;
+    }
+
+    pb->value_buf[map].xoff = pos - map;
+    *pmi = mi;
+    return pos;
+
+plain:
+    return preprocess_doc(mi, me - mi, pb, pos, pmi);
+}
+
+ssize_t preprocess_msgpack_projected(struct SchemaArena         *arena,
+                                     const struct SchemaProgram *prog,
+                                     const uint8_t              *mi,
+                                     size_t                      ms,
+                                     uint8_t                   **typeid_out,
+                                     struct Value              **value_out)
+{
+    ssize_t rc;
+
+    arena->pb.limit = arena_limit(arena, arena_ob_footprint(arena));
+    rc = project_value(prog, prog->root, &mi, mi + ms, &arena->pb, 0);
+    arena_update_high_water(arena);
+    if (rc < 0)
+        return -1;
+    *typeid_out = arena->pb.typeid_buf;
+    *value_out = arena->pb.value_buf;
+    return rc;
+}
+
+ssize_t preprocess_msgpack_batch_projected(struct SchemaArena         *arena,
+                                           const struct SchemaProgram *prog,
+                                           size_t                      ndocs,
+                                           const struct Doc           *docs,
+                                           uint8_t                   **typeid_out,
+                                           struct Value              **value_out,
+                                           uint32_t                   *offsets)
+{
+    size_t i, pos = 0;
+
+    arena->pb.limit = arena_limit(arena, arena_ob_footprint(arena));
+    for (i = 0; i != ndocs; i++) {
+        const uint8_t *mi = docs[i].data;
+        ssize_t rc = project_value(prog, prog->root, &mi,
+                                   mi + docs[i].size, &arena->pb, pos);
+        offsets[i] = (uint32_t)pos;
+        if (rc == PREPROC_NO_MEMORY || rc > UINT32_MAX) {
+            arena_update_high_water(arena);
+            return -1;
+        }
+        if (rc >= 0)
+            pos = (size_t)rc;
+        /* else an empty range marks a bad document */
+    }
+    offsets[ndocs] = (uint32_t)pos;
+    arena_update_high_water(arena);
+
+    *typeid_out = arena->pb.typeid_buf;
+    *value_out = arena->pb.value_buf;
+    return pos;
+}
+
+/*
+ * Maps
+ *
+ * FNV-1a over the key bytes, folded to 32 bits.  Keys are short as a
+ * rule, it's the probing that must be cheap: the load stays below 2/3
+ * and buckets are scanned linearly.
+ */
+
+#define MAP_KEY_NOT_STR (-1)
+#define MAP_DUP_KEY     (-2)
+#define MAP_TOO_BIG     (-3)
+#define MAP_MAX_PAIRS   (UINT32_MAX / 4)
+
+uint32_t map_key_hash(const uint8_t *key, uint32_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t i;
+    for (i = 0; i != len; i++) {
+        h ^= key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+uint32_t map_buckets(uint32_t npairs)
+{
+    uint64_t min = (uint64_t)npairs + npairs / 2;
+    uint32_t nbuckets = 1;
+    if (npairs == 0 || npairs > MAP_MAX_PAIRS)
+        return 0;
+    while (nbuckets <= min)
+        nbuckets *= 2;
+    return nbuckets;
+}
+
+ssize_t map_hash_order(const uint8_t      *typeid,
+                       const struct Value *value,
+                       size_t              map,
+                       const uint8_t      *bank1,
+                       uint32_t           *order)
+{
+    uint32_t npairs = value[map].xlen;
+    uint32_t nbuckets = map_buckets(npairs);
+    uint32_t mask = nbuckets - 1, k;
+    size_t   i = map + 1;
+
+    if (npairs > MAP_MAX_PAIRS)
+        return MAP_TOO_BIG;
+    if (nbuckets != 0)
+        memset(order, 0, nbuckets * sizeof(order[0]));
+    for (k = 0; k != npairs; k++) {
+        const uint8_t *key = bank1 - value[i].xoff;
+        uint32_t       len = value[i].xlen, b;
+
+        if (typeid[i] != StringValue)
+            return MAP_KEY_NOT_STR;
+        for (b = map_key_hash(key, len) & mask; order[b] != 0;
+             b = (b + 1) & mask) {
+            const struct Value *other = value + order[b];
+            if (other->xlen == len &&
+                memcmp(bank1 - other->xoff, key, len) == 0)
+                return MAP_DUP_KEY;
+        }
+        order[b] = (uint32_t)i;
+
+        /* next key */
+        i++;
+        if (typeid[i] == ArrayValue || typeid[i] == MapValue)
+            i += value[i].xoff;
+        else
+            i++;
+    }
+    return nbuckets;
+}
+
+/* Per-thread scratch buffers, persist between calls. */
+struct NativeScratch {
+    struct PreprocBuf  pb;
+    uint8_t           *ot;
+    struct Value      *ov;
+    size_t             ocap;
+    uint32_t          *regs;
+    size_t             nregs;
+    struct OutputBuf   out;
+    size_t             out_len;
+};
+
+/* State of a single document being flattened. */
+struct NativeDoc {
+    const struct SchemaProgram *prog;
+    struct NativeScratch       *s;
+    const uint8_t              *data;
+    const uint8_t              *b1;
+    struct DocError            *err;
+};
+
+static int native_error(struct NativeDoc *d, uint32_t code, uint32_t node,
+                        uint32_t aux1, uint32_t aux2)
+{
+    d->err->code = code;
+    d->err->node = node;
+    d->err->aux1 = aux1;
+    d->err->aux2 = aux2;
+    d->err->offset = 0;
+    return -1;
+}
+
+static int native_check_leaf(const struct SchemaNode *node,
+                             uint8_t tid, const struct Value *value)
+{
+    if (tid >= 32 || !(node->accept & (1u << tid)))
+        return NATIVE_ERR_TYPE;
+    if (node->size != UINT32_MAX && value->xlen != node->size)
+        return NATIVE_ERR_SIZE;
+    return 0;
+}
+
+/* Assign registers for the fields of record rec (map at item m). */
+static int native_scan(struct NativeDoc *d, uint32_t rec, uint32_t m)
+{
+    const struct SchemaProgram *prog = d->prog;
+    const struct SchemaNode    *node = &prog->nodes[rec];
+    const uint8_t              *t = d->s->pb.typeid_buf;
+    const struct Value         *v = d->s->pb.value_buf;
+    uint32_t                   *regs = d->s->regs;
+    uint32_t                    i = m + 1, end = m + v[m].xoff;
+
+    while (i != end) {
+        const struct SchemaKey  *key;
+        const struct SchemaNode *fn;
+        const uint8_t           *ks;
+        uint32_t                 f, val = i + 1;
+        int                      rc;
+
+        if (t[i] != StringValue)
+            return native_error(d, NATIVE_ERR_KEY_NOT_STR, rec, 0, 0);
+        ks = d->b1 - v[i].xoff;
+        key = schema_key_lookup(prog, node, ks, v[i].xlen);
+        if (key == NULL)
+            return native_error(d, NATIVE_ERR_UNKNOWN_KEY, rec,
+                                (uint32_t)(ks - d->data), v[i].xlen);
+        f = key->id;
+        fn = &prog->nodes[f];
+
+        switch (fn->kind) {
+        case NODE_RECORD:
+            if (t[val] != MapValue)
+                return native_error(d, NATIVE_ERR_TYPE, f, 0, 0);
+            break;
+        case NODE_ARRAY:
+            if (t[val] != ArrayValue)
+                return native_error(d, NATIVE_ERR_TYPE, f, 0, 0);
+            break;
+        case NODE_ENUM:
+            if (t[val] != StringValue)
+                return native_error(d, NATIVE_ERR_TYPE, f, 0, 0);
+            break;
+        default:
+            rc = native_check_leaf(fn, t[val], &v[val]);
+            if (rc != 0)
+                return native_error(d, rc, f, 0, 0);
+        }
+        if (regs[f] != 0)
+            return native_error(d, NATIVE_ERR_DUP, f, 0, 0);
+        regs[f] = val;
+
+        if (fn->kind == NODE_RECORD) {
+            if (native_scan(d, f, val) != 0)
+                return -1;
+        }
+        i = (t[val] == MapValue || t[val] == ArrayValue) ?
+            val + v[val].xoff : val + 1;
+    }
+    return 0;
+}
+
+static int native_reserve(struct NativeScratch *s, size_t n)
+{
+    uint8_t      *ot;
+    struct Value *ov;
+    size_t        cap;
+
+    if (n <= s->ocap)
+        return 0;
+    cap = n + n / 2;
+    ot = realloc(s->ot, cap * sizeof(ot[0]));
+    if (ot == NULL)
+        return -1;
+    s->ot = ot;
+    ov = realloc(s->ov, cap * sizeof(ov[0]));
+    if (ov == NULL)
+        return -1;
+    s->ov = ov;
+    s->ocap = cap;
+    return 0;
+}
+
+static int native_symbol(struct NativeDoc *d, const struct SchemaNode *node,
+                         const struct Value *value, uint64_t *index)
+{
+    const struct SchemaKey *key;
+    key = schema_key_lookup(d->prog, node, d->b1 - value->xoff, value->xlen);
+    if (key == NULL)
+        return -1;
+    *index = key->id;
+    return 0;
+}
+
+static void native_copy_leaf(const struct SchemaNode *node,
+                             uint8_t *ot, struct Value *ov,
+                             uint8_t tid, const struct Value *value)
+{
+    if (node->conv) {
+        *ot = node->tid;
+        ov->dval = tid == LongValue ? (double)value->ival : value->dval;
+    } else if (node->tid == 0) {
+        *ot = tid;
+        *ov = *value;
+    } else {
+        *ot = node->tid;
+        ov->uval = value->uval;
+    }
+}
+
+/* Emit slots for the fields of record rec, o - output position. */
+static int native_emit(struct NativeDoc *d, uint32_t rec, size_t *o)
+{
+    const struct SchemaProgram *prog = d->prog;
+    const struct SchemaNode    *node = &prog->nodes[rec];
+    struct NativeScratch       *s = d->s;
+    const uint8_t              *t = s->pb.typeid_buf;
+    const struct Value         *v = s->pb.value_buf;
+    uint32_t                    k;
+
+    for (k = 0; k != node->count; k++) {
+        uint32_t                 f = prog->fields[node->first + k];
+        uint32_t                 src = s->regs[f];
+        const struct SchemaNode *fn = &prog->nodes[f];
+
+        if (src == 0)
+            return native_error(d, NATIVE_ERR_MISSING, f, 0, 0);
+
+        if (fn->kind == NODE_RECORD) {
+            if (native_emit(d, f, o) != 0)
+                return -1;
+            continue;
+        }
+        if (fn->kind == NODE_ARRAY) {
+            const struct SchemaNode *in = &prog->nodes[fn->first];
+            uint32_t                 n = v[src].xlen, j;
+            size_t                   base = *o;
+            int                      rc;
+
+            if (native_reserve(s, base + n + 1) != 0)
+                return native_error(d, NATIVE_ERR_NO_MEMORY, f, 0, 0);
+            s->ot[base] = ArrayValue;
+            s->ov[base].xlen = n;
+            for (j = 1; j <= n; j++) {
+                if (in->kind == NODE_ENUM) {
+                    if (t[src + j] != StringValue)
+                        return native_error(d, NATIVE_ERR_ITEM_TYPE, f, j, 0);
+                    if (native_symbol(d, in, &v[src + j],
+                                      &s->ov[base + j].uval) != 0)
+                        return native_error(d, NATIVE_ERR_ITEM_ENUM, f, j, 0);
+                    s->ot[base + j] = LongValue;
+                    continue;
+                }
+                rc = native_check_leaf(in, t[src + j], &v[src + j]);
+                if (rc != 0)
+                    return native_error(d, rc == NATIVE_ERR_TYPE ?
+                                        NATIVE_ERR_ITEM_TYPE :
+                                        NATIVE_ERR_ITEM_SIZE, f, j, 0);
+                native_copy_leaf(in, &s->ot[base + j], &s->ov[base + j],
+                                 t[src + j], &v[src + j]);
+            }
+            *o = base + n + 1;
+            continue;
+        }
+        if (native_reserve(s, *o + 1) != 0)
+            return native_error(d, NATIVE_ERR_NO_MEMORY, f, 0, 0);
+        if (fn->kind == NODE_ENUM) {
+            if (native_symbol(d, fn, &v[src], &s->ov[*o].uval) != 0)
+                return native_error(d, NATIVE_ERR_ENUM, f, 0, 0);
+            s->ot[*o] = LongValue;
+        } else {
+            native_copy_leaf(fn, &s->ot[*o], &s->ov[*o], t[src], &v[src]);
+        }
+        ++*o;
+    }
+    return 0;
+}
+
+/*
+ * Flatten a document, appending the result to s->out.
+ * Returns 0 or -1 (details in err).
+ */
+static int native_flatten_doc(const struct SchemaProgram *prog,
+                              struct NativeScratch *s,
+                              const struct Doc *doc,
+                              struct DocError *err)
+{
+    struct NativeDoc d;
+    ssize_t          rc;
+    size_t           o = 1;
+
+    d.prog = prog;
+    d.s = s;
+    d.data = doc->data;
+    d.b1 = doc->data + doc->size;
+    d.err = err;
+
+    if (s->nregs < prog->nnodes) {
+        uint32_t *regs = realloc(s->regs, prog->nnodes * sizeof(regs[0]));
+        if (regs == NULL)
+            return native_error(&d, NATIVE_ERR_NO_MEMORY, 0, 0, 0);
+        s->regs = regs;
+        s->nregs = prog->nnodes;
+    }
+    memset(s->regs, 0, prog->nnodes * sizeof(s->regs[0]));
+
+    rc = preprocess_doc(doc->data, doc->size, &s->pb, 0, NULL);
+    if (rc == PREPROC_NO_MEMORY)
+        return native_error(&d, NATIVE_ERR_NO_MEMORY, 0, 0, 0);
+    if (rc < 0)
+        return native_error(&d, NATIVE_ERR_BAD_DATA, 0, 0, 0);
+
+    if (s->pb.typeid_buf[0] != MapValue)
+        return native_error(&d, NATIVE_ERR_TYPE, prog->root, 0, 0);
+    if (native_scan(&d, prog->root, 0) != 0)
+        return -1;
+
+    if (native_reserve(s, 1) != 0)
+        return native_error(&d, NATIVE_ERR_NO_MEMORY, 0, 0, 0);
+    s->ot[0] = ArrayValue;
+    s->ov[0].xlen = prog->nslots;
+    if (native_emit(&d, prog->root, &o) != 0)
+        return -1;
+
+    rc = encode_items(o, s->ot, s->ov, d.b1, NULL, &s->out, s->out_len);
+    if (rc < 0)
+        return native_error(&d, rc == CREATE_NO_MEMORY ?
+                            NATIVE_ERR_NO_MEMORY : NATIVE_ERR_BAD_DATA, 0, 0, 0);
+    s->out_len = (size_t)rc;
+    return 0;
+}
+
+/*
+ * Validation
+ *
+ * Same walk as project_value, but every field is checked right after
+ * it is preprocessed.  Fields seen in the current document are marked
+ * in arena->seen (indexed by node) with the document's generation, a
+ * field node belongs to a single record which occurs at most once.
+ */
+struct Validator {
+    const struct SchemaProgram *prog;
+    struct PreprocBuf          *pb;
+    const uint8_t              *data, *me;
+    uint32_t                   *seen;
+    uint32_t                    gen;
+    struct DocError            *err;
+};
+
+static ssize_t validate_error(struct Validator *vd, uint32_t code,
+                              uint32_t node, uint32_t aux1, uint32_t aux2,
+                              const uint8_t *at)
+{
+    vd->err->code = code;
+    vd->err->node = node;
+    vd->err->aux1 = aux1;
+    vd->err->aux2 = aux2;
+    vd->err->offset = (uint32_t)(at - vd->data);
+    return code == NATIVE_ERR_NO_MEMORY ? PREPROC_NO_MEMORY : PREPROC_BAD_DATA;
+}
+
+/* Failed preprocess_doc, rc is the error. */
+static ssize_t validate_failed(struct Validator *vd, ssize_t rc,
+                               const uint8_t *at)
+{
+    return validate_error(vd, rc == PREPROC_NO_MEMORY ?
+                          NATIVE_ERR_NO_MEMORY : NATIVE_ERR_BAD_DATA,
+                          0, 0, 0, at);
+}
+
+/* Check the item at pos (not a record), value starts at 'at'. */
+static ssize_t validate_item(struct Validator *vd, uint32_t id, size_t pos,
+                             const uint8_t *at)
+{
+    const struct SchemaProgram *prog = vd->prog;
+    const struct SchemaNode    *node = &prog->nodes[id], *in;
+    const uint8_t              *t = vd->pb->typeid_buf + pos;
+    const struct Value         *v = vd->pb->value_buf + pos;
+    uint32_t                    j;
+    int                         rc;
+
+    switch (node->kind) {
+    case NODE_LEAF:
+        rc = native_check_leaf(node, t[0], &v[0]);
+        if (rc != 0)
+            return validate_error(vd, rc, id, 0, 0, at);
+        return 0;
+    case NODE_ENUM:
+        if (t[0] != StringValue)
+            return validate_error(vd, NATIVE_ERR_TYPE, id, 0, 0, at);
+        if (schema_key_lookup(prog, node, vd->me - v[0].xoff,
+                              v[0].xlen) == NULL)
+            return validate_error(vd, NATIVE_ERR_ENUM, id, 0, 0, at);
+        return 0;
+    case NODE_ARRAY:
+        if (t[0] != ArrayValue)
+            return validate_error(vd, NATIVE_ERR_TYPE, id, 0, 0, at);
+        /* items are scalars until the first bad one */
+        in = &prog->nodes[node->first];
+        for (j = 1; j <= v[0].xlen; j++) {
+            if (in->kind == NODE_ENUM) {
+                if (t[j] != StringValue)
+                    return validate_error(vd, NATIVE_ERR_ITEM_TYPE,
+                                          id, j, 0, at);
+                if (schema_key_lookup(prog, in, vd->me - v[j].xoff,
+                                      v[j].xlen) == NULL)
+                    return validate_error(vd, NATIVE_ERR_ITEM_ENUM,
+                                          id, j, 0, at);
+                continue;
+            }
+            rc = native_check_leaf(in, t[j], &v[j]);
+            if (rc != 0)
+                return validate_error(vd, rc == NATIVE_ERR_TYPE ?
+                                      NATIVE_ERR_ITEM_TYPE :
+                                      NATIVE_ERR_ITEM_SIZE, id, j, 0, at);
+        }
+        return 0;
+    }
+    /* unions, maps - checked by the Lua flattener */
+    return 0;
+}
+
+/*
+ * Preprocess and check a value of node id at *pmi, advancing *pmi.
+ * Returns the index past the last item or one of PREPROC_BAD_DATA,
+ * PREPROC_NO_MEMORY, vd->err tells the details.
+ */
+static ssize_t validate_value(struct Validator *vd, uint32_t id,
+                              const uint8_t **pmi, size_t pos)
+{
+    const struct SchemaProgram *prog = vd->prog;
+    const struct SchemaNode    *node = &prog->nodes[id];
+    struct PreprocBuf          *pb = vd->pb;
+    const uint8_t              *mi = *pmi, *me = vd->me, *start = mi;
+    uint32_t                    npairs, k;
+    size_t                      map;
+    ssize_t                     rc;
+
+    if (node->kind != NODE_RECORD) {
+        rc = preprocess_doc(mi, me - mi, pb, pos, pmi);
+        if (rc < 0)
+            return validate_failed(vd, rc, start);
+        if (validate_item(vd, id, pos, start) != 0)
+            return PREPROC_BAD_DATA;
+        return rc;
+    }
+
+    if (mi == me)
+        return validate_error(vd, NATIVE_ERR_BAD_DATA, 0, 0, 0, start);
+    switch (*mi) {
+    case 0x80 ... 0x8f:
+        npairs = *mi - 0x80;
+        mi += 1;
+        break;
+    case 0xde:
+        if (me - mi < 3)
+            return validate_error(vd, NATIVE_ERR_BAD_DATA, 0, 0, 0, start);
+        npairs = net2host16(unaligned(mi + 1)->u16);
+        mi += 3;
+        break;
+    case 0xdf:
+        if (me - mi < 5)
+            return validate_error(vd, NATIVE_ERR_BAD_DATA, 0, 0, 0, start);
+        npairs = net2host32(unaligned(mi + 1)->u32);
+        mi += 5;
+        break;
+    default:
+        return validate_error(vd, NATIVE_ERR_TYPE, id, 0, 0, start);
+    }
+
+    if (preproc_buf_reserve(pb, pos) != 0)
+        return validate_error(vd, NATIVE_ERR_NO_MEMORY, 0, 0, 0, start);
+    map = pos++;
+    pb->typeid_buf[map] = MapValue;
+    pb->value_buf[map].xlen = npairs;
+
+    for (k = 0; k != npairs; k++) {
+        const struct SchemaKey *key;
+        const struct Value     *kv;
+        const uint8_t          *kstart = mi, *ks;
+        size_t                  key_pos = pos;
+        uint32_t                f;
+
+        rc = preprocess_doc(mi, me - mi, pb, pos, &mi);
+        if (rc < 0)
+            return validate_failed(vd, rc, kstart);
+        pos = rc;
+        if (pb->typeid_buf[key_pos] != StringValue)
+            return validate_error(vd, NATIVE_ERR_KEY_NOT_STR, id, 0, 0, kstart);
+        kv = pb->value_buf + key_pos;
+        ks = me - kv->xoff;
+        key = schema_key_lookup(prog, node, ks, kv->xlen);
+        if (key == NULL)
+            return validate_error(vd, NATIVE_ERR_UNKNOWN_KEY, id,
+                                  (uint32_t)(ks - vd->data), kv->xlen, kstart);
+        f = key->id;
+        if (vd->seen[f] == vd->gen)
+            return validate_error(vd, NATIVE_ERR_DUP, f, 0, 0, kstart);
+        vd->seen[f] = vd->gen;
+
+        if (prog->nodes[f].skip) {
+            const uint8_t *end = msgpack_skip(mi, me);
+            if (end == NULL)
+                return validate_error(vd, NATIVE_ERR_BAD_DATA, 0, 0, 0, mi);
+            if (preproc_buf_reserve(pb, pos) != 0)
+                return validate_error(vd, NATIVE_ERR_NO_MEMORY, 0, 0, 0, mi);
+            pb->typeid_buf[pos] = RawValue;
+            pb->value_buf[pos].xlen = end - mi;
+            pb->value_buf[pos].xoff = me - mi;
+            pos++;
+            mi = end;
+            continue;
+        }
+        rc = validate_value(vd, f, &mi, pos);
+        if (rc < 0)
+            return rc;
+        pos = rc;
+    }
+
+    for (k = 0; k != node->count; k++) {
+        uint32_t f = prog->fields[node->first + k];
+        if (vd->seen[f] != vd->gen && !prog->nodes[f].optional)
+            return validate_error(vd, NATIVE_ERR_MISSING, f, 0, 0, start);
+    }
+
+    pb->value_buf[map].xoff = pos - map;
+    *pmi = mi;
+    return pos;
+}
+
+static int validator_init(struct Validator *vd, struct SchemaArena *arena,
+                          const struct SchemaProgram *prog)
+{
+    if (arena->nseen < prog->nnodes) {
+        uint32_t *seen = realloc(arena->seen, prog->nnodes * sizeof(seen[0]));
+        if (seen == NULL)
+            return -1;
+        memset(seen + arena->nseen, 0,
+               (prog->nnodes - arena->nseen) * sizeof(seen[0]));
+        arena->seen = seen;
+        arena->nseen = prog->nnodes;
+    }
+    vd->prog = prog;
+    vd->pb = &arena->pb;
+    vd->seen = arena->seen;
+    arena->pb.limit = arena_limit(arena, arena_ob_footprint(arena));
+    return 0;
+}
+
+/* Prepare for the next document. */
+static void validator_doc(struct Validator *vd, struct SchemaArena *arena,
+                          const uint8_t *data, size_t size,
+                          struct DocError *err)
+{
+    if (++arena->seen_gen == 0) {
+        memset(arena->seen, 0, arena->nseen * sizeof(arena->seen[0]));
+        arena->seen_gen = 1;
+    }
+    vd->gen = arena->seen_gen;
+    vd->data = data;
+    vd->me = data + size;
+    vd->err = err;
+    err->code = 0;
+}
+
+ssize_t validate_msgpack(struct SchemaArena         *arena,
+                         const struct SchemaProgram *prog,
+                         const uint8_t              *mi,
+                         size_t                      ms,
+                         uint8_t                   **typeid_out,
+                         struct Value              **value_out,
+                         struct DocError            *err)
+{
+    struct Validator vd;
+    ssize_t          rc;
+
+    if (validator_init(&vd, arena, prog) != 0) {
+        memset(err, 0, sizeof(*err));
+        err->code = NATIVE_ERR_NO_MEMORY;
+        return -1;
+    }
+    validator_doc(&vd, arena, mi, ms, err);
+    rc = validate_value(&vd, prog->root, &mi, 0);
+    arena_update_high_water(arena);
+    if (rc < 0)
+        return -1;
+    *typeid_out = arena->pb.typeid_buf;
+    *value_out = arena->pb.value_buf;
+    return rc;
+}
+
+ssize_t validate_msgpack_batch(struct SchemaArena         *arena,
+                               const struct SchemaProgram *prog,
+                               size_t                      ndocs,
+                               const struct Doc           *docs,
+                               uint8_t                   **typeid_out,
+                               struct Value              **value_out,
+                               uint32_t                   *offsets,
+                               struct DocError            *errors)
+{
+    struct Validator vd;
+    size_t           i, pos = 0;
+
+    if (validator_init(&vd, arena, prog) != 0)
+        return -1;
+    for (i = 0; i != ndocs; i++) {
+        const uint8_t *mi = docs[i].data;
+        ssize_t        rc;
+
+        validator_doc(&vd, arena, mi, docs[i].size, &errors[i]);
+        rc = validate_value(&vd, prog->root, &mi, pos);
+        offsets[i] = (uint32_t)pos;
+        if (rc == PREPROC_NO_MEMORY || rc > UINT32_MAX) {
+            arena_update_high_water(arena);
+            return -1;
+        }
+        if (rc >= 0)
+            pos = (size_t)rc;
+        /* else an empty range marks a bad document */
+    }
+    offsets[ndocs] = (uint32_t)pos;
+    arena_update_high_water(arena);
+
+    *typeid_out = arena->pb.typeid_buf;
+    *value_out = arena->pb.value_buf;
+    return pos;
+}
+
+/*
+ * Worker pool
+ *
+ * The calling thread acts as worker 0.  A batch is split into equal
+ * ranges, one per worker.  A worker takes documents from the front of
+ * its range; once the range is exhausted, it steals the back half of
+ * another worker's range.  A range is packed into a single atomic
+ * (lo | hi << 32), updated with CAS.
+ */
+
+struct DocResult {
+    uint32_t   worker;
+    uint32_t   offset;
+    uint32_t   len;
+};
+
+struct NativeJob {
+    const struct SchemaProgram *prog;
+    const struct Doc           *docs;
+    struct DocResult           *results;
+    struct DocError            *errors;
+};
+
+struct Worker {
+    struct WorkerPool          *pool;
+    uint32_t                    id;
+    pthread_t                   thread;
+    struct NativeScratch        s;
+    _Atomic uint64_t            range;
+} __attribute__((aligned(64)));
+
+struct WorkerPool {
+    uint32_t                    nworkers;
+    pthread_mutex_t             lock;
+    pthread_cond_t              start;
+    pthread_cond_t              done;
+    uint64_t                    generation;
+    uint32_t                    running;
+    int                         shutdown;
+    struct NativeJob            job;
+    struct Worker              *workers;
+};
+
+static int range_pop(_Atomic uint64_t *range, uint32_t *doc)
+{
+    uint64_t v = atomic_load_explicit(range, memory_order_relaxed);
+    for (;;) {
+        uint32_t lo = (uint32_t)v, hi = (uint32_t)(v >> 32);
+        if (lo >= hi)
+            return 0;
+        if (atomic_compare_exchange_weak(range, &v,
+                                         (uint64_t)(lo + 1) | (uint64_t)hi << 32)) {
+            *doc = lo;
+            return 1;
+        }
+    }
+}
+
+static int range_steal(_Atomic uint64_t *range, uint32_t *lo_out,
+                       uint32_t *hi_out)
+{
+    uint64_t v = atomic_load_explicit(range, memory_order_relaxed);
+    for (;;) {
+        uint32_t lo = (uint32_t)v, hi = (uint32_t)(v >> 32), mid;
+        if (lo >= hi)
+            return 0;
+        mid = lo + (hi - lo) / 2;
+        if (atomic_compare_exchange_weak(range, &v,
+                                         (uint64_t)lo | (uint64_t)mid << 32)) {
+            *lo_out = mid;
+            *hi_out = hi;
+            return 1;
+        }
+    }
+}
+
+static void worker_run(struct Worker *w)
+{
+    struct WorkerPool *pool = w->pool;
+    struct NativeJob  *job = &pool->job;
+    uint32_t           doc, i;
+
+    w->s.out_len = 0;
+    for (;;) {
+        while (range_pop(&w->range, &doc)) {
+            struct DocResult *res = &job->results[doc];
+            size_t            pos = w->s.out_len;
+            res->worker = w->id;
+            res->offset = (uint32_t)pos;
+            res->len = 0;
+            job->errors[doc].code = 0;
+            if (native_flatten_doc(job->prog, &w->s, &job->docs[doc],
+                                   &job->errors[doc]) == 0)
+                res->len = (uint32_t)(w->s.out_len - pos);
+        }
+        /* steal */
+        for (i = 1; i != pool->nworkers; i++) {
+            struct Worker *victim = &pool->workers[(w->id + i) % pool->nworkers];
+            uint32_t       lo, hi;
+            if (range_steal(&victim->range, &lo, &hi)) {
+                atomic_store(&w->range, (uint64_t)lo | (uint64_t)hi << 32);
+                break;
+            }
+        }
+        if (i == pool->nworkers)
+            return;
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct Worker     *w = arg;
+    struct WorkerPool *pool = w->pool;
+    uint64_t           generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->generation == generation)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->shutdown)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        worker_run(w);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void native_scratch_destroy(struct NativeScratch *s)
+{
+    preproc_buf_destroy(&s->pb);
+    output_buf_destroy(&s->out);
+    free(s->ot);
+    free(s->ov);
+    free(s->regs);
+}
+
+static int native_scratch_init(struct NativeScratch *s)
+{
+    memset(s, 0, sizeof(*s));
+    if (preproc_buf_init(&s->pb, 4096, NULL, NULL) != 0)
+        return -1;
+    if (output_buf_init(&s->out, 0, 4096, NULL) != 0) {
+        preproc_buf_destroy(&s->pb);
+        return -1;
+    }
+    return 0;
+}
+
+struct WorkerPool *worker_pool_new(uint32_t nworkers)
+{
+    struct WorkerPool *pool;
+    uint32_t           i;
+
+    if (nworkers == 0)
+        nworkers = 1;
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    pool->workers = aligned_alloc(64, nworkers * sizeof(pool->workers[0]));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i != nworkers; i++) {
+        struct Worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->id = i;
+        atomic_init(&w->range, 0);
+        if (native_scratch_init(&w->s) != 0)
+            goto error;
+        pool->nworkers = i + 1;
+        /* worker 0 is the calling thread */
+        if (i != 0 && pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+            native_scratch_destroy(&w->s);
+            pool->nworkers = i;
+            goto error;
+        }
+    }
+    return pool;
+
+error:
+    worker_pool_delete(pool);
+    return NULL;
+}
+
+void worker_pool_delete(struct WorkerPool *pool)
+{
+    uint32_t i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i != pool->nworkers; i++) {
+        if (i != 0)
+            pthread_join(pool->workers[i].thread, NULL);
+        native_scratch_destroy(&pool->workers[i].s);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+ssize_t flatten_batch_mt(const struct SchemaProgram *prog,
+                         struct WorkerPool          *pool,
+                         size_t                      ndocs,
+                         const struct Doc           *docs,
+                         uint8_t                   **msgpack_out,
+                         uint32_t                   *out_offsets,
+                         struct DocError            *errors)
+{
+    struct DocResult *results;
+    uint8_t          *out;
+    size_t            i, total = 0;
+    uint32_t          n = pool->nworkers;
+
+    if (ndocs > UINT32_MAX)
+        return -1;
+    results = malloc((ndocs ? ndocs : 1) * sizeof(results[0]));
+    if (results == NULL)
+        return -1;
+
+    pool->job.prog = prog;
+    pool->job.docs = docs;
+    pool->job.results = results;
+    pool->job.errors = errors;
+    for (i = 0; i != n; i++) {
+        uint64_t lo = ndocs * i / n, hi = ndocs * (i + 1) / n;
+        atomic_store(&pool->workers[i].range, lo | hi << 32);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running = n - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    worker_run(&pool->workers[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running != 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    /* gather results in input order */
+    for (i = 0; i != ndocs; i++)
+        total += results[i].len;
+    if (total > UINT32_MAX || (out = malloc(total ? total : 1)) == NULL) {
+        free(results);
+        return -1;
+    }
+    for (i = 0, total = 0; i != ndocs; i++) {
+        const struct DocResult *res = &results[i];
+        out_offsets[i] = (uint32_t)total;
+        memcpy(out + total,
+               pool->workers[res->worker].s.out.out_buf + res->offset, res->len);
+        total += res->len;
+    }
+    out_offsets[ndocs] = (uint32_t)total;
+    free(results);
+
+    *msgpack_out = out;
+    return total;
+}
+
+/*
+ * Avro
+ *
+ * Both directions walk the schema program recursively (schemas can't
+ * be recursive, the depth is bounded).  Varints are decoded 8 bytes
+ * at a time when possible: the first clear high bit marks the last
+ * byte, the 7 bit groups are then gathered with shifts and masks.
+ */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define le2host32(v) (v)
+#define le2host64(v) (v)
+#else
+#define le2host32(v) __builtin_bswap32(v)
+#define le2host64(v) __builtin_bswap64(v)
+#endif
+#define host2le32(v) le2host32(v)
+#define host2le64(v) le2host64(v)
+
+#define AVRO_BAD_DATA   (-1)
+#define AVRO_NO_MEMORY  (-2)
+
+void avro_program_prepare(struct AvroProgram *prog)
+{
+    uint32_t i;
+
+    memcpy(prog->keys, prog->names, prog->nnames * sizeof(prog->keys[0]));
+    for (i = 0; i != prog->nnodes; i++) {
+        const struct AvroNode *node = &prog->nodes[i];
+        if ((node->kind == AVRO_RECORD || node->kind == AVRO_ENUM) &&
+            node->count > 1)
+            qsort(prog->keys + node->first, node->count,
+                  sizeof(prog->keys[0]), schema_key_cmp);
+    }
+}
+
+static const struct SchemaKey *avro_key_lookup(
+    const struct AvroProgram *prog, const struct AvroNode *node,
+    const uint8_t *str, uint32_t len)
+{
+    struct SchemaKey key;
+    key.str = str;
+    key.len = len;
+    return bsearch(&key, prog->keys + node->first, node->count,
+                   sizeof(key), schema_key_cmp);
+}
+
+/* Size of a msgpack str header, see bank_add in schema_compile.lua. */
+static uint32_t mp_str_header_size(uint32_t len)
+{
+    return len <= 31 ? 1 : len <= UINT8_MAX ? 2 : len <= UINT16_MAX ? 3 : 5;
+}
+
+/* Encoder state, slots - value items of record fields by child index. */
+struct AvroEnc {
+    const struct AvroProgram *prog;
+    const uint8_t            *t;
+    const struct Value       *v;
+    size_t                    nitems;
+    const uint8_t            *b1, *b2;
+    struct OutputBuf         *ob;
+    uint8_t                  *out;
+    uint32_t                 *slots;
+};
+
+/* Ensure room for n more bytes. */
+static int avro_room(struct AvroEnc *e, size_t n)
+{
+    struct OutputBuf *ob = e->ob;
+    size_t            capacity, new_capacity, used;
+    uint8_t          *new_out_buf;
+
+    if (__builtin_expect(e->out + n <= ob->out_max, 1))
+        return 0;
+    capacity = ob->out_max - ob->out_buf;
+    used = e->out - ob->out_buf;
+    new_capacity = capacity + capacity / 2;
+    if (new_capacity < used + n)
+        new_capacity = used + n;
+    if (ob->limit != 0 && new_capacity > ob->limit)
+        return AVRO_NO_MEMORY;
+    new_out_buf = realloc_wrap(ob->out_buf, new_capacity, ob->stock_buf, capacity);
+    if (new_out_buf == NULL)
+        return AVRO_NO_MEMORY;
+    ob->out_buf = new_out_buf;
+    ob->out_max = new_out_buf + new_capacity;
+    e->out = new_out_buf + used;
+    return 0;
+}
+
+static int avro_put_long(struct AvroEnc *e, int64_t n)
+{
+    uint64_t u = ((uint64_t)n << 1) ^ (uint64_t)(n >> 63);
+
+    if (avro_room(e, 10) != 0)
+        return AVRO_NO_MEMORY;
+    while (u >= 0x80) {
+        *e->out++ = (uint8_t)u | 0x80;
+        u >>= 7;
+    }
+    *e->out++ = (uint8_t)u;
+    return 0;
+}
+
+static int avro_put_bytes(struct AvroEnc *e, const uint8_t *data,
+                          uint32_t len, int with_len)
+{
+    if (with_len && avro_put_long(e, len) != 0)
+        return AVRO_NO_MEMORY;
+    if (avro_room(e, len) != 0)
+        return AVRO_NO_MEMORY;
+    memcpy(e->out, data, len);
+    e->out += len;
+    return 0;
+}
+
+/*
+ * A string item: StringValue (bank1) or CopyCommand with a msgpack
+ * string (bank2, e.g. a key emitted by preprocess_avro).
+ */
+static int avro_item_str(const struct AvroEnc *e, size_t i,
+                         const uint8_t **str, uint32_t *len)
+{
+    const struct Value *v = &e->v[i];
+    const uint8_t      *h;
+    uint32_t            hs;
+
+    if (e->t[i] == StringValue) {
+        *str = e->b1 - v->xoff;
+        *len = v->xlen;
+        return 0;
+    }
+    if (e->t[i] != CopyCommand || e->b2 == NULL || v->xlen == 0)
+        return AVRO_BAD_DATA;
+    h = e->b2 - v->xoff;
+    switch (*h) {
+    case 0xa0 ... 0xbf: *len = *h - 0xa0; break;
+    case 0xd9: *len = h[1]; break;
+    case 0xda: *len = net2host16(unaligned(h + 1)->u16); break;
+    case 0xdb: *len = net2host32(unaligned(h + 1)->u32); break;
+    default: return AVRO_BAD_DATA;
+    }
+    hs = mp_str_header_size(*len);
+    if (*h == 0xdb)
+        hs = 5;
+    if (v->xlen != hs + *len)
+        return AVRO_BAD_DATA;
+    *str = h + hs;
+    return 0;
+}
+
+/* Index past the item i and its children, 0 if out of bounds (item 0
+ * is the root, never a legit next item). */
+static size_t avro_item_end(const struct AvroEnc *e, size_t i)
+{
+    size_t end = (e->t[i] == ArrayValue || e->t[i] == MapValue) ?
+                 i + e->v[i].xoff : i + 1;
+    return end > i && end <= e->nitems ? end : 0;
+}
+
+/* Can an item of type tid be encoded as kind?  Picks union branches. */
+static int avro_accepts(uint8_t kind, uint8_t tid)
+{
+    switch (kind) {
+    case AVRO_NULL:
+        return tid == NilValue;
+    case AVRO_BOOLEAN:
+        return tid == FalseValue || tid == TrueValue;
+    case AVRO_INT:
+    case AVRO_LONG:
+        return tid == LongValue || tid == UlongValue;
+    case AVRO_FLOAT:
+    case AVRO_DOUBLE:
+        return tid == LongValue || tid == UlongValue ||
+               tid == FloatValue || tid == DoubleValue;
+    case AVRO_STRING:
+        return tid == StringValue;
+    case AVRO_BYTES:
+    case AVRO_FIXED:
+        return tid == StringValue || tid == BinValue;
+    case AVRO_ENUM:
+        return tid == StringValue || tid == CopyCommand;
+    case AVRO_ARRAY:
+        return tid == ArrayValue;
+    case AVRO_MAP:
+    case AVRO_RECORD:
+        return tid == MapValue;
+    }
+    return 0;
+}
+
+static int avro_encode(struct AvroEnc *e, uint32_t id, size_t i)
+{
+    const struct AvroProgram *prog = e->prog;
+    const struct AvroNode    *node = &prog->nodes[id];
+    const struct SchemaKey   *key;
+    const struct Value       *v = &e->v[i];
+    const uint8_t            *str;
+    struct unaligned_storage  ux;
+    uint8_t                   tid = e->t[i];
+    uint32_t                  len, k;
+    size_t                    j;
+    int                       rc;
+
+    if (node->kind != AVRO_UNION && !avro_accepts(node->kind, tid))
+        return AVRO_BAD_DATA;
+
+    switch (node->kind) {
+    case AVRO_NULL:
+        return 0;
+    case AVRO_BOOLEAN:
+        if (avro_room(e, 1) != 0)
+            return AVRO_NO_MEMORY;
+        *e->out++ = tid == TrueValue;
+        return 0;
+    case AVRO_INT:
+        if (tid == UlongValue ? v->uval > INT32_MAX :
+            v->ival < INT32_MIN || v->ival > INT32_MAX)
+            return AVRO_BAD_DATA;
+        return avro_put_long(e, v->ival);
+    case AVRO_LONG:
+        if (tid == UlongValue && v->uval > INT64_MAX)
+            return AVRO_BAD_DATA;
+        return avro_put_long(e, v->ival);
+    case AVRO_FLOAT:
+    case AVRO_DOUBLE:
+        ux.f64 = tid == LongValue ? (double)v->ival :
+                 tid == UlongValue ? (double)v->uval : v->dval;
+        if (avro_room(e, 8) != 0)
+            return AVRO_NO_MEMORY;
+        if (node->kind == AVRO_FLOAT) {
+            ux.f32 = (float)ux.f64;
+            unaligned(e->out)->u32 = host2le32(ux.u32);
+            e->out += 4;
+        } else {
+            unaligned(e->out)->u64 = host2le64(ux.u64);
+            e->out += 8;
+        }
+        return 0;
+    case AVRO_STRING:
+    case AVRO_BYTES:
+        return avro_put_bytes(e, e->b1 - v->xoff, v->xlen, 1);
+    case AVRO_FIXED:
+        if (v->xlen != node->count)
+            return AVRO_BAD_DATA;
+        return avro_put_bytes(e, e->b1 - v->xoff, v->xlen, 0);
+    case AVRO_ENUM:
+        if (avro_item_str(e, i, &str, &len) != 0)
+            return AVRO_BAD_DATA;
+        key = avro_key_lookup(prog, node, str, len);
+        if (key == NULL)
+            return AVRO_BAD_DATA;
+        return avro_put_long(e, key->id);
+    case AVRO_ARRAY:
+    case AVRO_MAP:
+        /* a single block */
+        if (v->xlen != 0 && avro_put_long(e, v->xlen) != 0)
+            return AVRO_NO_MEMORY;
+        for (j = i + 1, k = 0; k != v->xlen; k++) {
+            if (node->kind == AVRO_MAP) {
+                if (j >= e->nitems || avro_item_str(e, j, &str, &len) != 0)
+                    return AVRO_BAD_DATA;
+                if ((rc = avro_put_bytes(e, str, len, 1)) != 0)
+                    return rc;
+                j++;
+            }
+            if (j >= e->nitems)
+                return AVRO_BAD_DATA;
+            if ((rc = avro_encode(e, node->first, j)) != 0)
+                return rc;
+            if ((j = avro_item_end(e, j)) == 0)
+                return AVRO_BAD_DATA;
+        }
+        return avro_put_long(e, 0);
+    case AVRO_RECORD:
+        /* find field values, then encode these in schema order */
+        for (k = 0; k != node->count; k++)
+            e->slots[node->first + k] = 0;
+        for (j = i + 1, k = 0; k != v->xlen; k++) {
+            if (j + 1 >= e->nitems || avro_item_str(e, j, &str, &len) != 0)
+                return AVRO_BAD_DATA;
+            key = avro_key_lookup(prog, node, str, len);
+            if (key == NULL || e->slots[node->first + key->id] != 0)
+                return AVRO_BAD_DATA;
+            e->slots[node->first + key->id] = (uint32_t)j + 1;
+            if ((j = avro_item_end(e, j + 1)) == 0)
+                return AVRO_BAD_DATA;
+        }
+        for (k = 0; k != node->count; k++) {
+            uint32_t key_item = e->slots[node->first + k];
+            if (key_item == 0)
+                return AVRO_BAD_DATA; /* missing */
+            rc = avro_encode(e, prog->children[node->first + k], key_item);
+            if (rc != 0)
+                return rc;
+        }
+        return 0;
+    case AVRO_UNION:
+        for (k = 0; k != node->count; k++) {
+            uint32_t branch = prog->children[node->first + k];
+            if (avro_accepts(prog->nodes[branch].kind, tid)) {
+                if (avro_put_long(e, k) != 0)
+                    return AVRO_NO_MEMORY;
+                return avro_encode(e, branch, i);
+            }
+        }
+        return AVRO_BAD_DATA;
+    }
+    return AVRO_BAD_DATA;
+}
+
+ssize_t create_avro(struct SchemaArena       *arena,
+                    const struct AvroProgram *prog,
+                    size_t                    nitems,
+                    const uint8_t            *typeid,
+                    const struct Value       *value,
+                    const uint8_t            *bank1,
+                    const uint8_t            *bank2,
+                    uint8_t                 **avro_out)
+{
+    struct AvroEnc e;
+    int            rc;
+
+    if (nitems == 0)
+        return -1;
+    if (arena->nslots < prog->nnames) {
+        uint32_t *slots = realloc(arena->slots, prog->nnames * sizeof(slots[0]));
+        if (slots == NULL)
+            return -1;
+        arena->slots = slots;
+        arena->nslots = prog->nnames;
+    }
+    e.prog = prog;
+    e.t = typeid;
+    e.v = value;
+    e.nitems = nitems;
+    e.b1 = bank1;
+    e.b2 = bank2;
+    e.ob = &arena->ob;
+    e.ob->limit = arena_limit(arena, arena_pb_footprint(arena));
+    e.out = e.ob->out_buf;
+    e.slots = arena->slots;
+    rc = avro_encode(&e, prog->root, 0);
+    arena_update_high_water(arena);
+    if (rc != 0)
+        return -1;
+    *avro_out = e.ob->out_buf;
+    return e.out - e.ob->out_buf;
+}
+
+/* Decoder state, me - the end of the data. */
+struct AvroDec {
+    const struct AvroProgram *prog;
+    const uint8_t            *mi, *me;
+    struct PreprocBuf        *pb;
+    size_t                    pos;
+};
+
+static int avro_get_varint(struct AvroDec *d, uint64_t *out)
+{
+    const uint8_t *mi = d->mi;
+    uint64_t       u = 0;
+    unsigned       shift;
+
+    if (d->me - mi >= 8) {
+        uint64_t w = le2host64(unaligned(mi)->u64);
+        uint64_t stop = ~w & 0x8080808080808080ULL;
+        if (__builtin_expect(stop != 0, 1)) {
+            unsigned nbits = __builtin_ctzll(stop) + 1;
+            if (nbits != 64)
+                w &= (1ULL << nbits) - 1;
+            *out = (w & 0x7f) |
+                   (w >> 1 & 0x7fULL << 7) |
+                   (w >> 2 & 0x7fULL << 14) |
+                   (w >> 3 & 0x7fULL << 21) |
+                   (w >> 4 & 0x7fULL << 28) |
+                   (w >> 5 & 0x7fULL << 35) |
+                   (w >> 6 & 0x7fULL << 42) |
+                   (w >> 7 & 0x7fULL << 49);
+            d->mi = mi + nbits / 8;
+            return 0;
+        }
+    }
+    for (shift = 0; shift < 64; shift += 7) {
+        if (mi == d->me)
+            return AVRO_BAD_DATA;
+        u |= (uint64_t)(*mi & 0x7f) << shift;
+        if (*mi++ < 0x80) {
+            *out = u;
+            d->mi = mi;
+            return 0;
+        }
+    }
+    return AVRO_BAD_DATA;
+}
+
+static int avro_get_long(struct AvroDec *d, int64_t *out)
+{
+    uint64_t u;
+    if (avro_get_varint(d, &u) != 0)
+        return AVRO_BAD_DATA;
+    *out = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+    return 0;
+}
+
+/* Emit an item at d->pos. */
+static int avro_emit(struct AvroDec *d, uint8_t tid, struct Value **value)
+{
+    if (preproc_buf_reserve(d->pb, d->pos) != 0)
+        return AVRO_NO_MEMORY;
+    d->pb->typeid_buf[d->pos] = tid;
+    *value = &d->pb->value_buf[d->pos++];
+    return 0;
+}
+
+/* Bytes of length len at d->mi as a StringValue / BinValue. */
+static int avro_emit_xdata(struct AvroDec *d, uint8_t tid, int64_t len)
+{
+    struct Value *v;
+
+    if (len < 0 || len > d->me - d->mi || len > UINT32_MAX)
+        return AVRO_BAD_DATA;
+    if (avro_emit(d, tid, &v) != 0)
+        return AVRO_NO_MEMORY;
+    v->xlen = (uint32_t)len;
+    v->xoff = (uint32_t)(d->me - d->mi);
+    d->mi += len;
+    return 0;
+}
+
+/* A name / symbol from the bank as a CopyCommand. */
+static int avro_emit_name(struct AvroDec *d, const struct SchemaKey *name)
+{
+    struct Value *v;
+    uint32_t      hs = mp_str_header_size(name->len);
+
+    if (avro_emit(d, CopyCommand, &v) != 0)
+        return AVRO_NO_MEMORY;
+    v->xlen = hs + name->len;
+    v->xoff = (uint32_t)(d->prog->bank - (name->str - hs));
+    return 0;
+}
+
+static int avro_decode(struct AvroDec *d, uint32_t id)
+{
+    const struct AvroProgram *prog = d->prog;
+    const struct AvroNode    *node = &prog->nodes[id];
+    struct unaligned_storage  ux;
+    struct Value             *v;
+    int64_t                   n;
+    uint64_t                  total;
+    size_t                    c;
+    uint32_t                  k;
+    int                       rc;
+
+    switch (node->kind) {
+    case AVRO_NULL:
+        return avro_emit(d, NilValue, &v);
+    case AVRO_BOOLEAN:
+        if (d->mi == d->me || *d->mi > 1)
+            return AVRO_BAD_DATA;
+        return avro_emit(d, *d->mi++ ? TrueValue : FalseValue, &v);
+    case AVRO_INT:
+    case AVRO_LONG:
+        if (avro_get_long(d, &n) != 0)
+            return AVRO_BAD_DATA;
+        if (node->kind == AVRO_INT && (n < INT32_MIN || n > INT32_MAX))
+            return AVRO_BAD_DATA;
+        if (avro_emit(d, LongValue, &v) != 0)
+            return AVRO_NO_MEMORY;
+        v->ival = n;
+        return 0;
+    case AVRO_FLOAT:
+        if (d->me - d->mi < 4)
+            return AVRO_BAD_DATA;
+        ux.u32 = le2host32(unaligned(d->mi)->u32);
+        d->mi += 4;
+        if (avro_emit(d, FloatValue, &v) != 0)
+            return AVRO_NO_MEMORY;
+        v->dval = ux.f32;
+        return 0;
+    case AVRO_DOUBLE:
+        if (d->me - d->mi < 8)
+            return AVRO_BAD_DATA;
+        ux.u64 = le2host64(unaligned(d->mi)->u64);
+        d->mi += 8;
+        if (avro_emit(d, DoubleValue, &v) != 0)
+            return AVRO_NO_MEMORY;
+        v->dval = ux.f64;
+        return 0;
+    case AVRO_STRING:
+    case AVRO_BYTES:
+        if (avro_get_long(d, &n) != 0)
+            return AVRO_BAD_DATA;
+        return avro_emit_xdata(d, node->kind == AVRO_STRING ?
+                               StringValue : BinValue, n);
+    case AVRO_FIXED:
+        return avro_emit_xdata(d, BinValue, node->count);
+    case AVRO_ENUM:
+        if (avro_get_long(d, &n) != 0 || n < 0 || n >= node->count)
+            return AVRO_BAD_DATA;
+        return avro_emit_name(d, &prog->names[node->first + n]);
+    case AVRO_ARRAY:
+    case AVRO_MAP:
+        if (avro_emit(d, node->kind == AVRO_ARRAY ? ArrayValue : MapValue,
+                      &v) != 0)
+            return AVRO_NO_MEMORY;
+        c = d->pos - 1;
+        for (total = 0;;) {
+            if (avro_get_long(d, &n) != 0)
+                return AVRO_BAD_DATA;
+            if (n == 0)
+                break;
+            if (n < 0) {
+                /* the block size in bytes follows */
+                int64_t size;
+                if (n == INT64_MIN || avro_get_long(d, &size) != 0)
+                    return AVRO_BAD_DATA;
+                n = -n;
+            }
+            total += (uint64_t)n;
+            if (total > UINT32_MAX)
+                return AVRO_BAD_DATA;
+            while (n-- != 0) {
+                if (node->kind == AVRO_MAP) {
+                    int64_t len;
+                    if (avro_get_long(d, &len) != 0)
+                        return AVRO_BAD_DATA;
+                    if ((rc = avro_emit_xdata(d, StringValue, len)) != 0)
+                        return rc;
+                }
+                if ((rc = avro_decode(d, node->first)) != 0)
+                    return rc;
+            }
+        }
+        v = &d->pb->value_buf[c];
+        v->xlen = (uint32_t)total;
+        v->xoff = (uint32_t)(d->pos - c);
+        return 0;
+    case AVRO_RECORD:
+        if (avro_emit(d, MapValue, &v) != 0)
+            return AVRO_NO_MEMORY;
+        c = d->pos - 1;
+        for (k = 0; k != node->count; k++) {
+            if (avro_emit_name(d, &prog->names[node->first + k]) != 0)
+                return AVRO_NO_MEMORY;
+            if ((rc = avro_decode(d, prog->children[node->first + k])) != 0)
+                return rc;
+        }
+        v = &d->pb->value_buf[c];
+        v->xlen = node->count;
+        v->xoff = (uint32_t)(d->pos - c);
+        return 0;
+    case AVRO_UNION:
+        if (avro_get_long(d, &n) != 0 || n < 0 || n >= node->count)
+            return AVRO_BAD_DATA;
+        return avro_decode(d, prog->children[node->first + n]);
+    }
+    return AVRO_BAD_DATA;
+}
+
+ssize_t preprocess_avro(struct SchemaArena       *arena,
+                        const struct AvroProgram *prog,
+                        const uint8_t            *mi,
+                        size_t                    ms,
+                        uint8_t                 **typeid_out,
+                        struct Value            **value_out)
+{
+    struct AvroDec d;
+    int            rc;
+
+    d.prog = prog;
+    d.mi = mi;
+    d.me = mi + ms;
+    d.pb = &arena->pb;
+    d.pb->limit = arena_limit(arena, arena_ob_footprint(arena));
+    d.pos = 0;
+    rc = avro_decode(&d, prog->root);
+    arena_update_high_water(arena);
+    if (rc != 0 || d.mi != d.me || d.pos > UINT32_MAX)
+        return -1;
+    *typeid_out = arena->pb.typeid_buf;
+    *value_out = arena->pb.value_buf;
+    return d.pos;
+}
+
+/*
+ * JSON
+ *
+ * preprocess_json emits the items preprocess_msgpack would for the
+ * msgpack equivalent of a document: objects become maps, integers
+ * LongValue / UlongValue, other numbers DoubleValue.  Containers
+ * use the same patch chain, xlen counts items as they come.  JSON
+ * closes containers explicitly, hence the chain doubles as the
+ * stack.
+ *
+ * A string without escapes references the input.  The first string
+ * with escapes reserves a region of twice the document size in the
+ * arena's text buffer: the document is copied to the upper half,
+ * decoded strings go to the lower half (decoding never makes a
+ * string longer).  An offset relative to the region end is the same
+ * as relative to the input end, references made before the copy
+ * stay valid; bank1 is the region end then.
+ *
+ * Strings are scanned for '"', '\\' and control characters 16 or 32
+ * bytes at a time with SSE4.2 / AVX2, chosen at runtime (as in
+ * fix_run).
+ */
+
+typedef size_t (*json_str_run_fn)(const uint8_t *p, size_t n);
+
+/* Number of leading bytes in [p, p + n) that end a plain run. */
+static size_t json_str_run_scalar(const uint8_t *p, size_t n)
+{
+    size_t i;
+    for (i = 0; i != n && p[i] != '"' && p[i] != '\\' && p[i] >= 0x20; i++)
+        ;
+    return i;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse4.2")))
+static size_t json_str_run_sse42(const uint8_t *p, size_t n)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctl = _mm_set1_epi8(0x1f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i  x = _mm_loadu_si128((const __m128i *)(p + i));
+        /* x <= 0x1f iff min(x, 0x1f) == x (unsigned) */
+        __m128i  m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, bslash)),
+            _mm_cmpeq_epi8(_mm_min_epu8(x, ctl), x));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + json_str_run_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t json_str_run_avx2(const uint8_t *p, size_t n)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i ctl = _mm256_set1_epi8(0x1f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i  x = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i  m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, quote),
+                            _mm256_cmpeq_epi8(x, bslash)),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(x, ctl), x));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + json_str_run_scalar(p + i, n - i);
+}
+
+#endif
+
+static size_t json_str_run_select(const uint8_t *p, size_t n);
+
+/* Resolved on first call, see fixint_run_fnp. */
+static json_str_run_fn json_str_run_fnp = json_str_run_select;
+
+static inline size_t json_str_run(const uint8_t *p, size_t n)
+{
+    return __atomic_load_n(&json_str_run_fnp, __ATOMIC_RELAXED)(p, n);
+}
+
+static size_t json_str_run_select(const uint8_t *p, size_t n)
+{
+    json_str_run_fn fn = json_str_run_scalar;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        fn = json_str_run_avx2;
+    else if (__builtin_cpu_supports("sse4.2"))
+        fn = json_str_run_sse42;
+#endif
+    __atomic_store_n(&json_str_run_fnp, fn, __ATOMIC_RELAXED);
+    return fn(p, n);
+}
+
+/* Parser state, region - offset in the text buffer or SIZE_MAX. */
+struct JsonDec {
+    const uint8_t     *mi, *mb, *me;
+    struct PreprocBuf *pb;
+    struct JsonText   *tx;
+    size_t             region, side;
+};
+
+static inline const uint8_t *json_ws(const uint8_t *mi, const uint8_t *me)
+{
+    while (mi != me && (*mi == ' ' || *mi == '\n' || *mi == '\r' || *mi == '\t'))
+        mi++;
+    return mi;
+}
+
+/* Reserve the region and copy the document there. */
+static int json_region(struct JsonDec *d)
+{
+    struct JsonText *tx = d->tx;
+    size_t           ms = d->me - d->mb, need = 2 * ms;
+
+    if (tx->cap - tx->size < need) {
+        size_t   new_cap = tx->cap + tx->cap / 2;
+        uint8_t *new_buf;
+        if (new_cap < tx->size + need)
+            new_cap = tx->size + need;
+        if (tx->limit != 0 && new_cap > tx->limit)
+            return PREPROC_NO_MEMORY;
+        new_buf = realloc(tx->buf, new_cap);
+        if (new_buf == NULL)
+            return PREPROC_NO_MEMORY;
+        tx->buf = new_buf;
+        tx->cap = new_cap;
+    }
+    d->region = tx->size;
+    d->side = 0;
+    tx->size += need;
+    memcpy(tx->buf + d->region + ms, d->mb, ms);
+    return 0;
+}
+
+static int json_hex4(const uint8_t *p, uint32_t *out)
+{
+    uint32_t u = 0;
+    int      i;
+    for (i = 0; i != 4; i++) {
+        uint8_t c = p[i];
+        if (c >= '0' && c <= '9')
+            c -= '0';
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            c = (c | 0x20) - 'a' + 10;
+        else
+            return -1;
+        u = u << 4 | c;
+    }
+    *out = u;
+    return 0;
+}
+
+/*
+ * Decode the rest of a string having escapes, n plain bytes at
+ * d->mi + 1 were scanned already.
+ */
+static int json_string_escaped(struct JsonDec *d, size_t n, struct Value *v)
+{
+    const uint8_t *mi = d->mi + 1, *me = d->me;
+    size_t         ms = me - d->mb, start;
+    uint8_t       *out, *o;
+    uint32_t       c, c2;
+    int            rc;
+
+    if (d->region == SIZE_MAX && (rc = json_region(d)) != 0)
+        return rc;
+    start = d->side;
+    out = o = d->tx->buf + d->region + start;
+    memcpy(o, mi, n);
+    o += n;
+    mi += n;
+    for (;;) {
+        if (mi == me || *mi < 0x20)
+            return PREPROC_BAD_DATA;
+        if (*mi == '"')
+            break;
+        if (*mi != '\\') {
+            n = json_str_run(mi, me - mi);
+            memcpy(o, mi, n);
+            o += n;
+            mi += n;
+            continue;
+        }
+        if (me - mi < 2)
+            return PREPROC_BAD_DATA;
+        switch (mi[1]) {
+        case '"': case '\\': case '/': *o++ = mi[1]; break;
+        case 'b': *o++ = '\b'; break;
+        case 'f': *o++ = '\f'; break;
+        case 'n': *o++ = '\n'; break;
+        case 'r': *o++ = '\r'; break;
+        case 't': *o++ = '\t'; break;
+        case 'u':
+            if (me - mi < 6 || json_hex4(mi + 2, &c) != 0)
+                return PREPROC_BAD_DATA;
+            if (c >= 0xdc00 && c <= 0xdfff)
+                return PREPROC_BAD_DATA;
+            if (c >= 0xd800 && c <= 0xdbff) {
+                /* a surrogate pair */
+                if (me - mi < 12 || mi[6] != '\\' || mi[7] != 'u' ||
+                    json_hex4(mi + 8, &c2) != 0 ||
+                    c2 < 0xdc00 || c2 > 0xdfff)
+                    return PREPROC_BAD_DATA;
+                c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+                mi += 6;
+            }
+            if (c < 0x80) {
+                *o++ = c;
+            } else if (c < 0x800) {
+                *o++ = 0xc0 | c >> 6;
+                *o++ = 0x80 | (c & 0x3f);
+            } else if (c < 0x10000) {
+                *o++ = 0xe0 | c >> 12;
+                *o++ = 0x80 | (c >> 6 & 0x3f);
+                *o++ = 0x80 | (c & 0x3f);
+            } else {
+                *o++ = 0xf0 | c >> 18;
+                *o++ = 0x80 | (c >> 12 & 0x3f);
+                *o++ = 0x80 | (c >> 6 & 0x3f);
+                *o++ = 0x80 | (c & 0x3f);
+            }
+            mi += 4;
+            break;
+        default:
+            return PREPROC_BAD_DATA;
+        }
+        mi += 2;
+    }
+    d->mi = mi + 1;
+    d->side = start + (o - out);
+    v->xlen = (uint32_t)(o - out);
+    v->xoff = (uint32_t)(2 * ms - start);
+    return 0;
+}
+
+/* A string at d->mi (the opening quote). */
+static inline int json_string(struct JsonDec *d, struct Value *v)
+{
+    const uint8_t *p = d->mi + 1;
+    size_t         n = json_str_run(p, d->me - p);
+
+    if (__builtin_expect(p + n != d->me && p[n] == '"', 1)) {
+        v->xlen = (uint32_t)n;
+        /* offset relative to blob end, as in preprocess_doc */
+        v->xoff = (uint32_t)(d->me - p);
+        d->mi = p + n + 1;
+        return 0;
+    }
+    if (p + n == d->me || p[n] != '\\')
+        return PREPROC_BAD_DATA;
+    return json_string_escaped(d, n, v);
+}
+
+static const double json_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * A number at d->mi.  A double is computed directly if both the
+ * significand and the power of 10 are exact (Clinger's fast path),
+ * strtod handles the rest (the C locale is assumed), integers out of
+ * the int64 / uint64 range included.
+ */
+static int json_number(struct JsonDec *d, uint8_t *typeid, struct Value *v)
+{
+    const uint8_t *mi = d->mi, *me = d->me, *p = mi;
+    uint64_t       m = 0;
+    int            neg = 0, exact = 1, is_int = 1;
+    int            e10 = 0, exp = 0, exp_neg = 0;
+
+    if (*p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (p == me || *p < '0' || *p > '9')
+        return PREPROC_BAD_DATA;
+    if (*p == '0') {
+        p++;
+    } else {
+        for (; p != me && *p >= '0' && *p <= '9'; p++) {
+            if (m > UINT64_MAX / 10 ||
+                (m == UINT64_MAX / 10 && *p - '0' > (int)(UINT64_MAX % 10)))
+                exact = 0;
+            m = m * 10 + (*p - '0');
+        }
+    }
+    if (p != me && *p == '.') {
+        is_int = 0;
+        if (++p == me || *p < '0' || *p > '9')
+            return PREPROC_BAD_DATA;
+        for (; p != me && *p >= '0' && *p <= '9'; p++, e10--) {
+            if (m > UINT64_MAX / 10 ||
+                (m == UINT64_MAX / 10 && *p - '0' > (int)(UINT64_MAX % 10)))
+                exact = 0;
+            m = m * 10 + (*p - '0');
+        }
+    }
+    if (p != me && (*p | 0x20) == 'e') {
+        is_int = 0;
+        if (++p != me && (*p == '+' || *p == '-'))
+            exp_neg = *p++ == '-';
+        if (p == me || *p < '0' || *p > '9')
+            return PREPROC_BAD_DATA;
+        for (; p != me && *p >= '0' && *p <= '9'; p++)
+            if (exp < 100000)
+                exp = exp * 10 + (*p - '0');
+        e10 += exp_neg ? -exp : exp;
+    }
+    d->mi = p;
+
+    if (is_int && exact) {
+        if (!neg && m > (uint64_t)INT64_MAX) {
+            *typeid = UlongValue;
+            v->uval = m;
+            return 0;
+        }
+        if (!neg || m <= (uint64_t)INT64_MAX + 1) {
+            *typeid = LongValue;
+            v->ival = neg ? (int64_t)(0 - m) : (int64_t)m;
+            return 0;
+        }
+    }
+    *typeid = DoubleValue;
+    if (exact && m <= (1ULL << 53) && e10 >= -22 && e10 <= 22) {
+        double dv = (double)m;
+        dv = e10 < 0 ? dv / json_pow10[-e10] : dv * json_pow10[e10];
+        v->dval = neg ? -dv : dv;
+        return 0;
+    } else {
+        char   stock[128], *buf = stock;
+        size_t len = p - mi;
+        if (len >= sizeof(stock) && (buf = malloc(len + 1)) == NULL)
+            return PREPROC_NO_MEMORY;
+        memcpy(buf, mi, len);
+        buf[len] = 0;
+        v->dval = strtod(buf, NULL);
+        if (buf != stock)
+            free(buf);
+        return 0;
+    }
+}
+
+/*
+ * Preprocess a document, appending items to pb starting at index
+ * pos.  Returns the index past the last item or one of
+ * PREPROC_BAD_DATA, PREPROC_NO_MEMORY (as preprocess_doc).
+ */
+static ssize_t json_doc(struct JsonDec *d, size_t pos)
+{
+    struct PreprocBuf *pb = d->pb;
+    const uint8_t     *me = d->me;
+    struct Value      *v, *fixit;
+    uint32_t           patch = -1;
+    int                rc;
+
+    d->region = SIZE_MAX;
+    d->mi = json_ws(d->mi, me);
+
+value:
+    if (d->mi == me)
+        return PREPROC_BAD_DATA;
+    if (preproc_buf_reserve(pb, pos) != 0)
+        return PREPROC_NO_MEMORY;
+    v = &pb->value_buf[pos];
+    switch (*d->mi) {
+    case '{':
+    case '[':
+        pb->typeid_buf[pos] = *d->mi == '{' ? MapValue : ArrayValue;
+        v->xlen = 0;
+        v->xoff = patch;
+        patch = pos++;
+        d->mi = json_ws(d->mi + 1, me);
+        if (d->mi != me && *d->mi == (pb->typeid_buf[patch] == MapValue ? '}' : ']'))
+            goto close;
+        if (pb->typeid_buf[patch] == MapValue)
+            goto key;
+        goto value;
+    case '"':
+        pb->typeid_buf[pos++] = StringValue;
+        if ((rc = json_string(d, v)) != 0)
+            return rc;
+        break;
+    case '-':
+    case '0' ... '9':
+        if ((rc = json_number(d, &pb->typeid_buf[pos++], v)) != 0)
+            return rc;
+        break;
+    case 't':
+        if (me - d->mi < 4 || memcmp(d->mi, "true", 4) != 0)
+            return PREPROC_BAD_DATA;
+        pb->typeid_buf[pos++] = TrueValue;
+        d->mi += 4;
+        break;
+    case 'f':
+        if (me - d->mi < 5 || memcmp(d->mi, "false", 5) != 0)
+            return PREPROC_BAD_DATA;
+        pb->typeid_buf[pos++] = FalseValue;
+        d->mi += 5;
+        break;
+    case 'n':
+        if (me - d->mi < 4 || memcmp(d->mi, "null", 4) != 0)
+            return PREPROC_BAD_DATA;
+        pb->typeid_buf[pos++] = NilValue;
+        d->mi += 4;
+        break;
+    default:
+        return PREPROC_BAD_DATA;
+    }
+
+next:
+    if (patch == (uint32_t)-1)
+        goto done;
+    pb->value_buf[patch].xlen++;
+    d->mi = json_ws(d->mi, me);
+    if (d->mi == me)
+        return PREPROC_BAD_DATA;
+    if (*d->mi == ',') {
+        d->mi = json_ws(d->mi + 1, me);
+        if (pb->typeid_buf[patch] == MapValue)
+            goto key;
+        goto value;
+    }
+    if (*d->mi != (pb->typeid_buf[patch] == MapValue ? '}' : ']'))
+        return PREPROC_BAD_DATA;
+close:
+    d->mi++;
+    fixit = pb->value_buf + patch;
+    patch = fixit->xoff;
+    fixit->xoff = pos - (fixit - pb->value_buf);
+    goto next;
+
+key:
+    if (d->mi == me || *d->mi != '"')
+        return PREPROC_BAD_DATA;
+    if (preproc_buf_reserve(pb, pos) != 0)
+        return PREPROC_NO_MEMORY;
+    pb->typeid_buf[pos] = StringValue;
+    if ((rc = json_string(d, &pb->value_buf[pos++])) != 0)
+        return rc;
+    d->mi = json_ws(d->mi, me);
+    if (d->mi == me || *d->mi != ':')
+        return PREPROC_BAD_DATA;
+    d->mi = json_ws(d->mi + 1, me);
+    goto value;
+
+done:
+    if (json_ws(d->mi, me) != me)
+        return PREPROC_BAD_DATA;
+    return pos;
+}
+
+static void json_text_init(struct JsonDec *d, struct SchemaArena *arena)
+{
+    d->tx = &arena->text;
+    d->tx->size = 0;
+    d->tx->limit = arena_limit(arena, arena_pb_footprint(arena) +
+                                      arena_ob_footprint(arena));
+    d->pb = &arena->pb;
+    d->pb->limit = arena_limit(arena, arena_ob_footprint(arena) +
+                                      arena->text.cap);
+}
+
+ssize_t preprocess_json(struct SchemaArena *arena,
+                        const uint8_t      *mi,
+                        size_t              ms,
+                        uint8_t           **typeid_out,
+                        struct Value      **value_out,
+                        const uint8_t     **bank1_out)
+{
+    struct JsonDec d;
+    ssize_t        rc;
+
+    if (ms > UINT32_MAX / 2)
+        return -1;
+    json_text_init(&d, arena);
+    d.mi = d.mb = mi;
+    d.me = mi + ms;
+    rc = json_doc(&d, 0);
+    arena_update_high_water(arena);
+    if (rc < 0 || rc > UINT32_MAX)
+        return -1;
+    *typeid_out = arena->pb.typeid_buf;
+    *value_out = arena->pb.value_buf;
+    *bank1_out = d.region == SIZE_MAX ? d.me :
+                 arena->text.buf + d.region + 2 * ms;
+    return rc;
+}
+
+ssize_t preprocess_json_batch(struct SchemaArena *arena,
+                              size_t              ndocs,
+                              const struct Doc   *docs,
+                              uint8_t           **typeid_out,
+                              struct Value      **value_out,
+                              uint32_t           *offsets,
+                              struct Doc         *docs_out)
+{
+    struct JsonDec d;
+    size_t         i, pos = 0;
+    ssize_t        rc;
+
+    json_text_init(&d, arena);
+    for (i = 0; i != ndocs; i++) {
+        d.mi = d.mb = docs[i].data;
+        d.me = d.mi + docs[i].size;
+        rc = docs[i].size > UINT32_MAX / 2 ? PREPROC_BAD_DATA :
+             json_doc(&d, pos);
+        offsets[i] = (uint32_t)pos;
+        if (rc == PREPROC_NO_MEMORY || rc > UINT32_MAX) {
+            arena_update_high_water(arena);
+            return -1;
+        }
+        docs_out[i] = docs[i];
+        if (rc < 0)
+            continue; /* an empty range marks a bad document */
+        pos = (size_t)rc;
+        if (d.region != SIZE_MAX) {
+            /* the text buffer might move, the pointer is made below */
+            docs_out[i].data = NULL;
+            docs_out[i].size = d.region;
+        }
+    }
+    offsets[ndocs] = (uint32_t)pos;
+    for (i = 0; i != ndocs; i++) {
+        if (docs_out[i].data == NULL) {
+            docs_out[i].data = arena->text.buf + docs_out[i].size;
+            docs_out[i].size = 2 * docs[i].size;
+        }
+    }
+    arena_update_high_water(arena);
+    *typeid_out = arena->pb.typeid_buf;
+    *value_out = arena->pb.value_buf;
+    return pos;
+}
+
+/*
+ * Fingerprints
+ *
+ * Bitwise, without the 256 entry table of the spec: schemas are
+ * fingerprinted once, at load time.
+ */
+#define FP64_EMPTY 0xc15d213aa4d7a795ULL
+
+uint64_t schema_fingerprint64(const uint8_t *data, size_t size)
+{
+    uint64_t fp = FP64_EMPTY;
+    size_t   i;
+    int      k;
+
+    for (i = 0; i != size; i++) {
+        uint64_t x = (fp ^ data[i]) & 0xff;
+        for (k = 0; k != 8; k++)
+            x = (x >> 1) ^ (FP64_EMPTY & -(x & 1));
+        fp = (fp >> 8) ^ x;
+    }
+    return fp;
+}
+
+/*
+ * Columnar sink
+ *
+ * A row is appended column by column, a document failing halfway
+ * leaves columns of different lengths; marks taken before a call
+ * restore the sink.  Encoded values are preprocessed into a buffer
+ * of the sink's own, they never nest.
+ */
+struct ColumnMark {
+    uint64_t           length;
+    uint64_t           null_count;
+    size_t             validity, values, offsets, data;
+};
+
+struct ColumnSink {
+    struct Column     *columns;
+    struct ColumnMark *marks;
+    uint32_t           ncolumns;
+    uint32_t           nslots;
+    struct PreprocBuf  pb;
+};
+
+#define COLUMN_ALIGN 64
+
+static int column_buf_reserve(struct ColumnBuf *b, size_t n)
+{
+    size_t   new_cap;
+    void    *p;
+
+    if (b->size + n <= b->cap)
+        return 0;
+    new_cap = b->cap ? b->cap * 2 : COLUMN_ALIGN;
+    while (new_cap < b->size + n)
+        new_cap *= 2;
+    /* realloc keeps no alignment */
+    if (posix_memalign(&p, COLUMN_ALIGN, new_cap) != 0)
+        return -1;
+    if (b->size != 0)
+        memcpy(p, b->data, b->size);
+    free(b->data);
+    b->data = p;
+    b->cap = new_cap;
+    return 0;
+}
+
+static int column_buf_append(struct ColumnBuf *b, const void *p, size_t n)
+{
+    if (n == 0)
+        return 0; /* b->data might be NULL */
+    if (column_buf_reserve(b, n) != 0)
+        return -1;
+    memcpy(b->data + b->size, p, n);
+    b->size += n;
+    return 0;
+}
+
+/* Set bit i of a bitmap having i bits so far. */
+static int column_bit(struct ColumnBuf *b, uint64_t i, int bit)
+{
+    uint8_t mask = (uint8_t)(1 << (i & 7));
+
+    if ((i & 7) == 0) {
+        if (column_buf_reserve(b, 1) != 0)
+            return -1;
+        b->size++;
+    }
+    /* the byte might have bits of rows rolled back */
+    b->data[i >> 3] = (b->data[i >> 3] & ~mask) | (bit ? mask : 0);
+    return 0;
+}
+
+static int column_offset(struct Column *c, uint64_t end)
+{
+    int32_t off = (int32_t)end;
+
+    if (end > INT32_MAX)
+        return -1;
+    return column_buf_append(&c->offsets, &off, sizeof(off));
+}
+
+static int column_null(struct ColumnSink *sink, struct Column *c)
+{
+    static const uint8_t zero[8];
+
+    if (c->type != COLUMN_NULL &&
+        column_bit(&c->validity, c->length, 0) != 0)
+        return -1;
+    switch (c->type) {
+    case COLUMN_BOOL:
+        if (column_bit(&c->values, c->length, 0) != 0)
+            return -1;
+        break;
+    case COLUMN_INT64:
+    case COLUMN_DOUBLE:
+        if (column_buf_append(&c->values, zero, 8) != 0)
+            return -1;
+        break;
+    case COLUMN_DICT:
+    case COLUMN_FLOAT:
+        if (column_buf_append(&c->values, zero, 4) != 0)
+            return -1;
+        break;
+    case COLUMN_BINARY:
+        if (column_offset(c, c->data.size) != 0)
+            return -1;
+        break;
+    case COLUMN_LIST:
+        if (column_offset(c, sink->columns[c->child].length) != 0)
+            return -1;
+        break;
+    }
+    c->length++;
+    c->null_count++;
+    return 0;
+}
+
+static ssize_t column_put(struct ColumnSink  *sink,
+                          struct Column      *c,
+                          const uint8_t      *typeid,
+                          const struct Value *value,
+                          size_t              i,
+                          size_t              n,
+                          const uint8_t      *bank1,
+                          const uint8_t      *bank2);
+
+/*
+ * A value in its msgpack encoding, bank is the end of the data.
+ * While decoding one, bank2 is NULL.
+ */
+static int column_put_encoded(struct ColumnSink  *sink,
+                              struct Column      *c,
+                              const struct Value *v,
+                              const uint8_t      *bank,
+                              const uint8_t      *bank2)
+{
+    const uint8_t *data;
+    ssize_t        rc;
+
+    if (bank2 == NULL)
+        return -1;
+    data = bank - v->xoff;
+    rc = preprocess_doc(data, v->xlen, &sink->pb, 0, NULL);
+    if (rc <= 0)
+        return -1;
+    if (column_put(sink, c, sink->pb.typeid_buf, sink->pb.value_buf,
+                   0, rc, data + v->xlen, NULL) != rc)
+        return -1;
+    return 0;
+}
+
+/* Append item i (out of n) to c, returns the next item or -1. */
+static ssize_t column_put(struct ColumnSink  *sink,
+                          struct Column      *c,
+                          const uint8_t      *typeid,
+                          const struct Value *value,
+                          size_t              i,
+                          size_t              n,
+                          const uint8_t      *bank1,
+                          const uint8_t      *bank2)
+{
+    const struct Value *v = value + i;
+    uint8_t             tid;
+    ssize_t             j;
+    uint32_t            k;
+    int64_t             ival;
+    double              dval;
+    float               fval;
+    int32_t             index;
+
+    if (i >= n)
+        return -1;
+    tid = typeid[i];
+    switch (tid) {
+    case NilValue:
+        return column_null(sink, c) == 0 ? (ssize_t)i + 1 : -1;
+    case RawValue:
+        return column_put_encoded(sink, c, v, bank1, bank2) == 0 ?
+               (ssize_t)i + 1 : -1;
+    case CopyCommand:
+        return column_put_encoded(sink, c, v, bank2, bank2) == 0 ?
+               (ssize_t)i + 1 : -1;
+    }
+    j = (ssize_t)i + 1;
+    switch (c->type) {
+    case COLUMN_BOOL:
+        if (tid != FalseValue && tid != TrueValue)
+            return -1;
+        if (column_bit(&c->values, c->length, tid == TrueValue) != 0)
+            return -1;
+        break;
+    case COLUMN_INT64:
+        if (tid == UlongValue && v->uval > INT64_MAX)
+            return -1;
+        if (tid != LongValue && tid != UlongValue)
+            return -1;
+        ival = v->ival;
+        if (column_buf_append(&c->values, &ival, 8) != 0)
+            return -1;
+        break;
+    case COLUMN_DOUBLE:
+    case COLUMN_FLOAT:
+        if (tid == FloatValue || tid == DoubleValue)
+            dval = v->dval;
+        else if (tid == LongValue)
+            dval = (double)v->ival;
+        else if (tid == UlongValue)
+            dval = (double)v->uval;
+        else
+            return -1;
+        if (c->type == COLUMN_FLOAT) {
+            fval = (float)dval;
+            if (column_buf_append(&c->values, &fval, 4) != 0)
+                return -1;
+        } else if (column_buf_append(&c->values, &dval, 8) != 0)
+            return -1;
+        break;
+    case COLUMN_DICT:
+        if (tid != LongValue || v->ival < 0 || v->ival > INT32_MAX)
+            return -1;
+        index = (int32_t)v->ival;
+        if (column_buf_append(&c->values, &index, 4) != 0)
+            return -1;
+        break;
+    case COLUMN_BINARY:
+        if (tid != StringValue && tid != BinValue)
+            return -1;
+        if (column_buf_append(&c->data, bank1 - v->xoff, v->xlen) != 0 ||
+            column_offset(c, c->data.size) != 0)
+            return -1;
+        break;
+    case COLUMN_LIST:
+        if (tid != ArrayValue)
+            return -1;
+        for (k = 0; k != v->xlen && j >= 0; k++)
+            j = column_put(sink, &sink->columns[c->child],
+                           typeid, value, j, n, bank1, bank2);
+        if (j < 0 || column_offset(c, sink->columns[c->child].length) != 0)
+            return -1;
+        break;
+    default: /* COLUMN_NULL */
+        return -1;
+    }
+    if (c->type != COLUMN_NULL &&
+        column_bit(&c->validity, c->length, 1) != 0)
+        return -1;
+    c->length++;
+    return j;
+}
+
+static int column_has_offsets(const struct Column *c)
+{
+    return c->type == COLUMN_BINARY || c->type == COLUMN_LIST;
+}
+
+struct ColumnSink *column_sink_new(uint32_t        ncolumns,
+                                   const uint8_t  *types,
+                                   const uint32_t *children,
+                                   uint32_t        nslots)
+{
+    struct ColumnSink *sink;
+    uint32_t           i;
+
+    if (nslots > ncolumns)
+        return NULL;
+    for (i = 0; i != ncolumns; i++) {
+        if (types[i] < COLUMN_NULL || types[i] > COLUMN_FLOAT)
+            return NULL;
+        /* item columns come later, no cycles */
+        if (types[i] == COLUMN_LIST &&
+            (children[i] <= i || children[i] >= ncolumns))
+            return NULL;
+    }
+    sink = calloc(1, sizeof(*sink));
+    if (sink == NULL)
+        return NULL;
+    sink->columns = calloc(ncolumns ? ncolumns : 1, sizeof(sink->columns[0]));
+    sink->marks = calloc(ncolumns ? ncolumns : 1, sizeof(sink->marks[0]));
+    if (sink->columns == NULL || sink->marks == NULL ||
+        preproc_buf_init(&sink->pb, 0, NULL, NULL) != 0) {
+        free(sink->columns);
+        free(sink->marks);
+        free(sink);
+        return NULL;
+    }
+    sink->ncolumns = ncolumns;
+    sink->nslots = nslots;
+    for (i = 0; i != ncolumns; i++) {
+        struct Column *c = &sink->columns[i];
+        c->type = types[i];
+        c->child = c->type == COLUMN_LIST ? children[i] : 0;
+        /* reset never allocates */
+        if (column_has_offsets(c) &&
+            column_buf_reserve(&c->offsets, sizeof(int32_t)) != 0) {
+            column_sink_delete(sink);
+            return NULL;
+        }
+    }
+    column_sink_reset(sink);
+    return sink;
+}
+
+void column_sink_delete(struct ColumnSink *sink)
+{
+    uint32_t i;
+
+    for (i = 0; i != sink->ncolumns; i++) {
+        free(sink->columns[i].validity.data);
+        free(sink->columns[i].values.data);
+        free(sink->columns[i].offsets.data);
+        free(sink->columns[i].data.data);
+    }
+    preproc_buf_destroy(&sink->pb);
+    free(sink->columns);
+    free(sink->marks);
+    free(sink);
+}
+
+void column_sink_reset(struct ColumnSink *sink)
+{
+    uint32_t i;
+
+    for (i = 0; i != sink->ncolumns; i++) {
+        struct Column *c = &sink->columns[i];
+        c->length = c->null_count = 0;
+        c->validity.size = c->values.size = c->offsets.size = 0;
+        c->data.size = 0;
+        if (column_has_offsets(c))
+            column_offset(c, 0);
+    }
+}
+
+struct Column *column_sink_columns(struct ColumnSink *sink)
+{
+    return sink->columns;
+}
+
+static void column_sink_mark(struct ColumnSink *sink)
+{
+    uint32_t i;
+
+    for (i = 0; i != sink->ncolumns; i++) {
+        const struct Column *c = &sink->columns[i];
+        struct ColumnMark   *m = &sink->marks[i];
+        m->length = c->length;
+        m->null_count = c->null_count;
+        m->validity = c->validity.size;
+        m->values = c->values.size;
+        m->offsets = c->offsets.size;
+        m->data = c->data.size;
+    }
+}
+
+static void column_sink_restore(struct ColumnSink *sink)
+{
+    uint32_t i;
+
+    for (i = 0; i != sink->ncolumns; i++) {
+        struct Column           *c = &sink->columns[i];
+        const struct ColumnMark *m = &sink->marks[i];
+        c->length = m->length;
+        c->null_count = m->null_count;
+        c->validity.size = m->validity;
+        c->values.size = m->values;
+        c->offsets.size = m->offsets;
+        c->data.size = m->data;
+    }
+}
+
+ssize_t column_sink_append(struct ColumnSink  *sink,
+                           size_t              ndocs,
+                           const uint8_t      *typeid,
+                           const struct Value *value,
+                           const uint32_t     *offsets,
+                           const struct Doc   *docs,
+                           const uint8_t      *bank2)
+{
+    size_t   d, rows = 0;
+    uint32_t s;
+
+    column_sink_mark(sink);
+    for (d = 0; d != ndocs; d++) {
+        const uint8_t      *t = typeid + offsets[d];
+        const struct Value *v = value + offsets[d];
+        size_t              n = offsets[d + 1] - offsets[d];
+        ssize_t             i = 1;
+
+        if (n == 0)
+            continue; /* a bad document */
+        if (t[0] != ArrayValue || v[0].xlen != sink->nslots)
+            goto error;
+        for (s = 0; s != sink->nslots && i >= 0; s++)
+            i = column_put(sink, &sink->columns[s], t, v, i, n,
+                           docs[d].data + docs[d].size, bank2);
+        if (i < 0 || (size_t)i != n)
+            goto error;
+        rows++;
+    }
+    return rows;
+error:
+    column_sink_restore(sink);
+    return -1;
+}
+
+/*
+ * Keys
+ *
+ * Parts are encoded back to back, each one memcmp-orderable on its
+ * own and self-delimiting, hence so is the key:
+ *   long   - 8 bytes big-endian, the sign bit flipped
+ *   double - 8 bytes big-endian, negatives have all bits flipped,
+ *            the rest only the sign bit (-0 is 0, NaN-s are one,
+ *            greater than +inf); a float is rounded first
+ *   bool   - a byte, 0 or 1
+ *   string - the bytes, 0x00 escaped as 0x00 0xff, then 0x00 0x00
+ *   fixed  - the bytes (the size is fixed)
+ *   enum   - the symbol index, 4 bytes big-endian
+ *
+ * A scan records where the value of every node on the paths starts,
+ * a missing part then falls back to a default of the outermost node
+ * missing (see the generated flattener's defaults).
+ */
+struct KeyScan {
+    const struct KeyDef        *def;
+    struct SchemaArena         *arena;
+    const uint8_t              *data, *me;
+    const uint8_t              *at[KEY_MAX_SLOTS];
+    uint32_t                    found;
+    size_t                      pos;
+    struct DocError            *err;
+};
+
+static int key_error(struct KeyScan *ks, uint32_t code, uint32_t node,
+                     size_t offset)
+{
+    ks->err->code = code;
+    ks->err->node = node;
+    ks->err->aux1 = 0;
+    ks->err->aux2 = 0;
+    ks->err->offset = (uint32_t)offset;
+    return -1;
+}
+
+/* Decode the header at mi, checking bounds (xdata payload included).
+ * Returns the header size or 0 if data is malformed. */
+static size_t key_header(const uint8_t *mi, const uint8_t *me,
+                         uint8_t *typeid, struct Value *value,
+                         uint32_t *len)
+{
+    size_t hs;
+
+    if (mi == me)
+        return 0;
+    hs = *mi < 0xc0 || *mi >= 0xe0 ? 1 : header_size[*mi - 0xc0];
+    if ((size_t)(me - mi) < hs)
+        return 0;
+    switch (decode_header(mi, typeid, value, len)) {
+    case HDR_SCALAR:
+    case HDR_NESTED:
+        return hs;
+    case HDR_XDATA:
+        if ((size_t)(me - mi) - hs < *len)
+            return 0;
+        value->xlen = *len;
+        return hs;
+    }
+    return 0;
+}
+
+/*
+ * Scan the map of record rec at *pmi, advancing *pmi.  Returns 0,
+ * 1 if every part was found (*pmi is left as is) or -1.
+ */
+static int key_scan(struct KeyScan *ks, uint32_t rec, const uint8_t **pmi)
+{
+    const struct KeyDef        *def = ks->def;
+    const struct SchemaProgram *prog = def->prog;
+    const uint8_t              *mi = *pmi, *me = ks->me;
+    struct Value                value;
+    uint8_t                     typeid;
+    uint32_t                    len, npairs, i;
+    size_t                      hs;
+    int                         rc;
+
+    hs = key_header(mi, me, &typeid, &value, &len);
+    if (hs == 0)
+        return key_error(ks, NATIVE_ERR_BAD_DATA, 0, mi - ks->data);
+    if (typeid != MapValue)
+        return key_error(ks, NATIVE_ERR_TYPE, rec, mi - ks->data);
+    npairs = value.xlen;
+    mi += hs;
+    for (i = 0; i != npairs; i++) {
+        const struct SchemaKey *key;
+        uint32_t                slot;
+
+        hs = key_header(mi, me, &typeid, &value, &len);
+        if (hs == 0)
+            return key_error(ks, NATIVE_ERR_BAD_DATA, 0, mi - ks->data);
+        if (typeid != StringValue)
+            return key_error(ks, NATIVE_ERR_KEY_NOT_STR, rec, mi - ks->data);
+        key = schema_key_lookup(prog, &prog->nodes[rec], mi + hs, len);
+        mi += hs + len;
+        /* the first occurrence wins */
+        if (key != NULL && (slot = def->slots[key->id]) != 0 &&
+            ks->at[slot - 1] == NULL) {
+            ks->at[slot - 1] = mi;
+            if (prog->nodes[key->id].kind == NODE_RECORD) {
+                rc = key_scan(ks, key->id, &mi);
+                if (rc != 0)
+                    return rc;
+                continue;
+            }
+            if (++ks->found == def->nleaves)
+                return 1;
         }
-        case DoubleValue: {
-            struct unaligned_storage ux;
-            ux.f64 = value->dval;
-            out[0] = 0xcb;
-            unaligned(out + 1)->u64 = host2net64(ux.u64);
-            out += 9;
-            goto check_buf;
+        mi = msgpack_skip(mi, me);
+        if (mi == NULL)
+            return key_error(ks, NATIVE_ERR_BAD_DATA, 0, me - ks->data);
+    }
+    *pmi = mi;
+    return 0;
+}
+
+/* Room for n bytes at ks->pos, NULL if out of memory. */
+static uint8_t *key_room(struct KeyScan *ks, size_t n)
+{
+    struct OutputBuf *ob = &ks->arena->ob;
+
+    if (output_buf_room(ob, ks->pos, n) != 0)
+        return NULL;
+    return ob->out_buf + ks->pos;
+}
+
+/* Encode a value of part at mi (offset - for errors). */
+static int key_put(struct KeyScan *ks, const struct KeyPart *part,
+                   const uint8_t *mi, const uint8_t *me, size_t offset)
+{
+    const struct SchemaProgram *prog = ks->def->prog;
+    const struct SchemaNode    *node = &prog->nodes[part->node];
+    const struct SchemaKey     *key = NULL;
+    const uint8_t              *p, *e, *z;
+    struct Value                value;
+    uint8_t                     typeid, *o;
+    uint32_t                    len;
+    uint64_t                    u;
+    double                      d;
+    size_t                      hs;
+    int                         rc;
+
+    hs = key_header(mi, me, &typeid, &value, &len);
+    if (hs == 0)
+        return key_error(ks, NATIVE_ERR_BAD_DATA, 0, offset);
+    if (part->type == KEY_ENUM) {
+        if (typeid != StringValue)
+            return key_error(ks, NATIVE_ERR_TYPE, part->node, offset);
+        key = schema_key_lookup(prog, node, mi + hs, len);
+        if (key == NULL)
+            return key_error(ks, NATIVE_ERR_ENUM, part->node, offset);
+    } else {
+        rc = native_check_leaf(node, typeid, &value);
+        if (rc != 0)
+            return key_error(ks, rc, part->node, offset);
+    }
+    o = key_room(ks, part->type == KEY_STRING ? 2 * (size_t)len + 2 :
+                     part->type == KEY_FIXED ? len : 8);
+    if (o == NULL)
+        return key_error(ks, NATIVE_ERR_NO_MEMORY, 0, offset);
+
+    switch (part->type) {
+    case KEY_LONG:
+        unaligned(o)->u64 = host2net64(value.uval ^ (UINT64_C(1) << 63));
+        o += 8;
+        break;
+    case KEY_DOUBLE:
+        d = typeid == LongValue ? (double)value.ival : value.dval;
+        if (node->tid == FloatValue)
+            d = (float)d;
+        if (d == 0)
+            d = 0;
+        if (d != d)
+            u = UINT64_C(0x7ff8000000000000);
+        else
+            memcpy(&u, &d, sizeof(u));
+        u = u >> 63 ? ~u : u | (UINT64_C(1) << 63);
+        unaligned(o)->u64 = host2net64(u);
+        o += 8;
+        break;
+    case KEY_BOOL:
+        *o++ = typeid == TrueValue;
+        break;
+    case KEY_STRING:
+        p = mi + hs;
+        e = p + len;
+        while ((z = memchr(p, 0, e - p)) != NULL) {
+            memcpy(o, p, z - p);
+            o += z - p;
+            *o++ = 0x00;
+            *o++ = 0xff;
+            p = z + 1;
         }
-        case StringValue:
-            if (value->xlen <= 31) {
-                *out++ = 0xa0 + (uint8_t)value->xlen;
-                goto copy_data;
-            }
-            if (value->xlen <= UINT8_MAX) {
-                out[0] = 0xd9;
-                out[1] = (uint8_t)value->xlen;
-                out += 2;
-                goto copy_data;
-            }
-            if (value->xlen <= UINT16_MAX) {
-                out[1] = 0xda;
-                unaligned(out+1)->u16 = host2net16((uint16_t)value->xlen);
-                out += 3;
-                goto copy_data;
-            }
-            out[1] = 0xdb;
-            unaligned(out+1)->u32 = host2net32(value->xlen);
-            out += 5;
-            goto copy_data;
-        case BinValue:
-            if (value->xlen <= UINT8_MAX) {
-                out[0] = 0xc4;
-                out[1] = (uint8_t)value->xlen;
-                out += 2;
-                goto copy_data;
-            }
-            if (value->xlen <= UINT16_MAX) {
-                out[0] = 0xc5;
-                unaligned(out + 1)->u16 = host2net16((uint16_t)value->xlen);
-                out += 3;
-                goto copy_data;
-            }
-            out[0] = 0xc6;
-            unaligned(out + 1)->u32 = host2net32(value->xlen);
-            out += 5;
-            goto copy_data;
-        case ExtValue:
-            switch (value->xlen) {
-            case 2:
-                /* fixext 1 */
-                out[0] = 0xd4;
-                unaligned(out + 1)->u16 = unaligned(copy_from - value->xoff)->u16;
-                out += 3;
-                goto check_buf;
-            case 3:
-                /* fixext 2 */
-                out[0] = 0xd5;
-                out[1] = (copy_from - value->xoff)[0];
-                unaligned(out + 2)->u16 = unaligned(copy_from - value->xoff + 1)->u16;
-                out += 4;
-                goto check_buf;
-            case 5:
-                /* fixext 4 */
-                out[0] = 0xd6;
-                out[1] = (copy_from - value->xoff)[0];
-                unaligned(out + 2)->u32 = unaligned(copy_from - value->xoff + 1)->u32;
-                out += 6;
-                goto check_buf;
-            case 9:
-                /* fixext 8 */
-                out[0] = 0xd5;
-                out[1] = (copy_from - value->xoff)[0];
-                unaligned(out + 2)->u64 = unaligned(copy_from - value->xoff + 1)->u64;
-                out += 10;
-                goto check_buf;
-            case 17:
-                /* fixext 16 */
-                *out++ = 0xd8;
-                goto copy_data;
-            }
-            if (value->xlen - 1 <= UINT8_MAX) {
-                out[0] = 0xc7;
-                out[1] = (uint8_t)(value->xlen - 1);
-                out += 2;
-                goto copy_data;
-            }
-            if (value->xlen - 1 <= UINT16_MAX) {
-                out[0] = 0xc8;
-                unaligned(out + 1)->u16 = host2net16((uint16_t)(value->xlen - 1));
-                out += 3;
-                goto copy_data;
-            }
-            out[0] = 0xc9;
-            unaligned(out + 1)->u32 = host2net32(value->xlen - 1);
-            out += 5;
-            goto copy_data;
-        case ArrayValue:
-            if (value->xlen <= 15) {
-                *out++ = 0x90 + (uint8_t)value->xlen;
-                goto check_buf;
-            }
-            if (value->xlen <= UINT16_MAX) {
-                out[0] = 0xdc;
-                unaligned(out + 1)->u16 = host2net16((uint16_t)value->xlen);
-                out += 3;
-                goto check_buf;
-            }
-            out[0] = 0xdd;
-            unaligned(out + 1)->u32 = host2net32(value->xlen);
-            out += 5;
-            goto check_buf;
-        case MapValue:
-            if (value->xlen <= 15) {
-                *out++ = 0x80 + (uint8_t)value->xlen;
-                goto check_buf;
-            }
-            if (value->xlen <= UINT16_MAX) {
-                out[0] = 0xde;
-                unaligned(out + 1)->u16 = host2net16((uint16_t)value->xlen);
-                out += 3;
-                goto check_buf;
+        memcpy(o, p, e - p);
+        o += e - p;
+        *o++ = 0x00;
+        *o++ = 0x00;
+        break;
+    case KEY_FIXED:
+        memcpy(o, mi + hs, len);
+        o += len;
+        break;
+    case KEY_ENUM:
+        unaligned(o)->u32 = host2net32(key->id);
+        o += 4;
+        break;
+    }
+    ks->pos = o - ks->arena->ob.out_buf;
+    return 0;
+}
+
+/* Encode a part which wasn't found: its default or an error. */
+static int key_put_missing(struct KeyScan *ks, const struct KeyPart *part)
+{
+    const struct KeyDef *def = ks->def;
+    uint32_t             node = part->node, i;
+
+    /* the outermost node missing, the part itself at least */
+    for (i = 0; i != part->depth; i++) {
+        node = def->path[part->first_path + i];
+        if (ks->at[def->slots[node] - 1] == NULL)
+            break;
+    }
+    for (i = 0; i != part->ndefaults; i++) {
+        const struct KeyDefault *dflt =
+            &def->defaults[part->first_default + i];
+        if (dflt->node == node)
+            return key_put(ks, part, dflt->data, dflt->data + dflt->size, 0);
+    }
+    return key_error(ks, NATIVE_ERR_MISSING, node, 0);
+}
+
+static void key_scan_init(struct KeyScan *ks, struct SchemaArena *arena,
+                          const struct KeyDef *def)
+{
+    ks->def = def;
+    ks->arena = arena;
+    ks->pos = 0;
+    arena->ob.limit = arena_limit(arena, arena_pb_footprint(arena));
+}
+
+/* Append the key of a document at ks->pos. */
+static int key_doc(struct KeyScan *ks, const uint8_t *data, size_t size,
+                   struct DocError *err)
+{
+    const struct KeyDef *def = ks->def;
+    const uint8_t       *mi = data;
+    uint32_t             i;
+
+    memset(ks->at, 0, sizeof(ks->at));
+    ks->found = 0;
+    ks->data = data;
+    ks->me = data + size;
+    ks->err = err;
+    err->code = 0;
+    if (key_scan(ks, def->prog->root, &mi) < 0)
+        return -1;
+    for (i = 0; i != def->nparts; i++) {
+        const struct KeyPart *part = &def->parts[i];
+        const uint8_t        *at = ks->at[def->slots[part->node] - 1];
+
+        if (at == NULL) {
+            if (key_put_missing(ks, part) != 0)
+                return -1;
+        } else if (key_put(ks, part, at, ks->me, at - data) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+ssize_t key_extract(struct SchemaArena   *arena,
+                    const struct KeyDef  *def,
+                    const uint8_t        *mi,
+                    size_t                ms,
+                    uint8_t             **key_out,
+                    struct DocError      *err)
+{
+    struct KeyScan ks;
+    int            rc;
+
+    key_scan_init(&ks, arena, def);
+    rc = key_doc(&ks, mi, ms, err);
+    arena_update_high_water(arena);
+    if (rc != 0)
+        return -1;
+    *key_out = arena->ob.out_buf;
+    return ks.pos;
+}
+
+ssize_t key_extract_batch(struct SchemaArena   *arena,
+                          const struct KeyDef  *def,
+                          size_t                ndocs,
+                          const struct Doc     *docs,
+                          uint8_t             **keys_out,
+                          uint32_t             *out_offsets,
+                          struct DocError      *errors)
+{
+    struct KeyScan ks;
+    size_t         i;
+
+    key_scan_init(&ks, arena, def);
+    for (i = 0; i != ndocs; i++) {
+        size_t pos = ks.pos;
+
+        out_offsets[i] = (uint32_t)pos;
+        if (key_doc(&ks, docs[i].data, docs[i].size, &errors[i]) != 0) {
+            if (errors[i].code == NATIVE_ERR_NO_MEMORY) {
+                arena_update_high_water(arena);
+                return -1;
             }
-            out[0] = 0xdf;
-            unaligned(out + 1)->u32 = host2net32(value->xlen);
-            out += 5;
-            goto check_buf;
-        case CopyCommand:
-            copy_from = bank2;
-            goto copy_data;
+            /* an empty range marks a bad document */
+            ks.pos = pos;
+        }
+        if (ks.pos > UINT32_MAX) {
+            arena_update_high_water(arena);
+            return -1;
         }
+    }
+    out_offsets[ndocs] = (uint32_t)ks.pos;
+    arena_update_high_water(arena);
+    *keys_out = arena->ob.out_buf;
+    return ks.pos;
+}
 
-check_buf:
-        /*
-         * Restore invariant: at least 10 bytes available in out_buf.
-         * Almost every switch branch ends up jumping here.
-         */
-        if (out + 10 > out_max) {
-            size_t capacity = out_max - out_buf;
-            size_t new_capacity = capacity + capacity / 2;
-            uint8_t *new_out_buf = realloc_wrap(out_buf, new_capacity,
-                                                stock_buf, capacity);
-            if (new_out_buf == NULL)
-                goto error_alloc;
-            out     = new_out_buf + (out - out_buf);
-            out_buf = new_out_buf;
-            out_max = new_out_buf + new_capacity;
+ssize_t key_encode(struct SchemaArena   *arena,
+                   const struct KeyDef  *def,
+                   const struct Doc     *values,
+                   uint8_t             **key_out,
+                   struct DocError      *err)
+{
+    struct KeyScan ks;
+    uint32_t       i;
+
+    key_scan_init(&ks, arena, def);
+    ks.data = NULL;
+    ks.err = err;
+    err->code = 0;
+    for (i = 0; i != def->nparts; i++) {
+        if (key_put(&ks, &def->parts[i], values[i].data,
+                    values[i].data + values[i].size, 0) != 0) {
+            arena_update_high_water(arena);
+            return -1;
         }
-        continue;
+    }
+    arena_update_high_water(arena);
+    *key_out = arena->ob.out_buf;
+    return ks.pos;
+}
 
-copy_data:
-        /*
-         * Ensure we have a room fom value->xlen bytes in out_buf, plus
-         * 10 more bytes for the next iteration.
-         * Some switch branches end up jumping here.
-         */
-        if (out + value->xlen + 10 > out_max) {
-            size_t capacity = out_max - out_buf;
-            size_t new_capacity = capacity + capacity / 2;
-            uint8_t *new_out_buf = realloc_wrap(out_buf, new_capacity,
-                                                stock_buf, capacity);
-            if (new_out_buf == NULL)
-                goto error_alloc;
-            out     = new_out_buf + (out - out_buf);
-            out_buf = new_out_buf;
-            out_max = new_out_buf + new_capacity;
+/*
+ * Updates
+ *
+ * Slots are located by walking headers, nothing is preprocessed but
+ * the values operations apply to.  A run of slots no operation
+ * touches becomes a single RawValue, an argument a CopyCommand
+ * (args is bank2); create_msgpack copies both verbatim.  An append
+ * keeps the items the array has as one RawValue too.
+ */
+struct Updater {
+    struct SchemaArena         *arena;
+    const uint8_t              *me;       /* bank1 */
+    const uint8_t              *args;     /* bank2 */
+    size_t                      pos;
+    struct DocError            *err;
+};
+
+/* The value of a slot being updated. */
+struct UpdateSlot {
+    uint8_t                     tid;      /* 0 - encoded, p - pe */
+    struct Value                v;
+    const uint8_t              *p, *pe;
+    int                         in_args;
+    size_t                      array;    /* appending: header item + 1 */
+};
+
+static int update_error(struct Updater *u, uint32_t code, uint32_t slot,
+                        uint32_t op)
+{
+    u->err->code = code;
+    u->err->node = slot;
+    u->err->aux1 = op;
+    u->err->aux2 = 0;
+    u->err->offset = 0;
+    return -1;
+}
+
+static int update_emit(struct Updater *u, uint8_t tid, const struct Value *v)
+{
+    struct PreprocBuf *pb = &u->arena->pb;
+
+    if (preproc_buf_reserve(pb, u->pos) != 0)
+        return update_error(u, NATIVE_ERR_NO_MEMORY, 0, 0);
+    pb->typeid_buf[u->pos] = tid;
+    pb->value_buf[u->pos] = *v;
+    u->pos++;
+    return 0;
+}
+
+/* Encoded bytes [p, pe) verbatim, from the tuple or from args. */
+static int update_emit_raw(struct Updater *u, const uint8_t *p,
+                           const uint8_t *pe, int in_args)
+{
+    struct Value v;
+
+    if (p == pe)
+        return 0;
+    v.xlen = (uint32_t)(pe - p);
+    v.xoff = (uint32_t)((in_args ? u->args : u->me) - p);
+    return update_emit(u, in_args ? CopyCommand : RawValue, &v);
+}
+
+/* An argument, checked to be a single msgpack value. */
+static int update_arg(struct Updater *u, const struct UpdateOp *op,
+                      uint32_t k, const uint8_t **p, const uint8_t **pe)
+{
+    *p = u->args - op->arg.xoff;
+    *pe = *p + op->arg.xlen;
+    if (msgpack_skip(*p, *pe) != *pe)
+        return update_error(u, NATIVE_ERR_BAD_DATA, op->slot, k);
+    return 0;
+}
+
+static int update_add(struct Updater *u, struct UpdateSlot *sv,
+                      const struct UpdateOp *op, uint32_t k)
+{
+    uint32_t len;
+
+    if (sv->array != 0)
+        return update_error(u, NATIVE_ERR_TYPE, op->slot, k);
+    if (sv->tid == 0 &&
+        key_header(sv->p, sv->pe, &sv->tid, &sv->v, &len) == 0)
+        return update_error(u, NATIVE_ERR_BAD_DATA, op->slot, k);
+    switch (sv->tid) {
+    case LongValue:
+        if (op->tid != LongValue)
+            return update_error(u, NATIVE_ERR_TYPE, op->slot, k);
+        if (__builtin_add_overflow(sv->v.ival, op->arg.ival, &sv->v.ival) ||
+            (op->int32 != 0 &&
+             (sv->v.ival < INT32_MIN || sv->v.ival > INT32_MAX)))
+            return update_error(u, NATIVE_ERR_OVERFLOW, op->slot, k);
+        return 0;
+    case FloatValue:
+    case DoubleValue:
+        sv->v.dval += op->tid == LongValue ? (double)op->arg.ival :
+                                             op->arg.dval;
+        return 0;
+    }
+    return update_error(u, NATIVE_ERR_TYPE, op->slot, k);
+}
+
+static int update_append(struct Updater *u, struct UpdateSlot *sv,
+                         const struct UpdateOp *op, uint32_t k)
+{
+    struct PreprocBuf *pb = &u->arena->pb;
+    const uint8_t     *p, *pe;
+    struct Value       value;
+    uint8_t            typeid;
+    uint32_t           len;
+    size_t             hs;
+
+    if (sv->array == 0) {
+        /* start with the items the array has */
+        if (sv->tid != 0)
+            return update_error(u, NATIVE_ERR_TYPE, op->slot, k);
+        hs = key_header(sv->p, sv->pe, &typeid, &value, &len);
+        if (hs == 0)
+            return update_error(u, NATIVE_ERR_BAD_DATA, op->slot, k);
+        if (typeid != ArrayValue)
+            return update_error(u, NATIVE_ERR_TYPE, op->slot, k);
+        value.xoff = 0;
+        sv->array = u->pos + 1;
+        if (update_emit(u, ArrayValue, &value) != 0 ||
+            update_emit_raw(u, sv->p + hs, sv->pe, sv->in_args) != 0)
+            return -1;
+    }
+    if (update_arg(u, op, k, &p, &pe) != 0)
+        return -1;
+    hs = key_header(p, pe, &typeid, &value, &len);
+    if (typeid != ArrayValue)
+        return update_error(u, NATIVE_ERR_BAD_DATA, op->slot, k);
+    if (value.xlen > UINT32_MAX - pb->value_buf[sv->array - 1].xlen)
+        return update_error(u, NATIVE_ERR_OVERFLOW, op->slot, k);
+    pb->value_buf[sv->array - 1].xlen += value.xlen;
+    return update_emit_raw(u, p + hs, pe, 1);
+}
+
+/* Apply ops[*k] and the following ones on slot s, value [p, pe). */
+static int update_slot(struct Updater *u, uint32_t s, const uint8_t *p,
+                       const uint8_t *pe, uint32_t nops,
+                       const struct UpdateOp *ops, uint32_t *k)
+{
+    struct UpdateSlot sv;
+    size_t            first = u->pos;
+
+    sv.tid = 0;
+    sv.p = p;
+    sv.pe = pe;
+    sv.in_args = 0;
+    sv.array = 0;
+    for (; *k != nops && ops[*k].slot == s; ++*k) {
+        const struct UpdateOp *op = &ops[*k];
+
+        switch (op->op) {
+        case UPDATE_SET:
+            if (update_arg(u, op, *k, &sv.p, &sv.pe) != 0)
+                return -1;
+            sv.tid = 0;
+            sv.in_args = 1;
+            sv.array = 0;
+            u->pos = first;
+            break;
+        case UPDATE_ADD:
+            if (update_add(u, &sv, op, *k) != 0)
+                return -1;
+            break;
+        case UPDATE_APPEND:
+            if (update_append(u, &sv, op, *k) != 0)
+                return -1;
+            break;
+        default:
+            return update_error(u, NATIVE_ERR_BAD_DATA, s, *k);
         }
-        memcpy(out, copy_from - value->xoff, value->xlen);
-        out += value->xlen;
-        copy_from = bank1;
-        continue;
     }
+    if (sv.array != 0)
+        return 0;
+    if (sv.tid != 0)
+        return update_emit(u, sv.tid, &sv.v);
+    return update_emit_raw(u, sv.p, sv.pe, sv.in_args);
+}
+
+ssize_t update_tuple(struct SchemaArena    *arena,
+                     uint32_t               nslots,
+                     const uint8_t         *mi,
+                     size_t                 ms,
+                     uint32_t               nops,
+                     const struct UpdateOp *ops,
+                     const uint8_t         *args,
+                     uint8_t              **tuple_out,
+                     struct DocError       *err)
+{
+    struct Updater  u;
+    struct Value    value;
+    const uint8_t  *me = mi + ms, *run;
+    uint8_t         typeid;
+    uint32_t        len, s, k = 0;
+    size_t          hs;
+    ssize_t         rc;
 
-    *msgpack_out = out_buf;
-    return out - out_buf;
+    u.arena = arena;
+    u.me = me;
+    u.args = args;
+    u.pos = 0;
+    u.err = err;
+    err->code = 0;
+    if (ms > UINT32_MAX)
+        return update_error(&u, NATIVE_ERR_BAD_DATA, 0, 0);
+    hs = key_header(mi, me, &typeid, &value, &len);
+    if (hs == 0 || typeid != ArrayValue || value.xlen != nslots)
+        return update_error(&u, NATIVE_ERR_BAD_DATA, 0, 0);
+    arena->pb.limit = arena_limit(arena, arena_ob_footprint(arena));
+    value.xoff = 0;
+    if (update_emit(&u, ArrayValue, &value) != 0)
+        goto error;
+    mi += hs;
+    run = mi;
+    for (s = 0; s != nslots; s++) {
+        const uint8_t *end = msgpack_skip(mi, me);
 
-error_alloc:
-error_badcode:
-    if (out_buf != stock_buf)
-        free(out_buf);
+        if (end == NULL) {
+            update_error(&u, NATIVE_ERR_BAD_DATA, 0, 0);
+            goto error;
+        }
+        if (k != nops && ops[k].slot == s) {
+            if (update_emit_raw(&u, run, mi, 0) != 0 ||
+                update_slot(&u, s, mi, end, nops, ops, &k) != 0)
+                goto error;
+            run = end;
+        }
+        mi = end;
+    }
+    /* slots out of range or not sorted; trailing garbage */
+    if (k != nops || mi != me) {
+        update_error(&u, NATIVE_ERR_BAD_DATA, 0, k);
+        goto error;
+    }
+    if (update_emit_raw(&u, run, mi, 0) != 0)
+        goto error;
+
+    arena->ob.limit = arena_limit(arena, arena_pb_footprint(arena));
+    rc = encode_items(u.pos, arena->pb.typeid_buf, arena->pb.value_buf,
+                      me, args, &arena->ob, 0);
+    arena_update_high_water(arena);
+    if (rc < 0)
+        return update_error(&u, NATIVE_ERR_NO_MEMORY, 0, 0);
+    *tuple_out = arena->ob.out_buf;
+    return rc;
+error:
+    arena_update_high_water(arena);
     return -1;
 }
@@ -19,6 +19,17 @@ struct tarantool_schema_preproc_Value {
     };
 };
 
+/* u == xlen | xoff << 16, little-endian only (see schema_util.c) */
+struct tarantool_schema_CompactValue {
+    union {
+        uint32_t       u;
+        struct {
+            uint16_t   xlen;
+            uint16_t   xoff;
+        };
+    };
+};
+
 struct tarantool_schema_proc_Regs {
     ssize_t                   rc;
     uint8_t                  *t[1];
@@ -30,6 +41,13 @@ struct tarantool_schema_proc_Regs {
     struct tarantool_schema_preproc_Value
                              *ov;
     uint8_t                  *res[1];
+    struct tarantool_schema_iovec
+                             *iov[1];
+    size_t                    size[1];
+    struct tarantool_schema_CompactValue
+                             *cv[1];
+    struct tarantool_schema_preproc_Value
+                             *side[1];
     const uint8_t            *ks;
     size_t                    kl;
 };
@@ -56,7 +74,491 @@ create_msgpack(size_t             nitems,
                uint8_t           *stock_buf,
                uint8_t          **msgpack_out);
 
+ssize_t
+create_msgpack_size(size_t             nitems,
+                    const uint8_t     *typeid,
+                    const struct tarantool_schema_preproc_Value
+                                      *value);
+
+ssize_t
+create_msgpack_into(size_t             nitems,
+                    const uint8_t     *typeid,
+                    const struct tarantool_schema_preproc_Value
+                                      *value,
+                    const uint8_t     *bank1,
+                    const uint8_t     *bank2,
+                    uint8_t           *out);
+
+struct tarantool_schema_Doc {
+    const uint8_t            *data;
+    size_t                    size;
+};
+
+ssize_t
+preprocess_msgpack_batch(size_t         ndocs,
+                         const struct tarantool_schema_Doc
+                                       *docs,
+                         size_t         stock_buf_size_or_hint,
+                         uint8_t       *stock_typeid_buf,
+                         struct tarantool_schema_preproc_Value
+                                       *stock_value_buf,
+                         uint8_t      **typeid_out,
+                         struct tarantool_schema_preproc_Value
+                                      **value_out,
+                         uint32_t      *offsets);
+
+ssize_t
+create_msgpack_batch(size_t             ndocs,
+                     const uint8_t     *typeid,
+                     const struct tarantool_schema_preproc_Value
+                                       *value,
+                     const uint32_t    *offsets,
+                     const struct tarantool_schema_Doc
+                                       *docs,
+                     const uint8_t     *bank2,
+                     size_t             stock_buf_size_or_hint,
+                     uint8_t           *stock_buf,
+                     uint8_t          **msgpack_out,
+                     uint32_t          *out_offsets);
+
+struct tarantool_schema_PreprocStream;
+
+struct tarantool_schema_PreprocStream *
+preprocess_stream_new(size_t stock_buf_size_or_hint, size_t max_bytes);
+
+void
+preprocess_stream_delete(struct tarantool_schema_PreprocStream *st);
+
+void
+preprocess_stream_reset(struct tarantool_schema_PreprocStream *st);
+
+int
+preprocess_stream_feed(struct tarantool_schema_PreprocStream *st,
+                       const uint8_t                         *chunk,
+                       size_t                                 size,
+                       size_t                                *consumed);
+
+ssize_t
+preprocess_stream_result(struct tarantool_schema_PreprocStream *st,
+                         uint8_t                              **typeid_out,
+                         struct tarantool_schema_preproc_Value
+                                                              **value_out,
+                         const uint8_t                        **bank1_out);
+
+struct tarantool_schema_Arena;
+
+struct tarantool_schema_Arena *
+schema_arena_new(size_t size_hint, size_t max_bytes);
+
+void
+schema_arena_delete(struct tarantool_schema_Arena *arena);
+
+void
+schema_arena_set_limit(struct tarantool_schema_Arena *arena, size_t max_bytes);
+
+size_t
+schema_arena_high_water(const struct tarantool_schema_Arena *arena);
+
+ssize_t
+preprocess_msgpack_arena(struct tarantool_schema_Arena *arena,
+                         const uint8_t                 *msgpack_in,
+                         size_t                         msgpack_size,
+                         uint8_t                      **typeid_out,
+                         struct tarantool_schema_preproc_Value
+                                                      **value_out);
+
+ssize_t
+create_msgpack_arena(struct tarantool_schema_Arena *arena,
+                     size_t                         nitems,
+                     const uint8_t                 *typeid,
+                     const struct tarantool_schema_preproc_Value
+                                                   *value,
+                     const uint8_t                 *bank1,
+                     const uint8_t                 *bank2,
+                     uint8_t                      **msgpack_out);
+
+/* struct iovec */
+struct tarantool_schema_iovec {
+    void                     *iov_base;
+    size_t                    iov_len;
+};
+
+ssize_t
+create_msgpack_iov(struct tarantool_schema_Arena *arena,
+                   size_t                         nitems,
+                   const uint8_t                 *typeid,
+                   const struct tarantool_schema_preproc_Value
+                                                 *value,
+                   const uint8_t                 *bank1,
+                   const uint8_t                 *bank2,
+                   size_t                         threshold,
+                   struct tarantool_schema_iovec **iov_out,
+                   size_t                        *size_out);
+
+ssize_t
+preprocess_msgpack_compact(struct tarantool_schema_Arena         *arena,
+                           const uint8_t                         *msgpack_in,
+                           size_t                                 msgpack_size,
+                           uint8_t                              **typeid_out,
+                           struct tarantool_schema_CompactValue **value_out,
+                           struct tarantool_schema_preproc_Value
+                                                                **side_out);
+
+ssize_t
+create_msgpack_compact(struct tarantool_schema_Arena              *arena,
+                       size_t                                      nitems,
+                       const uint8_t                              *typeid,
+                       const struct tarantool_schema_CompactValue *value,
+                       const struct tarantool_schema_preproc_Value
+                                                                  *side,
+                       const uint8_t                              *bank1,
+                       const uint8_t                              *bank2,
+                       uint8_t                                   **msgpack_out);
+
+ssize_t
+preprocess_msgpack_batch_arena(struct tarantool_schema_Arena *arena,
+                               size_t                         ndocs,
+                               const struct tarantool_schema_Doc
+                                                             *docs,
+                               uint8_t                      **typeid_out,
+                               struct tarantool_schema_preproc_Value
+                                                            **value_out,
+                               uint32_t                      *offsets);
+
+ssize_t
+create_msgpack_batch_arena(struct tarantool_schema_Arena *arena,
+                           size_t                         ndocs,
+                           const uint8_t                 *typeid,
+                           const struct tarantool_schema_preproc_Value
+                                                         *value,
+                           const uint32_t                *offsets,
+                           const struct tarantool_schema_Doc
+                                                         *docs,
+                           const uint8_t                 *bank2,
+                           uint8_t                      **msgpack_out,
+                           uint32_t                      *out_offsets);
+
+struct tarantool_schema_Node {
+    uint8_t                   kind;
+    uint8_t                   tid;
+    uint8_t                   conv;
+    uint8_t                   skip;
+    uint8_t                   optional;
+    uint32_t                  accept;
+    uint32_t                  size;
+    uint32_t                  first;
+    uint32_t                  count;
+    uint32_t                  first_key;
+    uint32_t                  nkeys;
+};
+
+struct tarantool_schema_Key {
+    const uint8_t            *str;
+    uint32_t                  len;
+    uint32_t                  id;
+};
+
+struct tarantool_schema_Program {
+    const struct tarantool_schema_Node
+                             *nodes;
+    uint32_t                  nnodes;
+    uint32_t                  root;
+    uint32_t                  nslots;
+    const uint32_t           *fields;
+    struct tarantool_schema_Key
+                             *keys;
+};
+
+struct tarantool_schema_DocError {
+    uint32_t                  code;
+    uint32_t                  node;
+    uint32_t                  aux1;
+    uint32_t                  aux2;
+    uint32_t                  offset;
+};
+
+struct tarantool_schema_WorkerPool;
+
+void
+schema_program_prepare(struct tarantool_schema_Program *prog);
+
+ssize_t
+preprocess_msgpack_projected(struct tarantool_schema_Arena *arena,
+                             const struct tarantool_schema_Program
+                                                           *prog,
+                             const uint8_t                 *msgpack_in,
+                             size_t                         msgpack_size,
+                             uint8_t                      **typeid_out,
+                             struct tarantool_schema_preproc_Value
+                                                          **value_out);
+
+ssize_t
+preprocess_msgpack_batch_projected(struct tarantool_schema_Arena *arena,
+                                   const struct tarantool_schema_Program
+                                                                 *prog,
+                                   size_t                         ndocs,
+                                   const struct tarantool_schema_Doc
+                                                                 *docs,
+                                   uint8_t                      **typeid_out,
+                                   struct tarantool_schema_preproc_Value
+                                                                **value_out,
+                                   uint32_t                      *offsets);
+
+ssize_t
+validate_msgpack(struct tarantool_schema_Arena         *arena,
+                 const struct tarantool_schema_Program *prog,
+                 const uint8_t                         *msgpack_in,
+                 size_t                                 msgpack_size,
+                 uint8_t                              **typeid_out,
+                 struct tarantool_schema_preproc_Value **value_out,
+                 struct tarantool_schema_DocError      *err);
+
+ssize_t
+validate_msgpack_batch(struct tarantool_schema_Arena         *arena,
+                       const struct tarantool_schema_Program *prog,
+                       size_t                                 ndocs,
+                       const struct tarantool_schema_Doc     *docs,
+                       uint8_t                              **typeid_out,
+                       struct tarantool_schema_preproc_Value **value_out,
+                       uint32_t                              *offsets,
+                       struct tarantool_schema_DocError      *errors);
+
+ssize_t
+preprocess_json(struct tarantool_schema_Arena         *arena,
+                const uint8_t                         *json_in,
+                size_t                                 json_size,
+                uint8_t                              **typeid_out,
+                struct tarantool_schema_preproc_Value **value_out,
+                const uint8_t                        **bank1_out);
+
+ssize_t
+preprocess_json_batch(struct tarantool_schema_Arena         *arena,
+                      size_t                                 ndocs,
+                      const struct tarantool_schema_Doc     *docs,
+                      uint8_t                              **typeid_out,
+                      struct tarantool_schema_preproc_Value **value_out,
+                      uint32_t                              *offsets,
+                      struct tarantool_schema_Doc           *docs_out);
+
+struct tarantool_schema_AvroNode {
+    uint8_t                   kind;
+    uint32_t                  first;
+    uint32_t                  count;
+};
+
+struct tarantool_schema_AvroProgram {
+    const struct tarantool_schema_AvroNode
+                             *nodes;
+    uint32_t                  nnodes;
+    uint32_t                  root;
+    uint32_t                  nnames;
+    const uint32_t           *children;
+    const struct tarantool_schema_Key
+                             *names;
+    struct tarantool_schema_Key
+                             *keys;
+    const uint8_t            *bank;
+};
+
+void
+avro_program_prepare(struct tarantool_schema_AvroProgram *prog);
+
+ssize_t
+create_avro(struct tarantool_schema_Arena             *arena,
+            const struct tarantool_schema_AvroProgram *prog,
+            size_t                                     nitems,
+            const uint8_t                             *typeid,
+            const struct tarantool_schema_preproc_Value
+                                                      *value,
+            const uint8_t                             *bank1,
+            const uint8_t                             *bank2,
+            uint8_t                                  **avro_out);
+
+ssize_t
+preprocess_avro(struct tarantool_schema_Arena             *arena,
+                const struct tarantool_schema_AvroProgram *prog,
+                const uint8_t                             *avro_in,
+                size_t                                     avro_size,
+                uint8_t                                  **typeid_out,
+                struct tarantool_schema_preproc_Value    **value_out);
+
+uint32_t
+map_key_hash(const uint8_t *key, uint32_t len);
+
+uint32_t
+map_buckets(uint32_t npairs);
+
+uint64_t
+schema_fingerprint64(const uint8_t *data, size_t size);
+
+ssize_t
+map_hash_order(const uint8_t      *typeid,
+               const struct tarantool_schema_preproc_Value
+                                  *value,
+               size_t              map,
+               const uint8_t      *bank1,
+               uint32_t           *order);
+
+struct tarantool_schema_ColumnBuf {
+    uint8_t                  *data;
+    size_t                    size;
+    size_t                    cap;
+};
+
+struct tarantool_schema_Column {
+    uint8_t                   type;
+    uint32_t                  child;
+    uint64_t                  length;
+    uint64_t                  null_count;
+    struct tarantool_schema_ColumnBuf validity;
+    struct tarantool_schema_ColumnBuf values;
+    struct tarantool_schema_ColumnBuf offsets;
+    struct tarantool_schema_ColumnBuf data;
+};
+
+struct tarantool_schema_ColumnSink;
+
+struct tarantool_schema_ColumnSink *
+column_sink_new(uint32_t        ncolumns,
+                const uint8_t  *types,
+                const uint32_t *children,
+                uint32_t        nslots);
+
+void
+column_sink_delete(struct tarantool_schema_ColumnSink *sink);
+
+void
+column_sink_reset(struct tarantool_schema_ColumnSink *sink);
+
+struct tarantool_schema_Column *
+column_sink_columns(struct tarantool_schema_ColumnSink *sink);
+
+ssize_t
+column_sink_append(struct tarantool_schema_ColumnSink    *sink,
+                   size_t                                 ndocs,
+                   const uint8_t                         *typeid,
+                   const struct tarantool_schema_preproc_Value
+                                                         *value,
+                   const uint32_t                        *offsets,
+                   const struct tarantool_schema_Doc     *docs,
+                   const uint8_t                         *bank2);
+
+struct tarantool_schema_KeyPart {
+    uint32_t                  node;
+    uint32_t                  type;
+    uint32_t                  first_path;
+    uint32_t                  depth;
+    uint32_t                  first_default;
+    uint32_t                  ndefaults;
+};
+
+struct tarantool_schema_KeyDefault {
+    uint32_t                  node;
+    uint32_t                  size;
+    const uint8_t            *data;
+};
+
+struct tarantool_schema_KeyDef {
+    const struct tarantool_schema_Program
+                             *prog;
+    const struct tarantool_schema_KeyPart
+                             *parts;
+    uint32_t                  nparts;
+    uint32_t                  nleaves;
+    const uint32_t           *path;
+    const struct tarantool_schema_KeyDefault
+                             *defaults;
+    const uint32_t           *slots;
+};
+
+ssize_t
+key_extract(struct tarantool_schema_Arena        *arena,
+            const struct tarantool_schema_KeyDef *def,
+            const uint8_t                        *msgpack_in,
+            size_t                                msgpack_size,
+            uint8_t                             **key_out,
+            struct tarantool_schema_DocError     *err);
+
+ssize_t
+key_extract_batch(struct tarantool_schema_Arena        *arena,
+                  const struct tarantool_schema_KeyDef *def,
+                  size_t                                ndocs,
+                  const struct tarantool_schema_Doc    *docs,
+                  uint8_t                             **keys_out,
+                  uint32_t                             *out_offsets,
+                  struct tarantool_schema_DocError     *errors);
+
+ssize_t
+key_encode(struct tarantool_schema_Arena        *arena,
+           const struct tarantool_schema_KeyDef *def,
+           const struct tarantool_schema_Doc    *values,
+           uint8_t                             **key_out,
+           struct tarantool_schema_DocError     *err);
+
+struct tarantool_schema_UpdateOp {
+    uint8_t                   op;
+    uint8_t                   tid;
+    uint8_t                   int32;
+    uint32_t                  slot;
+    struct tarantool_schema_preproc_Value
+                              arg;
+};
+
+ssize_t
+update_tuple(struct tarantool_schema_Arena          *arena,
+             uint32_t                                nslots,
+             const uint8_t                          *tuple_in,
+             size_t                                  tuple_size,
+             uint32_t                                nops,
+             const struct tarantool_schema_UpdateOp *ops,
+             const uint8_t                          *args,
+             uint8_t                               **tuple_out,
+             struct tarantool_schema_DocError       *err);
+
+struct tarantool_schema_Stats {
+    uint64_t preprocess_calls;
+    uint64_t preprocess_grows;
+    uint64_t preprocess_stock_overflows;
+    uint64_t stack_grows;
+    uint64_t error_underflow;
+    uint64_t error_c1;
+    uint64_t error_alloc;
+    uint64_t create_calls;
+    uint64_t create_grows;
+    uint64_t create_stock_overflows;
+    uint64_t copy_bytes;
+    uint64_t error_badcode;
+    uint64_t error_create_alloc;
+    uint64_t preprocess_types[32];
+    uint64_t create_types[32];
+};
+
+int
+schema_stats_enable(int on);
+
+const struct tarantool_schema_Stats *
+schema_stats(void);
+
+void
+schema_stats_reset(void);
+
+struct tarantool_schema_WorkerPool *
+worker_pool_new(uint32_t nworkers);
+
+void
+worker_pool_delete(struct tarantool_schema_WorkerPool *pool);
+
+ssize_t
+flatten_batch_mt(const struct tarantool_schema_Program *prog,
+                 struct tarantool_schema_WorkerPool    *pool,
+                 size_t                                 ndocs,
+                 const struct tarantool_schema_Doc     *docs,
+                 uint8_t                              **msgpack_out,
+                 uint32_t                              *out_offsets,
+                 struct tarantool_schema_DocError      *errors);
+
 void *malloc(size_t);
+void *realloc(void *, size_t);
 void  free(void *);
 int   memcmp(const void *, const void *, size_t);
 
@@ -80,7 +582,7 @@ end
 local typenames = {
     [1] = 'NIL', [2] = 'FALSE', [3] = 'TRUE', [4] = 'LONG', [5] = 'ULONG',
     [6] = 'FLOAT', [7] = 'DOUBLE', [8] = 'STR', [9] = 'BIN',
-    [10] = 'EXT', [11] = 'ARRAY', [12] = 'MAP'
+    [10] = 'EXT', [11] = 'ARRAY', [12] = 'MAP', [13] = 'RAW', [20] = 'COPY'
 }
 
 local valuevis = {
@@ -180,7 +682,185 @@ local function visualize_msgpack(input)
     return res
 end
 
+--
+-- preprocess_stream
+--
+-- A document arriving in pieces (e.g. from a socket).  Feed chunks
+-- as they come; once complete, the stream is accepted by flatten /
+-- unflatten in place of a string.  The memory a stream may use is
+-- capped by max_bytes (0 or nil - no limit).
+--
+-- stream_feed(st, chunk) returns true when the document is complete,
+-- false if more data is needed; also the number of bytes consumed
+-- (the bytes past the document end are not).  stream_reset(st)
+-- prepares the stream for the next document.
+--
+
+local stream_consumed = ffi.new('size_t[1]')
+
+local function preprocess_stream(max_bytes)
+    local st = schema_util_C.preprocess_stream_new(0, max_bytes or 0)
+    if st == nil then
+        error('preprocess_stream_new: -1')
+    end
+    return ffi.gc(st, schema_util_C.preprocess_stream_delete)
+end
+
+local function stream_feed(st, chunk)
+    local rc = schema_util_C.preprocess_stream_feed(
+        st, chunk, #chunk, stream_consumed)
+    if rc < 0 then
+        error(rc == -1 and 'preprocess_stream: bad data' or
+                           'preprocess_stream: out of memory')
+    end
+    return rc == 1, tonumber(stream_consumed[0])
+end
+
+local function stream_reset(st)
+    schema_util_C.preprocess_stream_reset(st)
+end
+
+--
+-- arena
+--
+-- Buffers of preprocess / create persisting between calls.  Memory
+-- used is capped by max_bytes (0 or nil - no limit); a call needing
+-- more fails.
+--
+
+local function new_arena(size_hint, max_bytes)
+    local arena = schema_util_C.schema_arena_new(size_hint or 0, max_bytes or 0)
+    if arena == nil then
+        error('schema_arena_new: -1')
+    end
+    return ffi.gc(arena, schema_util_C.schema_arena_delete)
+end
+
+local function arena_set_limit(arena, max_bytes)
+    schema_util_C.schema_arena_set_limit(arena, max_bytes or 0)
+end
+
+-- Peak memory used by the arena, bytes.
+local function arena_high_water(arena)
+    return tonumber(schema_util_C.schema_arena_high_water(arena))
+end
+
+--
+-- column sink
+--
+-- Columns in Arrow's memory layout, see column_sink_append in
+-- schema_util.c.  Types is a list of column type names, children
+-- maps a list column to its item column (1-based, as types); the
+-- first nslots columns receive the slots of flattened tuples.
+--
+
+local column_types = {
+    null = 1, bool = 2, int64 = 3, double = 4, binary = 5, dict = 6,
+    list = 7, float = 8
+}
+
+local function new_column_sink(types, children, nslots)
+    local n = #types
+    local ctypes = ffi.new('uint8_t[?]', n + 1)
+    local cchildren = ffi.new('uint32_t[?]', n + 1)
+    for i, t in ipairs(types) do
+        ctypes[i - 1] = column_types[t] or error('unknown column type '..t)
+        cchildren[i - 1] = children[i] and children[i] - 1 or 0
+    end
+    local sink = schema_util_C.column_sink_new(n, ctypes, cchildren, nslots)
+    if sink == nil then
+        error('column_sink_new: -1')
+    end
+    return ffi.gc(sink, schema_util_C.column_sink_delete)
+end
+
+--
+-- stats
+--
+-- Hot path counters of schema_util.c (struct SchemaStats), off until
+-- enabled.  stats_enable(on) returns the previous state or nil if
+-- counters are compiled out; stats() returns a snapshot with numbers,
+-- item histograms are keyed by type name.
+--
+
+local stats_counters = {
+    'preprocess_calls', 'preprocess_grows', 'preprocess_stock_overflows',
+    'stack_grows', 'error_underflow', 'error_c1', 'error_alloc',
+    'create_calls', 'create_grows', 'create_stock_overflows', 'copy_bytes',
+    'error_badcode', 'error_create_alloc'
+}
+
+local function stats_enable(on)
+    local rc = schema_util_C.schema_stats_enable(on == false and 0 or 1)
+    if rc < 0 then
+        return nil
+    end
+    return rc == 1
+end
+
+local function stats_histogram(hist)
+    local res = {}
+    for i = 0, 31 do
+        if hist[i] ~= 0 then
+            res[typenames[i] or tostring(i)] = tonumber(hist[i])
+        end
+    end
+    return res
+end
+
+local function stats()
+    local s = schema_util_C.schema_stats()
+    if s == nil then
+        return nil
+    end
+    local res = {}
+    for _, name in ipairs(stats_counters) do
+        res[name] = tonumber(s[name])
+    end
+    res.preprocess_types = stats_histogram(s.preprocess_types)
+    res.create_types = stats_histogram(s.create_types)
+    return res
+end
+
+local function stats_reset()
+    schema_util_C.schema_stats_reset()
+end
+
+--
+-- map_find(map, key) - look a key up in a flattened map, i.e. the
+-- bucket array as decoded from the tuple (empty buckets are NULL).
+-- Returns the value or nil.
+--
+
+local function map_find(map, key)
+    local mask = #map / 2 - 1
+    if mask < 0 then
+        return nil
+    end
+    local b = bit.band(schema_util_C.map_key_hash(key, #key), mask)
+    while true do
+        local k = map[b + b + 1]
+        if k == nil then
+            return nil
+        elseif k == key then
+            return map[b + b + 2]
+        end
+        b = bit.band(b + 1, mask)
+    end
+end
+
 return {
     visualize_msgpack = visualize_msgpack,
+    new_arena         = new_arena,
+    arena_set_limit   = arena_set_limit,
+    arena_high_water  = arena_high_water,
+    preprocess_stream = preprocess_stream,
+    stream_feed       = stream_feed,
+    stream_reset      = stream_reset,
+    map_find          = map_find,
+    stats_enable      = stats_enable,
+    stats             = stats,
+    stats_reset       = stats_reset,
+    new_column_sink   = new_column_sink,
     schema_util_C = schema_util_C
 }